@@ -24,6 +24,10 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     node->data = data;
     node->host = host;
     node->path = path;
+    node->code = 200;
+    node->expires = 0;
+    node->refs = 2;     //list and http that downloads it
+    node->is_linked = TRUE;
 
     node->prev = NULL;
     node->next = cache->head;
@@ -33,11 +37,33 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     return node;
 }
 
+void cache_unlink(cache_entry_t *entry, cache_t *cache) {
+    if (entry == cache->head) {
+        cache->head = entry->next;
+        if (cache->head != NULL) cache->head->prev = NULL;
+    }
+    else {
+        entry->prev->next = entry->next;
+        if (entry->next != NULL) entry->next->prev = entry->prev;
+    }
+    entry->is_linked = FALSE;
+}
+
+int is_expired(cache_entry_t *entry, time_t now) {
+    return entry->is_full && entry->expires != 0 && entry->expires <= now;
+}
+
+//expired entries met on the way leave cache, their readers keep them until they finish
 cache_entry_t *cache_find(const char *host, const char *path, cache_t *cache) {
+    time_t now = time(NULL);
     cache_entry_t *cur = cache->head;
     while (cur != NULL) {
-        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path)) break;
-        cur = cur->next;
+        cache_entry_t *next = cur->next;
+        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path)) {
+            if (!is_expired(cur, now)) break;
+            cache_remove(cur, cache);
+        }
+        cur = next;
     }
     return cur;
 }
@@ -50,17 +76,19 @@ void free_cache_entry(cache_entry_t *entry) {
     free(entry);
 }
 
+//drops reference of list, entry lives on while somebody else holds it
 void cache_remove(cache_entry_t *entry, cache_t *cache) {
-    if (entry == cache->head) {
-        cache->head = entry->next;
-        if (cache->head != NULL) cache->head->prev = NULL;
-    }
-    else {
-        entry->prev->next = entry->next;
-        if (entry->next != NULL) entry->next->prev = entry->prev;
-    }
+    if (!entry->is_linked) return;
+    cache_unlink(entry, cache);
+    cache_entry_release(entry);
+}
+
+void cache_entry_acquire(cache_entry_t *entry) {
+    entry->refs++;
+}
 
-    free_cache_entry(entry);
+void cache_entry_release(cache_entry_t *entry) {
+    if (entry != NULL && --entry->refs == 0) free_cache_entry(entry);
 }
 
 void cache_destroy(cache_t *cache) {
@@ -76,7 +104,7 @@ void cache_destroy(cache_t *cache) {
 void cache_print_content(cache_t *cache) {
     cache_entry_t *cur = cache->head;
     while (cur != NULL) {
-        printf("%s %s %zd full=%d\n", cur->host, cur->path, cur->size, cur->is_full);
+        printf("%s %s %zd full=%d code=%d refs=%d\n", cur->host, cur->path, cur->size, cur->is_full, cur->code, cur->refs);
         cur = cur->next;
     }
 }
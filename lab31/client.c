@@ -8,7 +8,20 @@
 #include "client.h"
 #include "list.h"
 
-void create_client(int client_sock_fd, client_list_t *client_list) {
+void client_goes_error(client_t *client);
+
+void client_timeout(wheel_timer_t *timer) {
+    client_t *client = (client_t *)timer->owner;
+    if (IS_ERROR_OR_DONE_STATUS(client->status)) return;
+
+    const char *reason = "idle";
+    if (client->status == AWAITING_REQUEST && client->request_size > 0) reason = "request headers";
+    else if (client->status != AWAITING_REQUEST) reason = "response not taken";
+    if (INFO_LOG) printf("[%d] Timed out: %s\n", client->sock_fd, reason);
+    client_goes_error(client);
+}
+
+void create_client(int client_sock_fd, client_list_t *client_list, timer_wheel_t *timer_wheel) {
     client_t *new_client = (client_t *)calloc(1, sizeof(client_t));
     if (new_client == NULL) {
         if (ERROR_LOG) perror("create_client: Unable to allocate memory for client struct");
@@ -19,10 +32,20 @@ void create_client(int client_sock_fd, client_list_t *client_list) {
         close(client_sock_fd);
         return;
     }
+    timer_init(&new_client->timer, timer_wheel, client_timeout, new_client);
+    timer_arm(&new_client->timer, CLIENT_IDLE_TIMEOUT * 1000);
     client_add_to_list(new_client, client_list);
     if (INFO_LOG) printf("[%d] Connected\n", client_sock_fd);
 }
 
+//overloaded proxy answers without reading request, client may retry later
+void reject_client(int client_sock_fd) {
+    const char *response = "HTTP/1.0 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(client_sock_fd, response, strlen(response), MSG_DONTWAIT);
+    if (INFO_LOG) printf("[%d] Rejected: too many connections\n", client_sock_fd);
+    close(client_sock_fd);
+}
+
 void remove_client(client_t *client, client_list_t *client_list) {
     client_remove_from_list(client, client_list);
     if (INFO_LOG) printf("[%d] Disconnected\n", client->sock_fd);
@@ -48,7 +71,10 @@ int client_init(client_t *client, int client_sock_fd) {
 }
 
 void client_destroy(client_t *client) {
+    timer_cancel(&client->timer);
     if (client->http_entry != NULL) client->http_entry->clients--;
+    cache_entry_release(client->cache_entry);
+    client->cache_entry = NULL;
     close(client->sock_fd);
 }
 
@@ -71,6 +97,7 @@ void client_update_http_info(client_t *client) {
         else if (client->http_entry->cache_entry != NULL && client->http_entry->cache_entry->is_full) {
             client->status = GETTING_FROM_CACHE;
             client->cache_entry = client->http_entry->cache_entry;
+            cache_entry_acquire(client->cache_entry);
             client->http_entry->clients--;
             client->http_entry = NULL;
         }
@@ -147,6 +174,7 @@ void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *ht
         if (INFO_LOG) printf("[%d] Getting data from cache for '%s%s'\n", client->sock_fd, host, path);
         client->status = GETTING_FROM_CACHE;
         client->cache_entry = entry;
+        cache_entry_acquire(entry);
         client->request_size = 0;
         free_with_null((void **)&client->request);
         free(host); free(path);
@@ -167,14 +195,14 @@ void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *ht
     }
 
     if (http_entry == NULL) {  //no active http entry with the same request
-        int http_sock_fd = http_open_socket(host, 80);
+        int http_sock_fd = http_open_host_socket(host);
         if (http_sock_fd == -1) {
             client_goes_error(client);
             free(host); free(path);
             return;
         }
 
-        http_entry = create_http(http_sock_fd, client->request, client->request_size, host, path, http_list);
+        http_entry = create_http(http_sock_fd, client->request, client->request_size, host, path, http_list, client->timer.wheel);
         if (http_entry == NULL) {
             client_goes_error(client);
             free(host); free(path);
@@ -215,6 +243,8 @@ void client_read_data(client_t *client, http_list_t *http_list, cache_t *cache)
                 client->http_entry->clients--;
                 client->http_entry = NULL;
             }
+            cache_entry_release(client->cache_entry);
+            client->cache_entry = NULL;
             client->bytes_written = 0;
             client->status = AWAITING_REQUEST;
             client->request_size = 0;
@@ -244,8 +274,10 @@ void client_read_data(client_t *client, http_list_t *http_list, cache_t *cache)
 
     memcpy(client->request + client->request_size, buf, bytes_read);
     client->request_size += bytes_read;
+    if (client->request_size == bytes_read) timer_arm(&client->timer, CLIENT_HEADER_TIMEOUT * 1000);   //not rearmed by later parts
 
     handle_client_request(client, bytes_read, http_list, cache);
+    if (client->status == DOWNLOADING || client->status == GETTING_FROM_CACHE) timer_arm(&client->timer, CLIENT_IDLE_TIMEOUT * 1000);
 }
 
 void check_finished_writing_to_client(client_t *client) {
@@ -259,6 +291,7 @@ void check_finished_writing_to_client(client_t *client) {
             (client->status == DOWNLOADING && client->http_entry->is_response_complete))) {
         client->bytes_written = 0;
 
+        cache_entry_release(client->cache_entry);
         client->cache_entry = NULL;
         if (client->http_entry != NULL) {
             client->http_entry->clients--;
@@ -291,6 +324,7 @@ void write_to_client(client_t *client) {
         return;
     }
     client->bytes_written += bytes_written;
+    if (bytes_written > 0) timer_arm(&client->timer, CLIENT_IDLE_TIMEOUT * 1000);
 
     check_finished_writing_to_client(client);
 }
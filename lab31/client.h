@@ -5,7 +5,8 @@
 
 #ifndef LAB31_CLIENT_H
 #define LAB31_CLIENT_H
-void create_client(int client_sock_fd, client_list_t *client_list);
+void create_client(int client_sock_fd, client_list_t *client_list, timer_wheel_t *timer_wheel);
+void reject_client(int client_sock_fd);
 void remove_client(client_t *client, client_list_t *client_list);
 
 int client_init(client_t *client, int client_sock_fd);
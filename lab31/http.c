@@ -10,7 +10,20 @@
 #include "states.h"
 #include "list.h"
 
-http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_list_t *http_list) {
+void http_goes_error(http_t *http);
+
+void http_timeout(wheel_timer_t *timer) {
+    http_t *http = (http_t *)timer->owner;
+    if (IS_ERROR_OR_DONE_STATUS(http->status)) return;
+
+    const char *reason = "idle";
+    if (http->status == AWAITING_REQUEST) reason = http->request_bytes_written == 0 ? "connect" : "sending request";
+    else if (http->data_size == 0) reason = "first byte";
+    if (INFO_LOG) printf("[%d %s %s] Timed out: %s\n", http->sock_fd, http->host, http->path, reason);
+    http_goes_error(http);
+}
+
+http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_list_t *http_list, timer_wheel_t *timer_wheel) {
     http_t *new_http = (http_t *)calloc(1, sizeof(http_t));
     if (new_http == NULL) {
         if (ERROR_LOG) perror("create_http: Unable to allocate memory for http struct");
@@ -20,6 +33,8 @@ http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host
         free(new_http);
         return NULL;
     }
+    timer_init(&new_http->timer, timer_wheel, http_timeout, new_http);
+    timer_arm(&new_http->timer, HTTP_CONNECT_TIMEOUT * 1000);
     http_add_to_list(new_http, http_list);
     if (INFO_LOG) printf("[%s %s] Connected\n", host, path);
     return new_http;
@@ -52,11 +67,13 @@ int http_init(http_t *http, int sock_fd, char *request, ssize_t request_size, ch
 }
 
 void http_destroy(http_t *http, cache_t *cache) {
-    if (http->cache_entry != NULL && !http->cache_entry->is_full) {
-        cache_remove(http->cache_entry, cache);
+    timer_cancel(&http->timer);
+    if (http->cache_entry != NULL) {
+        if (!http->cache_entry->is_full) cache_remove(http->cache_entry, cache);
+        cache_entry_release(http->cache_entry);
         http->cache_entry = NULL;
     }
-    else if (http->cache_entry == NULL) {
+    else {
         free(http->data);
         free(http->host);
         free(http->path);
@@ -112,20 +129,45 @@ int http_open_socket(const char *hostname, int port) {
         return -1;
     }
 
-    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1) {
+    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        if (ERROR_LOG) perror("open_http_socket: fcntl error");
+    }
+
+    //connect finishes in background, http_send_request checks its result once socket is writable
+    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS) {
         if (ERROR_LOG) perror("open_http_socket: connect error");
         close(sock_fd);
         return -1;
     }
 
-    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
-        if (ERROR_LOG) perror("open_http_socket: fcntl error");
+    return sock_fd;
+}
+
+//host header value may carry explicit port: "example.com:8080"
+int http_open_host_socket(const char *host) {
+    int port = HTTP_DEFAULT_PORT;
+    const char *delim = strrchr(host, ':');
+    size_t hostname_len = delim == NULL ? strlen(host) : (size_t)(delim - host);
+    if (delim != NULL) {
+        port = get_number_from_string_by_length(delim + 1, strlen(delim + 1));
+        if (!IS_PORT_VALID(port)) {
+            if (ERROR_LOG) fprintf(stderr, "Invalid port in host '%s'\n", host);
+            return -1;
+        }
     }
 
-    return sock_fd;
+    char hostname[HOSTNAME_MAX_SIZE];
+    if (hostname_len >= sizeof(hostname)) {
+        if (ERROR_LOG) fprintf(stderr, "Host name '%s' is too long\n", host);
+        return -1;
+    }
+    memcpy(hostname, host, hostname_len);
+    hostname[hostname_len] = '\0';
+    return http_open_socket(hostname, port);
 }
 
 void http_goes_error(http_t *http) {
+    timer_cancel(&http->timer);
     http->status = SOCK_ERROR;
     close_socket(&http->sock_fd);
     http->data_size = 0;
@@ -166,6 +208,36 @@ void parse_http_response_headers(http_t *http) {
     }
 }
 
+int http_cache_ttl(int code) {
+    if (code == 301 || code == 404 || code == 410) return NEGATIVE_CACHE_TTL;
+    if (code >= 500 && code < 600) return ERROR_CACHE_TTL;
+    return 0;
+}
+
+//complete 200 responses stay for good, some errors and redirects for short ttl
+int http_is_cacheable(http_t *entry) {
+    return entry->code == 200 || http_cache_ttl(entry->code) > 0;
+}
+
+void http_update_cache_entry(http_t *entry, cache_t *cache) {
+    if (entry->cache_entry == NULL) {
+        entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
+        if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
+        else entry->cache_entry->code = entry->code;
+    }
+    else {
+        entry->cache_entry->data = entry->data;
+        entry->cache_entry->size = entry->data_size;
+    }
+}
+
+//ttl counts from the moment response is complete
+void http_complete_cache_entry(http_t *entry) {
+    if (entry->cache_entry == NULL) return;
+    entry->cache_entry->is_full = TRUE;
+    if (entry->code != 200) entry->cache_entry->expires = time(NULL) + http_cache_ttl(entry->code);
+}
+
 void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize_t size, cache_t *cache) {
     size_t rsize = size;
     ssize_t pret;
@@ -177,36 +249,18 @@ void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize
         return;
     }
 
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
 
     if (pret == 0) {
-        if (entry->cache_entry != NULL) entry->cache_entry->is_full = TRUE;
+        http_complete_cache_entry(entry);
         entry->is_response_complete = TRUE;
     }
 }
 
 void parse_http_response_by_length(http_t *entry, cache_t *cache) {
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
     if (entry->data_size == entry->headers_size + entry->response_size) {
-        if (entry->cache_entry != NULL) entry->cache_entry->is_full = TRUE;
+        http_complete_cache_entry(entry);
         entry->is_response_complete = TRUE;
     }
 }
@@ -222,10 +276,11 @@ void http_read_data(http_t *entry, cache_t *cache) {
         return;
     }
     if (bytes_read == 0) {
+        timer_cancel(&entry->timer);
         entry->status = SOCK_DONE;
         if (entry->response_type == HTTP_RESPONSE_NONE) {
             entry->is_response_complete = TRUE;
-            if (entry->cache_entry != NULL) entry->cache_entry->is_full = TRUE;
+            http_complete_cache_entry(entry);
         }
         close_socket(&entry->sock_fd);
         return;
@@ -250,6 +305,7 @@ void http_read_data(http_t *entry, cache_t *cache) {
 
     memcpy(entry->data + entry->data_size, buf, bytes_read);
     entry->data_size += bytes_read;
+    timer_arm(&entry->timer, HTTP_IDLE_TIMEOUT * 1000);
 
     int b_no_headers = entry->headers_size == HTTP_NO_HEADERS;
     if (entry->headers_size == HTTP_NO_HEADERS) parse_http_response_headers(entry);
@@ -265,14 +321,31 @@ void http_read_data(http_t *entry, cache_t *cache) {
     }
 }
 
+int http_check_connected(http_t *entry) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(entry->sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) error = errno;
+    if (error != 0) {
+        errno = error;
+        if (ERROR_LOG) perror("http_send_request: unable to connect to http socket");
+        http_goes_error(entry);
+        return -1;
+    }
+    return 0;
+}
+
 void http_send_request(http_t *entry) {
+    if (entry->request_bytes_written == 0 && http_check_connected(entry) == -1) return;
+
     ssize_t bytes_written = write(entry->sock_fd, entry->request + entry->request_bytes_written, entry->request_size - entry->request_bytes_written);
     if (bytes_written >= 0) entry->request_bytes_written += bytes_written;
     if (entry->request_bytes_written == entry->request_size) {
         entry->status = DOWNLOADING;
         entry->request_size = 0;
         free_with_null((void **)&entry->request);
+        timer_arm(&entry->timer, HTTP_FIRST_BYTE_TIMEOUT * 1000);
     }
+    else if (bytes_written > 0) timer_arm(&entry->timer, HTTP_IDLE_TIMEOUT * 1000);
     if (bytes_written == -1) {
         if (ERROR_LOG) perror("http_send_request: unable to write to http socket");
         http_goes_error(entry);
@@ -5,7 +5,7 @@
 #ifndef LAB31_HTTP_H
 #define LAB31_HTTP_H
 
-http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_list_t *http_list);
+http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_list_t *http_list, timer_wheel_t *timer_wheel);
 void remove_http(http_t *http, http_list_t *http_list, cache_t *cache);
 
 int http_init(http_t *http, int sock_fd, char *request, ssize_t request_size, char *host, char *path);
@@ -13,6 +13,7 @@ void http_destroy(http_t *http, cache_t *cache);
 
 int http_check_disconnect(http_t *http);
 int http_open_socket(const char *hostname, int port);
+int http_open_host_socket(const char *host);
 
 void http_read_data(http_t *entry, cache_t *cache);
 void http_send_request(http_t *entry);
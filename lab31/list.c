@@ -5,6 +5,7 @@ void http_add_to_list(http_t *http, http_list_t *http_list) {
     http->next = http_list->head;
     http_list->head = http;
     if (http->next != NULL) http->next->prev = http;
+    http_list->size++;
 }
 
 void http_remove_from_list(http_t *http, http_list_t *http_list) {
@@ -16,6 +17,7 @@ void http_remove_from_list(http_t *http, http_list_t *http_list) {
         http->prev->next = http->next;
         if (http->next != NULL) http->next->prev = http->prev;
     }
+    http_list->size--;
 }
 
 void client_add_to_list(client_t *client, client_list_t *client_list) {
@@ -23,6 +25,7 @@ void client_add_to_list(client_t *client, client_list_t *client_list) {
     client->next = client_list->head;
     client_list->head = client;
     if (client->next != NULL) client->next->prev = client;
+    client_list->size++;
 }
 
 void client_remove_from_list(client_t *client, client_list_t *client_list) {
@@ -34,4 +37,5 @@ void client_remove_from_list(client_t *client, client_list_t *client_list) {
         client->prev->next = client->next;
         if (client->next != NULL) client->next->prev = client->prev;
     }
+    client_list->size--;
 }
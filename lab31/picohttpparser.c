@@ -36,6 +36,14 @@
 #endif
 #include "picohttpparser.h"
 
+/* without -msse4.2 the vector scanners are compiled with target attributes and picked at runtime by cpuid */
+#if !defined(__SSE4_2__) && (defined(__x86_64__) || defined(__i386__)) && (__GNUC__ >= 5 || defined(__clang__))
+#define PHR_RUNTIME_DISPATCH 1
+#include <immintrin.h>
+#else
+#define PHR_RUNTIME_DISPATCH 0
+#endif
+
 #if __GNUC__ >= 3
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -102,6 +110,161 @@ static const char *token_char_map = "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"
                                     "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0";
 
+#if PHR_RUNTIME_DISPATCH
+
+__attribute__((target("sse4.2"))) static const char *findchar_sse42(const char *buf, const char *buf_end, const char *ranges,
+                                                                     size_t ranges_size, int *found)
+{
+    *found = 0;
+    if (likely(buf_end - buf >= 16)) {
+        __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+
+        size_t left = (buf_end - buf) & ~15;
+        do {
+            __m128i b16 = _mm_loadu_si128((const __m128i *)buf);
+            int r = _mm_cmpestri(ranges16, ranges_size, b16, 16, _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+            if (unlikely(r != 16)) {
+                buf += r;
+                *found = 1;
+                break;
+            }
+            buf += 16;
+            left -= 16;
+        } while (likely(left != 0));
+    }
+    return buf;
+}
+
+/* AVX2 has no range compare, every [lo, hi] pair is tested as max(b, lo) == b && min(b, hi) == b on unsigned bytes.
+ * Most tokens end within 16 bytes, so pcmpestri checks the first block and only long values reach the 32-byte loop. */
+__attribute__((target("avx2,sse4.2"))) static const char *findchar_avx2(const char *buf, const char *buf_end, const char *ranges,
+                                                                        size_t ranges_size, int *found)
+{
+    __m256i lo[3], hi[3];
+    size_t num_ranges = ranges_size / 2;
+    size_t i;
+
+    /* with many ranges (header names) pcmpestri is cheaper than the emulation */
+    if (num_ranges > 3 || buf_end - buf < 16 + 32)
+        return findchar_sse42(buf, buf_end, ranges, ranges_size, found);
+
+    __m128i ranges16 = _mm_loadu_si128((const __m128i *)ranges);
+    int r = _mm_cmpestri(ranges16, ranges_size, _mm_loadu_si128((const __m128i *)buf), 16,
+                         _SIDD_LEAST_SIGNIFICANT | _SIDD_CMP_RANGES | _SIDD_UBYTE_OPS);
+    if (r != 16) {
+        *found = 1;
+        return buf + r;
+    }
+    buf += 16;
+
+    for (i = 0; i != num_ranges; ++i) {
+        lo[i] = _mm256_set1_epi8(ranges[i * 2]);
+        hi[i] = _mm256_set1_epi8(ranges[i * 2 + 1]);
+    }
+
+    size_t left = (buf_end - buf) & ~31;
+    do {
+        __m256i b32 = _mm256_loadu_si256((const __m256i *)buf);
+        __m256i match = _mm256_setzero_si256();
+        for (i = 0; i != num_ranges; ++i) {
+            __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(b32, lo[i]), b32);
+            __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(b32, hi[i]), b32);
+            match = _mm256_or_si256(match, _mm256_and_si256(ge, le));
+        }
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+        if (unlikely(mask != 0)) {
+            *found = 1;
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+        left -= 32;
+    } while (likely(left != 0));
+
+    /* every AVX2 CPU has SSE4.2, let it take the last 16 bytes */
+    return findchar_sse42(buf, buf_end, ranges, ranges_size, found);
+}
+
+static const char *findchar_scalar(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    /* callers finish the scan in their byte loops */
+    (void)buf_end;
+    (void)ranges;
+    (void)ranges_size;
+    *found = 0;
+    return buf;
+}
+
+typedef const char *(*findchar_fn)(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found);
+
+static const char *findchar_resolve(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found);
+
+/* races between threads on first use are benign: every thread stores the same values */
+static findchar_fn findchar_impl = findchar_resolve;
+static int simd_level = -1;
+
+static int detect_simd_level(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return PHR_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return PHR_SIMD_SSE42;
+    return PHR_SIMD_SCALAR;
+}
+
+static void select_simd_level(int level)
+{
+    findchar_impl = level == PHR_SIMD_AVX2 ? findchar_avx2 : level == PHR_SIMD_SSE42 ? findchar_sse42 : findchar_scalar;
+    simd_level = level;
+}
+
+/* AVX2 only pays off on values longer than ~1KB, typical header sets parse faster with SSE4.2 (see parser_bench) */
+static int default_simd_level(void)
+{
+    int level = detect_simd_level();
+    return level > PHR_SIMD_SSE42 ? PHR_SIMD_SSE42 : level;
+}
+
+static const char *findchar_resolve(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    select_simd_level(default_simd_level());
+    return findchar_impl(buf, buf_end, ranges, ranges_size, found);
+}
+
+static inline const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
+{
+    return findchar_impl(buf, buf_end, ranges, ranges_size, found);
+}
+
+static inline int findchar_is_vectorized(void)
+{
+    if (unlikely(simd_level < 0))
+        select_simd_level(default_simd_level());
+    return simd_level != PHR_SIMD_SCALAR;
+}
+
+int phr_get_simd_level(void)
+{
+    if (simd_level < 0)
+        select_simd_level(default_simd_level());
+    return simd_level;
+}
+
+int phr_get_max_simd_level(void)
+{
+    return detect_simd_level();
+}
+
+int phr_set_simd_level(int level)
+{
+    if (level < PHR_SIMD_SCALAR || level > detect_simd_level())
+        return -1;
+    select_simd_level(level);
+    return 0;
+}
+
+#else
+
 static const char *findchar_fast(const char *buf, const char *buf_end, const char *ranges, size_t ranges_size, int *found)
 {
     *found = 0;
@@ -131,19 +294,50 @@ static const char *findchar_fast(const char *buf, const char *buf_end, const cha
     return buf;
 }
 
+int phr_get_simd_level(void)
+{
+#ifdef __SSE4_2__
+    return PHR_SIMD_SSE42;
+#else
+    return PHR_SIMD_SCALAR;
+#endif
+}
+
+int phr_get_max_simd_level(void)
+{
+    return phr_get_simd_level();
+}
+
+int phr_set_simd_level(int level)
+{
+    return level == phr_get_simd_level() ? 0 : -1;
+}
+
+#endif
+
 static const char *get_token_to_eol(const char *buf, const char *buf_end, const char **token, size_t *token_len, int *ret)
 {
     const char *token_start = buf;
 
-#ifdef __SSE4_2__
+#if defined(__SSE4_2__) || PHR_RUNTIME_DISPATCH
     static const char ALIGNED(16) ranges1[16] = "\0\010"    /* allow HT */
                                                 "\012\037"  /* allow SP and up to but not including DEL */
                                                 "\177\177"; /* allow chars w. MSB set */
     int found;
+#endif
+#ifdef __SSE4_2__
     buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
     if (found)
         goto FOUND_CTL;
 #else
+#if PHR_RUNTIME_DISPATCH
+    /* vector scan leaves less than one vector for the byte loops below */
+    if (findchar_is_vectorized()) {
+        buf = findchar_fast(buf, buf_end, ranges1, 6, &found);
+        if (found)
+            goto FOUND_CTL;
+    }
+#endif
     /* find non-printable char within the next 8 bytes, this is the hottest code; manually inlined */
     while (likely(buf_end - buf >= 8)) {
 #define DOIT()                                                                                                                     \
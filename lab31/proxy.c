@@ -9,15 +9,22 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
 #include "http.h"
 #include "client.h"
 #include "cache.h"
 #include "types.h"
 #include "list.h"
+#include "timer_wheel.h"
+#include "snapshot.h"
 
 cache_t cache;
-client_list_t client_list = { .head = NULL };
-http_list_t http_list = { .head = NULL };
+client_list_t client_list = { .head = NULL, .size = 0 };
+http_list_t http_list = { .head = NULL, .size = 0 };
+timer_wheel_t timer_wheel;
+char *snapshot_path = NULL;
+pid_t snapshot_pid = -1;    //child writing snapshot in background
 
 int open_listen_socket(int port) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -95,15 +102,17 @@ void init_select_masks(fd_set *readfds, fd_set *writefds, int *select_max_fd) {
     while (cur_client != NULL) {
         client_t *next = cur_client->next;
 
+        if (!IS_ERROR_OR_DONE_STATUS(cur_client->status)) {
+            client_update_http_info(cur_client);    //failed http fails its clients, they are removed right away
+            check_finished_writing_to_client(cur_client);
+        }
+
         if (IS_ERROR_OR_DONE_STATUS(cur_client->status)) {
             remove_client(cur_client, &client_list);
             cur_client = next;
             continue;
         }
 
-        client_update_http_info(cur_client);
-        check_finished_writing_to_client(cur_client);
-
         FD_SET(cur_client->sock_fd, readfds);
         if ((cur_client->status == DOWNLOADING && cur_client->bytes_written < cur_client->http_entry->data_size) ||
             (cur_client->status == GETTING_FROM_CACHE && cur_client->bytes_written < cur_client->cache_entry->size)) {
@@ -170,7 +179,46 @@ void update_accept(fd_set *readfds, int listen_fd) {
             if (ERROR_LOG) perror("update_accept: accept error");
             return;
         }
-        create_client(client_sock_fd, &client_list);
+        if (client_list.size + http_list.size >= SOFT_CONNECTIONS) {
+            reject_client(client_sock_fd);
+            return;
+        }
+        create_client(client_sock_fd, &client_list, &timer_wheel);
+    }
+}
+
+//reports how background snapshot went once its child exits
+void reap_snapshot() {
+    int status;
+    if (snapshot_pid == -1 || waitpid(snapshot_pid, &status, WNOHANG) != snapshot_pid) return;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        if (INFO_LOG) printf("Snapshot: background write to '%s' finished\n", snapshot_path);
+    }
+    else if (ERROR_LOG) fprintf(stderr, "Snapshot: background write to '%s' failed\n", snapshot_path);
+    snapshot_pid = -1;
+}
+
+//forked child writes cache as it was at fork, event loop goes on meanwhile
+void update_snapshot() {
+    if (snapshot_path == NULL) {
+        fprintf(stderr, "Cache snapshot is disabled, give snapshot_path argument\n");
+        return;
+    }
+    reap_snapshot();
+    if (snapshot_pid != -1) {
+        fprintf(stderr, "Cache snapshot is already being written\n");
+        return;
+    }
+    fflush(stdout);
+    snapshot_pid = fork();
+    if (snapshot_pid == -1) {
+        if (ERROR_LOG) perror("update_snapshot: fork error");
+        return;
+    }
+    if (snapshot_pid == 0) {
+        int err_code = snapshot_write(snapshot_path, &cache);
+        fflush(stdout);
+        _exit(err_code == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 }
 
@@ -187,6 +235,7 @@ int update_stdin(fd_set *readfds) {
 
         if (STR_EQ(buf, "exit")) return -1;
         else if (STR_EQ(buf, "cache")) cache_print_content(&cache);
+        else if (STR_EQ(buf, "snapshot")) update_snapshot();
         else if (STR_EQ(buf, "active")) print_active_connections();
     }
     return 0;
@@ -199,22 +248,32 @@ void proxy_spin(int listen_fd) {
     while (TRUE) {
         select_max_fd = MAX(STDIN_FILENO, listen_fd);
         init_select_masks(&readfds, &writefds, &select_max_fd);
-        FD_SET(listen_fd, &readfds);
+        if (client_list.size + http_list.size < MAX_CONNECTIONS) FD_SET(listen_fd, &readfds);  //else clients wait in backlog until some leave
         FD_SET(STDIN_FILENO, &readfds);
 
-        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, NULL);
+        struct timeval timeout;
+        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, timer_wheel_timeout(&timer_wheel, &timeout));
+        reap_snapshot();
         if (num_fds_ready == -1) {
+            if (errno == EINTR) continue;   //SIGCHLD of snapshot child
             if (ERROR_LOG) perror("proxy_spin: select error");
             break;
         }
-        if (num_fds_ready == 0) continue;
 
-        update_connections(&readfds, &writefds);
-        update_accept(&readfds, listen_fd);
-        if (update_stdin(&readfds) == -1) break;
+        if (num_fds_ready > 0) {
+            update_connections(&readfds, &writefds);
+            update_accept(&readfds, listen_fd);
+            if (update_stdin(&readfds) == -1) break;
+        }
+        timer_wheel_expire(&timer_wheel);
     }
 }
 
+//only wakes select, so finished snapshot child is reaped right away
+void handle_child_signal(int sig) {
+    (void)sig;
+}
+
 int parse_port(char *listen_port_str, int *listen_port) {
     if (convert_number(listen_port_str, listen_port) == -1) return -1;
     if (!IS_PORT_VALID(*listen_port)) {
@@ -225,14 +284,23 @@ int parse_port(char *listen_port_str, int *listen_port) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s listen_port\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s listen_port [snapshot_path]\n", argv[0]);
         return EXIT_SUCCESS;
     }
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         perror("main: signal error");
         return EXIT_FAILURE;
     }
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = handle_child_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &action, NULL) == -1) {
+        perror("main: sigaction error");
+        return EXIT_FAILURE;
+    }
     if (cache_init(&cache) != 0) {
         fprintf(stderr, "Unable to init cache\n");
         return EXIT_FAILURE;
@@ -240,13 +308,22 @@ int main(int argc, char **argv) {
 
     int port;
     if (parse_port(argv[1], &port) == -1) return EXIT_FAILURE;
+    if (argc == 3) {
+        snapshot_path = argv[2];
+        snapshot_load(snapshot_path, &cache);   //before listening socket, first clients find cache warm
+    }
 
     int listen_fd = open_listen_socket(port);
     if (listen_fd == -1) return EXIT_FAILURE;
+    timer_wheel_init(&timer_wheel);
 
     proxy_spin(listen_fd);
 
     remove_all_connections();
+    if (snapshot_path != NULL) {
+        if (snapshot_pid != -1) waitpid(snapshot_pid, NULL, 0);
+        snapshot_write(snapshot_path, &cache);
+    }
     cache_destroy(&cache);
     close(listen_fd);
 
@@ -5,12 +5,28 @@
 
 #define BUF_SIZE 4096
 
+#define HTTP_DEFAULT_PORT 80
+#define HOSTNAME_MAX_SIZE 256
+
 #define GETTING_FROM_CACHE 2    //only for client
 #define DOWNLOADING 1
 #define AWAITING_REQUEST 0
 #define SOCK_DONE (-1)
 #define SOCK_ERROR (-2)
 
+#define CLIENT_IDLE_TIMEOUT 60        //seconds, between requests and while client does not take response
+#define CLIENT_HEADER_TIMEOUT 10      //seconds from first byte of request to its last header
+#define HTTP_CONNECT_TIMEOUT 10
+#define HTTP_FIRST_BYTE_TIMEOUT 30    //seconds from sent request to first byte of response
+#define HTTP_IDLE_TIMEOUT 30          //seconds between reads of response
+
+//clients and https together, select cannot watch descriptors above FD_SETSIZE
+#define MAX_CONNECTIONS 960           //accept pauses, new connections wait in listen backlog
+#define SOFT_CONNECTIONS 800          //new connections get 503 and are closed right away
+
+#define NEGATIVE_CACHE_TTL 10         //seconds 301, 404 and 410 responses stay in cache, 0 disables
+#define ERROR_CACHE_TTL 0             //seconds for 5xx responses, 0 disables
+
 #define HTTP_NO_HEADERS (-1)
 
 #define HTTP_CODE_UNDEFINED (-1)
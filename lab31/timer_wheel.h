@@ -0,0 +1,46 @@
+#include <sys/time.h>
+
+#ifndef LAB31_TIMER_WHEEL_H
+#define LAB31_TIMER_WHEEL_H
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4    //64^4 ticks of 10ms, about 46 hours
+
+/*
+ * Hierarchical timer wheel, one per event loop, not thread-safe.
+ * Arm and cancel are O(1): timer goes to the level its delay fits in and is
+ * moved one level down each time the lower level wraps around.
+ */
+
+struct timer_wheel;
+
+typedef struct wheel_timer {
+    unsigned long long expires;     //in ticks since wheel start
+    void (*callback)(struct wheel_timer *timer);
+    void *owner;
+    struct timer_wheel *wheel;
+    struct wheel_timer **slot;      //NULL if timer is not armed
+    struct wheel_timer *prev, *next;
+} wheel_timer_t;
+
+typedef struct timer_wheel {
+    long long start_ms;
+    unsigned long long current;     //next tick to process
+    wheel_timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    int size;
+} timer_wheel_t;
+
+long long timer_now_ms();
+
+void timer_wheel_init(timer_wheel_t *wheel);
+
+void timer_init(wheel_timer_t *timer, timer_wheel_t *wheel, void (*callback)(wheel_timer_t *), void *owner);
+void timer_arm(wheel_timer_t *timer, long long timeout_ms);
+void timer_cancel(wheel_timer_t *timer);
+
+int timer_wheel_expire(timer_wheel_t *wheel);
+struct timeval *timer_wheel_timeout(timer_wheel_t *wheel, struct timeval *timeout);
+
+#endif
@@ -1,5 +1,6 @@
 #include "cache.h"
 #include "picohttpparser.h"
+#include "timer_wheel.h"
 
 #ifndef LAB31_TYPES_H
 #define LAB31_TYPES_H
@@ -12,6 +13,7 @@ typedef struct http {
     char *request; ssize_t request_size; ssize_t request_bytes_written;
     char *host, *path;
     cache_entry_t *cache_entry;
+    wheel_timer_t timer;
     struct http *prev, *next;
 } http_t;
 
@@ -20,15 +22,18 @@ typedef struct client {
     cache_entry_t *cache_entry;  http_t *http_entry;
     char *request;  ssize_t request_size; ssize_t request_alloc_size;
     ssize_t bytes_written;
+    wheel_timer_t timer;
     struct client *prev, *next;
 } client_t;
 
 typedef struct http_list {
     http_t *head;
+    int size;
 } http_list_t;
 
 typedef struct client_list {
     client_t *head;
+    int size;
 } client_list_t;
 
 #endif
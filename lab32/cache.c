@@ -37,6 +37,10 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     node->data = data;
     node->host = host;
     node->path = path;
+    node->code = 200;
+    node->expires = 0;
+    node->refs = 2;     //list and http that downloads it
+    node->is_linked = TRUE;
 
     write_lock_rwlock(&cache->rwlock, "cache_add");
     node->prev = NULL;
@@ -48,14 +52,65 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     return node;
 }
 
+int is_expired(cache_entry_t *entry, time_t now) {
+    read_lock_rwlock(&entry->rwlock, "is_expired");
+    int expired = entry->is_full && entry->expires != 0 && entry->expires <= now;
+    unlock_rwlock(&entry->rwlock, "is_expired");
+    return expired;
+}
+
+void cache_unlink(cache_entry_t *entry, cache_t *cache) {
+    if (entry == cache->head) {
+        cache->head = entry->next;
+        if (cache->head != NULL) cache->head->prev = NULL;
+    }
+    else {
+        entry->prev->next = entry->next;
+        if (entry->next != NULL) entry->next->prev = entry->prev;
+    }
+    entry->is_linked = FALSE;
+}
+
+//unlinked entries are released after lock, freeing them does not hold up other lookups
+void cache_remove_expired(const char *host, const char *path, time_t now, cache_t *cache) {
+    cache_entry_t *expired = NULL;
+    write_lock_rwlock(&cache->rwlock, "cache_remove_expired");
+    cache_entry_t *cur = cache->head;
+    while (cur != NULL) {
+        cache_entry_t *next = cur->next;
+        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path) && is_expired(cur, now)) {
+            cache_unlink(cur, cache);
+            cur->next = expired;
+            expired = cur;
+        }
+        cur = next;
+    }
+    unlock_rwlock(&cache->rwlock, "cache_remove_expired");
+
+    while (expired != NULL) {
+        cache_entry_t *next = expired->next;
+        cache_entry_release(expired);
+        expired = next;
+    }
+}
+
+//found entry comes with a reference taken for caller, expired ones leave cache
 cache_entry_t *cache_find(const char *host, const char *path, cache_t *cache) {
+    time_t now = time(NULL);
+    int has_expired = FALSE;
     read_lock_rwlock(&cache->rwlock, "cache_find");
     cache_entry_t *cur = cache->head;
     while (cur != NULL) {
-        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path)) break;
+        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path)) {
+            if (!is_expired(cur, now)) break;
+            has_expired = TRUE;
+        }
         cur = cur->next;
     }
+    if (cur != NULL) cache_entry_acquire(cur);
     unlock_rwlock(&cache->rwlock, "cache_find");
+
+    if (has_expired) cache_remove_expired(host, path, now, cache);
     return cur;
 }
 
@@ -68,18 +123,21 @@ void free_cache_entry(cache_entry_t *entry) {
     free(entry);
 }
 
+//drops reference of list, entry lives on while somebody else holds it
 void cache_remove(cache_entry_t *entry, cache_t *cache) {
     write_lock_rwlock(&cache->rwlock, "cache_remove");
-    if (entry == cache->head) {
-        cache->head = entry->next;
-        if (cache->head != NULL) cache->head->prev = NULL;
-    }
-    else {
-        entry->prev->next = entry->next;
-        if (entry->next != NULL) entry->next->prev = entry->prev;
-    }
+    int was_linked = entry->is_linked;
+    if (was_linked) cache_unlink(entry, cache);
     unlock_rwlock(&cache->rwlock, "cache_remove");
-    free_cache_entry(entry);
+    if (was_linked) cache_entry_release(entry);
+}
+
+void cache_entry_acquire(cache_entry_t *entry) {
+    __sync_add_and_fetch(&entry->refs, 1);
+}
+
+void cache_entry_release(cache_entry_t *entry) {
+    if (entry != NULL && __sync_sub_and_fetch(&entry->refs, 1) == 0) free_cache_entry(entry);
 }
 
 void cache_destroy(cache_t *cache) {
@@ -97,7 +155,7 @@ void cache_print_content(cache_t *cache) {
     read_lock_rwlock(&cache->rwlock, "cache_print_content");
     cache_entry_t *cur = cache->head;
     while (cur != NULL) {
-        printf("%s %s %zd full=%d\n", cur->host, cur->path, cur->size, cur->is_full);
+        printf("%s %s %zd full=%d code=%d refs=%d\n", cur->host, cur->path, cur->size, cur->is_full, cur->code, cur->refs);
         cur = cur->next;
     }
     unlock_rwlock(&cache->rwlock, "cache_print_content");
@@ -1,13 +1,23 @@
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 
 #ifndef LAB32_CACHE_H
 #define LAB32_CACHE_H
 
+/*
+ * Entry is freed when its last reference is released: list holds one while entry is linked,
+ * http that downloads it holds one, every client reading it holds one. Complete entry with
+ * expiry time (error and redirect responses) is unlinked by lookup that finds it expired.
+ */
+
 typedef struct cache_entry {
     int is_full;
     char *data; ssize_t size;
     char *host, *path;
+    int code;
+    time_t expires;     //0 is never, set together with is_full
+    int refs, is_linked;
     pthread_rwlock_t rwlock;
     struct cache_entry *next, *prev;
 } cache_entry_t;
@@ -21,6 +31,8 @@ int cache_init(cache_t *cache);
 cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache_t *cache);
 cache_entry_t *cache_find(const char *host, const char *path, cache_t *cache);
 void cache_remove(cache_entry_t *entry, cache_t *cache);
+void cache_entry_acquire(cache_entry_t *entry);
+void cache_entry_release(cache_entry_t *entry);
 void cache_destroy(cache_t *cache);
 void cache_print_content(cache_t *cache);
 
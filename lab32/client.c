@@ -46,6 +46,8 @@ int client_init(client_t *client, int client_sock_fd) {
     client->bytes_written = 0;
     client->request = NULL;
     client->request_size = 0;
+    client->is_fresh = TRUE;
+    client->deadline_ms = get_deadline_ms(CLIENT_IDLE_TIMEOUT);
 
     if (fcntl(client_sock_fd, F_SETFL, O_NONBLOCK) == -1) {
         if (ERROR_LOG) perror("create_client: fcntl error");
@@ -60,6 +62,8 @@ void client_destroy(client_t *client) {
         client->http_entry->clients--;
         unlock_rwlock(&client->http_entry->rwlock, "client_destroy");
     }
+    cache_entry_release(client->cache_entry);
+    client->cache_entry = NULL;
     close(client->sock_fd);
 }
 
@@ -90,6 +94,7 @@ void client_update_http_info(client_t *client) {
             char buf[1] = { 1 };
             write(client->http_entry->client_pipe_fd, buf, 1);
             client->cache_entry = client->http_entry->cache_entry;
+            cache_entry_acquire(client->cache_entry);
             unlock_rwlock(&client->http_entry->rwlock, "client_update_http_info: FULL CACHE");
             client->http_entry = NULL;
             client->status = GETTING_FROM_CACHE;
@@ -175,6 +180,7 @@ void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *ht
             return;
         }
         unlock_rwlock(&cache_entry->rwlock, "handle_client_request: CACHE");
+        cache_entry_release(cache_entry);   //still downloading, client joins its http below
     }
 
     //there is no cache_entry in cache:
@@ -198,7 +204,7 @@ void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *ht
     unlock_rwlock(&http_list->rwlock, "handle_client_request: HTTP LIST");
 
     if (http_entry == NULL)  {  //no active http cache_entry with the same request
-        int http_sock_fd = http_open_socket(host, 80);
+        int http_sock_fd = http_open_host_socket(host);
         if (http_sock_fd == -1) {
             client_goes_error(client);
             free(host); free(path);
@@ -261,6 +267,7 @@ void client_read_data(client_t *client, http_list_t *http_list, cache_t *cache,
             read_lock_rwlock(&client->cache_entry->rwlock, "client_read_data: CACHE ENTRY");
             if (client->bytes_written == client->cache_entry->size) {
                 unlock_rwlock(&client->cache_entry->rwlock, "client_read_data: CACHE ENTRY EQUALS");
+                cache_entry_release(client->cache_entry);
                 client->cache_entry = NULL;
                 client->bytes_written = 0;
                 client->status = AWAITING_REQUEST;
@@ -290,9 +297,22 @@ void client_read_data(client_t *client, http_list_t *http_list, cache_t *cache,
 
     client->request = check;
     memcpy(client->request + client->request_size, buf, bytes_read);
+    client->is_fresh = FALSE;
     client->request_size += bytes_read;
+    if (client->request_size == bytes_read) client->deadline_ms = get_deadline_ms(CLIENT_HEADER_TIMEOUT);  //not moved by later parts
 
     handle_client_request(client, bytes_read, http_list, cache, http_thread_func);
+    if (client->status == DOWNLOADING || client->status == GETTING_FROM_CACHE) client->deadline_ms = get_deadline_ms(CLIENT_IDLE_TIMEOUT);
+}
+
+void client_check_timeout(client_t *client) {
+    if (client->deadline_ms == NO_DEADLINE || IS_ERROR_OR_DONE_STATUS(client->status) || get_time_ms() < client->deadline_ms) return;
+
+    const char *reason = "idle";
+    if (client->status == AWAITING_REQUEST && client->request_size > 0) reason = "request headers";
+    else if (client->status != AWAITING_REQUEST) reason = "response not taken";
+    if (INFO_LOG) printf("[%d] Timed out: %s\n", client->sock_fd, reason);
+    client_goes_error(client);
 }
 
 void check_finished_writing_to_client(client_t *client) {
@@ -314,6 +334,7 @@ void check_finished_writing_to_client(client_t *client) {
         read_lock_rwlock(&client->cache_entry->rwlock, "check_finished_writing_to_client: CACHE");
         if (client->bytes_written >= client->cache_entry->size && client->cache_entry->is_full) {
             unlock_rwlock(&client->cache_entry->rwlock, "check_finished_writing_to_client: CACHE COMPLETE");
+            cache_entry_release(client->cache_entry);
             client->cache_entry = NULL;
             client->bytes_written = 0;
             client->status = AWAITING_REQUEST;
@@ -351,5 +372,6 @@ void write_to_client(client_t *client) {
         return;
     }
     client->bytes_written += bytes_written;
+    if (bytes_written > 0) client->deadline_ms = get_deadline_ms(CLIENT_IDLE_TIMEOUT);
     check_finished_writing_to_client(client);
 }
@@ -17,5 +17,6 @@ void check_finished_writing_to_client(client_t *client);
 
 void client_read_data(client_t *client, http_list_t *http_list, cache_t *cache, void *(*http_thread_func)(void*));
 void write_to_client(client_t *client);
+void client_check_timeout(client_t *client);
 
 #endif
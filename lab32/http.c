@@ -67,15 +67,17 @@ int http_init(http_t *http, int sock_fd, char *request, ssize_t request_size, ch
     http->request = request; http->request_size = request_size; http->request_bytes_written = 0;
     http->host = host; http->path = path;
     http->cache_entry = NULL;
+    http->deadline_ms = get_deadline_ms(HTTP_CONNECT_TIMEOUT);
     return 0;
 }
 
 void http_destroy(http_t *http, cache_t *cache) {
-    if (http->cache_entry != NULL && !http->cache_entry->is_full) {
-        cache_remove(http->cache_entry, cache);
+    if (http->cache_entry != NULL) {
+        if (!http->cache_entry->is_full) cache_remove(http->cache_entry, cache);
+        cache_entry_release(http->cache_entry);
         http->cache_entry = NULL;
     }
-    else if (http->cache_entry == NULL) {
+    else {
         free(http->data);
         free(http->host);
         free(http->path);
@@ -140,21 +142,46 @@ int http_open_socket(const char *hostname, int port) {
         return -1;
     }
 
-    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1) {
+    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        if (ERROR_LOG) perror("open_http_socket: fcntl error");
+    }
+
+    //connect finishes in background, http_send_request checks its result once socket is writable
+    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS) {
         if (ERROR_LOG) perror("open_http_socket: connect error");
         close(sock_fd);
         return -1;
     }
 
-    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
-        if (ERROR_LOG) perror("open_http_socket: fcntl error");
+    return sock_fd;
+}
+
+//host header value may carry explicit port: "example.com:8080"
+int http_open_host_socket(const char *host) {
+    int port = HTTP_DEFAULT_PORT;
+    const char *delim = strrchr(host, ':');
+    size_t hostname_len = delim == NULL ? strlen(host) : (size_t)(delim - host);
+    if (delim != NULL) {
+        port = get_number_from_string_by_length(delim + 1, strlen(delim + 1));
+        if (!IS_PORT_VALID(port)) {
+            if (ERROR_LOG) fprintf(stderr, "Invalid port in host '%s'\n", host);
+            return -1;
+        }
     }
 
-    return sock_fd;
+    char hostname[HOSTNAME_MAX_SIZE];
+    if (hostname_len >= sizeof(hostname)) {
+        if (ERROR_LOG) fprintf(stderr, "Host name '%s' is too long\n", host);
+        return -1;
+    }
+    memcpy(hostname, host, hostname_len);
+    hostname[hostname_len] = '\0';
+    return http_open_socket(hostname, port);
 }
 
 void http_goes_error(http_t *http) {
     http->status = SOCK_ERROR;
+    http->deadline_ms = NO_DEADLINE;
     close_socket(&http->sock_fd);
     http->data_size = 0;
     http->is_response_complete = FALSE;
@@ -197,6 +224,39 @@ void parse_http_response_headers(http_t *http) {
     }
 }
 
+int http_cache_ttl(int code) {
+    if (code == 301 || code == 404 || code == 410) return NEGATIVE_CACHE_TTL;
+    if (code >= 500 && code < 600) return ERROR_CACHE_TTL;
+    return 0;
+}
+
+//complete 200 responses stay for good, some errors and redirects for short ttl
+int http_is_cacheable(http_t *entry) {
+    return entry->code == 200 || http_cache_ttl(entry->code) > 0;
+}
+
+void http_update_cache_entry(http_t *entry, cache_t *cache) {
+    if (entry->cache_entry == NULL) {
+        entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
+        if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
+        else entry->cache_entry->code = entry->code;
+        return;
+    }
+    write_lock_rwlock(&entry->cache_entry->rwlock, "http_update_cache_entry");
+    entry->cache_entry->data = entry->data;
+    entry->cache_entry->size = entry->data_size;
+    unlock_rwlock(&entry->cache_entry->rwlock, "http_update_cache_entry");
+}
+
+//ttl counts from the moment response is complete
+void http_complete_cache_entry(http_t *entry) {
+    if (entry->cache_entry == NULL) return;
+    write_lock_rwlock(&entry->cache_entry->rwlock, "http_complete_cache_entry");
+    entry->cache_entry->is_full = TRUE;
+    if (entry->code != 200) entry->cache_entry->expires = time(NULL) + http_cache_ttl(entry->code);
+    unlock_rwlock(&entry->cache_entry->rwlock, "http_complete_cache_entry");
+}
+
 void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize_t size, cache_t *cache) {
     size_t rsize = size;
     ssize_t pret;
@@ -208,25 +268,10 @@ void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize
         return;
     }
 
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: CODE 200");
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: CODE 200");
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
 
     if (pret == 0) {
-        if (entry->cache_entry != NULL) {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: FULL");
-            entry->cache_entry->is_full = TRUE;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: FULL");
-        }
+        http_complete_cache_entry(entry);
         entry->is_response_complete = TRUE;
         char buf1[1] = { 1 };
         for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
@@ -234,24 +279,9 @@ void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize
 }
 
 void parse_http_response_by_length(http_t *entry, cache_t *cache) {
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: CODE 200");
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: CODE 200");
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
     if (entry->data_size == entry->headers_size + entry->response_size) {
-        if (entry->cache_entry != NULL) {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: FULL");
-            entry->cache_entry->is_full = TRUE;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: FULL");
-        }
+        http_complete_cache_entry(entry);
         entry->is_response_complete = TRUE;
         char buf1[1] = { 1 };
         for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
@@ -281,9 +311,10 @@ void http_read_data(http_t *entry, cache_t *cache) {
 
     if (bytes_read == 0) {
         entry->status = SOCK_DONE;
+        entry->deadline_ms = NO_DEADLINE;
         if (entry->response_type == HTTP_RESPONSE_NONE) {
             entry->is_response_complete = TRUE;
-            if (entry->cache_entry != NULL) entry->cache_entry->is_full = TRUE;
+            http_complete_cache_entry(entry);
         }
         close_socket(&entry->sock_fd);
         unlock_rwlock(&entry->rwlock, "http_read_data: 0");
@@ -308,6 +339,7 @@ void http_read_data(http_t *entry, cache_t *cache) {
     entry->data = check;
     memcpy(entry->data + entry->data_size, buf, bytes_read);
     entry->data_size += bytes_read;
+    entry->deadline_ms = get_deadline_ms(HTTP_IDLE_TIMEOUT);
 
     int b_no_headers = entry->headers_size == HTTP_NO_HEADERS;
     if (entry->headers_size == HTTP_NO_HEADERS) parse_http_response_headers(entry);
@@ -328,7 +360,24 @@ void http_read_data(http_t *entry, cache_t *cache) {
     unlock_rwlock(&entry->rwlock, "http_read_data: END");
 }
 
+//result of non-blocking connect, checked before first write
+int http_connect_error(http_t *entry) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(entry->sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) error = errno;
+    return error;
+}
+
 void http_send_request(http_t *entry) {
+    int connect_error = entry->request_bytes_written == 0 ? http_connect_error(entry) : 0;
+    if (connect_error != 0) {
+        if (ERROR_LOG) print_error("http_send_request: unable to connect to http socket", connect_error);
+        write_lock_rwlock(&entry->rwlock, "http_send_request: CONNECT");
+        http_goes_error(entry);
+        unlock_rwlock(&entry->rwlock, "http_send_request: CONNECT");
+        return;
+    }
+
     ssize_t bytes_written = write(entry->sock_fd, entry->request + entry->request_bytes_written, entry->request_size - entry->request_bytes_written);
     if (bytes_written >= 0) entry->request_bytes_written += bytes_written;
     write_lock_rwlock(&entry->rwlock, "http_send_request");
@@ -336,10 +385,26 @@ void http_send_request(http_t *entry) {
         entry->status = DOWNLOADING;
         entry->request_size = 0;
         free_with_null((void **)&entry->request);
+        entry->deadline_ms = get_deadline_ms(HTTP_FIRST_BYTE_TIMEOUT);
     }
+    else if (bytes_written > 0) entry->deadline_ms = get_deadline_ms(HTTP_IDLE_TIMEOUT);
     if (bytes_written == -1) {
         if (ERROR_LOG) perror("http_send_request: unable to write to http socket");
         http_goes_error(entry);
     }
     unlock_rwlock(&entry->rwlock, "http_send_request");
 }
+
+void http_check_timeout(http_t *entry) {
+    if (entry->deadline_ms == NO_DEADLINE || get_time_ms() < entry->deadline_ms) return;
+
+    write_lock_rwlock(&entry->rwlock, "http_check_timeout");
+    if (!IS_ERROR_OR_DONE_STATUS(entry->status)) {
+        const char *reason = "idle";
+        if (entry->status == AWAITING_REQUEST) reason = entry->request_bytes_written == 0 ? "connect" : "sending request";
+        else if (entry->data_size == 0) reason = "first byte";
+        if (INFO_LOG) printf("[%d %s %s] Timed out: %s\n", entry->sock_fd, entry->host, entry->path, reason);
+        http_goes_error(entry);
+    }
+    unlock_rwlock(&entry->rwlock, "http_check_timeout");
+}
@@ -13,8 +13,10 @@ void http_destroy(http_t *http, cache_t *cache);
 
 int http_check_disconnect(http_t *http);
 int http_open_socket(const char *hostname, int port);
+int http_open_host_socket(const char *host);
 
 void http_read_data(http_t *entry, cache_t *cache);
 void http_send_request(http_t *entry);
+void http_check_timeout(http_t *entry);
 
 #endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "lockprof.h"
+#include "states.h"
+
+typedef struct lockprof_site {
+    const char *tag;
+    unsigned long long acquisitions, contended;
+    unsigned long long wait_ns, wait_max_ns;
+    unsigned long long hold_ns, hold_max_ns;
+} lockprof_site_t;
+
+typedef struct lockprof_held {
+    pthread_rwlock_t *rwlock;
+    lockprof_site_t *site;
+    long long start_ns;
+} lockprof_held_t;
+
+typedef struct lockprof_table {
+    lockprof_site_t sites[LOCKPROF_TABLE_SIZE];
+    lockprof_site_t overflow;   //tags that did not fit
+    lockprof_held_t held[LOCKPROF_HELD_DEPTH];
+    int held_num;
+    struct lockprof_table *next;
+} lockprof_table_t;
+
+volatile int lockprof_enabled = FALSE;
+
+static __thread lockprof_table_t *thread_table = NULL;
+static lockprof_table_t *tables = NULL;
+static lockprof_table_t retired;    //totals of exited threads, guarded by tables_mutex
+static pthread_mutex_t tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t table_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+long long lockprof_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void site_add(lockprof_site_t *dest, const lockprof_site_t *src) {
+    dest->acquisitions += src->acquisitions;
+    dest->contended += src->contended;
+    dest->wait_ns += src->wait_ns;
+    dest->hold_ns += src->hold_ns;
+    dest->wait_max_ns = MAX(dest->wait_max_ns, src->wait_max_ns);
+    dest->hold_max_ns = MAX(dest->hold_max_ns, src->hold_max_ns);
+}
+
+lockprof_site_t *table_find_site(lockprof_table_t *table, const char *tag) {
+    for (int i = 0; i < LOCKPROF_TABLE_SIZE; i++) {
+        if (table->sites[i].tag == NULL || STR_EQ(table->sites[i].tag, tag)) return &table->sites[i];
+    }
+    return NULL;
+}
+
+//exiting thread folds its table into retired totals, so short-lived threads of lab32 do not pile up
+void table_retire(void *param) {
+    lockprof_table_t *table = (lockprof_table_t *)param;
+    pthread_mutex_lock(&tables_mutex);
+    lockprof_table_t **cur = &tables;
+    while (*cur != NULL && *cur != table) cur = &(*cur)->next;
+    if (*cur != NULL) *cur = table->next;
+
+    for (int i = 0; i < LOCKPROF_TABLE_SIZE; i++) {
+        if (table->sites[i].tag == NULL) continue;
+        lockprof_site_t *site = table_find_site(&retired, table->sites[i].tag);
+        if (site == NULL) site = &retired.overflow;
+        else site->tag = table->sites[i].tag;
+        site_add(site, &table->sites[i]);
+    }
+    site_add(&retired.overflow, &table->overflow);
+    pthread_mutex_unlock(&tables_mutex);
+    free(table);
+}
+
+void create_table_key() {
+    int err_code = pthread_key_create(&table_key, table_retire);
+    if (err_code != 0 && ERROR_LOG) print_error("lockprof: Unable to create thread key", err_code);
+}
+
+lockprof_table_t *get_thread_table() {
+    if (thread_table != NULL) return thread_table;
+
+    pthread_once(&key_once, create_table_key);
+    lockprof_table_t *table = (lockprof_table_t *)calloc(1, sizeof(lockprof_table_t));
+    if (table == NULL) return NULL;     //thread stays unprofiled
+    table->overflow.tag = "(other)";
+
+    pthread_mutex_lock(&tables_mutex);
+    table->next = tables;
+    tables = table;
+    pthread_mutex_unlock(&tables_mutex);
+    pthread_setspecific(table_key, table);
+    thread_table = table;
+    return table;
+}
+
+//tags are string literals, pointer hash finds the slot, strcmp only merges equal literals from different files
+lockprof_site_t *get_site(lockprof_table_t *table, const char *tag) {
+    unsigned int index = (unsigned int)(((size_t)tag >> 3) * 2654435761u) & (LOCKPROF_TABLE_SIZE - 1);
+    for (int i = 0; i < LOCKPROF_TABLE_SIZE; i++) {
+        lockprof_site_t *site = &table->sites[(index + i) & (LOCKPROF_TABLE_SIZE - 1)];
+        if (site->tag == tag) return site;
+        if (site->tag == NULL) {
+            site->tag = tag;
+            return site;
+        }
+    }
+    return &table->overflow;
+}
+
+int lockprof_lock(pthread_rwlock_t *rwlock, const char *tag, int is_write) {
+    lockprof_table_t *table = get_thread_table();
+    if (table == NULL) return is_write ? pthread_rwlock_wrlock(rwlock) : pthread_rwlock_rdlock(rwlock);
+    lockprof_site_t *site = get_site(table, tag);
+
+    int err_code = is_write ? pthread_rwlock_trywrlock(rwlock) : pthread_rwlock_tryrdlock(rwlock);
+    if (err_code == EBUSY) {
+        long long wait_start = lockprof_now_ns();
+        err_code = is_write ? pthread_rwlock_wrlock(rwlock) : pthread_rwlock_rdlock(rwlock);
+        unsigned long long wait = lockprof_now_ns() - wait_start;
+        site->contended++;
+        site->wait_ns += wait;
+        site->wait_max_ns = MAX(site->wait_max_ns, wait);
+    }
+    if (err_code != 0) return err_code;
+
+    site->acquisitions++;
+    if (table->held_num < LOCKPROF_HELD_DEPTH) {
+        lockprof_held_t *held = &table->held[table->held_num++];
+        held->rwlock = rwlock;
+        held->site = site;
+        held->start_ns = lockprof_now_ns();
+    }
+    return 0;
+}
+
+int lockprof_rdlock(pthread_rwlock_t *rwlock, const char *tag) {
+    return lockprof_lock(rwlock, tag, FALSE);
+}
+
+int lockprof_wrlock(pthread_rwlock_t *rwlock, const char *tag) {
+    return lockprof_lock(rwlock, tag, TRUE);
+}
+
+//called after unlock whether profiling is on or not, locks taken while it was on must leave the held stack
+void lockprof_unlocked(pthread_rwlock_t *rwlock) {
+    lockprof_table_t *table = thread_table;
+    if (table == NULL || table->held_num == 0) return;
+
+    for (int i = table->held_num - 1; i >= 0; i--) {
+        if (table->held[i].rwlock != rwlock) continue;
+
+        unsigned long long hold = lockprof_now_ns() - table->held[i].start_ns;
+        lockprof_site_t *site = table->held[i].site;
+        site->hold_ns += hold;
+        site->hold_max_ns = MAX(site->hold_max_ns, hold);
+
+        table->held_num--;
+        memmove(&table->held[i], &table->held[i + 1], (table->held_num - i) * sizeof(lockprof_held_t));
+        return;
+    }
+}
+
+//counters of running threads are zeroed without their owners knowing, a few in-flight updates may survive
+void lockprof_reset() {
+    pthread_mutex_lock(&tables_mutex);
+    for (lockprof_table_t *table = tables; table != NULL; table = table->next) {
+        for (int i = 0; i < LOCKPROF_TABLE_SIZE; i++) {
+            const char *tag = table->sites[i].tag;
+            memset(&table->sites[i], 0, sizeof(lockprof_site_t));
+            table->sites[i].tag = tag;
+        }
+        memset(&table->overflow, 0, sizeof(lockprof_site_t));
+        table->overflow.tag = "(other)";
+    }
+    memset(retired.sites, 0, sizeof(retired.sites));
+    memset(&retired.overflow, 0, sizeof(lockprof_site_t));
+    retired.overflow.tag = "(other)";
+    pthread_mutex_unlock(&tables_mutex);
+}
+
+void merge_table(lockprof_table_t *total, lockprof_table_t *table) {
+    for (int i = 0; i < LOCKPROF_TABLE_SIZE; i++) {
+        if (table->sites[i].tag == NULL || table->sites[i].acquisitions + table->sites[i].contended == 0) continue;
+        lockprof_site_t *site = table_find_site(total, table->sites[i].tag);
+        if (site == NULL) site = &total->overflow;
+        else site->tag = table->sites[i].tag;
+        site_add(site, &table->sites[i]);
+    }
+    site_add(&total->overflow, &table->overflow);
+}
+
+int compare_sites(const void *a, const void *b) {
+    const lockprof_site_t *x = (const lockprof_site_t *)a, *y = (const lockprof_site_t *)b;
+    if (x->wait_ns != y->wait_ns) return x->wait_ns < y->wait_ns ? 1 : -1;
+    if (x->hold_ns != y->hold_ns) return x->hold_ns < y->hold_ns ? 1 : -1;
+    return 0;
+}
+
+void lockprof_print_report() {
+    lockprof_table_t *total = (lockprof_table_t *)calloc(1, sizeof(lockprof_table_t));
+    if (total == NULL) {
+        if (ERROR_LOG) perror("lockprof_print_report: Unable to allocate memory for report");
+        return;
+    }
+    total->overflow.tag = "(other)";
+
+    pthread_mutex_lock(&tables_mutex);
+    for (lockprof_table_t *table = tables; table != NULL; table = table->next) merge_table(total, table);
+    merge_table(total, &retired);
+    pthread_mutex_unlock(&tables_mutex);
+
+    int sites_num = 0;
+    while (sites_num < LOCKPROF_TABLE_SIZE && total->sites[sites_num].tag != NULL) sites_num++;
+    if (total->overflow.acquisitions != 0 && sites_num < LOCKPROF_TABLE_SIZE) total->sites[sites_num++] = total->overflow;
+    qsort(total->sites, sites_num, sizeof(lockprof_site_t), compare_sites);
+
+    printf("Lock profiling is %s, top %d sites by wait time:\n", lockprof_enabled ? "on" : "off", LOCKPROF_REPORT_TOP);
+    printf("%10s %10s %7s %11s %10s %11s %10s  %s\n", "acquired", "contended", "cont%", "wait ms", "wait max", "hold ms", "hold max", "site");
+    for (int i = 0; i < sites_num && i < LOCKPROF_REPORT_TOP; i++) {
+        lockprof_site_t *site = &total->sites[i];
+        printf("%10llu %10llu %6.2f%% %11.3f %8.1fus %11.3f %8.1fus  %s\n", site->acquisitions, site->contended,
+               site->acquisitions == 0 ? 0.0 : 100.0 * site->contended / site->acquisitions,
+               site->wait_ns / 1e6, site->wait_max_ns / 1e3, site->hold_ns / 1e6, site->hold_max_ns / 1e3, site->tag);
+    }
+    if (sites_num == 0) printf("no locks recorded, enable with 'locks on'\n");
+    free(total);
+}
@@ -80,6 +80,19 @@ ssize_t phr_decode_chunked(struct phr_chunked_decoder *decoder, char *buf, size_
 /* returns if the chunked decoder is in middle of chunked data */
 int phr_decode_chunked_is_in_data(struct phr_chunked_decoder *decoder);
 
+#define PHR_SIMD_SCALAR 0
+#define PHR_SIMD_SSE42 1
+#define PHR_SIMD_AVX2 2
+
+/* returns scanner used for tokens and header values, picked from CPU features on first use */
+int phr_get_simd_level(void);
+
+/* returns best scanner the CPU and the build support, it is not always the default one */
+int phr_get_max_simd_level(void);
+
+/* forces scanner, e.g. for benchmarks; returns -1 if the CPU or the build does not support it */
+int phr_set_simd_level(int level);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,12 +12,22 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 #include "http.h"
 #include "client.h"
 #include "cache.h"
 #include "types.h"
+#include "lockprof.h"
+#include "snapshot.h"
 
-int listen_fd;
+int listen_fd = -1;
+int shutdown_pipe_fds[2];   //never read from, so it stays readable for every worker once written
+int signal_pipe_fds[2];     //drain signal may hit any thread, so handler wakes up main select through it
+int stdin_open = TRUE;
+char *snapshot_path = NULL;
+
+volatile int proxy_state = PROXY_RUNNING;
+volatile sig_atomic_t drain_requested = FALSE;
 
 cache_t cache;
 http_list_t http_list = { .head = NULL, .rwlock = PTHREAD_RWLOCK_INITIALIZER};
@@ -59,24 +69,33 @@ int open_listen_socket(int port) {
     return sock_fd;
 }
 
-void remove_all_connections() {
-    read_lock_rwlock(&client_list.rwlock, "remove_all_connections: CLIENT");
-    client_t *cur_client = client_list.head;
-    while (cur_client != NULL) {
-        client_t *next = cur_client->next;
-        pthread_cancel(cur_client->thread_id);
-        cur_client = next;
-    }
-    unlock_rwlock(&client_list.rwlock, "remove_all_connections: CLIENT");
+int has_connections() {
+    read_lock_rwlock(&client_list.rwlock, "has_connections: CLIENT");
+    read_lock_rwlock(&http_list.rwlock, "has_connections: HTTP");
+    int result = client_list.head != NULL || http_list.head != NULL;
+    unlock_rwlock(&http_list.rwlock, "has_connections: HTTP");
+    unlock_rwlock(&client_list.rwlock, "has_connections: CLIENT");
+    return result;
+}
 
-    read_lock_rwlock(&http_list.rwlock, "remove_all_connections: HTTP");
-    http_t *cur_http = http_list.head;
-    while (cur_http != NULL) {
-        http_t *next = cur_http->next;
-        pthread_cancel(cur_http->thread_id);
-        cur_http = next;
+void stop_workers() {
+    proxy_state = PROXY_STOPPED;
+    char buf[1] = { 1 };
+    write(shutdown_pipe_fds[1], buf, 1);
+}
+
+//every connection thread removes itself, so we only wait for lists to become empty
+void wait_for_connections() {
+    time_t deadline = time(NULL) + DRAIN_TIMEOUT;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+
+    while (has_connections()) {
+        if (proxy_state == PROXY_DRAINING && time(NULL) >= deadline) {
+            fprintf(stderr, "Drain timeout, dropping active connections\n");
+            stop_workers();
+        }
+        nanosleep(&interval, NULL);
     }
-    unlock_rwlock(&http_list.rwlock, "remove_all_connections: HTTP");
 }
 
 void print_active_connections() {
@@ -108,24 +127,27 @@ void print_active_connections() {
     unlock_rwlock(&http_list.rwlock, "print_active_connections: HTTP");
 }
 
-void *client_cancel_handler(void *param) {
-    client_t *client = (client_t *)param;
-    if (client == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "client_cancel_handler: param was NULL\n");
-        return NULL;
-    }
-    remove_client(client, &client_list);
-    return NULL;
+//select wakes up at connection deadline, while draining also every DRAIN_POLL_INTERVAL
+struct timeval *get_select_timeout(long long deadline_ms, struct timeval *timeout) {
+    long long wait_ms = -1;
+    if (deadline_ms != NO_DEADLINE) wait_ms = MAX(deadline_ms - get_time_ms(), 0);
+    if (proxy_state != PROXY_RUNNING && (wait_ms == -1 || wait_ms > DRAIN_POLL_INTERVAL * 1000)) wait_ms = DRAIN_POLL_INTERVAL * 1000;
+    if (wait_ms == -1) return NULL;
+
+    timeout->tv_sec = wait_ms / 1000;
+    timeout->tv_usec = (wait_ms % 1000) * 1000;
+    return timeout;
 }
 
 int init_client_select_masks(client_t *client, fd_set *readfds, fd_set *writefds) {
     FD_ZERO(readfds);
     FD_ZERO(writefds);
-    if (IS_ERROR_OR_DONE_STATUS(client->status)) return -1;
-
     int select_max_fd = 0;
-    client_update_http_info(client);
-    check_finished_writing_to_client(client);
+    if (!IS_ERROR_OR_DONE_STATUS(client->status)) {
+        client_update_http_info(client);    //failed http fails its clients, they leave right away
+        check_finished_writing_to_client(client);
+    }
+    if (IS_ERROR_OR_DONE_STATUS(client->status)) return -1;
 
     if (client->http_entry != NULL) {   //check wake-up from http
         FD_SET(client->http_entry->client_pipe_fd, readfds);
@@ -188,6 +210,11 @@ void update_client_connection(client_t *client, fd_set *readfds, fd_set *writefd
     }
 }
 
+//just accepted client has not sent its first request yet, it is not idle
+int is_client_idle(client_t *client) {
+    return client->status == AWAITING_REQUEST && client->request_size == 0 && !client->is_fresh;
+}
+
 void *client_worker(void *param) {
     client_t *client = (client_t *)param;
     if (client == NULL) {
@@ -196,34 +223,33 @@ void *client_worker(void *param) {
     }
 
     fd_set readfds, writefds;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-    pthread_cleanup_push(client_cancel_handler, client);
-    while (TRUE) {
+    while (proxy_state != PROXY_STOPPED) {
+        //while draining, keep-alive client between requests is closed right away
+        if (proxy_state == PROXY_DRAINING && is_client_idle(client)) break;
+
         int select_max_fd = init_client_select_masks(client, &readfds, &writefds);
         if (select_max_fd == -1) break;
 
-        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, NULL);
+        if (proxy_state == PROXY_RUNNING) {
+            FD_SET(shutdown_pipe_fds[0], &readfds);
+            select_max_fd = MAX(select_max_fd, shutdown_pipe_fds[0]);
+        }
+
+        errno = 0;
+        struct timeval timeout;
+        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, get_select_timeout(client->deadline_ms, &timeout));
         if (num_fds_ready == -1) {
+            if (errno == EINTR) continue;
             if (ERROR_LOG) fprintf(stderr, "client_worker: select error\n");
             break;
         }
-        if (num_fds_ready == 0) continue;
 
-        update_client_connection(client, &readfds, &writefds);
+        if (num_fds_ready > 0) update_client_connection(client, &readfds, &writefds);
+        client_check_timeout(client);
     }
-    pthread_cleanup_pop(TRUE);
-
-    return NULL;
-}
 
-void *http_cancel_handler(void *param) {
-    http_t *http = (http_t *)param;
-    if (http == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "http_cancel_handler: param was NULL\n");
-        return NULL;
-    }
-    remove_http(http, &http_list, &cache);
+    remove_client(client, &client_list);
     return NULL;
 }
 
@@ -263,6 +289,16 @@ void update_http_connection(http_t *http, fd_set *readfds, fd_set *writefds) {
     }
 }
 
+//http is freed only when no client thread references it, even on forced stop
+int http_can_stop(http_t *http) {
+    if (proxy_state == PROXY_RUNNING) return FALSE;
+    write_lock_rwlock(&http->rwlock, "http_can_stop");
+    int can_stop = http->clients == 0;
+    if (can_stop) http->dont_accept_clients = TRUE;
+    unlock_rwlock(&http->rwlock, "http_can_stop");
+    return can_stop;
+}
+
 void *http_worker(void *param) {
     http_t *http = (http_t *)param;
     if (http == NULL) {
@@ -271,24 +307,30 @@ void *http_worker(void *param) {
     }
 
     fd_set readfds, writefds;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-    pthread_cleanup_push(http_cancel_handler, http);
-    while (TRUE) {
+    while (!http_can_stop(http)) {
         int select_max_fd = init_http_select_masks(http, &readfds, &writefds);
         if (select_max_fd == -1) break;
 
-        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, NULL);
+        if (proxy_state == PROXY_RUNNING) {
+            FD_SET(shutdown_pipe_fds[0], &readfds);
+            select_max_fd = MAX(select_max_fd, shutdown_pipe_fds[0]);
+        }
+
+        errno = 0;
+        struct timeval timeout;
+        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, get_select_timeout(http->deadline_ms, &timeout));
         if (num_fds_ready == -1) {
+            if (errno == EINTR) continue;
             if (ERROR_LOG) fprintf(stderr, "http_worker: select error\n");
             break;
         }
-        if (num_fds_ready == 0) continue;
 
-        update_http_connection(http, &readfds, &writefds);
+        if (num_fds_ready > 0) update_http_connection(http, &readfds, &writefds);
+        http_check_timeout(http);
     }
-    pthread_cleanup_pop(TRUE);
 
+    remove_http(http, &http_list, &cache);
     return NULL;
 }
 
@@ -305,6 +347,44 @@ void update_accept(fd_set *readfds) {
     }
 }
 
+void start_drain() {
+    if (proxy_state != PROXY_RUNNING) return;
+    fprintf(stderr, "Draining: no new connections, waiting up to %d seconds for active ones\n", DRAIN_TIMEOUT);
+
+    while (TRUE) {
+        int client_sock_fd = accept(listen_fd, NULL, NULL);
+        if (client_sock_fd == -1) break;
+        create_client(client_sock_fd, &client_list, client_worker);
+    }
+    close_socket(&listen_fd);
+
+    proxy_state = PROXY_DRAINING;
+    if (snapshot_path != NULL && snapshot_start(snapshot_path, &cache, TRUE) == 0) {
+        fprintf(stderr, "Writing cache snapshot to '%s'\n", snapshot_path);
+    }
+    char buf[1] = { 1 };
+    write(shutdown_pipe_fds[1], buf, 1);
+}
+
+void update_snapshot() {
+    if (snapshot_path == NULL) {
+        fprintf(stderr, "Cache snapshot is disabled, give snapshot_path argument\n");
+        return;
+    }
+    int result = snapshot_start(snapshot_path, &cache, FALSE);
+    if (result == 0) fprintf(stderr, "Writing cache snapshot to '%s'\n", snapshot_path);
+    else if (result == 1) fprintf(stderr, "Cache snapshot is already being written\n");
+}
+
+//"locks" prints report, "locks on|off|reset" controls profiler
+void update_lock_profiler(const char *arg) {
+    if (STR_EQ(arg, "")) lockprof_print_report();
+    else if (STR_EQ(arg, " on")) lockprof_enabled = TRUE;
+    else if (STR_EQ(arg, " off")) lockprof_enabled = FALSE;
+    else if (STR_EQ(arg, " reset")) lockprof_reset();
+    else fprintf(stderr, "Usage: locks [on|off|reset]\n");
+}
+
 int update_stdin(fd_set *readfds) {
     if (FD_ISSET(STDIN_FILENO, readfds)) {
         char buf[BUF_SIZE + 1];
@@ -313,12 +393,19 @@ int update_stdin(fd_set *readfds) {
             if (ERROR_LOG)  perror("update_stdin: Unable to read from stdin");
             return -1;
         }
+        if (bytes_read == 0) {  //running detached from terminal, only signals are left
+            stdin_open = FALSE;
+            return 0;
+        }
         buf[bytes_read] = '\0';
         if (buf[bytes_read - 1] == '\n') buf[bytes_read - 1] = '\0';
 
         if (STR_EQ(buf, "exit")) return -1;
+        else if (STR_EQ(buf, "drain")) start_drain();
         else if (STR_EQ(buf, "cache")) cache_print_content(&cache);
+        else if (STR_EQ(buf, "snapshot")) update_snapshot();
         else if (STR_EQ(buf, "active")) print_active_connections();
+        else if (strncmp(buf, "locks", 5) == 0) update_lock_profiler(buf + 5);
     }
     return 0;
 }
@@ -326,21 +413,58 @@ int update_stdin(fd_set *readfds) {
 void proxy_spin() {
     fd_set readfds;
 
-    while (TRUE) {
+    while (proxy_state == PROXY_RUNNING) {
         FD_ZERO(&readfds);
         FD_SET(listen_fd, &readfds);
-        FD_SET(STDIN_FILENO, &readfds);
+        FD_SET(signal_pipe_fds[0], &readfds);
+        if (stdin_open) FD_SET(STDIN_FILENO, &readfds);
 
-        int num_fds_ready = select(listen_fd + 1, &readfds, NULL, NULL, NULL);
+        errno = 0;
+        int num_fds_ready = select(MAX(listen_fd, signal_pipe_fds[0]) + 1, &readfds, NULL, NULL, NULL);
         if (num_fds_ready == -1) {
+            if (errno == EINTR) continue;
             if (ERROR_LOG) perror("proxy_spin: select error");
+            stop_workers();
             break;
         }
         if (num_fds_ready == 0) continue;
 
+        if (drain_requested || FD_ISSET(signal_pipe_fds[0], &readfds)) {
+            start_drain();
+            break;
+        }
         update_accept(&readfds);
-        if (update_stdin(&readfds) == -1) break;
+        if (update_stdin(&readfds) == -1) {
+            stop_workers();
+            break;
+        }
+    }
+}
+
+void handle_drain_signal(int sig) {
+    (void)sig;
+    drain_requested = TRUE;
+    char buf[1] = { 1 };
+    write(signal_pipe_fds[1], buf, 1);
+}
+
+int setup_signals() {
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("main: signal error");
+        return -1;
+    }
+    if (open_wakeup_pipe(&signal_pipe_fds[0], &signal_pipe_fds[1]) == -1) return -1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = handle_drain_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGTERM, &action, NULL) == -1) {
+        perror("main: sigaction error");
+        return -1;
     }
+    return 0;
 }
 
 int parse_port(char *listen_port_str, int *listen_port) {
@@ -353,20 +477,24 @@ int parse_port(char *listen_port_str, int *listen_port) {
 }
 
 void cleanup() {
+    if (snapshot_path != NULL) snapshot_finish(snapshot_path, &cache);
     cache_destroy(&cache);
     pthread_rwlock_destroy(&http_list.rwlock);
-    close(listen_fd);
+    pthread_rwlock_destroy(&client_list.rwlock);
+    close(shutdown_pipe_fds[0]);
+    close(shutdown_pipe_fds[1]);
+    close(signal_pipe_fds[0]);
+    close(signal_pipe_fds[1]);
+    close_socket(&listen_fd);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s listen_port\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s listen_port [snapshot_path]\n", argv[0]);
         return EXIT_SUCCESS;
     }
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        perror("main: signal error");
-        return EXIT_FAILURE;
-    }
+    if (setup_signals() == -1) return EXIT_FAILURE;
+    if (open_wakeup_pipe(&shutdown_pipe_fds[0], &shutdown_pipe_fds[1]) == -1) return EXIT_FAILURE;
     if (cache_init(&cache) != 0) {
         fprintf(stderr, "Unable to init cache\n");
         return EXIT_FAILURE;
@@ -374,11 +502,15 @@ int main(int argc, char **argv) {
 
     int port;
     if (parse_port(argv[1], &port) == -1) return EXIT_FAILURE;
+    if (argc == 3) {
+        snapshot_path = argv[2];
+        snapshot_load(snapshot_path, &cache);   //before listening socket, first clients find cache warm
+    }
     if ((listen_fd = open_listen_socket(port)) == -1) return EXIT_FAILURE;
     atexit(cleanup);
 
     proxy_spin();
 
-    remove_all_connections();
-    pthread_exit(NULL);
+    wait_for_connections();
+    return EXIT_SUCCESS;
 }
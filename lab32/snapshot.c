@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "states.h"
+
+#define ALIGNED(SIZE) (((SIZE) + SNAPSHOT_ALIGN - 1) & ~((long long)SNAPSHOT_ALIGN - 1))
+
+typedef struct snapshot_index {
+    char *data;
+    size_t size, alloc_size;
+} snapshot_index_t;
+
+//background writer, next one joins previous
+static struct {
+    pthread_t thread;
+    int is_started, has_shutdown_snapshot;
+    volatile int is_writing;
+    const char *file_path;
+    cache_t *cache;
+    pthread_mutex_t mutex;
+} writer = { .is_started = FALSE, .has_shutdown_snapshot = FALSE, .is_writing = FALSE, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void crc_init() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : crc >> 1;
+        crc_table[i] = crc;
+    }
+}
+
+//CRC-32 as in zlib
+unsigned int snapshot_checksum(const void *data, size_t size) {
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned int crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; i++) crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            if (ERROR_LOG) perror("snapshot: write error");
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int index_append(snapshot_index_t *index, const snapshot_record_t *record, const char *host, const char *path) {
+    size_t size = ALIGNED(sizeof(snapshot_record_t) + record->host_length + record->path_length);
+    if (index->size + size > index->alloc_size) {
+        size_t alloc_size = MAX(index->alloc_size * 2, index->size + size + 64 * 1024);
+        char *check = (char *)realloc(index->data, alloc_size);
+        if (check == NULL) {
+            if (ERROR_LOG) perror("index_append: Unable to reallocate memory for snapshot index");
+            return -1;
+        }
+        index->data = check;
+        index->alloc_size = alloc_size;
+    }
+    char *cur = index->data + index->size;
+    memset(cur, 0, size);
+    memcpy(cur, record, sizeof(snapshot_record_t));
+    memcpy(cur + sizeof(snapshot_record_t), host, record->host_length);
+    memcpy(cur + sizeof(snapshot_record_t) + record->host_length, path, record->path_length);
+    index->size += size;
+    return 0;
+}
+
+int write_entry(int fd, cache_entry_t *entry, long long *offset, snapshot_index_t *index) {
+    static const char zeros[SNAPSHOT_ALIGN] = { 0 };
+    snapshot_record_t record;
+    memset(&record, 0, sizeof(snapshot_record_t));
+    record.data_offset = *offset;
+    record.size = entry->size;
+    record.expires = entry->expires;
+    record.code = entry->code;
+    record.host_length = strlen(entry->host);
+    record.path_length = strlen(entry->path);
+    record.checksum = snapshot_checksum(entry->data, entry->size);
+
+    if (write_all(fd, entry->data, entry->size) == -1) return -1;
+    if (write_all(fd, zeros, ALIGNED(entry->size) - entry->size) == -1) return -1;
+    *offset += ALIGNED(entry->size);
+    return index_append(index, &record, entry->host, entry->path);
+}
+
+//references are taken under cache lock, bodies are written after it: complete entry does not change anymore
+cache_entry_t **collect_full_entries(cache_t *cache, int *size) {
+    read_lock_rwlock(&cache->rwlock, "collect_full_entries");
+    int capacity = 0;
+    for (cache_entry_t *cur = cache->head; cur != NULL; cur = cur->next) capacity++;
+    cache_entry_t **entries = (cache_entry_t **)malloc(sizeof(cache_entry_t *) * MAX(capacity, 1));
+    *size = 0;
+    for (cache_entry_t *cur = cache->head; cur != NULL && entries != NULL; cur = cur->next) {
+        read_lock_rwlock(&cur->rwlock, "collect_full_entries: CACHE");
+        int is_full = cur->is_full;
+        unlock_rwlock(&cur->rwlock, "collect_full_entries: CACHE");
+        if (!is_full || cur->size <= 0) continue;
+        cache_entry_acquire(cur);
+        entries[(*size)++] = cur;
+    }
+    unlock_rwlock(&cache->rwlock, "collect_full_entries");
+    if (entries == NULL && ERROR_LOG) perror("collect_full_entries: Unable to allocate memory for entries");
+    return entries;
+}
+
+//complete entries only; returns number of written entries
+int snapshot_write(const char *file_path, cache_t *cache) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path) >= (int)sizeof(tmp_path)) {
+        if (ERROR_LOG) fprintf(stderr, "snapshot_write: path '%s' is too long\n", file_path);
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        if (ERROR_LOG) perror("snapshot_write: Unable to open snapshot");
+        return -1;
+    }
+
+    snapshot_index_t index = { .data = NULL, .size = 0, .alloc_size = 0 };
+    long long offset = SNAPSHOT_DATA_OFFSET;
+    unsigned int entries = 0;
+    int err_code = 0;
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        if (ERROR_LOG) perror("snapshot_write: lseek error");
+        err_code = -1;
+    }
+    int size;
+    cache_entry_t **full_entries = collect_full_entries(cache, &size);
+    if (full_entries == NULL) err_code = -1;
+    for (int i = 0; i < size; i++) {
+        if (err_code == 0) {
+            err_code = write_entry(fd, full_entries[i], &offset, &index);
+            entries++;
+        }
+        cache_entry_release(full_entries[i]);
+    }
+    free(full_entries);
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(snapshot_header_t));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.entries = entries;
+    header.index_offset = offset;
+    header.index_size = index.size;
+    header.index_checksum = snapshot_checksum(index.data, index.size);
+    header.header_checksum = snapshot_checksum(&header, offsetof(snapshot_header_t, header_checksum));
+
+    //header goes last, file without it is never renamed into place
+    if (err_code == 0) err_code = write_all(fd, index.data, index.size);
+    if (err_code == 0 && pwrite(fd, &header, sizeof(snapshot_header_t), 0) != sizeof(snapshot_header_t)) {
+        if (ERROR_LOG) perror("snapshot_write: Unable to write header");
+        err_code = -1;
+    }
+    if (err_code == 0 && fsync(fd) == -1) {
+        if (ERROR_LOG) perror("snapshot_write: fsync error");
+        err_code = -1;
+    }
+    free(index.data);
+    if (close(fd) == -1 && err_code == 0) {
+        if (ERROR_LOG) perror("snapshot_write: close error");
+        err_code = -1;
+    }
+    if (err_code == 0 && rename(tmp_path, file_path) == -1) {
+        if (ERROR_LOG) perror("snapshot_write: Unable to rename snapshot");
+        err_code = -1;
+    }
+    if (err_code == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    if (INFO_LOG) printf("Snapshot: %u entries written to '%s'\n", entries, file_path);
+    return entries;
+}
+
+void *snapshot_writer(void *param) {
+    (void)param;
+    snapshot_write(writer.file_path, writer.cache);
+    writer.is_writing = FALSE;
+    return NULL;
+}
+
+//1 while previous snapshot is still written, -1 if writer could not be started
+int snapshot_start(const char *file_path, cache_t *cache, int is_shutdown) {
+    pthread_mutex_lock(&writer.mutex);
+    if (writer.is_writing) {
+        pthread_mutex_unlock(&writer.mutex);
+        return 1;
+    }
+    if (writer.is_started) pthread_join(writer.thread, NULL);
+    writer.is_started = FALSE;
+    writer.file_path = file_path;
+    writer.cache = cache;
+    writer.is_writing = TRUE;
+    int err_code = pthread_create(&writer.thread, NULL, snapshot_writer, NULL);
+    if (err_code != 0) {
+        writer.is_writing = FALSE;
+        pthread_mutex_unlock(&writer.mutex);
+        print_error("snapshot_start: Unable to create writer thread", err_code);
+        return -1;
+    }
+    writer.is_started = TRUE;
+    if (is_shutdown) writer.has_shutdown_snapshot = TRUE;
+    pthread_mutex_unlock(&writer.mutex);
+    return 0;
+}
+
+//at exit: waits for running writer, writes snapshot itself if none was started on shutdown
+void snapshot_finish(const char *file_path, cache_t *cache) {
+    pthread_mutex_lock(&writer.mutex);
+    if (writer.is_started) pthread_join(writer.thread, NULL);
+    writer.is_started = FALSE;
+    int has_shutdown_snapshot = writer.has_shutdown_snapshot;
+    pthread_mutex_unlock(&writer.mutex);
+    if (!has_shutdown_snapshot) snapshot_write(file_path, cache);
+}
+
+//header is trusted only after this, entries must fit into index before anything is allocated for them
+int check_snapshot_header(const char *map, size_t file_size) {
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    if (file_size < SNAPSHOT_DATA_OFFSET || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return -1;
+    if (header->header_checksum != snapshot_checksum(header, offsetof(snapshot_header_t, header_checksum))) return -1;
+    if (header->version != SNAPSHOT_VERSION || header->index_offset < SNAPSHOT_DATA_OFFSET || header->index_size < 0) return -1;
+    if ((unsigned long long)header->index_offset + header->index_size != file_size) return -1;
+    if (header->entries > (unsigned long long)header->index_size / sizeof(snapshot_record_t)) return -1;
+    return 0;
+}
+
+//index is checked whole, records must point inside file
+int check_snapshot_index(const char *map, size_t *records) {
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    const char *index = map + header->index_offset;
+    if (header->index_checksum != snapshot_checksum(index, header->index_size)) return -1;
+    long long cur = 0;
+    for (unsigned int i = 0; i < header->entries; i++) {
+        if (header->index_size - cur < (long long)sizeof(snapshot_record_t)) return -1;
+        const snapshot_record_t *record = (const snapshot_record_t *)(index + cur);
+        long long rest = header->index_size - cur - sizeof(snapshot_record_t);
+        if (record->host_length > rest || record->path_length > rest - record->host_length) return -1;
+        if (record->data_offset < SNAPSHOT_DATA_OFFSET || record->size <= 0 || record->size > header->index_offset - record->data_offset) return -1;
+        records[i] = header->index_offset + cur;
+        cur += ALIGNED(sizeof(snapshot_record_t) + record->host_length + record->path_length);
+    }
+    return 0;
+}
+
+char *copy_string(const char *data, size_t length) {
+    char *copy = (char *)malloc(length + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+//0 if restored, 1 if left out
+int load_entry(const char *map, const snapshot_record_t *record, time_t now, cache_t *cache) {
+    if (record->expires != 0 && record->expires <= now) return 1;
+    const char *body = map + record->data_offset;
+    if (snapshot_checksum(body, record->size) != record->checksum) return 1;
+
+    const char *name = (const char *)(record + 1);
+    char *host = copy_string(name, record->host_length);
+    char *path = copy_string(name + record->host_length, record->path_length);
+    char *data = (char *)malloc(record->size);
+    cache_entry_t *entry = NULL;
+    if (host != NULL && path != NULL && data != NULL) {
+        memcpy(data, body, record->size);
+        entry = cache_add(host, path, data, record->size, cache);
+    }
+    if (entry == NULL) {
+        free(host);
+        free(path);
+        free(data);
+        return 1;
+    }
+    entry->code = record->code;
+    entry->expires = record->expires;
+    entry->is_full = TRUE;
+    cache_entry_release(entry);     //no http downloads it
+    return 0;
+}
+
+//returns number of restored entries, -1 if there is no usable snapshot
+int snapshot_load(const char *file_path, cache_t *cache) {
+    int fd = open(file_path, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT && ERROR_LOG) perror("snapshot_load: Unable to open snapshot");
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < SNAPSHOT_DATA_OFFSET) {
+        if (ERROR_LOG) fprintf(stderr, "Snapshot: '%s' is not a cache snapshot, cache starts empty\n", file_path);
+        close(fd);
+        return -1;
+    }
+    size_t file_size = file_stat.st_size;
+    char *map = (char *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (ERROR_LOG) perror("snapshot_load: mmap error");
+        return -1;
+    }
+
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    if (check_snapshot_header(map, file_size) == -1) {
+        if (ERROR_LOG) fprintf(stderr, "Snapshot: '%s' is damaged, cache starts empty\n", file_path);
+        munmap(map, file_size);
+        return -1;
+    }
+    size_t *records = (size_t *)malloc(sizeof(size_t) * MAX(header->entries, 1));
+    if (records == NULL || check_snapshot_index(map, records) == -1) {
+        if (records == NULL && ERROR_LOG) perror("snapshot_load: Unable to allocate memory for index");
+        else if (ERROR_LOG) fprintf(stderr, "Snapshot: '%s' is damaged, cache starts empty\n", file_path);
+        free(records);
+        munmap(map, file_size);
+        return -1;
+    }
+
+    //entries are added to list head, going backwards keeps their order
+    time_t now = time(NULL);
+    int restored = 0, skipped = 0;
+    for (unsigned int i = header->entries; i > 0; i--) {
+        if (load_entry(map, (const snapshot_record_t *)(map + records[i - 1]), now, cache) == 0) restored++;
+        else skipped++;
+    }
+    if (INFO_LOG) printf("Snapshot: restored %d entries from '%s', %d expired or damaged\n", restored, file_path, skipped);
+    free(records);
+    munmap(map, file_size);
+    return restored;
+}
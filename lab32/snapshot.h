@@ -0,0 +1,40 @@
+#include "cache.h"
+
+#ifndef LAB32_SNAPSHOT_H
+#define LAB32_SNAPSHOT_H
+
+#define SNAPSHOT_MAGIC "L32CACHE"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DATA_OFFSET 4096   //bodies start after header page
+#define SNAPSHOT_ALIGN 8
+
+/*
+ * Cache snapshot: header (magic, entries, where index is, checksums), bodies of complete entries,
+ * index with record per entry followed by its host and path. Writer thread takes references of
+ * complete entries under cache lock and writes them after it, file is written under temporary
+ * name and renamed when complete. Loader maps it before listening socket is opened and leaves
+ * out entries that expired meanwhile or whose body checksum does not match.
+ */
+
+typedef struct snapshot_header {
+    char magic[8];
+    unsigned int version, entries;
+    long long index_offset, index_size;
+    unsigned int index_checksum;
+    unsigned int header_checksum;   //of fields above
+} snapshot_header_t;
+
+typedef struct snapshot_record {
+    long long data_offset, size;
+    long long expires;      //wall clock seconds, 0 is never
+    int code;
+    unsigned int host_length, path_length;
+    unsigned int checksum;  //of body
+} snapshot_record_t;
+
+int snapshot_load(const char *file_path, cache_t *cache);
+int snapshot_write(const char *file_path, cache_t *cache);
+int snapshot_start(const char *file_path, cache_t *cache, int is_shutdown);
+void snapshot_finish(const char *file_path, cache_t *cache);
+
+#endif
@@ -6,7 +6,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include "states.h"
+#include "lockprof.h"
 
 void print_error(const char *prefix, int code) {
     if (prefix == NULL) prefix = "error";
@@ -65,8 +67,18 @@ void free_with_null(void **mem) {
     *mem = NULL;
 }
 
+long long get_time_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long get_deadline_ms(int timeout) {
+    return get_time_ms() + (long long)timeout * 1000;
+}
+
 int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
-    int err_code = pthread_rwlock_rdlock(rwlock);
+    int err_code = lockprof_enabled ? lockprof_rdlock(rwlock, error) : pthread_rwlock_rdlock(rwlock);
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
@@ -74,7 +86,7 @@ int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
 }
 
 int write_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
-    int err_code = pthread_rwlock_wrlock(rwlock);
+    int err_code = lockprof_enabled ? lockprof_wrlock(rwlock, error) : pthread_rwlock_wrlock(rwlock);
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
@@ -86,6 +98,7 @@ int unlock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
+    else lockprof_unlocked(rwlock);
     return err_code;
 }
 
@@ -5,12 +5,33 @@
 
 #define BUF_SIZE 4096
 
+#define HTTP_DEFAULT_PORT 80
+#define HOSTNAME_MAX_SIZE 256
+
 #define GETTING_FROM_CACHE 2    //only for client
 #define DOWNLOADING 1
 #define AWAITING_REQUEST 0
 #define SOCK_DONE (-1)
 #define SOCK_ERROR (-2)
 
+#define PROXY_RUNNING 0
+#define PROXY_DRAINING 1     //no new connections, in-flight responses are finished
+#define PROXY_STOPPED 2      //workers leave their loops immediately
+
+#define DRAIN_TIMEOUT 30        //seconds given to in-flight responses after drain starts
+#define DRAIN_POLL_INTERVAL 1   //seconds between drain checks in select
+
+#define CLIENT_IDLE_TIMEOUT 60        //seconds, between requests and while client does not take response
+#define CLIENT_HEADER_TIMEOUT 10      //seconds from first byte of request to its last header
+#define HTTP_CONNECT_TIMEOUT 10
+#define HTTP_FIRST_BYTE_TIMEOUT 30    //seconds from sent request to first byte of response
+#define HTTP_IDLE_TIMEOUT 30          //seconds between reads of response
+
+#define NEGATIVE_CACHE_TTL 10         //seconds 301, 404 and 410 responses stay in cache, 0 disables
+#define ERROR_CACHE_TTL 0             //seconds for 5xx responses, 0 disables
+
+#define NO_DEADLINE 0
+
 #define HTTP_NO_HEADERS (-1)
 
 #define HTTP_CODE_UNDEFINED (-1)
@@ -39,6 +60,9 @@ int get_number_from_string_by_length(const char *str, size_t length);
 void close_socket(int *sock_fd);
 void free_with_null(void **mem);
 
+long long get_time_ms();
+long long get_deadline_ms(int timeout);
+
 int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
 int write_lock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
 int unlock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
@@ -12,6 +12,7 @@ typedef struct http {
     char *request;  ssize_t request_size;   ssize_t request_bytes_written;
     char *host, *path;
     cache_entry_t *cache_entry;
+    long long deadline_ms;      //connect, first byte or idle timeout
     pthread_t thread_id;
     pthread_rwlock_t rwlock;
     int client_pipe_fd, http_pipe_fd;
@@ -23,6 +24,8 @@ typedef struct client {
     cache_entry_t *cache_entry;  http_t *http_entry;
     char *request;  ssize_t request_size;
     ssize_t bytes_written;
+    long long deadline_ms;      //idle or request header timeout
+    int is_fresh;               //nothing read since accept, so not an idle keep-alive connection
     pthread_t thread_id;
     struct client *prev, *next;
 } client_t;
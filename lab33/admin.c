@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "admin.h"
+#include "warm.h"
+#include "snapshot.h"
+#include "url.h"
+#include "stats.h"
+#include "logger.h"
+
+int admin_number(str_view_t query, const char *name, int default_value) {
+    char value[16];
+    int number;
+    if (url_query_param(query, name, 0, value, sizeof(value)) == -1 || convert_number(value, &number) == -1 || number < 0) return default_value;
+    return number;
+}
+
+void render_cache(render_buffer_t *buffer, str_view_t query, cache_t *cache) {
+    char host[HOSTNAME_MAX_SIZE];
+    str_view_t prefix = { host, 0 };
+    if (url_query_param(query, "host", 0, host, sizeof(host)) != -1) prefix.length = strlen(host);
+    int offset = admin_number(query, "offset", 0);
+    int limit = MIN(admin_number(query, "limit", ADMIN_PAGE), ADMIN_MAX_PAGE);
+
+    cache_listing_t page[ADMIN_MAX_PAGE];
+    int total;
+    int size = cache_list(prefix, offset, limit, page, &total, cache);
+    render_append(buffer, "total %d offset %d entries %d\n", total, offset, size);
+    for (int i = 0; i < size; i++) {
+        cache_entry_t *entry = page[i].entry;
+        render_append(buffer, "%s %s size=%zd code=%d full=%d age=%lld segment=%s frequency=%d\n", entry->host, entry->path, entry->size,
+                      entry->code, entry->is_full, entry->is_full ? cache_entry_age(entry) / 1000 : -1LL, cache_segment_name(page[i].segment), page[i].frequency);
+    }
+    cache_listing_release(page, size);
+}
+
+//url is keyed the same way as GET request in absolute-form
+int render_purge(render_buffer_t *buffer, str_view_t query, cache_t *cache) {
+    char value[WARM_URL_MAX_SIZE];
+    if (url_query_param(query, "url", 0, value, sizeof(value)) != -1) {
+        char key[URL_KEY_SIZE];
+        str_view_t no_host = { "", 0 }, host, path;
+        if (url_canonicalize(no_host, view_of(value), key, sizeof(key), &host, &path) == -1 || host.length == 0) return -1;
+        render_append(buffer, "purged %d\n", cache_purge(host, path, cache));
+        return 0;
+    }
+    if (url_query_param(query, "host", 0, value, sizeof(value)) != -1) {
+        render_append(buffer, "purged %d\n", cache_purge_host(view_of(value), cache));
+        return 0;
+    }
+    return -1;
+}
+
+int render_warm(render_buffer_t *buffer, str_view_t query, http_queue_t *http_queue, cache_t *cache) {
+    char value[WARM_URL_MAX_SIZE];
+    int added = 0;
+    for (int i = 0; url_query_param(query, "url", i, value, sizeof(value)) != -1; i++) {
+        if (warm_add(value, strlen(value)) == 0) added++;
+    }
+    if (url_query_param(query, "list", 0, value, sizeof(value)) != -1) {
+        int file_added = warm_add_file(value);
+        if (file_added == -1) return -1;
+        added += file_added;
+    }
+    if (added > 0) LOG_INFO("Warm-up: %d urls queued", added);
+    warm_continue(http_queue, cache);
+    render_append(buffer, "added %d\n", added);
+    warm_render(buffer);
+    return 0;
+}
+
+void render_snapshot(render_buffer_t *buffer, const char **status, cache_t *cache) {
+    int result = snapshot_start(cache, FALSE);
+    if (result == SNAPSHOT_STARTED) render_append(buffer, "started\n");
+    else if (result == SNAPSHOT_BUSY) {
+        *status = "409 Conflict";
+        render_append(buffer, "busy\n");
+    }
+    else if (result == SNAPSHOT_DISABLED) {
+        *status = "404 Not Found";
+        render_append(buffer, "disabled\n");
+    }
+    else {
+        *status = "500 Internal Server Error";
+        render_append(buffer, "failed\n");
+    }
+}
+
+//caller frees the result; NULL if there was no memory for it
+char *admin_render(str_view_t path, const char **status, ssize_t *size, http_queue_t *http_queue, cache_t *cache) {
+    str_view_t resource = path, query = { "", 0 };
+    const char *question = memchr(path.data, '?', path.length);
+    if (question != NULL) {
+        resource.length = question - path.data;
+        query.data = question + 1;
+        query.length = path.length - resource.length - 1;
+    }
+
+    render_buffer_t buffer = { .data = NULL, .size = 0, .alloc_size = 0, .error = FALSE };
+    *status = "200 OK";
+    int err_code = 0;
+    if (view_equals(resource, ADMIN_PREFIX "cache")) render_cache(&buffer, query, cache);
+    else if (view_equals(resource, ADMIN_PREFIX "purge")) err_code = render_purge(&buffer, query, cache);
+    else if (view_equals(resource, ADMIN_PREFIX "warm")) err_code = render_warm(&buffer, query, http_queue, cache);
+    else if (view_equals(resource, ADMIN_PREFIX "snapshot")) render_snapshot(&buffer, status, cache);
+    else {
+        *status = "404 Not Found";
+        render_append(&buffer, "Not Found\n");
+    }
+    if (err_code == -1) {
+        *status = "400 Bad Request";
+        buffer.size = 0;
+        render_append(&buffer, "Bad Request\n");
+    }
+
+    if (buffer.error) {
+        free(buffer.data);
+        return NULL;
+    }
+    *size = buffer.size;
+    return buffer.data;
+}
@@ -0,0 +1,22 @@
+#include "cache.h"
+#include "types.h"
+
+#ifndef LAB33_ADMIN_H
+#define LAB33_ADMIN_H
+
+#define ADMIN_PREFIX "/__proxy/"
+#define ADMIN_PAGE 100          //cache entries listed when limit is not given
+#define ADMIN_MAX_PAGE 1000
+
+/*
+ * Admin API, local clients only, answered with plain text:
+ *   /__proxy/cache?host=PREFIX&offset=N&limit=N   cache entries, one page under cache lock at a time
+ *   /__proxy/purge?url=URL or ?host=PREFIX        removes entries, readers finish their copies
+ *   /__proxy/warm?url=URL&url=URL or ?list=FILE   queues warm-up, without parameters shows its progress
+ *   /__proxy/snapshot                             starts writing cache snapshot, see snapshot.h
+ * Parameter values may be percent-encoded. Stats have their own path, see stats.h.
+ */
+
+char *admin_render(str_view_t path, const char **status, ssize_t *size, http_queue_t *http_queue, cache_t *cache);
+
+#endif
@@ -0,0 +1,136 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     //sched_getaffinity, pthread_setaffinity_np
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#elif defined(__sun)
+#include <sys/processor.h>
+#include <sys/procset.h>
+#endif
+#include "affinity.h"
+#include "states.h"
+#include "logger.h"
+
+static int *cpus = NULL;            //ids of cpus process may run on, worker i is bound to cpus[i % cpus_num]
+static int cpus_num = 0;
+static int *cpu_positions = NULL;   //index in cpus by cpu id, -1 where process may not run
+static int cpu_ids_num = 0;
+
+#if defined(__linux__)
+
+int list_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) == -1) return -1;
+    cpu_ids_num = CPU_SETSIZE;
+    cpus = (int *)malloc(sizeof(int) * CPU_COUNT(&set));
+    if (cpus == NULL) return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) cpus[cpus_num++] = cpu;
+    }
+    return 0;
+}
+
+int bind_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err_code = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+    if (err_code != 0) {
+        errno = err_code;
+        return -1;
+    }
+    return 0;
+}
+
+#elif defined(__sun)
+
+int list_cpus() {
+    long max_id = sysconf(_SC_CPUID_MAX);
+    if (max_id < 0) return -1;
+    cpu_ids_num = (int)max_id + 1;
+    cpus = (int *)malloc(sizeof(int) * cpu_ids_num);
+    if (cpus == NULL) return -1;
+    for (int cpu = 0; cpu < cpu_ids_num; cpu++) {
+        int status = p_online(cpu, P_STATUS);
+        if (status == P_ONLINE || status == P_NOINTR) cpus[cpus_num++] = cpu;
+    }
+    return 0;
+}
+
+int bind_thread(int cpu) {
+    return processor_bind(P_LWPID, P_MYID, cpu, NULL);
+}
+
+#else
+
+int list_cpus() {
+    errno = ENOTSUP;
+    return -1;
+}
+
+int bind_thread(int cpu) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
+
+//returns number of cpus workers are spread over
+int affinity_init(void) {
+    if (list_cpus() == -1 || cpus_num == 0) {
+        LOG_ERRNO("affinity_init: Unable to get cpus of process");
+        affinity_destroy();
+        return -1;
+    }
+    cpu_positions = (int *)malloc(sizeof(int) * cpu_ids_num);
+    if (cpu_positions == NULL) {
+        LOG_ERRNO("affinity_init: Unable to allocate memory for cpu map");
+        affinity_destroy();
+        return -1;
+    }
+    for (int cpu = 0; cpu < cpu_ids_num; cpu++) cpu_positions[cpu] = -1;
+    for (int i = 0; i < cpus_num; i++) cpu_positions[cpus[i]] = i;
+    return cpus_num;
+}
+
+//called by worker itself, memory it allocates from now on is placed on its node by first touch
+int affinity_bind_thread(int worker) {
+    if (cpus_num == 0) return -1;
+    int cpu = cpus[worker % cpus_num];
+    if (bind_thread(cpu) == -1) {
+        LOG_ERRNO("affinity_bind_thread: Unable to bind worker %d to cpu %d", worker, cpu);
+        return -1;
+    }
+    LOG_INFO("Worker %d bound to cpu %d", worker, cpu);
+    return 0;
+}
+
+//worker bound to cpu that received connection, -1 if there is none or kernel does not tell
+int affinity_socket_worker(int sock_fd, int workers) {
+    #ifdef SO_INCOMING_CPU
+    int cpu;
+    socklen_t length = sizeof(int);
+    if (cpu_positions == NULL || getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1) return -1;
+    if (cpu < 0 || cpu >= cpu_ids_num) return -1;
+    int position = cpu_positions[cpu];
+    return position < workers ? position : -1;
+    #else
+    return -1;
+    #endif
+}
+
+void affinity_destroy(void) {
+    free(cpus);
+    free(cpu_positions);
+    cpus = NULL;
+    cpu_positions = NULL;
+    cpus_num = cpu_ids_num = 0;
+}
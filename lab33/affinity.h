@@ -0,0 +1,16 @@
+#ifndef LAB33_AFFINITY_H
+#define LAB33_AFFINITY_H
+
+/*
+ * Placement of pool threads. Worker i is bound to i-th cpu process may run on (modulo their
+ * number), so its connections, buffers and timers stay in caches of one core, and memory it
+ * touches first is taken from NUMA node of that core. Accepted socket may be steered to
+ * worker bound to cpu which handles receive queue of the connection (SO_INCOMING_CPU).
+ */
+
+int affinity_init(void);
+int affinity_bind_thread(int worker);
+int affinity_socket_worker(int sock_fd, int workers);
+void affinity_destroy(void);
+
+#endif
@@ -0,0 +1,578 @@
+/*
+ * Load generator for the proxies of lab31, lab32 and lab33.
+ * Starts an origin stand-in on origin_port, warms hot objects up through the proxy,
+ * then drives clients through the proxy and reports throughput and latency percentiles.
+ * With trace=FILE it instead replays a request trace in order over one connection and
+ * reports hit ratio of proxy cache, make_trace=FILE writes such a trace and exits.
+ *
+ * Usage: bench proxy_port [option=value ...]
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <math.h>
+
+#define TRUE 1
+#define FALSE 0
+
+#define BUF_SIZE 4096
+#define MAX_SIZES 16
+#define ORIGIN_BODY_CHUNK (64 * 1024)
+
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+typedef struct bench_config {
+    int proxy_port, origin_port, origin, origin_keepalive;
+    int clients, requests, keepalive, objects, timeout;
+    double hit_ratio, zipf;
+    long sizes[MAX_SIZES]; int sizes_num;
+    char *trace, *make_trace;
+} bench_config_t;
+
+typedef struct client_result {
+    int index;
+    long long *latencies; int latencies_num;
+    int errors;
+    long long bytes;
+} client_result_t;
+
+bench_config_t config = {
+    .proxy_port = 0, .origin_port = 8081, .origin = TRUE, .origin_keepalive = FALSE,
+    .clients = 16, .requests = 1000, .keepalive = TRUE, .objects = 100, .timeout = 10,
+    .hit_ratio = 0.9, .zipf = 0.9,
+    .sizes = { 1024 }, .sizes_num = 1,
+    .trace = NULL, .make_trace = NULL,
+};
+
+char origin_body[ORIGIN_BODY_CHUNK];
+
+long long now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+const char *find_ignore_case(const char *str, const char *pattern) {
+    size_t pattern_len = strlen(pattern);
+    for (; *str != '\0'; str++) {
+        if (strncasecmp(str, pattern, pattern_len) == 0) return str;
+    }
+    return NULL;
+}
+
+int write_all(int fd, const char *buf, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t bytes_written = write(fd, buf + offset, size - offset);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        offset += bytes_written;
+    }
+    return 0;
+}
+
+int open_connection(int port) {
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        perror("open_connection: socket error");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
+        close(sock_fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = { .tv_sec = config.timeout, .tv_usec = 0 };   //stuck response counts as error
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return sock_fd;
+}
+
+//size is the last path component: /o/<id>/<size>, /m/<client>/<seq>/<size>
+long origin_size_from_request(const char *request) {
+    const char *path_end = strstr(request, " HTTP/");
+    if (path_end == NULL) return -1;
+    const char *size_start = path_end;
+    while (size_start > request && size_start[-1] != '/') size_start--;
+    return strtol(size_start, NULL, 10);
+}
+
+void *origin_connection(void *param) {
+    int sock_fd = (int)(long)param;
+    char buf[BUF_SIZE + 1];
+    ssize_t buf_size = 0;
+
+    while (TRUE) {
+        ssize_t bytes_read = read(sock_fd, buf + buf_size, BUF_SIZE - buf_size);
+        if (bytes_read <= 0) break;
+        buf_size += bytes_read;
+        buf[buf_size] = '\0';
+
+        char *request_end = strstr(buf, "\r\n\r\n");
+        if (request_end == NULL) {
+            if (buf_size == BUF_SIZE) break;    //headers too large
+            continue;
+        }
+
+        long size = origin_size_from_request(buf);
+        int close_after = !config.origin_keepalive || find_ignore_case(buf, "Connection: close") != NULL;
+        char headers[256];
+        int headers_size;
+        const char *connection = close_after ? "Connection: close\r\n" : "";
+        if (size < 0) headers_size = snprintf(headers, sizeof(headers), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n", connection);
+        else headers_size = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %ld\r\n%s\r\n", size, connection);
+
+        if (write_all(sock_fd, headers, headers_size) == -1) break;
+        for (long sent = 0; size > 0 && sent < size; sent += ORIGIN_BODY_CHUNK) {
+            if (write_all(sock_fd, origin_body, MIN(ORIGIN_BODY_CHUNK, size - sent)) == -1) {
+                close_after = TRUE;
+                break;
+            }
+        }
+        if (close_after) break;
+
+        request_end += 4;
+        buf_size -= request_end - buf;
+        memmove(buf, request_end, buf_size);
+    }
+
+    close(sock_fd);
+    return NULL;
+}
+
+void *origin_worker(void *param) {
+    int listen_fd = (int)(long)param;
+    while (TRUE) {
+        int sock_fd = accept(listen_fd, NULL, NULL);
+        if (sock_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("origin_worker: accept error");
+            return NULL;
+        }
+
+        pthread_t thread;
+        int err_code = pthread_create(&thread, NULL, origin_connection, (void *)(long)sock_fd);
+        if (err_code != 0) {
+            fprintf(stderr, "origin_worker: unable to create thread: %s\n", strerror(err_code));
+            close(sock_fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+int start_origin(int port) {
+    memset(origin_body, 'x', sizeof(origin_body));
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("start_origin: socket error");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
+        perror("start_origin: bind error");
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        perror("start_origin: listen error");
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    int err_code = pthread_create(&thread, NULL, origin_worker, (void *)(long)listen_fd);
+    if (err_code != 0) {
+        fprintf(stderr, "start_origin: unable to create thread: %s\n", strerror(err_code));
+        close(listen_fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+//reads one response, returns body size or -1 if it was broken or not 200
+long long read_response(int sock_fd) {
+    char buf[BUF_SIZE + 1];
+    ssize_t buf_size = 0;
+    char *headers_end = NULL;
+
+    while (headers_end == NULL) {
+        if (buf_size == BUF_SIZE) return -1;
+        ssize_t bytes_read = read(sock_fd, buf + buf_size, BUF_SIZE - buf_size);
+        if (bytes_read <= 0) return -1;
+        buf_size += bytes_read;
+        buf[buf_size] = '\0';
+        headers_end = strstr(buf, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1 || status != 200) return -1;
+    const char *length_header = find_ignore_case(buf, "\r\nContent-Length:");
+    if (length_header == NULL || length_header > headers_end) return -1;
+    long long content_length = strtoll(length_header + 17, NULL, 10);
+
+    long long body_read = buf_size - (headers_end + 4 - buf);
+    while (body_read < content_length) {
+        ssize_t bytes_read = read(sock_fd, buf, MIN((long long)BUF_SIZE, content_length - body_read));
+        if (bytes_read <= 0) return -1;
+        body_read += bytes_read;
+    }
+    return body_read == content_length ? content_length : -1;
+}
+
+//returns latency in microseconds or -1 on error, *sock_fd is kept open for keep-alive
+long long do_request(int *sock_fd, const char *path, long long *bytes) {
+    long long start_us = now_us();
+    if (*sock_fd == -1) {
+        *sock_fd = open_connection(config.proxy_port);
+        if (*sock_fd == -1) return -1;
+    }
+
+    char request[512];
+    int request_size = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n%s\r\n",
+                                path, config.origin_port, config.keepalive ? "" : "Connection: close\r\n");
+
+    long long body_size = -1;
+    if (write_all(*sock_fd, request, request_size) == 0) body_size = read_response(*sock_fd);
+    if (body_size == -1 || !config.keepalive) {
+        close(*sock_fd);
+        *sock_fd = -1;
+    }
+    if (body_size == -1) return -1;
+
+    *bytes += body_size;
+    return now_us() - start_us;
+}
+
+void *client_worker(void *param) {
+    client_result_t *result = (client_result_t *)param;
+    unsigned int seed = (unsigned int)(result->index * 7919 + 1);
+    int sock_fd = -1;
+
+    for (int i = 0; i < config.requests; i++) {
+        char path[128];
+        if ((double)rand_r(&seed) / RAND_MAX < config.hit_ratio) {
+            int id = rand_r(&seed) % config.objects;
+            snprintf(path, sizeof(path), "/o/%d/%ld", id, config.sizes[id % config.sizes_num]);
+        }
+        else {  //unique path, never cached
+            snprintf(path, sizeof(path), "/m/%d/%d/%ld", result->index, i, config.sizes[i % config.sizes_num]);
+        }
+
+        long long latency = do_request(&sock_fd, path, &result->bytes);
+        if (latency == -1) result->errors++;
+        else result->latencies[result->latencies_num++] = latency;
+    }
+
+    if (sock_fd != -1) close(sock_fd);
+    return NULL;
+}
+
+int warm_up() {
+    int keepalive = config.keepalive;
+    config.keepalive = FALSE;
+    int errors = 0;
+    long long bytes = 0;
+    for (int id = 0; id < config.objects; id++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/o/%d/%ld", id, config.sizes[id % config.sizes_num]);
+        int sock_fd = -1;
+        if (do_request(&sock_fd, path, &bytes) == -1) errors++;
+    }
+    config.keepalive = keepalive;
+    return errors;
+}
+
+//popular objects follow zipf over objects ids, hit_ratio of requests go to them, the rest are one-hit wonders
+int write_trace(const char *path) {
+    double *cumulative = (double *)malloc(config.objects * sizeof(double));
+    FILE *file = fopen(path, "w");
+    if (cumulative == NULL || file == NULL) {
+        perror("write_trace: Unable to create trace");
+        free(cumulative);
+        if (file != NULL) fclose(file);
+        return -1;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < config.objects; i++) {
+        sum += 1.0 / pow(i + 1, config.zipf);
+        cumulative[i] = sum;
+    }
+
+    unsigned int seed = 1;
+    long long total = (long long)config.clients * config.requests;
+    for (long long i = 0; i < total; i++) {
+        long long id;
+        if ((double)rand_r(&seed) / RAND_MAX < config.hit_ratio) {
+            double point = (double)rand_r(&seed) / RAND_MAX * sum;
+            int low = 0, high = config.objects - 1;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (cumulative[middle] < point) low = middle + 1;
+                else high = middle;
+            }
+            id = low;
+        }
+        else id = config.objects + i;
+        fprintf(file, "%lld %ld\n", id, config.sizes[id % config.sizes_num]);
+    }
+
+    free(cumulative);
+    if (fclose(file) != 0) {
+        perror("write_trace: Unable to write trace");
+        return -1;
+    }
+    printf("trace: %lld requests to %s\n", total, path);
+    return 0;
+}
+
+//reads one counter from stats page of lab33 proxy, -1 if proxy has none
+long long fetch_counter(const char *name) {
+    int sock_fd = open_connection(config.proxy_port);
+    if (sock_fd == -1) return -1;
+
+    char request[128];
+    int request_size = snprintf(request, sizeof(request), "GET /__proxy/stats HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n");
+    if (write_all(sock_fd, request, request_size) == -1) {
+        close(sock_fd);
+        return -1;
+    }
+
+    size_t alloc_size = 64 * 1024, size = 0;
+    char *page = (char *)malloc(alloc_size + 1);
+    while (page != NULL) {
+        if (size == alloc_size) {
+            char *check = (char *)realloc(page, alloc_size * 2 + 1);
+            if (check == NULL) break;
+            page = check;
+            alloc_size *= 2;
+        }
+        ssize_t bytes_read = read(sock_fd, page + size, alloc_size - size);
+        if (bytes_read <= 0) break;
+        size += bytes_read;
+        page[size] = '\0';
+
+        const char *headers_end = strstr(page, "\r\n\r\n");
+        const char *length_header = find_ignore_case(page, "\r\nContent-Length:");
+        if (headers_end != NULL && length_header != NULL && length_header < headers_end &&
+            (long long)size >= headers_end + 4 - page + strtoll(length_header + 17, NULL, 10)) break;
+    }
+    close(sock_fd);
+    if (page == NULL) return -1;
+
+    page[size] = '\0';
+    char pattern[128];
+    snprintf(pattern, sizeof(pattern), "\n%s ", name);
+    const char *line = strstr(page, pattern);
+    long long value = line == NULL ? -1 : strtoll(line + strlen(pattern), NULL, 10);
+    free(page);
+    return value;
+}
+
+//order of requests decides hit ratio, so trace goes in one sequence; run it against a fresh proxy
+int replay_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("replay_trace: Unable to open trace");
+        return -1;
+    }
+
+    long long hits_before = fetch_counter("proxy_cache_hits_total");
+    long long misses_before = fetch_counter("proxy_cache_misses_total");
+    long long start_us = now_us();
+    int sock_fd = -1, requests = 0, errors = 0;
+    long long bytes = 0, id;
+    long size;
+    while (fscanf(file, "%lld %ld", &id, &size) == 2) {
+        char request_path[128];
+        snprintf(request_path, sizeof(request_path), "/t/%lld/%ld", id, size);
+        if (do_request(&sock_fd, request_path, &bytes) == -1) errors++;
+        requests++;
+    }
+    if (sock_fd != -1) close(sock_fd);
+    fclose(file);
+    double elapsed = (now_us() - start_us) / 1e6;
+
+    long long hits = fetch_counter("proxy_cache_hits_total") - hits_before;
+    long long misses = fetch_counter("proxy_cache_misses_total") - misses_before;
+    printf("trace: %s\n", path);
+    printf("requests: %d, errors: %d, elapsed: %.3f s\n", requests, errors, elapsed);
+    if (hits_before == -1 || misses_before == -1) printf("hit ratio: unknown, proxy has no stats page\n");
+    else printf("hits: %lld, misses: %lld, hit ratio: %.4f\n", hits, misses, hits + misses == 0 ? 0 : (double)hits / (hits + misses));
+    return errors == 0 ? 0 : -1;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile_ms(const long long *sorted, int size, double quantile) {
+    if (size == 0) return 0;
+    int index = (int)(quantile * size);
+    if (index >= size) index = size - 1;
+    return sorted[index] / 1000.0;
+}
+
+int parse_sizes(char *value) {
+    config.sizes_num = 0;
+    char *save_ptr;
+    for (char *token = strtok_r(value, ",", &save_ptr); token != NULL; token = strtok_r(NULL, ",", &save_ptr)) {
+        if (config.sizes_num == MAX_SIZES) return -1;
+        long size = strtol(token, NULL, 10);
+        if (size < 0) return -1;
+        config.sizes[config.sizes_num++] = size;
+    }
+    return config.sizes_num == 0 ? -1 : 0;
+}
+
+int parse_option(char *option) {
+    char *value = strchr(option, '=');
+    if (value == NULL) return -1;
+    *value++ = '\0';
+
+    if (strcmp(option, "clients") == 0) config.clients = atoi(value);
+    else if (strcmp(option, "requests") == 0) config.requests = atoi(value);
+    else if (strcmp(option, "keepalive") == 0) config.keepalive = atoi(value);
+    else if (strcmp(option, "objects") == 0) config.objects = atoi(value);
+    else if (strcmp(option, "hit_ratio") == 0) config.hit_ratio = atof(value);
+    else if (strcmp(option, "origin_port") == 0) config.origin_port = atoi(value);
+    else if (strcmp(option, "origin") == 0) config.origin = atoi(value);
+    else if (strcmp(option, "origin_keepalive") == 0) config.origin_keepalive = atoi(value);
+    else if (strcmp(option, "timeout") == 0) config.timeout = atoi(value);
+    else if (strcmp(option, "zipf") == 0) config.zipf = atof(value);
+    else if (strcmp(option, "trace") == 0) config.trace = value;
+    else if (strcmp(option, "make_trace") == 0) config.make_trace = value;
+    else if (strcmp(option, "sizes") == 0) return parse_sizes(value);
+    else return -1;
+    return 0;
+}
+
+void print_usage(const char *name) {
+    fprintf(stderr, "Usage: %s proxy_port [option=value ...]\n", name);
+    fprintf(stderr, "  clients=16       concurrent client connections\n");
+    fprintf(stderr, "  requests=1000    requests per client\n");
+    fprintf(stderr, "  keepalive=1      reuse client connection, 0 opens one per request\n");
+    fprintf(stderr, "  hit_ratio=0.9    share of requests going to warmed-up objects\n");
+    fprintf(stderr, "  objects=100      number of warmed-up objects\n");
+    fprintf(stderr, "  sizes=1024       comma separated object sizes in bytes\n");
+    fprintf(stderr, "  origin_port=8081 port of origin stand-in\n");
+    fprintf(stderr, "  origin=1         0 uses an already running origin on origin_port\n");
+    fprintf(stderr, "  origin_keepalive=0  1 keeps upstream connections open after response\n");
+    fprintf(stderr, "  timeout=10       seconds before a stuck request counts as error\n");
+    fprintf(stderr, "  make_trace=FILE  write clients*requests trace: zipf over objects for hit_ratio of requests, one-hit wonders else\n");
+    fprintf(stderr, "  zipf=0.9         skew of popular objects in written trace\n");
+    fprintf(stderr, "  trace=FILE       replay trace in order and report hit ratio, compare policies on fresh proxies\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    config.proxy_port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        if (parse_option(argv[i]) == -1) {
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.clients <= 0 || config.requests <= 0 || config.objects <= 0 || config.timeout <= 0 || config.proxy_port <= 0) {
+        fprintf(stderr, "clients, requests, objects, timeout and proxy_port must be positive\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.make_trace != NULL) return write_trace(config.make_trace) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (config.origin && start_origin(config.origin_port) == -1) return EXIT_FAILURE;
+    if (config.trace != NULL) return replay_trace(config.trace) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    int warm_up_errors = warm_up();
+    if (warm_up_errors == config.objects) {
+        fprintf(stderr, "Proxy on port %d did not serve any warm-up request\n", config.proxy_port);
+        return EXIT_FAILURE;
+    }
+
+    pthread_t threads[config.clients];
+    client_result_t *results = (client_result_t *)calloc(config.clients, sizeof(client_result_t));
+    long long *latencies = (long long *)malloc((size_t)config.clients * config.requests * sizeof(long long));
+    if (results == NULL || latencies == NULL) {
+        perror("main: Unable to allocate memory for results");
+        return EXIT_FAILURE;
+    }
+
+    long long start_us = now_us();
+    int threads_created = 0;
+    for (int i = 0; i < config.clients; i++) {
+        results[i].index = i;
+        results[i].latencies = latencies + (size_t)i * config.requests;
+        int err_code = pthread_create(&threads[i], NULL, client_worker, &results[i]);
+        if (err_code != 0) {
+            fprintf(stderr, "main: unable to create client thread: %s\n", strerror(err_code));
+            break;
+        }
+        threads_created++;
+    }
+    for (int i = 0; i < threads_created; i++) pthread_join(threads[i], NULL);
+    double elapsed = (now_us() - start_us) / 1e6;
+
+    int completed = 0, errors = 0;
+    long long bytes = 0;
+    for (int i = 0; i < threads_created; i++) {
+        //results are contiguous per client, pack them before sorting
+        memmove(latencies + completed, results[i].latencies, results[i].latencies_num * sizeof(long long));
+        completed += results[i].latencies_num;
+        errors += results[i].errors;
+        bytes += results[i].bytes;
+    }
+    qsort(latencies, completed, sizeof(long long), compare_latencies);
+
+    printf("clients=%d requests=%d keepalive=%d hit_ratio=%.2f objects=%d\n",
+           threads_created, config.requests, config.keepalive, config.hit_ratio, config.objects);
+    printf("completed: %d, errors: %d, warm-up errors: %d\n", completed, errors, warm_up_errors);
+    printf("elapsed: %.3f s\n", elapsed);
+    printf("throughput: %.1f req/s, %.2f MB/s\n", completed / elapsed, bytes / elapsed / (1024 * 1024));
+    printf("latency ms: p50=%.3f p90=%.3f p99=%.3f p999=%.3f max=%.3f\n",
+           percentile_ms(latencies, completed, 0.5), percentile_ms(latencies, completed, 0.9),
+           percentile_ms(latencies, completed, 0.99), percentile_ms(latencies, completed, 0.999),
+           completed == 0 ? 0 : latencies[completed - 1] / 1000.0);
+
+    free(latencies);
+    free(results);
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
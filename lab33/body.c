@@ -0,0 +1,169 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "body.h"
+#include "states.h"
+#include "stats.h"
+#include "logger.h"
+
+#define BODY_HEAP 0
+#define BODY_POOL 1
+#define BODY_MMAP 2
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef union body_header {
+    struct {
+        size_t capacity;        //usable bytes after header
+        int kind, size_class;
+    } info;
+    union body_header *next;    //while block lies in pool
+    char align[16];
+} body_header_t;
+
+typedef struct body_pool {
+    body_header_t *head;
+    int size;
+} body_pool_t;
+
+int body_hugepages = FALSE;
+
+static body_pool_t pools[BODY_CLASSES];
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define HEADER(DATA) ((body_header_t *)(DATA) - 1)
+#define CLASS_SIZE(CLASS) (((size_t)1 << (BODY_MIN_CLASS_BITS + (CLASS))) - sizeof(body_header_t))
+
+//BODY_CLASSES when size does not fit largest class
+int get_size_class(size_t size) {
+    int size_class = 0;
+    while (size_class < BODY_CLASSES && CLASS_SIZE(size_class) < size) size_class++;
+    return size_class;
+}
+
+char *pool_alloc(size_t size) {
+    int size_class = get_size_class(size);
+    if (size_class == BODY_CLASSES) return NULL;       //size belongs to mmap_alloc
+    pthread_mutex_lock(&pools_mutex);
+    body_header_t *header = pools[size_class].head;
+    if (header != NULL) {
+        pools[size_class].head = header->next;
+        pools[size_class].size--;
+    }
+    pthread_mutex_unlock(&pools_mutex);
+
+    if (header == NULL) {
+        header = (body_header_t *)malloc(CLASS_SIZE(size_class) + sizeof(body_header_t));
+        if (header == NULL) return NULL;
+    }
+    header->info.capacity = CLASS_SIZE(size_class);
+    header->info.kind = BODY_POOL;
+    header->info.size_class = size_class;
+    return (char *)(header + 1);
+}
+
+void pool_free(body_header_t *header) {
+    int size_class = header->info.size_class;
+    pthread_mutex_lock(&pools_mutex);
+    if (pools[size_class].size < BODY_POOL_BLOCKS) {
+        header->next = pools[size_class].head;
+        pools[size_class].head = header;
+        pools[size_class].size++;
+        header = NULL;
+    }
+    pthread_mutex_unlock(&pools_mutex);
+    free(header);
+}
+
+char *mmap_alloc(size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size + sizeof(body_header_t) + page_size - 1) / page_size * page_size;
+    void *base = MAP_FAILED;
+
+    #ifdef MAP_HUGETLB
+    if (body_hugepages && length >= BODY_HUGE_PAGE_SIZE) {
+        size_t huge_length = (length + BODY_HUGE_PAGE_SIZE - 1) / BODY_HUGE_PAGE_SIZE * BODY_HUGE_PAGE_SIZE;
+        base = mmap(NULL, huge_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) length = huge_length;      //else no huge pages reserved, regular mapping is used
+    }
+    #endif
+    if (base == MAP_FAILED) base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    #ifdef MADV_HUGEPAGE
+    if (body_hugepages && length >= BODY_HUGE_PAGE_SIZE) madvise(base, length, MADV_HUGEPAGE);
+    #endif
+
+    body_header_t *header = (body_header_t *)base;
+    header->info.capacity = length - sizeof(body_header_t);
+    header->info.kind = BODY_MMAP;
+    header->info.size_class = -1;
+    return (char *)(header + 1);
+}
+
+//buffer of exactly known size, it is not expected to grow
+char *body_alloc(size_t size) {
+    //largest class holds a bit less than threshold because of header
+    char *data = size <= CLASS_SIZE(BODY_CLASSES - 1) ? pool_alloc(size) : mmap_alloc(size);
+    if (data == NULL) {
+        LOG_ERRNO("body_alloc: Unable to allocate %zu bytes", size);
+        return NULL;
+    }
+    STATS_INC(body_allocs);
+    return data;
+}
+
+//buffer of unknown final size, grows at least twice to keep reallocations few; NULL leaves data intact
+char *body_grow(char *data, size_t size) {
+    size_t capacity = data == NULL ? 0 : body_capacity(data);
+    if (size <= capacity) return data;
+    size_t new_capacity = MAX(size, capacity * 2);
+
+    body_header_t *header;
+    if (data != NULL && HEADER(data)->info.kind == BODY_HEAP) {
+        header = (body_header_t *)realloc(HEADER(data), new_capacity + sizeof(body_header_t));
+        if (header == NULL) return NULL;
+    }
+    else {
+        header = (body_header_t *)malloc(new_capacity + sizeof(body_header_t));
+        if (header == NULL) return NULL;
+        if (data != NULL) {
+            memcpy(header + 1, data, capacity);
+            body_free(data);
+        }
+    }
+    header->info.capacity = new_capacity;
+    header->info.kind = BODY_HEAP;
+    header->info.size_class = -1;
+    STATS_INC(body_reallocs);
+    return (char *)(header + 1);
+}
+
+size_t body_capacity(const char *data) {
+    return HEADER(data)->info.capacity;
+}
+
+void body_free(char *data) {
+    if (data == NULL) return;
+    body_header_t *header = HEADER(data);
+    if (header->info.kind == BODY_POOL) pool_free(header);
+    else if (header->info.kind == BODY_MMAP) munmap(header, header->info.capacity + sizeof(body_header_t));
+    else free(header);
+}
+
+void body_pools_destroy() {
+    pthread_mutex_lock(&pools_mutex);
+    for (int i = 0; i < BODY_CLASSES; i++) {
+        while (pools[i].head != NULL) {
+            body_header_t *next = pools[i].head->next;
+            free(pools[i].head);
+            pools[i].head = next;
+        }
+        pools[i].size = 0;
+    }
+    pthread_mutex_unlock(&pools_mutex);
+}
@@ -0,0 +1,27 @@
+#include <stdlib.h>
+
+#ifndef LAB33_BODY_H
+#define LAB33_BODY_H
+
+#define BODY_MIN_CLASS_BITS 12      //4 KiB
+#define BODY_CLASSES 7              //4 KiB .. 256 KiB
+#define BODY_MMAP_THRESHOLD ((size_t)1 << (BODY_MIN_CLASS_BITS + BODY_CLASSES - 1))
+#define BODY_POOL_BLOCKS 64         //free blocks kept per class
+#define BODY_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Response buffers. Size known from Content-Length is allocated once: small ones come from
+ * size-classed pools, large ones are anonymous mappings. Chunked and close-delimited
+ * responses grow on heap. Kind of buffer is kept in a header right before data, so every
+ * buffer is freed with body_free whoever owns it by then (http, cache entry).
+ */
+
+extern int body_hugepages;      //large mappings try MAP_HUGETLB first, else are advised to use huge pages
+
+char *body_alloc(size_t size);
+char *body_grow(char *data, size_t size);
+size_t body_capacity(const char *data);
+void body_free(char *data);
+void body_pools_destroy();
+
+#endif
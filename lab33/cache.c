@@ -1,25 +1,118 @@
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "cache.h"
 #include "states.h"
+#include "body.h"
+#include "stats.h"
 
 #define TRUE 1
 #define FALSE 0
 
 #define STR_EQ(STR1, STR2) (strcmp(STR1, STR2) == 0)
 
-int cache_init(cache_t *cache) {
+long long cache_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//FNV-1a over host and path, halves of it give sketch rows their own positions
+unsigned long long cache_hash(str_view_t host, str_view_t path) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < host.length; i++) hash = (hash ^ (unsigned char)host.data[i]) * 1099511628211ULL;
+    hash = (hash ^ '/') * 1099511628211ULL;
+    for (size_t i = 0; i < path.length; i++) hash = (hash ^ (unsigned char)path.data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+unsigned char *sketch_counter(cache_sketch_t *sketch, unsigned long long hash, int row) {
+    unsigned int index = ((unsigned int)hash + row * ((unsigned int)(hash >> 32) | 1)) & (CACHE_SKETCH_WIDTH - 1);
+    return &sketch->counters[row * CACHE_SKETCH_WIDTH + index];
+}
+
+int sketch_estimate(cache_sketch_t *sketch, unsigned long long hash) {
+    int frequency = CACHE_SKETCH_MAX;
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) frequency = MIN(frequency, *sketch_counter(sketch, hash, row));
+    return frequency;
+}
+
+//old popularity fades: every sample all counters are halved
+void sketch_increment(cache_sketch_t *sketch, unsigned long long hash) {
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        unsigned char *counter = sketch_counter(sketch, hash, row);
+        if (*counter < CACHE_SKETCH_MAX) (*counter)++;
+    }
+    if (++sketch->additions < CACHE_SKETCH_SAMPLE) return;
+    for (int i = 0; i < CACHE_SKETCH_DEPTH * CACHE_SKETCH_WIDTH; i++) sketch->counters[i] >>= 1;
+    sketch->additions /= 2;
+}
+
+void segment_push(cache_segment_t *segment, cache_entry_t *entry, int segment_id) {
+    entry->segment = segment_id;
+    entry->lru_prev = NULL;
+    entry->lru_next = segment->head;
+    if (segment->head != NULL) segment->head->lru_prev = entry;
+    else segment->tail = entry;
+    segment->head = entry;
+    segment->size += entry->size;
+}
+
+void segment_unlink(cache_segment_t *segment, cache_entry_t *entry) {
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else segment->head = entry->lru_next;
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else segment->tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+    entry->segment = CACHE_SEGMENT_NONE;
+    segment->size -= entry->size;
+}
+
+cache_segment_t *entry_segment(cache_entry_t *entry, cache_t *cache) {
+    if (entry->segment == CACHE_SEGMENT_WINDOW) return &cache->window;
+    if (entry->segment == CACHE_SEGMENT_MAIN) return &cache->main;
+    return NULL;
+}
+
+int cache_init(cache_t *cache, ssize_t capacity, int window_percent, int admission) {
+    memset(cache, 0, sizeof(cache_t));
+    cache->sketch.counters = (unsigned char *)calloc(CACHE_SKETCH_DEPTH * CACHE_SKETCH_WIDTH, 1);
+    if (cache->sketch.counters == NULL) {
+        perror("cache_init: Unable to allocate memory for sketch");
+        return -1;
+    }
+
     int err_code = pthread_rwlock_init(&cache->rwlock, NULL);
     if (err_code != 0) {
         print_error("cache_init: Unable to init rwlock", err_code);
+        free(cache->sketch.counters);
+        return -1;
+    }
+    err_code = pthread_mutex_init(&cache->policy_mutex, NULL);
+    if (err_code != 0) {
+        print_error("cache_init: Unable to init mutex", err_code);
+        pthread_rwlock_destroy(&cache->rwlock);
+        free(cache->sketch.counters);
         return -1;
     }
+    err_code = pthread_mutex_init(&cache->failures_mutex, NULL);
+    if (err_code != 0) {
+        print_error("cache_init: Unable to init mutex", err_code);
+        pthread_mutex_destroy(&cache->policy_mutex);
+        pthread_rwlock_destroy(&cache->rwlock);
+        free(cache->sketch.counters);
+        return -1;
+    }
+
     cache->head = NULL;
+    cache->admission = admission;
+    cache->window.capacity = admission ? capacity / 100 * window_percent : 0;
+    cache->main.capacity = capacity - cache->window.capacity;
     return 0;
 }
 
 cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache_t *cache) {
-    cache_entry_t *node = (cache_entry_t *)malloc(sizeof(cache_entry_t));
+    cache_entry_t *node = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
     if (node == NULL) {
         perror("cache_add: unable to allocate memory for cache entry");
         return NULL;
@@ -33,10 +126,15 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     }
 
     node->is_full = FALSE;
+    node->is_private = FALSE;
     node->size = size;
     node->data = data;
     node->host = host;
     node->path = path;
+    node->hash = cache_hash(view_of(host), view_of(path));
+    node->refs = 2;     //cache and http that downloads it
+    node->is_linked = TRUE;
+    node->segment = CACHE_SEGMENT_NONE;
 
     write_lock_rwlock(&cache->rwlock, "cache_add: Unable to write-lock rwlock");
     node->prev = NULL;
@@ -48,28 +146,95 @@ cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache
     return node;
 }
 
-cache_entry_t *cache_find(const char *host, const char *path, cache_t *cache) {
+//entry copied from snapshot or shared cache is complete from the start; host, path and data of meta
+//go to it, its age and request frequency are carried over; on failure caller still owns them.
+//Entry comes with a reference taken for caller
+cache_entry_t *cache_restore(const cache_entry_t *meta, long long age_ms, int frequency, cache_t *cache) {
+    cache_entry_t *entry = cache_add(meta->host, meta->path, meta->data, meta->size, cache);
+    if (entry == NULL) return NULL;
+    entry->code = meta->code;
+    entry->max_age = meta->max_age;
+    entry->stale_while_revalidate = meta->stale_while_revalidate;
+    entry->stale_if_error = meta->stale_if_error;
+
+    read_lock_rwlock(&cache->rwlock, "cache_restore: Unable to read-lock rwlock");
+    pthread_mutex_lock(&cache->policy_mutex);
+    for (int i = 0; i < frequency; i++) sketch_increment(&cache->sketch, entry->hash);
+    pthread_mutex_unlock(&cache->policy_mutex);
+    unlock_rwlock(&cache->rwlock, "cache_restore: Unable to unlock rwlock");
+
+    cache_complete(entry, cache);
+    entry->completed_at -= age_ms;
+    return entry;   //reference cache_add keeps for downloading http
+}
+
+int is_same_key(cache_entry_t *entry, unsigned long long hash, str_view_t host, str_view_t path) {
+    return entry->hash == hash && view_equals(host, entry->host) && view_equals(path, entry->path);
+}
+
+//every lookup counts in sketch, found entry comes with a reference taken for caller;
+//complete entry wins over one still downloading, that may be its refresh; key is a view into request, hash comes with it
+cache_entry_t *cache_find(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache) {
     read_lock_rwlock(&cache->rwlock, "cache_find: Unable to read-lock rwlock");
-    cache_entry_t *cur = cache->head;
-    while (cur != NULL) {
-        if (STR_EQ(host, cur->host) && STR_EQ(path, cur->path)) break;
-        cur = cur->next;
+    cache_entry_t *cur = NULL;
+    for (cache_entry_t *entry = cache->head; entry != NULL; entry = entry->next) {
+        if (!is_same_key(entry, hash, host, path)) continue;
+        if (cur == NULL) cur = entry;
+        if (entry->is_full) {
+            cur = entry;
+            break;
+        }
+    }
+    if (cur != NULL) cache_entry_acquire(cur);
+
+    pthread_mutex_lock(&cache->policy_mutex);
+    sketch_increment(&cache->sketch, hash);
+    cache_segment_t *segment = cur != NULL ? entry_segment(cur, cache) : NULL;
+    if (segment != NULL && segment->head != cur) {
+        int segment_id = cur->segment;
+        segment_unlink(segment, cur);
+        segment_push(segment, cur, segment_id);
     }
+    pthread_mutex_unlock(&cache->policy_mutex);
     unlock_rwlock(&cache->rwlock, "cache_find: Unable to unlock rwlock");
     return cur;
 }
 
+//freshness of complete entry for another node asking about it, CACHE_EXPIRED if there is none; not counted as a request
+int cache_peek(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache) {
+    read_lock_rwlock(&cache->rwlock, "cache_peek: Unable to read-lock rwlock");
+    cache_entry_t *cur = NULL;
+    for (cache_entry_t *entry = cache->head; entry != NULL; entry = entry->next) {
+        if (entry->is_full && is_same_key(entry, hash, host, path)) {
+            cur = entry;
+            cache_entry_acquire(cur);
+            break;
+        }
+    }
+    unlock_rwlock(&cache->rwlock, "cache_peek: Unable to unlock rwlock");
+    if (cur == NULL) return CACHE_EXPIRED;
+
+    read_lock_rwlock(&cur->rwlock, "cache_peek: ENTRY");
+    int freshness = cache_entry_freshness(cur);
+    unlock_rwlock(&cur->rwlock, "cache_peek: ENTRY");
+    cache_entry_release(cur);
+    return freshness;
+}
+
 void free_cache_entry(cache_entry_t *entry) {
     if (entry == NULL) return;
     free(entry->host);
     free(entry->path);
-    free(entry->data);
+    body_free(entry->data);
     pthread_rwlock_destroy(&entry->rwlock);
     free(entry);
 }
 
-void cache_remove(cache_entry_t *entry, cache_t *cache) {
-    write_lock_rwlock(&cache->rwlock, "cache_remove: Unable to write-lock rwlock");
+//called with write lock held, cache reference goes to victims list and is released after unlock
+void cache_unlink(cache_entry_t *entry, cache_t *cache, cache_entry_t **victims) {
+    cache_segment_t *segment = entry_segment(entry, cache);
+    if (segment != NULL) segment_unlink(segment, entry);
+
     if (entry == cache->head) {
         cache->head = entry->next;
         if (cache->head != NULL) cache->head->prev = NULL;
@@ -78,8 +243,251 @@ void cache_remove(cache_entry_t *entry, cache_t *cache) {
         entry->prev->next = entry->next;
         if (entry->next != NULL) entry->next->prev = entry->prev;
     }
+    entry->is_linked = FALSE;
+    entry->lru_next = *victims;
+    *victims = entry;
+}
+
+void release_victims(cache_entry_t *victims) {
+    while (victims != NULL) {
+        cache_entry_t *next = victims->lru_next;
+        cache_entry_release(victims);
+        victims = next;
+    }
+}
+
+//candidate pushed out of window goes to main if it was requested more often than every entry it would evict there
+void cache_admit(cache_entry_t *candidate, cache_t *cache, cache_entry_t **victims) {
+    ssize_t needed = cache->main.size + candidate->size - cache->main.capacity;
+    int admitted = candidate->size <= cache->main.capacity;
+    if (admitted && needed > 0) {
+        int frequency = sketch_estimate(&cache->sketch, candidate->hash);
+        ssize_t freed = 0;
+        for (cache_entry_t *victim = cache->main.tail; freed < needed; victim = victim->lru_prev) {
+            if (sketch_estimate(&cache->sketch, victim->hash) >= frequency) {
+                admitted = FALSE;
+                break;
+            }
+            freed += victim->size;
+        }
+    }
+    if (!admitted) {
+        STATS_INC(cache_rejects);
+        cache_unlink(candidate, cache, victims);
+        return;
+    }
+
+    while (cache->main.size + candidate->size > cache->main.capacity) {
+        STATS_INC(cache_evictions);
+        cache_unlink(cache->main.tail, cache, victims);
+    }
+    segment_push(&cache->main, candidate, CACHE_SEGMENT_MAIN);
+}
+
+//entry got its whole response, from now on it is charged against capacity and may be evicted
+void cache_complete(cache_entry_t *entry, cache_t *cache) {
+    write_lock_rwlock(&entry->rwlock, "cache_complete: FULL");
+    entry->completed_at = cache_now_ms();
+    entry->is_full = TRUE;
+    unlock_rwlock(&entry->rwlock, "cache_complete: FULL");
+
+    cache_entry_t *victims = NULL;
+    write_lock_rwlock(&cache->rwlock, "cache_complete: Unable to write-lock rwlock");
+    if (entry->is_linked && entry->segment == CACHE_SEGMENT_NONE) {
+        cache_entry_t *cur = cache->head;
+        while (cur != NULL) {   //older copies are replaced, their readers keep them until they finish
+            cache_entry_t *next = cur->next;
+            if (cur != entry && cur->is_full && cur->hash == entry->hash && STR_EQ(cur->host, entry->host) && STR_EQ(cur->path, entry->path)) cache_unlink(cur, cache, &victims);
+            cur = next;
+        }
+
+        if (cache->main.capacity == 0) segment_push(&cache->main, entry, CACHE_SEGMENT_MAIN);
+        else if (!cache->admission) {
+            segment_push(&cache->main, entry, CACHE_SEGMENT_MAIN);
+            while (cache->main.size > cache->main.capacity) {
+                STATS_INC(cache_evictions);
+                cache_unlink(cache->main.tail, cache, &victims);
+            }
+        }
+        else {
+            segment_push(&cache->window, entry, CACHE_SEGMENT_WINDOW);
+            while (cache->window.size > cache->window.capacity) {
+                cache_entry_t *candidate = cache->window.tail;
+                segment_unlink(&cache->window, candidate);
+                cache_admit(candidate, cache, &victims);
+            }
+        }
+    }
+    unlock_rwlock(&cache->rwlock, "cache_complete: Unable to unlock rwlock");
+    release_victims(victims);
+}
+
+//windows of stale serving start when entry stops being fresh
+int cache_entry_freshness(cache_entry_t *entry) {
+    long long age = cache_now_ms() - entry->completed_at;
+    if (age < entry->max_age * 1000LL) return CACHE_FRESH;
+    if (age < (entry->max_age + (long long)entry->stale_while_revalidate) * 1000) return CACHE_STALE;
+    if (age < (entry->max_age + (long long)entry->stale_if_error) * 1000) return CACHE_STALE_IF_ERROR;
+    return CACHE_EXPIRED;
+}
+
+//milliseconds since entry became complete
+long long cache_entry_age(cache_entry_t *entry) {
+    return cache_now_ms() - entry->completed_at;
+}
+
+//TRUE for the only caller that should refresh entry, flag is dropped by http doing it
+int cache_entry_start_revalidation(cache_entry_t *entry) {
+    return __sync_bool_compare_and_swap(&entry->is_revalidating, FALSE, TRUE);
+}
+
+//complete response owned by a single client and never linked into cache (admin and error pages)
+cache_entry_t *cache_entry_create_private(char *data, ssize_t size) {
+    cache_entry_t *node = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+    if (node == NULL) {
+        perror("cache_entry_create_private: unable to allocate memory for cache entry");
+        return NULL;
+    }
+
+    int err_code = pthread_rwlock_init(&node->rwlock, NULL);
+    if (err_code != 0) {
+        print_error("cache_entry_create_private: Unable to init rwlock", err_code);
+        free(node);
+        return NULL;
+    }
+
+    node->is_full = TRUE;
+    node->is_private = TRUE;
+    node->data = data;
+    node->size = size;
+    node->refs = 1;
+    return node;
+}
+
+void cache_entry_acquire(cache_entry_t *entry) {
+    __sync_add_and_fetch(&entry->refs, 1);
+}
+
+//last reference frees entry: private one goes away with its client, shared one once it left cache
+void cache_entry_release(cache_entry_t *entry) {
+    if (entry != NULL && __sync_sub_and_fetch(&entry->refs, 1) == 0) free_cache_entry(entry);
+}
+
+//remembers unreachable host for ttl seconds, expired records are dropped on the way
+void cache_host_failed(const char *host, int ttl, cache_t *cache) {
+    long long now = cache_now_ms();
+    pthread_mutex_lock(&cache->failures_mutex);
+    cache_host_failure_t **cur = &cache->failures, *found = NULL;
+    while (*cur != NULL) {
+        cache_host_failure_t *failure = *cur;
+        if (STR_EQ(failure->host, host)) found = failure;
+        else if (failure->until <= now) {
+            *cur = failure->next;
+            free(failure->host);
+            free(failure);
+            continue;
+        }
+        cur = &failure->next;
+    }
+
+    if (found == NULL && (found = (cache_host_failure_t *)malloc(sizeof(cache_host_failure_t))) != NULL) {
+        found->host = strdup(host);
+        if (found->host == NULL) {
+            free(found);
+            found = NULL;
+        }
+        else {
+            found->next = cache->failures;
+            cache->failures = found;
+        }
+    }
+    if (found != NULL) found->until = now + ttl * 1000LL;
+    pthread_mutex_unlock(&cache->failures_mutex);
+}
+
+int cache_host_is_failing(const char *host, cache_t *cache) {
+    int is_failing = FALSE;
+    pthread_mutex_lock(&cache->failures_mutex);
+    for (cache_host_failure_t *failure = cache->failures; failure != NULL; failure = failure->next) {
+        if (STR_EQ(failure->host, host)) {
+            is_failing = failure->until > cache_now_ms();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->failures_mutex);
+    return is_failing;
+}
+
+//drops reference of cache, entry lives on while somebody else holds it
+void cache_remove(cache_entry_t *entry, cache_t *cache) {
+    cache_entry_t *victims = NULL;
+    write_lock_rwlock(&cache->rwlock, "cache_remove: Unable to write-lock rwlock");
+    if (entry->is_linked) cache_unlink(entry, cache, &victims);
     unlock_rwlock(&cache->rwlock, "cache_remove: Unable to unlock rwlock");
-    free_cache_entry(entry);
+    release_victims(victims);
+}
+
+int is_host_prefix(cache_entry_t *entry, str_view_t prefix) {
+    return strlen(entry->host) >= prefix.length && memcmp(entry->host, prefix.data, prefix.length) == 0;
+}
+
+//unlinks entries, complete or still downloading, readers keep their copies; returns number of unlinked
+int purge_matching(str_view_t host, const str_view_t *path, cache_t *cache) {
+    unsigned long long hash = path != NULL ? cache_hash(host, *path) : 0;
+    cache_entry_t *victims = NULL;
+    int purged = 0;
+    write_lock_rwlock(&cache->rwlock, "purge_matching: Unable to write-lock rwlock");
+    cache_entry_t *cur = cache->head;
+    while (cur != NULL) {
+        cache_entry_t *next = cur->next;
+        if (path != NULL ? is_same_key(cur, hash, host, *path) : is_host_prefix(cur, host)) {
+            cache_unlink(cur, cache, &victims);
+            purged++;
+        }
+        cur = next;
+    }
+    unlock_rwlock(&cache->rwlock, "purge_matching: Unable to unlock rwlock");
+    release_victims(victims);
+    STATS_ADD(purged, purged);
+    return purged;
+}
+
+int cache_purge(str_view_t host, str_view_t path, cache_t *cache) {
+    return purge_matching(host, &path, cache);
+}
+
+int cache_purge_host(str_view_t prefix, cache_t *cache) {
+    return purge_matching(prefix, NULL, cache);
+}
+
+//fills page with at most limit entries whose host starts with prefix, skipping offset of them;
+//read lock is held only while page is collected, caller formats it and releases references
+int cache_list(str_view_t host_prefix, int offset, int limit, cache_listing_t *page, int *total, cache_t *cache) {
+    int size = 0, matches = 0;
+    read_lock_rwlock(&cache->rwlock, "cache_list: Unable to read-lock rwlock");
+    pthread_mutex_lock(&cache->policy_mutex);
+    for (cache_entry_t *cur = cache->head; cur != NULL; cur = cur->next) {
+        if (!is_host_prefix(cur, host_prefix)) continue;
+        if (matches++ < offset || size == limit) continue;
+        cache_entry_acquire(cur);
+        page[size].entry = cur;
+        page[size].segment = cur->segment;
+        page[size].frequency = sketch_estimate(&cache->sketch, cur->hash);
+        size++;
+    }
+    pthread_mutex_unlock(&cache->policy_mutex);
+    unlock_rwlock(&cache->rwlock, "cache_list: Unable to unlock rwlock");
+    *total = matches;
+    return size;
+}
+
+void cache_listing_release(cache_listing_t *page, int size) {
+    for (int i = 0; i < size; i++) cache_entry_release(page[i].entry);
+}
+
+const char *cache_segment_name(int segment) {
+    static const char *segment_names[] = { "none", "window", "main" };
+    return segment_names[segment];
 }
 
 void cache_destroy(cache_t *cache) {
@@ -90,15 +498,34 @@ void cache_destroy(cache_t *cache) {
         cur = next;
     }
     cache->head = NULL;
+    while (cache->failures != NULL) {
+        cache_host_failure_t *next = cache->failures->next;
+        free(cache->failures->host);
+        free(cache->failures);
+        cache->failures = next;
+    }
+    free(cache->sketch.counters);
+    pthread_mutex_destroy(&cache->failures_mutex);
+    pthread_mutex_destroy(&cache->policy_mutex);
     pthread_rwlock_destroy(&cache->rwlock);
 }
 
+//printed page by page, workers wait for cache lock only while one page is collected
 void cache_print_content(cache_t *cache) {
     read_lock_rwlock(&cache->rwlock, "cache_print_content: Unable to read-lock rwlock");
-    cache_entry_t *cur = cache->head;
-    while (cur != NULL) {
-        printf("%s %s %zd full=%d\n", cur->host, cur->path, cur->size, cur->is_full);
-        cur = cur->next;
-    }
+    printf("window %zd/%zd, main %zd/%zd bytes\n", cache->window.size, cache->window.capacity, cache->main.size, cache->main.capacity);
     unlock_rwlock(&cache->rwlock, "cache_print_content: Unable to unlock rwlock");
+
+    cache_listing_t page[CACHE_LIST_PAGE];
+    str_view_t any_host = { "", 0 };
+    int offset = 0, total, size;
+    do {
+        size = cache_list(any_host, offset, CACHE_LIST_PAGE, page, &total, cache);
+        for (int i = 0; i < size; i++) {
+            cache_entry_t *cur = page[i].entry;
+            printf("%s %s %zd full=%d segment=%s frequency=%d\n", cur->host, cur->path, cur->size, cur->is_full, cache_segment_name(page[i].segment), page[i].frequency);
+        }
+        cache_listing_release(page, size);
+        offset += size;
+    } while (size == CACHE_LIST_PAGE);
 }
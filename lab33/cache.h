@@ -1,27 +1,109 @@
 #include <stdlib.h>
 #include <pthread.h>
+#include "states.h"
 
 #ifndef LAB33_CACHE_H
 #define LAB33_CACHE_H
 
+//count-min sketch of request frequencies, counters saturate like 4-bit ones and are halved every sample
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH (64 * 1024)      //power of two
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_SAMPLE (10 * CACHE_SKETCH_WIDTH)
+
+#define CACHE_SEGMENT_NONE 0    //still downloading or already unlinked
+#define CACHE_SEGMENT_WINDOW 1
+#define CACHE_SEGMENT_MAIN 2
+
+#define CACHE_LIST_PAGE 100      //entries taken under one read lock when whole cache is printed
+
+#define CACHE_FRESH 0
+#define CACHE_STALE 1               //served while one background revalidation refreshes it
+#define CACHE_STALE_IF_ERROR 2      //served only if origin fails to give a new copy
+#define CACHE_EXPIRED 3
+
+/*
+ * Complete entries live in two LRU segments (W-TinyLFU). New ones enter small window,
+ * whoever falls out of it is admitted to main only if sketch saw it requested more often
+ * than every main entry it would evict, so one-hit wonders pass through window and leave.
+ * Entry is freed when its last reference is released: cache holds one while entry is
+ * linked, http that downloads it holds one, every client reading it holds one.
+ * Complete entry replaces older complete ones with same key, so stale copy keeps being
+ * found while its replacement downloads.
+ */
+
 typedef struct cache_entry {
-    int is_full;
+    int is_full, is_private;
+    int code;                   //status of cached response, not only 200 ones are kept
     char *data; ssize_t size;
     char *host, *path;
+    unsigned long long hash;
+    int refs, is_linked, segment;
+    int max_age, stale_while_revalidate, stale_if_error;   //seconds, set before entry is complete
+    long long completed_at;     //milliseconds, age starts here
+    int is_revalidating;
     pthread_rwlock_t rwlock;
-    struct cache_entry *next, *prev;
+    struct cache_entry *next, *prev;            //lookup list
+    struct cache_entry *lru_next, *lru_prev;    //segment, most recently used first
 } cache_entry_t;
 
+typedef struct cache_segment {
+    cache_entry_t *head, *tail;
+    ssize_t size, capacity;
+} cache_segment_t;
+
+typedef struct cache_sketch {
+    unsigned char *counters;    //CACHE_SKETCH_DEPTH rows of CACHE_SKETCH_WIDTH
+    int additions;
+} cache_sketch_t;
+
+//host origin could not be reached at, requests to it are answered locally until expiry
+typedef struct cache_host_failure {
+    char *host;
+    long long until;    //milliseconds
+    struct cache_host_failure *next;
+} cache_host_failure_t;
+
+//entry of a listing page, reference is held until page is released
+typedef struct cache_listing {
+    cache_entry_t *entry;
+    int segment, frequency;
+} cache_listing_t;
+
+//segments and sketch change under write lock, or under read lock together with policy_mutex
 typedef struct {
     cache_entry_t *head;
     pthread_rwlock_t rwlock;
+    pthread_mutex_t policy_mutex;
+    cache_segment_t window, main;
+    cache_sketch_t sketch;
+    int admission;
+    cache_host_failure_t *failures;
+    pthread_mutex_t failures_mutex;
 } cache_t;
 
-int cache_init(cache_t *cache);
+int cache_init(cache_t *cache, ssize_t capacity, int window_percent, int admission);
 
 cache_entry_t *cache_add(char *host, char *path, char *data, ssize_t size, cache_t *cache);
-cache_entry_t *cache_find(const char *host, const char *path, cache_t *cache);
+cache_entry_t *cache_restore(const cache_entry_t *meta, long long age_ms, int frequency, cache_t *cache);
+unsigned long long cache_hash(str_view_t host, str_view_t path);
+cache_entry_t *cache_find(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache);
+int cache_peek(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache);
+void cache_complete(cache_entry_t *entry, cache_t *cache);
+int cache_entry_freshness(cache_entry_t *entry);
+long long cache_entry_age(cache_entry_t *entry);
+int cache_entry_start_revalidation(cache_entry_t *entry);
+void cache_host_failed(const char *host, int ttl, cache_t *cache);
+int cache_host_is_failing(const char *host, cache_t *cache);
 void cache_remove(cache_entry_t *entry, cache_t *cache);
+int cache_purge(str_view_t host, str_view_t path, cache_t *cache);
+int cache_purge_host(str_view_t prefix, cache_t *cache);
+int cache_list(str_view_t host_prefix, int offset, int limit, cache_listing_t *page, int *total, cache_t *cache);
+void cache_listing_release(cache_listing_t *page, int size);
+const char *cache_segment_name(int segment);
+cache_entry_t *cache_entry_create_private(char *data, ssize_t size);
+void cache_entry_acquire(cache_entry_t *entry);
+void cache_entry_release(cache_entry_t *entry);
 void cache_destroy(cache_t *cache);
 void cache_print_content(cache_t *cache);
 
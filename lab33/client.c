@@ -1,4 +1,6 @@
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,11 +9,24 @@
 #include <errno.h>
 #include "client.h"
 #include "list_queue.h"
+#include "stats.h"
+#include "logger.h"
+#include "config.h"
+#include "body.h"
+#include "url.h"
+#include "admin.h"
+#include "origin.h"
+#include "egress.h"
+#include "sockopt.h"
+#include "shmcache.h"
+#include "peer.h"
 
-void create_client(int client_sock_fd, client_queue_t *client_queue) {
+int clients_open = 0;
+
+void create_client(int client_sock_fd, int worker, client_queue_t *client_queue) {
     client_t *new_client = (client_t *)calloc(1, sizeof(client_t));
     if (new_client == NULL) {
-        if (ERROR_LOG) perror("create_client: Unable to allocate memory for client struct");
+        LOG_ERRNO("create_client: Unable to allocate memory for client struct");
         close(client_sock_fd);
         return;
     }
@@ -19,14 +34,67 @@ void create_client(int client_sock_fd, client_queue_t *client_queue) {
         close(client_sock_fd);
         return;
     }
+    new_client->worker = worker;
+    __sync_add_and_fetch(&clients_open, 1);
     client_enqueue(new_client, client_queue);
-    if (INFO_LOG) printf("[%d] Connected\n", client_sock_fd);
+    STATS_INC(connections);
+    LOG_DEBUG("[%d] Connected from %s", client_sock_fd, new_client->peer);
+}
+
+void client_goes_error(client_t *client);
+void client_log_access(client_t *client, const char *host, const char *path, int code);
+
+void client_arm_timer(client_t *client, int timeout) {
+    if (timeout > 0) timer_arm(&client->timer, timeout * 1000LL);
+    else timer_cancel(&client->timer);
+}
+
+void client_timeout(wheel_timer_t *timer) {
+    client_t *client = (client_t *)timer->owner;
+    if (IS_ERROR_OR_DONE_STATUS(client->status)) return;
+    if (client->status == PEER_LOOKUP) {    //not an error, miss goes on with answers that came
+        client->peer_lookup->is_expired = TRUE;
+        return;
+    }
+
+    STATS_INC(client_timeouts);
+    if (client->status == AWAITING_REQUEST && client->request_size == 0) LOG_DEBUG("[%d] Timed out: idle", client->sock_fd);
+    else if (client->status == TUNNELING) LOG_INFO("[%d] Timed out: %s", client->sock_fd, client->tunnel->connected ? "tunnel idle" : "tunnel connect");
+    else if (client->upload_buf != NULL) LOG_INFO("[%d] Timed out: request body", client->sock_fd);
+    else LOG_INFO("[%d] Timed out: %s", client->sock_fd, client->status == AWAITING_REQUEST ? "request headers" : "response not taken");
+    client_goes_error(client);
+}
+
+//timer lives in the wheel of worker that took client from queue
+void client_start_timer(client_t *client, timer_wheel_t *timer_wheel) {
+    timer_init(&client->timer, timer_wheel, client_timeout, client);
+    client_arm_timer(client, config.client_idle_timeout);
+}
+
+//client is created by main thread, bound worker copies it into memory it touches first, that is on its own node
+client_t *client_move_to_worker(client_t *client) {
+    client_t *moved = (client_t *)malloc(sizeof(client_t));
+    if (moved == NULL) return client;
+    memcpy(moved, client, sizeof(client_t));
+    free(client);
+    return moved;
+}
+
+//overloaded proxy answers without reading request, client may retry later
+void reject_client(int client_sock_fd) {
+    const char *response = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(client_sock_fd, response, strlen(response), MSG_DONTWAIT);
+    close(client_sock_fd);
+    STATS_INC(rejected);
+    LOG_DEBUG("[%d] Rejected: workers overloaded", client_sock_fd);
 }
 
 void remove_client(client_t *client, client_list_t *client_list, client_list_t *global_client_list) {
     client_remove_from_list(client, client_list);
     client_remove_from_global_list(client, global_client_list);
-    if (INFO_LOG) printf("[%d] Disconnected\n", client->sock_fd);
+    STATS_INC(disconnections);
+    __sync_sub_and_fetch(&clients_open, 1);
+    LOG_DEBUG("[%d] Disconnected", client->sock_fd);
     client_destroy(client);
     free(client);
 }
@@ -39,20 +107,52 @@ int client_init(client_t *client, int client_sock_fd) {
     client->bytes_written = 0;
     client->request = NULL;
     client->request_size = 0;
+    client->tunnel = NULL;
+    client->upload_left = 0;
+    client->upload_buf = NULL;
+    client->peer_lookup = NULL;
+    client->close_after_response = FALSE;
+    client->is_fresh = TRUE;
+    client->request_start_us = 0;
+    client->response_started = FALSE;
+    client->response_code = HTTP_CODE_NONE;
+    client->response_source = NULL;
+    egress_client_init(client);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    if (getpeername(client_sock_fd, (struct sockaddr *)&addr, &addr_len) == -1 || addr.sin_family != AF_INET ||
+        inet_ntop(AF_INET, &addr.sin_addr, client->peer, sizeof(client->peer)) == NULL) {
+        strcpy(client->peer, "-");
+    }
 
     if (fcntl(client_sock_fd, F_SETFL, O_NONBLOCK) == -1) {
-        if (ERROR_LOG) perror("create_client: fcntl error");
+        LOG_ERRNO("create_client: fcntl error");
     }
+    sockopt_apply(client_sock_fd, SOCKOPT_CLIENT);
 
     return 0;
 }
 
 void client_destroy(client_t *client) {
+    timer_cancel(&client->timer);
     if (client->http_entry != NULL) {
         write_lock_rwlock(&client->http_entry->rwlock, "client_destroy");
         client->http_entry->clients--;
         unlock_rwlock(&client->http_entry->rwlock, "client_destroy");
     }
+    cache_entry_release(client->cache_entry);
+    client->cache_entry = NULL;
+    tunnel_destroy(client->tunnel);
+    client->tunnel = NULL;
+    if (client->peer_lookup != NULL) {
+        cache_entry_release(client->peer_lookup->stale_entry);
+        free(client->peer_lookup->host); free(client->peer_lookup->path);
+        free_with_null((void **)&client->peer_lookup);
+    }
+    free_with_null((void **)&client->upload_buf);
+    body_free(client->request);
+    client->request = NULL;
     close(client->sock_fd);
 }
 
@@ -68,13 +168,27 @@ void client_goes_error(client_t *client) {
     }
     client->bytes_written = 0;
     client->request_size = 0;
-    free_with_null((void **)&client->request);
 }
 
 void client_update_http_info(client_t *client) {
     if (client->http_entry != NULL) {
         write_lock_rwlock(&client->http_entry->rwlock, "client_update_http_info");
-        if (IS_ERROR_STATUS(client->http_entry->status)) {
+        http_t *http_entry = client->http_entry;
+        if (http_entry->stale_entry != NULL && client->bytes_written == 0 && (IS_ERROR_STATUS(http_entry->status) || http_entry->code >= 500)) {
+            http_entry->clients--;
+            char buf1[1] = { 1 };
+            write(http_entry->client_pipe_fd, buf1, 1);
+            client->cache_entry = http_entry->stale_entry;
+            cache_entry_acquire(client->cache_entry);
+            unlock_rwlock(&http_entry->rwlock, "client_update_http_info: STALE IF ERROR");
+            LOG_DEBUG("[%d] Origin failed, serving stale '%s%s'", client->sock_fd, client->cache_entry->host, client->cache_entry->path);
+            STATS_INC(stale_if_error);
+            client->http_entry = NULL;
+            client->status = GETTING_FROM_CACHE;
+            client->response_code = client->cache_entry->code;
+            client->response_source = "stale";
+        }
+        else if (IS_ERROR_STATUS(client->http_entry->status)) {
             unlock_rwlock(&client->http_entry->rwlock, "client_update_http_info: ERROR STATUS");
             client_goes_error(client);
         }
@@ -83,15 +197,18 @@ void client_update_http_info(client_t *client) {
             char buf1[1] = { 1 };
             write(client->http_entry->client_pipe_fd, buf1, 1);
             client->cache_entry = client->http_entry->cache_entry;
+            cache_entry_acquire(client->cache_entry);
             unlock_rwlock(&client->http_entry->rwlock, "client_update_http_info: FULL CACHE");
             client->http_entry = NULL;
             client->status = GETTING_FROM_CACHE;
+            client->response_code = client->cache_entry->code;
         }
         if (client->http_entry != NULL) unlock_rwlock(&client->http_entry->rwlock, "client_update_http_info");
     }
 }
 
-int parse_client_request(client_t *client, char **host, char **path, ssize_t bytes_read) {
+//returns size of request headers, method goes to request_type; host and path point into client->request
+int parse_client_request(client_t *client, str_view_t *host, str_view_t *path, int *request_type, ssize_t bytes_read) {
     const char *method, *phr_path;
     size_t method_len, path_len;
     int minor_version;
@@ -100,154 +217,740 @@ int parse_client_request(client_t *client, char **host, char **path, ssize_t byt
 
     int err_code = phr_parse_request(client->request, client->request_size, &method, &method_len, &phr_path, &path_len, &minor_version, headers, &num_headers, client->request_size - bytes_read);
     if (err_code == -1) {
-        if (ERROR_LOG) fprintf(stderr, "parse_client_request: unable to parse request\n");
+        LOG_WARN("[%d] parse_client_request: unable to parse request", client->sock_fd);
         client_goes_error(client);
         return -1;
     }
     if (err_code == -2) return -2; //incomplete, read from client more
 
-    if (!strings_equal_by_length(method, method_len, "GET", 3)) {
-        if (ERROR_LOG) fprintf(stderr, "parse_client_request: not a GET method\n");
+    if (strings_equal_by_length(method, method_len, "GET", 3)) *request_type = REQUEST_GET;
+    else if (strings_equal_by_length(method, method_len, "CONNECT", 7)) *request_type = REQUEST_CONNECT;
+    else if (strings_equal_by_length(method, method_len, "POST", 4) || strings_equal_by_length(method, method_len, "PUT", 3)) *request_type = REQUEST_UPLOAD;
+    else {
+        LOG_WARN("[%d] parse_client_request: unsupported method %.*s", client->sock_fd, (int)method_len, method);
         client_goes_error(client);
         return -1;
     }
 
-    *path = (char *)calloc(path_len + 1, sizeof(char));
-    if (*path == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "parse_client_request: unable to allocate memory for path\n");
-        client_goes_error(client);
-        return -1;
+    path->data = phr_path;
+    path->length = path_len;
+
+    client->upload_left = 0;
+    if (*request_type == REQUEST_UPLOAD) {
+        for (size_t i = 0; i < num_headers; i++) {
+            if (strings_equal_by_length(headers[i].name, headers[i].name_len, "Content-Length", strlen("Content-Length"))) {
+                client->upload_left = get_number_from_string_by_length(headers[i].value, headers[i].value_len);
+                if (client->upload_left == -1) {
+                    LOG_WARN("[%d] parse_client_request: invalid Content-Length", client->sock_fd);
+                    client_goes_error(client);
+                    return -1;
+                }
+            }
+            if (strings_equal_by_length(headers[i].name, headers[i].name_len, "Transfer-Encoding", strlen("Transfer-Encoding")) &&
+            strings_equal_by_length(headers[i].value, headers[i].value_len, "chunked", strlen("chunked"))) {
+                client->upload_left = UPLOAD_CHUNKED;
+                memset(&client->upload_decoder, 0, sizeof(client->upload_decoder));
+                client->upload_decoder.consume_trailer = 1;
+                break;
+            }
+        }
     }
-    memcpy(*path, phr_path, path_len);
 
+    //CONNECT names its destination in place of path
     int found_host = FALSE;
+    if (*request_type == REQUEST_CONNECT) {
+        *host = *path;
+        found_host = TRUE;
+    }
+    client->is_from_peer = FALSE;
     for (size_t i = 0; i < num_headers; i++) {
+        if (strings_equal_by_length(headers[i].name, headers[i].name_len, PEER_HEADER, strlen(PEER_HEADER))) client->is_from_peer = TRUE;
+    }
+    for (size_t i = 0; i < num_headers && !found_host; i++) {
         if (strings_equal_by_length(headers[i].name, headers[i].name_len,  "Host", 4)) {
-            *host = calloc(headers[i].value_len + 1, sizeof(char));
-            if (*host == NULL) {
-                if (ERROR_LOG) fprintf(stderr, "parse_client_request: unable to allocate memory for host\n");
-                free(*path); *path = NULL;
-                client_goes_error(client);
-                return -1;
-            }
-            memcpy(*host, headers[i].value, headers[i].value_len);
+            host->data = headers[i].value;
+            host->length = headers[i].value_len;
             found_host = TRUE;
             break;
         }
     }
     if (!found_host) {
-        if (ERROR_LOG) fprintf(stderr, "parse_client_request: no host header\n");
-        free(*path); *path = NULL;
+        LOG_WARN("[%d] parse_client_request: no host header", client->sock_fd);
         client_goes_error(client);
         return -1;
     }
 
+    return err_code;
+}
+
+int client_is_local(client_t *client) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    if (getpeername(client->sock_fd, (struct sockaddr *)&addr, &addr_len) == -1) return FALSE;
+    return addr.sin_family == AF_INET && (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+//response generated by proxy itself, client gets it as a private complete cache entry
+void client_serve_local(client_t *client, const char *status, const char *content_type, const char *body, ssize_t body_size) {
+    char headers[256];
+    int headers_size = snprintf(headers, sizeof(headers), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zd\r\n%s\r\n", status, content_type, body_size,
+                                client->close_after_response ? "Connection: close\r\n" : "");
+
+    char *data = body_alloc(headers_size + body_size);
+    if (data == NULL) {
+        LOG_ERRNO("client_serve_local: Unable to allocate memory for response");
+        client_goes_error(client);
+        return;
+    }
+    memcpy(data, headers, headers_size);
+    memcpy(data + headers_size, body, body_size);
+
+    cache_entry_t *entry = cache_entry_create_private(data, headers_size + body_size);
+    if (entry == NULL) {
+        body_free(data);
+        client_goes_error(client);
+        return;
+    }
+
+    client->status = GETTING_FROM_CACHE;
+    client->cache_entry = entry;
+    client->response_code = atoi(status);
+    client->response_source = "local";
+    client->request_size = 0;
+}
+
+//returns TRUE if request was addressed to proxy itself
+int handle_admin_request(client_t *client, str_view_t path, http_queue_t *http_queue, cache_t *cache) {
+    if (path.length < strlen(ADMIN_PREFIX) || memcmp(path.data, ADMIN_PREFIX, strlen(ADMIN_PREFIX)) != 0) return FALSE;
+
+    if (!client_is_local(client)) {
+        const char *body = "Forbidden\n";
+        client_serve_local(client, "403 Forbidden", "text/plain", body, (ssize_t)strlen(body));
+        return TRUE;
+    }
+
+    ssize_t size;
+    const char *status = "200 OK", *content_type = "text/plain";
+    char *body;
+    if (view_equals(path, STATS_PATH)) {
+        body = stats_render(&size);
+        content_type = "text/plain; version=0.0.4";
+    }
+    else body = admin_render(path, &status, &size, http_queue, cache);
+    if (body == NULL) {
+        client_goes_error(client);
+        return TRUE;
+    }
+    client_serve_local(client, status, content_type, body, size);
+    free(body);
+    return TRUE;
+}
+
+int client_open_upstream(const char *host) {
+    long long connect_start_us = stats_now_us();
+    int sock_fd = http_open_host_socket(host);
+    STATS_ADD(upstream_connect_time, stats_now_us() - connect_start_us);
+    if (sock_fd == -1) STATS_INC(upstream_connect_errors);
+    else STATS_INC(upstream_connects);
+    return sock_fd;
+}
+
+//peer serving request must not pass it on; header goes last, so views into request stay valid
+int client_mark_peer_request(client_t *client, int headers_size) {
+    static const char header[] = PEER_HEADER ": 1\r\n";
+    ssize_t length = sizeof(header) - 1, insert_at = headers_size - 2;
+    if (client->request_size + length > REQUEST_BUF_SIZE || insert_at < 0 || memcmp(client->request + insert_at, "\r\n", 2) != 0) return -1;
+    memmove(client->request + insert_at + length, client->request + insert_at, client->request_size - insert_at);
+    memcpy(client->request + insert_at, header, length);
+    client->request_size += length;
     return 0;
 }
 
-void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache) {
-    char *host = NULL, *path = NULL;
-    int err_code = parse_client_request(client, &host, &path, bytes_read);
-    if (err_code == -1) {
+void client_serve_bad_gateway(client_t *client) {
+    const char *body = "Bad Gateway\n";
+    client_serve_local(client, "502 Bad Gateway", "text/plain", body, (ssize_t)strlen(body));
+}
+
+//config.connect_ports is a comma separated list, destination without port is refused
+int is_connect_port_allowed(str_view_t destination) {
+    size_t colon = destination.length;
+    while (colon > 0 && destination.data[colon - 1] != ':') colon--;
+    if (colon == 0 || colon == destination.length) return FALSE;
+    const char *port = destination.data + colon;
+    size_t port_len = destination.length - colon;
+
+    const char *allowed = config.connect_ports;
+    while (*allowed != '\0') {
+        const char *comma = strchr(allowed, ',');
+        size_t len = comma == NULL ? strlen(allowed) : (size_t)(comma - allowed);
+        if (strings_equal_by_length(allowed, len, port, port_len)) return TRUE;
+        if (comma == NULL) break;
+        allowed = comma + 1;
+    }
+    return FALSE;
+}
+
+void client_start_tunnel(client_t *client, str_view_t destination, int headers_size) {
+    if (!is_connect_port_allowed(destination)) {     //else proxy relays to any service, e.g. mail or internal ones
+        LOG_INFO("[%d] Tunnel to %.*s refused: port is not in connect_ports", client->sock_fd, (int)destination.length, destination.data);
+        const char *body = "Forbidden\n";
+        client_serve_local(client, "403 Forbidden", "text/plain", body, (ssize_t)strlen(body));
+        return;
+    }
+    char *host = view_dup(destination);
+    if (host == NULL) {
+        LOG_ERRNO("client_start_tunnel: Unable to allocate memory for host");
         client_goes_error(client);
         return;
     }
-    if (err_code == -2) return;
+    int sock_fd = client_open_upstream(host);
+    if (sock_fd == -1) {
+        client_serve_bad_gateway(client);
+        free(host);
+        return;
+    }
 
-    cache_entry_t *cache_entry = cache_find(host, path, cache);
-    if (cache_entry != NULL) {
-        read_lock_rwlock(&cache_entry->rwlock, "handle_client_request: CACHE");
-        if (cache_entry->is_full) {
-            unlock_rwlock(&cache_entry->rwlock, "handle_client_request: FULL CACHE");
-            if (INFO_LOG) printf("[%d] Getting data from cache for '%s%s'\n", client->sock_fd, host, path);
-            client->status = GETTING_FROM_CACHE;
-            client->cache_entry = cache_entry;
-            client->request_size = 0;
-            free_with_null((void **)&client->request);
+    client->tunnel = tunnel_create(client->sock_fd, sock_fd, client->request + headers_size, client->request_size - headers_size);
+    if (client->tunnel == NULL) {
+        close(sock_fd);
+        free(host);
+        client_goes_error(client);
+        return;
+    }
+    client->tunnel->host = host;
+    STATS_INC(tunnels);
+    client->status = TUNNELING;
+    client->response_source = "tunnel";
+    client->request_size = 0;
+    client_arm_timer(client, config.connect_timeout);
+    LOG_DEBUG("[%d] Tunnel to %s", client->sock_fd, host);
+}
+
+void client_end_tunnel(client_t *client, int code) {
+    tunnel_t *tunnel = client->tunnel;
+    STATS_ADD(client_bytes_in, tunnel->up.bytes);
+    STATS_ADD(upstream_bytes_out, tunnel->up.bytes);
+    STATS_ADD(upstream_bytes_in, tunnel->down.bytes);
+    STATS_ADD(client_bytes_out, tunnel->down.bytes);
+    client->bytes_written = tunnel->down.bytes;
+    STATS_RECORD(response_time, client->request_start_us);
+    client_log_access(client, tunnel->host, "", code);
+    client->bytes_written = 0;
+    tunnel_destroy(tunnel);
+    client->tunnel = NULL;
+}
+
+void client_update_tunnel(client_t *client, poller_t *poller) {
+    int was_connected = client->tunnel->connected;
+    int result = tunnel_update(client->tunnel, poller);
+    if (result == TUNNEL_ERROR && !was_connected) {
+        LOG_ERRNO("[%d] Unable to connect tunnel to %s", client->sock_fd, client->tunnel->host);
+        STATS_INC(upstream_connect_errors);
+        client_end_tunnel(client, 502);
+        client_serve_bad_gateway(client);
+    }
+    else if (result == TUNNEL_ERROR) {
+        LOG_ERRNO("[%d] Tunnel to %s broken", client->sock_fd, client->tunnel->host);
+        client_end_tunnel(client, 200);
+        client_goes_error(client);
+    }
+    else if (result == TUNNEL_CLOSED) {
+        client_end_tunnel(client, 200);
+        client->status = SOCK_DONE;
+    }
+    else if (result == TUNNEL_ACTIVE) {
+        if (!was_connected) STATS_RECORD(ttfb, client->request_start_us);
+        client_arm_timer(client, config.client_idle_timeout);
+    }
+}
+
+//decodes a copy, body itself goes upstream still chunked; returns -1 on error, TRUE when body ended within size
+int client_scan_chunked(client_t *client, const char *data, ssize_t *size) {
+    char *copy = (char *)malloc(*size);
+    if (copy == NULL) {
+        LOG_ERRNO("client_scan_chunked: Unable to allocate memory");
+        return -1;
+    }
+    memcpy(copy, data, *size);
+    size_t decoded_size = *size;
+    ssize_t left = phr_decode_chunked(&client->upload_decoder, copy, &decoded_size);
+    free(copy);
+    if (left == -1) {
+        LOG_WARN("[%d] client_scan_chunked: Unable to parse request body", client->sock_fd);
+        return -1;
+    }
+    if (left == -2) return FALSE;
+    *size -= left;      //bytes after the body are not forwarded
+    return TRUE;
+}
+
+//takes size bytes of body from client, returns how many of them belong to body or -1
+ssize_t client_take_body(client_t *client, const char *data, ssize_t size) {
+    if (client->upload_left == UPLOAD_CHUNKED) {
+        int is_end = client_scan_chunked(client, data, &size);
+        if (is_end == -1) return -1;
+        if (is_end) client->upload_left = 0;
+        return size;
+    }
+    if (size > client->upload_left) size = client->upload_left;
+    client->upload_left -= size;
+    return size;
+}
+
+/*
+ * POST and PUT get their own http that nobody else joins. Headers and the part of body that came
+ * with them are sent by http like any request, the rest is read by client thread into a small buffer
+ * and written straight to http socket, so whole body is never kept in memory.
+ */
+void client_start_upload(client_t *client, str_view_t host_view, str_view_t path_view, int headers_size, http_queue_t *http_queue) {
+    ssize_t body_size = client_take_body(client, client->request + headers_size, client->request_size - headers_size);
+    if (body_size == -1) {
+        client_goes_error(client);
+        return;
+    }
+    char *host = view_dup(host_view), *path = view_dup(path_view);
+    if (host == NULL || path == NULL) {
+        LOG_ERRNO("client_start_upload: Unable to allocate memory for host and path");
+        free(host); free(path);
+        client_goes_error(client);
+        return;
+    }
+    int is_body_streaming = client->upload_left != 0;
+    if (is_body_streaming) {
+        client->upload_buf = (char *)malloc(BUF_SIZE);
+        if (client->upload_buf == NULL) {
+            LOG_ERRNO("client_start_upload: Unable to allocate memory for request body");
             free(host); free(path);
+            client_goes_error(client);
             return;
         }
-        unlock_rwlock(&cache_entry->rwlock, "handle_client_request: CACHE");
+        client->upload_buf_size = client->upload_buf_sent = 0;
+    }
+
+    int http_sock_fd = client_open_upstream(host);
+    if (http_sock_fd == -1) {
+        free(host); free(path);
+        free_with_null((void **)&client->upload_buf);
+        client_goes_error(client);     //body that is still coming cannot be told from next request
+        return;
+    }
+    origin_enter(host);
+    http_t *http_entry = create_http(http_sock_fd, client->request, headers_size + body_size, host, path, TRUE, is_body_streaming, NULL, HTTP_FOREGROUND, http_queue);
+    if (http_entry == NULL) {
+        origin_cancel(host);
+        free(host); free(path);
+        close(http_sock_fd);
+        free_with_null((void **)&client->upload_buf);
+        client_goes_error(client);
+        return;
+    }
+    STATS_INC(misses);
+    client->response_source = "upload";
+    client->request_size = 0;
+    client->request = NULL;
+    client->status = DOWNLOADING;
+    client->http_entry = http_entry;
+    LOG_DEBUG("[%d] Uploading to '%s%s'", client->sock_fd, host, path);
+}
+
+//called when body is sent or its http finished without it, write lock of http must be held
+void client_stop_upload(client_t *client) {
+    client->http_entry->is_body_streaming = FALSE;
+    free_with_null((void **)&client->upload_buf);
+}
+
+void client_add_upload_interest(client_t *client, poller_t *poller) {
+    if (client->upload_buf_size == 0) {
+        poller_add(poller, client->sock_fd, POLLER_READ);
+        return;
+    }
+    read_lock_rwlock(&client->http_entry->rwlock, "client_add_upload_interest");
+    if (client->http_entry->status == DOWNLOADING) poller_add(poller, client->http_entry->sock_fd, POLLER_WRITE);
+    unlock_rwlock(&client->http_entry->rwlock, "client_add_upload_interest");
+}
+
+void client_read_body(client_t *client) {
+    errno = 0;
+    ssize_t bytes_read = recv(client->sock_fd, client->upload_buf, BUF_SIZE, MSG_DONTWAIT);
+    if (bytes_read == -1 && errno == EWOULDBLOCK) return;
+    if (bytes_read <= 0) {
+        if (bytes_read == -1) LOG_ERRNO("[%d] client_read_body: Unable to read from client socket", client->sock_fd);
+        else LOG_INFO("[%d] Client closed connection in the middle of request body", client->sock_fd);
+        client_goes_error(client);
+        return;
     }
+    STATS_ADD(client_bytes_in, bytes_read);
+    client_arm_timer(client, config.client_idle_timeout);
 
+    client->upload_buf_size = client_take_body(client, client->upload_buf, bytes_read);
+    client->upload_buf_sent = 0;
+    if (client->upload_buf_size == -1) client_goes_error(client);
+}
+
+void client_write_body(client_t *client) {
+    write_lock_rwlock(&client->http_entry->rwlock, "client_write_body");
+    http_t *http = client->http_entry;
+    if (http->status != DOWNLOADING) {     //failed http fails client later, finished one does not need the rest
+        if (http->status == SOCK_DONE) client_stop_upload(client);
+        unlock_rwlock(&http->rwlock, "client_write_body: NOT DOWNLOADING");
+        return;
+    }
+
+    ssize_t bytes_written = write(http->sock_fd, client->upload_buf + client->upload_buf_sent, client->upload_buf_size - client->upload_buf_sent);
+    int err_code = errno;
+    if (bytes_written > 0) {
+        STATS_ADD(upstream_bytes_out, bytes_written);
+        client->upload_buf_sent += bytes_written;
+        if (client->upload_buf_sent == client->upload_buf_size) {
+            client->upload_buf_size = client->upload_buf_sent = 0;
+            if (client->upload_left == 0) client_stop_upload(client);
+        }
+    }
+    unlock_rwlock(&http->rwlock, "client_write_body");
+
+    //http socket is left to its own thread, http without clients is removed there
+    if (bytes_written == -1 && err_code != EAGAIN) {
+        errno = err_code;
+        LOG_ERRNO("[%d] client_write_body: Unable to write to http socket", client->sock_fd);
+        client_goes_error(client);
+    }
+}
+
+//body is moved in turns: read a buffer from client, then write all of it upstream
+void client_update_upload(client_t *client, poller_t *poller) {
+    if (client->upload_buf_size == 0) {
+        if (poller_is_ready(poller, client->sock_fd, POLLER_READ)) client_read_body(client);
+        return;
+    }
+
+    read_lock_rwlock(&client->http_entry->rwlock, "client_update_upload");
+    int is_writable = poller_is_ready(poller, client->http_entry->sock_fd, POLLER_WRITE);
+    unlock_rwlock(&client->http_entry->rwlock, "client_update_upload");
+    if (is_writable) client_write_body(client);
+}
+
+//request of proxy itself, http starts without clients and only fills cache;
+//it never waits for busy origin, returns -1 if it was not started
+int client_start_background(str_view_t host_view, str_view_t path_view, cache_entry_t *stale_entry, int background, http_queue_t *http_queue) {
+    char *host = view_dup(host_view), *path = view_dup(path_view);
+    size_t request_size = strlen("GET  HTTP/1.0\r\nHost: \r\n\r\n") + path_view.length + host_view.length;
+    char *request = body_alloc(request_size + 1);      //http frees request it has sent as a body buffer
+    if (host == NULL || path == NULL || request == NULL) {
+        LOG_ERRNO("client_start_background: Unable to allocate memory for request");
+        free(host); free(path); body_free(request);
+        return -1;
+    }
+    if (!origin_admit(host)) {
+        free(host); free(path); body_free(request);
+        return -1;
+    }
+    int sock_fd = client_open_upstream(host);
+    if (sock_fd == -1) {
+        origin_cancel(host);
+        free(host); free(path); body_free(request);
+        return -1;
+    }
+    snprintf(request, request_size + 1, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, host);
+
+    if (create_http(sock_fd, request, (ssize_t)request_size, host, path, FALSE, FALSE, stale_entry, background, http_queue) == NULL) {
+        origin_cancel(host);
+        free(host); free(path); body_free(request);
+        close(sock_fd);
+        return -1;
+    }
+    return 0;
+}
+
+//stale entry is refreshed by http without clients, only first client that finds it starts one;
+//stale copy is good enough until a later hit tries again if refresh was not started
+void client_start_revalidation(cache_entry_t *entry, http_queue_t *http_queue) {
+    if (!cache_entry_start_revalidation(entry)) return;
+    cache_entry_acquire(entry);
+    if (client_start_background(view_of(entry->host), view_of(entry->path), entry, HTTP_REVALIDATION, http_queue) == -1) {
+        cache_entry_release(entry);
+        entry->is_revalidating = FALSE;
+        return;
+    }
+    STATS_INC(revalidations);
+}
+
+//client joins http that already fetches same url, FALSE if there is none
+int client_join_http(client_t *client, str_view_t host_view, str_view_t path_view, unsigned long long hash, http_list_t *http_list, http_queue_t *http_queue) {
     //search for queued https
     pthread_mutex_lock(&http_queue->mutex);
     http_t *http_entry = http_queue->head;
     while (http_entry != NULL) {    //we look for already existing http connection with the same request
-        read_lock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY");
-        if (STR_EQ(http_entry->host, host) && STR_EQ(http_entry->path, path)) {   //there is active http
+        read_lock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY");
+        if (http_entry->hash == hash && view_equals(host_view, http_entry->host) && view_equals(path_view, http_entry->path) &&
+        !http_entry->dont_accept_clients) {   //there is active http
             http_entry->clients++;
-            unlock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY FOUND");
+            STATS_INC(coalesced);
+            client->response_source = "coalesced";
+            unlock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY FOUND");
             client->request_size = 0;
-            free_with_null((void **)&client->request);
             break;
         }
-        unlock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY");
+        unlock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY");
         http_entry = http_entry->next;
     }
     pthread_mutex_unlock(&http_queue->mutex);
 
     if (http_entry == NULL) {
         //there is no cache_entry in cache:
-        read_lock_rwlock(&http_list->rwlock, "handle_client_request: HTTP LIST");
+        read_lock_rwlock(&http_list->rwlock, "client_join_http: HTTP LIST");
         http_entry = http_list->head;
         while (http_entry != NULL) {    //we look for already existing http connection with the same request
-            read_lock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY");
-            if (STR_EQ(http_entry->host, host) && STR_EQ(http_entry->path, path) &&
-            (http_entry->status == DOWNLOADING || http_entry->status == SOCK_DONE) && !http_entry->dont_accept_clients) {   //there is active http
+            read_lock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY");
+            if (http_entry->hash == hash && view_equals(host_view, http_entry->host) && view_equals(path_view, http_entry->path) && !http_entry->dont_accept_clients &&
+            (http_entry->status == DOWNLOADING || http_entry->status == SOCK_DONE || (http_entry->status == AWAITING_REQUEST && http_entry->sock_fd == -1))) {   //there is active or waiting http
                 http_entry->clients++;
+                STATS_INC(coalesced);
+                client->response_source = "coalesced";
                 char buf1[1] = { 1 };
                 write(http_entry->client_pipe_fd, buf1, 1);
-                unlock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY FOUND");
+                unlock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY FOUND");
                 client->request_size = 0;
-                free_with_null((void **)&client->request);
                 break;
             }
-            unlock_rwlock(&http_entry->rwlock, "handle_client_request: HTTP ENTRY");
+            unlock_rwlock(&http_entry->rwlock, "client_join_http: HTTP ENTRY");
             http_entry = http_entry->next;
         }
-        unlock_rwlock(&http_list->rwlock, "handle_client_request: HTTP LIST");
+        unlock_rwlock(&http_list->rwlock, "client_join_http: HTTP LIST");
     }
 
-    if (http_entry == NULL)  {  //no active http cache_entry with the same request
-        int http_sock_fd = http_open_socket(host, 80);
-        if (http_sock_fd == -1) {
-            client_goes_error(client);
-            free(host); free(path);
-            return;
-        }
+    if (http_entry == NULL) return FALSE;
 
-        http_entry = create_http(http_sock_fd, client->request, client->request_size, host, path, http_queue);
-        if (http_entry == NULL) {
-            client_goes_error(client);
-            free(host); free(path);
-            close(http_sock_fd);
-            return;
-        }
+    client->status = DOWNLOADING;
+    client->http_entry = http_entry;
+    LOG_DEBUG("[%d] No data in cache for '%.*s %.*s'", client->sock_fd, (int)host_view.length, host_view.data, (int)path_view.length, path_view.data);
+    return TRUE;
+}
+
+//starts http for url, host and path go to it; peer is node chosen by lookup, NULL fetches from origin
+void client_fetch(client_t *client, char *host, char *path, int headers_size, const char *peer, cache_entry_t *stale_entry, http_queue_t *http_queue, cache_t *cache) {
+    LOG_DEBUG("[%d] No data in cache for '%s %s'", client->sock_fd, host, path);
+    //limits of origin do not apply to peer; header goes in only once peer socket is open, origin must not get it
+    int http_sock_fd = peer == NULL ? -1 : client_open_upstream(peer);
+    if (http_sock_fd != -1 && client_mark_peer_request(client, headers_size) == -1) close_socket(&http_sock_fd);
+    int is_peer_fetch = http_sock_fd != -1;
+    if (is_peer_fetch) LOG_DEBUG("[%d] Fetching '%s%s' from peer %s", client->sock_fd, host, path, peer);
+
+    int is_host_failing = !is_peer_fetch && config.error_ttl > 0 && cache_host_is_failing(host, cache);
+    int is_queued = !is_peer_fetch && !is_host_failing && !origin_admit(host);     //http waits for connection slot without socket
+    if (!is_peer_fetch && !is_host_failing && !is_queued) http_sock_fd = client_open_upstream(host);
+    if (!is_peer_fetch && !is_host_failing && !is_queued && http_sock_fd == -1) {
+        origin_cancel(host);
+        if (config.error_ttl > 0) cache_host_failed(host, config.error_ttl, cache);
+    }
+    if (is_host_failing) STATS_INC(failed_host_hits);
 
+    if (http_sock_fd == -1 && !is_queued && stale_entry != NULL) {
+        STATS_INC(stale_if_error);
+        client->response_code = stale_entry->code;
+        client->response_source = "stale";
+        client->status = GETTING_FROM_CACHE;
+        client->cache_entry = stale_entry;
         client->request_size = 0;
-        client->request = NULL;
+        free(host); free(path);
+        return;
+    }
+    if (http_sock_fd == -1 && !is_queued) {
+        client_serve_bad_gateway(client);
+        free(host); free(path);
+        return;
+    }
+
+    http_t *http_entry = create_http(http_sock_fd, client->request, client->request_size, host, path, FALSE, FALSE, stale_entry,
+                                     is_peer_fetch ? HTTP_PEER : HTTP_FOREGROUND, http_queue);
+    if (http_entry == NULL) {
+        if (http_sock_fd != -1 && !is_peer_fetch) origin_cancel(host);
+        cache_entry_release(stale_entry);
+        client_goes_error(client);
+        free(host); free(path);
+        close_socket(&http_sock_fd);
+        return;
     }
+    STATS_INC(misses);
+    client->response_source = is_peer_fetch ? "peer" : "miss";
 
+    client->request_size = 0;
+    client->request = NULL;     //sent by http, client takes new buffer on next read
     client->status = DOWNLOADING;
     client->http_entry = http_entry;
-    if (INFO_LOG) printf("[%d] No data in cache for '%s %s'.\n", client->sock_fd, host, path);
 }
 
+//miss waits for answers of peer nodes before going upstream, -1 if nobody was asked
+int client_start_peer_lookup(client_t *client, char *host, char *path, unsigned long long hash, int headers_size, cache_entry_t *stale_entry) {
+    if (config.peers == NULL) return -1;
+    peer_lookup_t *lookup = (peer_lookup_t *)malloc(sizeof(peer_lookup_t));
+    if (lookup == NULL) {
+        LOG_ERRNO("client_start_peer_lookup: Unable to allocate memory");
+        return -1;
+    }
+    lookup->host = host; lookup->path = path; lookup->hash = hash;
+    lookup->headers_size = headers_size;
+    lookup->stale_entry = stale_entry;
+    if (peer_query_start(lookup) == -1) {
+        free(lookup);
+        return -1;
+    }
+    client->peer_lookup = lookup;
+    client->status = PEER_LOOKUP;
+    timer_arm(&client->timer, config.peer_timeout);
+    return 0;
+}
+
+//answers to queries of this worker go to clients waiting for them
+void client_update_peer_replies(client_list_t *client_list) {
+    unsigned int id;
+    int sender, is_hit;
+    while (peer_read_reply(&id, &sender, &is_hit) == 0) {
+        for (client_t *client = client_list->head; client != NULL; client = client->next) {
+            if (client->status == PEER_LOOKUP && client->peer_lookup->id == id) {
+                peer_query_answer(client->peer_lookup, sender, is_hit);
+                break;
+            }
+        }
+    }
+}
+
+//decided or timed out lookup goes on as miss: joins http started meanwhile, else fetches from chosen peer or origin
+void client_finish_peer_lookup(client_t *client, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache) {
+    peer_lookup_t *lookup = client->peer_lookup;
+    if (!peer_query_is_done(lookup)) return;
+    client->peer_lookup = NULL;
+    if (client_join_http(client, view_of(lookup->host), view_of(lookup->path), lookup->hash, http_list, http_queue)) {
+        cache_entry_release(lookup->stale_entry);
+        free(lookup->host); free(lookup->path);
+    }
+    else client_fetch(client, lookup->host, lookup->path, lookup->headers_size, peer_query_result(lookup), lookup->stale_entry, http_queue, cache);
+    free(lookup);
+    if (client->status == DOWNLOADING || client->status == GETTING_FROM_CACHE) client_arm_timer(client, config.client_idle_timeout);
+}
+
+/*
+ * Host and path stay views into client request, or into its canonical key on stack, until it is a miss:
+ * hits and clients joining existing http allocate nothing. Owned copies are made only for new http,
+ * cache entry takes them from it.
+ */
+void handle_client_request(client_t *client, ssize_t bytes_read, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache) {
+    str_view_t host_view, path_view;
+    int request_type;
+    int headers_size = parse_client_request(client, &host_view, &path_view, &request_type, bytes_read);
+    if (headers_size == -1) {
+        client_goes_error(client);
+        return;
+    }
+    if (headers_size == -2) {
+        if (client->request_size == REQUEST_BUF_SIZE) {
+            LOG_WARN("[%d] handle_client_request: request headers do not fit %d bytes", client->sock_fd, REQUEST_BUF_SIZE);
+            const char *body = "Request Header Fields Too Large\n";
+            STATS_INC(requests);
+            client->request_start_us = stats_now_us();
+            client->response_started = FALSE;
+            client->close_after_response = TRUE;    //rest of headers is still in socket
+            client_serve_local(client, "431 Request Header Fields Too Large", "text/plain", body, (ssize_t)strlen(body));
+        }
+        return;
+    }
+
+    STATS_INC(requests);
+    client->request_start_us = stats_now_us();
+    client->response_started = FALSE;
+    client->response_code = HTTP_CODE_NONE;
+
+    if (request_type == REQUEST_CONNECT) {
+        client_start_tunnel(client, host_view, headers_size);
+        return;
+    }
+    if (request_type == REQUEST_UPLOAD) {
+        client_start_upload(client, host_view, path_view, headers_size, http_queue);
+        return;
+    }
+
+    char key[URL_KEY_SIZE];
+    str_view_t key_host, key_path;
+    if (config.url_canonical && url_canonicalize(host_view, path_view, key, sizeof(key), &key_host, &key_path) == 0) {
+        if (!views_equal(key_host, host_view) || !views_equal(key_path, path_view)) STATS_INC(canonicalized);
+        host_view = key_host;
+        path_view = key_path;
+    }
+
+    if (handle_admin_request(client, path_view, http_queue, cache)) return;
+
+    unsigned long long hash = cache_hash(host_view, path_view);
+    cache_entry_t *cache_entry = cache_find(host_view, path_view, hash, cache);
+    int is_shared = FALSE;
+    if (cache_entry == NULL && (cache_entry = shmcache_fetch(host_view, path_view, hash, cache)) != NULL) is_shared = TRUE;
+    cache_entry_t *stale_entry = NULL;     //expired copy kept for the case origin fails
+    if (cache_entry != NULL) {
+        read_lock_rwlock(&cache_entry->rwlock, "handle_client_request: CACHE");
+        int freshness = cache_entry->is_full ? cache_entry_freshness(cache_entry) : CACHE_EXPIRED;
+        if (freshness == CACHE_FRESH || freshness == CACHE_STALE) {
+            unlock_rwlock(&cache_entry->rwlock, "handle_client_request: FULL CACHE");
+            LOG_DEBUG("[%d] Getting data from cache for '%.*s%.*s'", client->sock_fd, (int)host_view.length, host_view.data, (int)path_view.length, path_view.data);
+            STATS_INC(hits);
+            if (cache_entry->code != 200) STATS_INC(negative_hits);
+            client->response_code = cache_entry->code;
+            client->response_source = is_shared ? "shared" : "hit";
+            if (freshness == CACHE_STALE) {
+                STATS_INC(stale_hits);
+                client->response_source = "stale";
+                client_start_revalidation(cache_entry, http_queue);
+            }
+            client->status = GETTING_FROM_CACHE;
+            client->cache_entry = cache_entry;
+            client->request_size = 0;
+            return;
+        }
+        if (freshness == CACHE_STALE_IF_ERROR) stale_entry = cache_entry;
+        unlock_rwlock(&cache_entry->rwlock, "handle_client_request: CACHE");
+        if (stale_entry == NULL) cache_entry_release(cache_entry);  //still downloading or too old, client joins http below
+    }
+
+    if (client_join_http(client, host_view, path_view, hash, http_list, http_queue)) {
+        cache_entry_release(stale_entry);     //fallback stays with http that was there first
+        return;
+    }
+
+    char *host = view_dup(host_view), *path = view_dup(path_view);
+    if (host == NULL || path == NULL) {
+        LOG_ERRNO("handle_client_request: Unable to allocate memory for host and path");
+        free(host); free(path);
+        cache_entry_release(stale_entry);
+        client_goes_error(client);
+        return;
+    }
+    if (!client->is_from_peer && client_start_peer_lookup(client, host, path, hash, headers_size, stale_entry) == 0) return;
+    client_fetch(client, host, path, headers_size, NULL, stale_entry, http_queue, cache);
+}
+
+//request is received in place, into fixed buffer parser and views work on
 void client_read_data(client_t *client, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache) {
-    char buf[BUF_SIZE + 1];
+    if (client->request == NULL) {
+        client->request = body_alloc(REQUEST_BUF_SIZE);
+        if (client->request == NULL) {
+            LOG_ERRNO("client_read_data: Unable to allocate memory for client request");
+            client_goes_error(client);
+            return;
+        }
+    }
     errno = 0;
-    ssize_t bytes_read = recv(client->sock_fd, buf, BUF_SIZE, MSG_DONTWAIT);
+    ssize_t bytes_read = recv(client->sock_fd, client->request + client->request_size, REQUEST_BUF_SIZE - client->request_size, MSG_DONTWAIT);
     if (bytes_read == -1) {
         if (errno == EWOULDBLOCK) return;
-        if (ERROR_LOG) perror("client_read_data: Unable to read from client socket");
+        LOG_ERRNO("[%d] client_read_data: Unable to read from client socket", client->sock_fd);
         client_goes_error(client);
         return;
     }
+    STATS_ADD(client_bytes_in, bytes_read);
     if (bytes_read == 0) {
         client->status = SOCK_DONE;
         client->request_size = 0;
-        free_with_null((void **)&client->request);
+        return;
+    }
+    if (client->close_after_response) {     //remainder of rejected request is dropped
+        client->request_size = 0;
         return;
     }
 
@@ -255,7 +958,7 @@ void client_read_data(client_t *client, http_list_t *http_list, http_queue_t *ht
         int error = TRUE;
         if (client->status == DOWNLOADING) {
             write_lock_rwlock(&client->http_entry->rwlock, "client_read_data: HTTP ENTRY");
-            if (client->bytes_written == client->http_entry->data_size) {
+            if (client->bytes_written == http_available_size(client->http_entry)) {
                 client->http_entry->clients--;
                 char buf1[1] = { 1 };
                 write(client->http_entry->client_pipe_fd, buf1, 1);
@@ -264,7 +967,6 @@ void client_read_data(client_t *client, http_list_t *http_list, http_queue_t *ht
                 client->bytes_written = 0;
                 client->status = AWAITING_REQUEST;
                 client->request_size = 0;
-                free_with_null((void **)&client->request);
                 error = FALSE;
             }
             if (client->http_entry != NULL) unlock_rwlock(&client->http_entry->rwlock, "client_read_data: HTTP ENTRY");
@@ -273,52 +975,54 @@ void client_read_data(client_t *client, http_list_t *http_list, http_queue_t *ht
             read_lock_rwlock(&client->cache_entry->rwlock, "client_read_data: CACHE ENTRY");
             if (client->bytes_written == client->cache_entry->size) {
                 unlock_rwlock(&client->cache_entry->rwlock, "client_read_data: CACHE ENTRY EQUALS");
+                cache_entry_release(client->cache_entry);
                 client->cache_entry = NULL;
                 client->bytes_written = 0;
                 client->status = AWAITING_REQUEST;
                 client->request_size = 0;
-                free_with_null((void **)&client->request);
                 error = FALSE;
             }
             if (client->cache_entry != NULL) unlock_rwlock(&client->cache_entry->rwlock, "client_read_data: CACHE ENTRY");
         }
 
         if (error) {
-            if (ERROR_LOG) fprintf(stderr, "client_read_data: client read data when we shouldn't\n");
+            LOG_WARN("[%d] client_read_data: client read data when we shouldn't", client->sock_fd);
             /*if (INFO_LOG) {
-                buf[bytes_read] = '\n';
-                write(STDERR_FILENO, buf, bytes_read + 1);
+                write(STDERR_FILENO, client->request, bytes_read);
             }*/
             return;
         }
     }
 
-    char *check = (char *)realloc(client->request, client->request_size + BUF_SIZE);
-    if (check == NULL) {
-        if (ERROR_LOG) perror("client_read_data: Unable to reallocate memory for client request");
-        client_goes_error(client);
-        return;
-    }
-
-    client->request = check;
-    memcpy(client->request + client->request_size, buf, bytes_read);
+    client->is_fresh = FALSE;
     client->request_size += bytes_read;
+    if (client->request_size == bytes_read) client_arm_timer(client, config.header_timeout);   //not rearmed by later parts
 
     handle_client_request(client, bytes_read, http_list, http_queue, cache);
+    if (client->status == DOWNLOADING || client->status == GETTING_FROM_CACHE) client_arm_timer(client, config.client_idle_timeout);
+}
+
+void client_log_access(client_t *client, const char *host, const char *path, int code) {
+    log_access(client->peer, host, path, code, client->bytes_written, stats_now_us() - client->request_start_us,
+               client->response_source == NULL ? "-" : client->response_source);
 }
 
 void check_finished_writing_to_client(client_t *client) {
     if (client->status == DOWNLOADING) {
         write_lock_rwlock(&client->http_entry->rwlock, "check_finished_writing_to_client: HTTP");
-        if (client->bytes_written >= client->http_entry->data_size && client->http_entry->is_response_complete) {
+        if (client->bytes_written >= http_available_size(client->http_entry) && client->http_entry->is_response_complete) {
+            int is_upload_left = client->upload_buf != NULL;
+            if (is_upload_left) client_stop_upload(client);
             client->http_entry->clients--;
             char buf1[1] = { 1 };
             write(client->http_entry->client_pipe_fd, buf1, 1);
             unlock_rwlock(&client->http_entry->rwlock, "check_finished_writing_to_client: HTTP COMPLETE");
+            STATS_RECORD(response_time, client->request_start_us);
+            client_log_access(client, client->http_entry->host, client->http_entry->path, client->http_entry->code);
             client->http_entry = NULL;
             client->bytes_written = 0;
             client->cache_entry = NULL;
-            client->status = AWAITING_REQUEST;
+            client->status = is_upload_left ? SOCK_DONE : AWAITING_REQUEST;    //rest of body cannot be told from next request
         }
         if (client->http_entry != NULL) unlock_rwlock(&client->http_entry->rwlock, "check_finished_writing_to_client: HTTP");
     }
@@ -326,42 +1030,77 @@ void check_finished_writing_to_client(client_t *client) {
         read_lock_rwlock(&client->cache_entry->rwlock, "check_finished_writing_to_client: CACHE");
         if (client->bytes_written >= client->cache_entry->size && client->cache_entry->is_full) {
             unlock_rwlock(&client->cache_entry->rwlock, "check_finished_writing_to_client: CACHE COMPLETE");
+            STATS_RECORD(response_time, client->request_start_us);
+            client_log_access(client, client->cache_entry->host, client->cache_entry->path, client->response_code);
+            cache_entry_release(client->cache_entry);
             client->cache_entry = NULL;
             client->bytes_written = 0;
-            client->status = AWAITING_REQUEST;
+            client->status = client->close_after_response ? SOCK_DONE : AWAITING_REQUEST;
         }
         if (client->cache_entry != NULL) unlock_rwlock(&client->cache_entry->rwlock, "check_finished_writing_to_client: CACHE");
     }
 }
 
-void write_to_client(client_t *client) {
+//response bytes that are ready to be written to client right now
+ssize_t client_pending_bytes(client_t *client) {
+    ssize_t pending = 0;
+    if (client->status == DOWNLOADING) {
+        read_lock_rwlock(&client->http_entry->rwlock, "client_pending_bytes: HTTP");
+        if (!IS_ERROR_STATUS(client->http_entry->status)) pending = http_available_size(client->http_entry) - client->bytes_written;
+        unlock_rwlock(&client->http_entry->rwlock, "client_pending_bytes: HTTP");
+    }
+    else if (client->status == GETTING_FROM_CACHE) {
+        read_lock_rwlock(&client->cache_entry->rwlock, "client_pending_bytes: CACHE");
+        pending = client->cache_entry->size - client->bytes_written;
+        unlock_rwlock(&client->cache_entry->rwlock, "client_pending_bytes: CACHE");
+    }
+    return MAX(pending, 0);
+}
+
+//writes at most limit bytes, full socket is not an error; returns bytes written or -1
+ssize_t write_to_client(client_t *client, ssize_t limit) {
     ssize_t offset = client->bytes_written;
-    const char *buf = "";
-    ssize_t size = 0;
+    ssize_t bytes_written = 0;
 
+    //lock is held during write: http thread may realloc data as soon as it is released
+    errno = 0;
     if (client->status == GETTING_FROM_CACHE) {
         read_lock_rwlock(&client->cache_entry->rwlock, "write_to_client: CACHE");
-        buf = client->cache_entry->data;
-        size = client->cache_entry->size;
+        bytes_written = write(client->sock_fd, client->cache_entry->data + offset, MIN(client->cache_entry->size - offset, limit));
         unlock_rwlock(&client->cache_entry->rwlock, "write_to_client: CACHE");
     }
     else if (client->status == DOWNLOADING) {
         read_lock_rwlock(&client->http_entry->rwlock, "write_to_client: HTTP");
-        if (client->http_entry->data == NULL) {
+        http_t *http = client->http_entry;
+        if (offset >= http->data_size && http->passthrough_read_fd != -1) {
+            bytes_written = http_splice_to_client(http, client->sock_fd, MIN(http_available_size(http) - offset, limit));
+        }
+        else if (http->data == NULL) {
             unlock_rwlock(&client->http_entry->rwlock, "write_to_client: HTTP return");
-            return;
+            return 0;
+        }
+        else {
+            //headers alone are held back until first body bytes join them
+            ssize_t size = MIN(http->data_size - offset, limit);
+            int is_more = !http->is_response_complete && offset + size <= http->headers_size;
+            bytes_written = sockopt_send(client->sock_fd, http->data + offset, size, is_more);
         }
-        buf = client->http_entry->data;
-        size = client->http_entry->data_size;
         unlock_rwlock(&client->http_entry->rwlock, "write_to_client: HTTP");
     }
 
-    ssize_t bytes_written = write(client->sock_fd, buf + offset, size - offset);
+    if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
     if (bytes_written == -1) {
-        if (ERROR_LOG) perror("write_to_client: Unable to write to client socket");
+        LOG_ERRNO("[%d] write_to_client: Unable to write to client socket", client->sock_fd);
         client_goes_error(client);
-        return;
+        return -1;
     }
     client->bytes_written += bytes_written;
+    STATS_ADD(client_bytes_out, bytes_written);
+    if (bytes_written > 0) client_arm_timer(client, config.client_idle_timeout);
+    if (!client->response_started && bytes_written > 0) {
+        client->response_started = TRUE;
+        STATS_RECORD(ttfb, client->request_start_us);
+    }
     check_finished_writing_to_client(client);
+    return bytes_written;
 }
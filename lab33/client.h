@@ -2,11 +2,16 @@
 #include "cache.h"
 #include "types.h"
 #include "states.h"
+#include "poller.h"
 
 #ifndef LAB33_CLIENT_H
 #define LAB33_CLIENT_H
 
-void create_client(int client_sock_fd, client_queue_t *client_queue);
+extern int clients_open;    //created and not yet removed, changed atomically
+
+void create_client(int client_sock_fd, int worker, client_queue_t *client_queue);
+client_t *client_move_to_worker(client_t *client);
+void reject_client(int client_sock_fd);
 void remove_client(client_t *client, client_list_t *client_list, client_list_t *global_client_list);
 
 int client_init(client_t *client, int client_sock_fd);
@@ -16,6 +21,14 @@ void client_update_http_info(client_t *client);
 void check_finished_writing_to_client(client_t *client);
 
 void client_read_data(client_t *client, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache);
-void write_to_client(client_t *client);
+int client_start_background(str_view_t host, str_view_t path, cache_entry_t *stale_entry, int background, http_queue_t *http_queue);
+ssize_t client_pending_bytes(client_t *client);
+ssize_t write_to_client(client_t *client, ssize_t limit);
+void client_update_tunnel(client_t *client, poller_t *poller);
+void client_add_upload_interest(client_t *client, poller_t *poller);
+void client_update_upload(client_t *client, poller_t *poller);
+void client_update_peer_replies(client_list_t *client_list);
+void client_finish_peer_lookup(client_t *client, http_list_t *http_list, http_queue_t *http_queue, cache_t *cache);
+void client_start_timer(client_t *client, timer_wheel_t *timer_wheel);
 
 #endif
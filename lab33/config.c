@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "config.h"
+#include "states.h"
+
+#define CONFIG_INT 0
+#define CONFIG_STRING 1
+
+config_t config = {
+    .drain_timeout = DRAIN_TIMEOUT,
+    .handoff_path = NULL,
+    .log_level = "info",
+    .io_backend = "select",
+    .lock_profile = FALSE,
+    .passthrough = TRUE,
+    .hugepages = FALSE,
+    .cache_size = CACHE_SIZE,
+    .cache_window = CACHE_WINDOW,
+    .cache_admission = CACHE_ADMISSION,
+    .cache_ttl = CACHE_TTL,
+    .stale_while_revalidate = STALE_WHILE_REVALIDATE,
+    .stale_if_error = STALE_IF_ERROR,
+    .negative_ttl = NEGATIVE_TTL,
+    .error_ttl = ERROR_TTL,
+    .client_idle_timeout = CLIENT_IDLE_TIMEOUT,
+    .header_timeout = CLIENT_HEADER_TIMEOUT,
+    .connect_timeout = HTTP_CONNECT_TIMEOUT,
+    .first_byte_timeout = HTTP_FIRST_BYTE_TIMEOUT,
+    .upstream_idle_timeout = HTTP_IDLE_TIMEOUT,
+    .origin_connections = ORIGIN_CONNECTIONS,
+    .upstream_connections = UPSTREAM_CONNECTIONS,
+    .origin_queue_timeout = ORIGIN_QUEUE_TIMEOUT,
+    .connect_ports = CONNECT_PORTS,
+    .egress_quantum = EGRESS_QUANTUM,
+    .egress_budget = EGRESS_BUDGET,
+    .client_rate = CLIENT_RATE,
+    .client_burst = CLIENT_BURST,
+    .max_connections = MAX_CONNECTIONS,
+    .thread_connections = THREAD_CONNECTIONS,
+    .thread_soft_connections = THREAD_SOFT_CONNECTIONS,
+    .cpu_affinity = CPU_AFFINITY,
+    .steer_incoming_cpu = STEER_INCOMING_CPU,
+    .tcp_nodelay = TCP_NODELAY_ON,
+    .cork = TCP_CORK_ON,
+    .defer_accept = DEFER_ACCEPT,
+    .fastopen = FASTOPEN_QUEUE,
+    .origin_fastopen = ORIGIN_FASTOPEN,
+    .client_sndbuf = CLIENT_SNDBUF,
+    .origin_rcvbuf = ORIGIN_RCVBUF,
+    .url_canonical = URL_CANONICAL,
+    .url_sort_query = URL_SORT_QUERY,
+    .url_strip_params = NULL,
+    .warm_concurrency = WARM_CONCURRENCY,
+    .snapshot_path = NULL,
+    .snapshot_threads = SNAPSHOT_THREADS,
+    .shared_cache = NULL,
+    .shared_cache_size = SHARED_CACHE_SIZE,
+    .peers = NULL,
+    .peer_name = NULL,
+    .peer_timeout = PEER_TIMEOUT,
+    .peer_route = PEER_ROUTE,
+};
+
+typedef struct config_option {
+    const char *name;
+    int type;
+    void *value;
+} config_option_t;
+
+static config_option_t options[] = {
+    { "drain_timeout", CONFIG_INT, &config.drain_timeout },
+    { "handoff_path", CONFIG_STRING, &config.handoff_path },
+    { "log_level", CONFIG_STRING, &config.log_level },
+    { "io_backend", CONFIG_STRING, &config.io_backend },
+    { "lock_profile", CONFIG_INT, &config.lock_profile },
+    { "passthrough", CONFIG_INT, &config.passthrough },
+    { "hugepages", CONFIG_INT, &config.hugepages },
+    { "cache_size", CONFIG_INT, &config.cache_size },
+    { "cache_window", CONFIG_INT, &config.cache_window },
+    { "cache_admission", CONFIG_INT, &config.cache_admission },
+    { "cache_ttl", CONFIG_INT, &config.cache_ttl },
+    { "stale_while_revalidate", CONFIG_INT, &config.stale_while_revalidate },
+    { "stale_if_error", CONFIG_INT, &config.stale_if_error },
+    { "negative_ttl", CONFIG_INT, &config.negative_ttl },
+    { "error_ttl", CONFIG_INT, &config.error_ttl },
+    { "client_idle_timeout", CONFIG_INT, &config.client_idle_timeout },
+    { "header_timeout", CONFIG_INT, &config.header_timeout },
+    { "connect_timeout", CONFIG_INT, &config.connect_timeout },
+    { "first_byte_timeout", CONFIG_INT, &config.first_byte_timeout },
+    { "upstream_idle_timeout", CONFIG_INT, &config.upstream_idle_timeout },
+    { "origin_connections", CONFIG_INT, &config.origin_connections },
+    { "upstream_connections", CONFIG_INT, &config.upstream_connections },
+    { "origin_queue_timeout", CONFIG_INT, &config.origin_queue_timeout },
+    { "connect_ports", CONFIG_STRING, &config.connect_ports },
+    { "egress_quantum", CONFIG_INT, &config.egress_quantum },
+    { "egress_budget", CONFIG_INT, &config.egress_budget },
+    { "client_rate", CONFIG_INT, &config.client_rate },
+    { "client_burst", CONFIG_INT, &config.client_burst },
+    { "max_connections", CONFIG_INT, &config.max_connections },
+    { "thread_connections", CONFIG_INT, &config.thread_connections },
+    { "thread_soft_connections", CONFIG_INT, &config.thread_soft_connections },
+    { "cpu_affinity", CONFIG_INT, &config.cpu_affinity },
+    { "steer_incoming_cpu", CONFIG_INT, &config.steer_incoming_cpu },
+    { "tcp_nodelay", CONFIG_INT, &config.tcp_nodelay },
+    { "cork", CONFIG_INT, &config.cork },
+    { "defer_accept", CONFIG_INT, &config.defer_accept },
+    { "fastopen", CONFIG_INT, &config.fastopen },
+    { "origin_fastopen", CONFIG_INT, &config.origin_fastopen },
+    { "client_sndbuf", CONFIG_INT, &config.client_sndbuf },
+    { "origin_rcvbuf", CONFIG_INT, &config.origin_rcvbuf },
+    { "url_canonical", CONFIG_INT, &config.url_canonical },
+    { "url_sort_query", CONFIG_INT, &config.url_sort_query },
+    { "url_strip_params", CONFIG_STRING, &config.url_strip_params },
+    { "warm_concurrency", CONFIG_INT, &config.warm_concurrency },
+    { "snapshot_path", CONFIG_STRING, &config.snapshot_path },
+    { "snapshot_threads", CONFIG_INT, &config.snapshot_threads },
+    { "shared_cache", CONFIG_STRING, &config.shared_cache },
+    { "shared_cache_size", CONFIG_INT, &config.shared_cache_size },
+    { "peers", CONFIG_STRING, &config.peers },
+    { "peer_name", CONFIG_STRING, &config.peer_name },
+    { "peer_timeout", CONFIG_INT, &config.peer_timeout },
+    { "peer_route", CONFIG_INT, &config.peer_route },
+};
+
+#define OPTIONS_NUM (sizeof(options) / sizeof(options[0]))
+
+int config_set(const char *name, size_t name_len, char *value) {
+    for (size_t i = 0; i < OPTIONS_NUM; i++) {
+        if (!strings_equal_by_length(options[i].name, strlen(options[i].name), name, name_len)) continue;
+
+        if (options[i].type == CONFIG_STRING) {
+            *(char **)options[i].value = value;
+            return 0;
+        }
+
+        int number;
+        if (convert_number(value, &number) == -1 || number < 0) {
+            if (ERROR_LOG) fprintf(stderr, "config_set: invalid value for '%s'\n", options[i].name);
+            return -1;
+        }
+        *(int *)options[i].value = number;
+        return 0;
+    }
+
+    if (ERROR_LOG) fprintf(stderr, "config_set: unknown option '%.*s'\n", (int)name_len, name);
+    return -1;
+}
+
+//options are given as name=value pairs after positional arguments
+int config_parse(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        char *delim = strchr(argv[i], '=');
+        if (delim == NULL) {
+            if (ERROR_LOG) fprintf(stderr, "config_parse: expected name=value, got '%s'\n", argv[i]);
+            return -1;
+        }
+        if (config_set(argv[i], delim - argv[i], delim + 1) == -1) return -1;
+    }
+    return 0;
+}
+
+void config_print(void) {
+    for (size_t i = 0; i < OPTIONS_NUM; i++) {
+        if (options[i].type == CONFIG_STRING) {
+            const char *value = *(char **)options[i].value;
+            printf("%s=%s\n", options[i].name, value == NULL ? "" : value);
+        }
+        else printf("%s=%d\n", options[i].name, *(int *)options[i].value);
+    }
+}
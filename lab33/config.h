@@ -0,0 +1,102 @@
+#include <stdlib.h>
+
+#ifndef LAB33_CONFIG_H
+#define LAB33_CONFIG_H
+
+#define DRAIN_TIMEOUT 30    //seconds given to in-flight responses after drain starts
+
+//connection timeouts in seconds, 0 disables
+#define CLIENT_IDLE_TIMEOUT 60        //between requests and while client does not take response
+#define CLIENT_HEADER_TIMEOUT 10      //from first byte of request to its last header
+#define HTTP_CONNECT_TIMEOUT 10
+#define HTTP_FIRST_BYTE_TIMEOUT 30    //from sent request to first byte of response
+#define HTTP_IDLE_TIMEOUT 30          //between reads of response
+
+//upstream connections, 0 is unlimited; requests above limit wait for a free connection in FIFO of their host
+#define ORIGIN_CONNECTIONS 32       //per host
+#define UPSTREAM_CONNECTIONS 0      //all hosts together, freed connections go to hosts in turn
+#define ORIGIN_QUEUE_TIMEOUT 30     //seconds request may wait for connection
+#define CONNECT_PORTS "443"         //comma separated ports CONNECT may open tunnel to, others get 403
+
+//writes to clients of one worker are taken in turns
+#define EGRESS_QUANTUM (16 * 1024)      //bytes client may write per turn
+#define EGRESS_BUDGET (1024 * 1024)     //bytes written per loop before new requests are read, 0 is unlimited
+#define CLIENT_RATE 0                   //kilobytes per second per client, 0 is unlimited
+#define CLIENT_BURST 64                 //kilobytes client may send at once after idle time
+
+//admission of new connections, 0 is unlimited; connections above hard limits wait in listen backlog
+#define MAX_CONNECTIONS 0               //open clients of all workers
+#define THREAD_CONNECTIONS 0            //clients and https of one worker, accept pauses when every worker has them
+#define THREAD_SOFT_CONNECTIONS 0       //when least loaded worker has them, new connections get 503 and are closed
+
+//placement of pool threads, see affinity.h
+#define CPU_AFFINITY 0                  //bind worker i to i-th cpu, it then allocates its clients on its own node
+#define STEER_INCOMING_CPU 0            //give accepted connection to worker bound to cpu that received it
+
+//socket options, see sockopt.h; 0 keeps kernel default
+#define TCP_NODELAY_ON 1                //client and origin sockets
+#define TCP_CORK_ON 1                   //response headers wait for first body bytes (MSG_MORE)
+#define DEFER_ACCEPT 5                  //seconds listener may hold connection that sent no data yet
+#define FASTOPEN_QUEUE 256              //pending TCP Fast Open requests on listener
+#define ORIGIN_FASTOPEN 0               //send request in SYN to origins that support it
+#define CLIENT_SNDBUF 0                 //kilobytes, setting it turns kernel autotuning off
+#define ORIGIN_RCVBUF 0                 //kilobytes
+
+//cache key, see url.h
+#define URL_CANONICAL 1                 //0 keys cache by Host header and target as client sent them
+#define URL_SORT_QUERY 0                //for origins that do not depend on order of query parameters
+
+#define WARM_CONCURRENCY 4              //upstream fetches of cache warm-up at a time, see warm.h
+#define SNAPSHOT_THREADS 4              //threads restoring cache snapshot at startup, see snapshot.h
+#define SHARED_CACHE_SIZE 256           //megabytes of shared cache segment, taken by process that creates it
+#define PEER_TIMEOUT 20                 //milliseconds miss waits for answers of peer nodes, see peer.h
+#define PEER_ROUTE 1                    //miss no peer has goes through node owning url on hash ring
+
+#define CACHE_SIZE 256          //megabytes of complete entries, 0 is unlimited
+#define CACHE_WINDOW 1          //percent of cache given to window segment
+#define CACHE_ADMISSION 1       //0 turns cache into plain LRU
+
+//seconds, used when response has no Cache-Control directive of its own
+#define CACHE_TTL 300
+#define STALE_WHILE_REVALIDATE 30   //after expiry stale copy is served while one refresh runs
+#define STALE_IF_ERROR 300          //after expiry stale copy replaces error or timeout of origin
+#define NEGATIVE_TTL 10             //301, 404 and 410 responses
+#define ERROR_TTL 0                 //5xx responses and hosts that refused connection, 0 disables
+
+typedef struct config {
+    int drain_timeout;
+    char *handoff_path;
+    char *log_level;
+    char *io_backend;
+    int lock_profile;
+    int passthrough;
+    int hugepages;
+    int cache_size, cache_window, cache_admission;
+    int cache_ttl, stale_while_revalidate, stale_if_error;
+    int negative_ttl, error_ttl;
+    int client_idle_timeout, header_timeout;
+    int connect_timeout, first_byte_timeout, upstream_idle_timeout;
+    int origin_connections, upstream_connections, origin_queue_timeout;
+    char *connect_ports;        //comma separated, e.g. 443,8443; empty value turns CONNECT off
+    int egress_quantum, egress_budget, client_rate, client_burst;
+    int max_connections, thread_connections, thread_soft_connections;
+    int cpu_affinity, steer_incoming_cpu;
+    int tcp_nodelay, cork, defer_accept, fastopen, origin_fastopen, client_sndbuf, origin_rcvbuf;
+    int url_canonical, url_sort_query;
+    char *url_strip_params;     //comma separated query parameters left out of cache key, e.g. utm_source,utm_medium
+    int warm_concurrency;
+    char *snapshot_path;        //cache is restored from it at startup and written to it on shutdown, NULL disables
+    int snapshot_threads;
+    char *shared_cache;         //POSIX shared memory name, e.g. /proxy33; processes giving same name share cache, NULL disables
+    int shared_cache_size;
+    char *peers;                //comma separated host:port of other proxy nodes, NULL disables; may list this node too
+    char *peer_name;            //host:port other nodes know this one by, default 127.0.0.1:listen_port
+    int peer_timeout, peer_route;
+} config_t;
+
+extern config_t config;
+
+int config_parse(int argc, char **argv);
+void config_print(void);
+
+#endif
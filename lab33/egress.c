@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <limits.h>
+#include "egress.h"
+#include "client.h"
+#include "config.h"
+#include "states.h"
+#include "stats.h"
+
+void egress_init(egress_t *egress) {
+    egress->head = egress->tail = NULL;
+    egress->wake_us = 0;
+}
+
+void egress_client_init(client_t *client) {
+    client->egress_deficit = 0;
+    client->egress_tokens = config.client_burst * 1024LL;
+    client->egress_refill_us = stats_now_us();
+    client->egress_next = NULL;
+}
+
+void refill(client_t *client, long long now_us) {
+    long long burst = config.client_burst * 1024LL;
+    client->egress_tokens += (now_us - client->egress_refill_us) * config.client_rate * 1024LL / 1000000;
+    if (client->egress_tokens > burst) client->egress_tokens = burst;
+    client->egress_refill_us = now_us;
+}
+
+//called for client with pending response; throttled one is left out until enough tokens for a quantum
+int egress_may_write(egress_t *egress, client_t *client) {
+    if (config.client_rate <= 0) return TRUE;
+    long long now_us = stats_now_us();
+    refill(client, now_us);
+    long long threshold = MIN((long long)config.egress_quantum, config.client_burst * 1024LL);
+    if (client->egress_tokens >= threshold) return TRUE;
+
+    long long wake_us = now_us + (threshold - client->egress_tokens) * 1000000 / (config.client_rate * 1024LL) + 1;
+    if (egress->wake_us == 0 || wake_us < egress->wake_us) egress->wake_us = wake_us;
+    STATS_INC(egress_throttled);
+    return FALSE;
+}
+
+void egress_add(egress_t *egress, client_t *client) {
+    client->egress_next = NULL;
+    if (egress->tail != NULL) egress->tail->egress_next = client;
+    else egress->head = client;
+    egress->tail = client;
+}
+
+/*
+ * Client leaves the round when it has nothing more to send (credit is dropped, as flow that
+ * went idle in DRR), when its socket is full or its tokens ran out (at most one quantum of
+ * credit is kept for next loop, so slow reader does not save up for one huge write).
+ */
+void egress_run(egress_t *egress) {
+    long long budget = config.egress_budget > 0 ? config.egress_budget : LLONG_MAX;     //0 is unlimited
+    while (egress->head != NULL && budget > 0) {
+        STATS_INC(egress_rounds);
+        client_t *prev = NULL, *client = egress->head;
+        while (client != NULL && budget > 0) {
+            client_t *next = client->egress_next;
+            client->egress_deficit += MAX(config.egress_quantum, 1);
+            ssize_t limit = client->egress_deficit;
+            if (config.client_rate > 0) {
+                refill(client, stats_now_us());
+                limit = MIN(limit, (ssize_t)client->egress_tokens);
+            }
+
+            ssize_t bytes_written = limit > 0 ? write_to_client(client, limit) : 0;
+            if (bytes_written > 0) {
+                client->egress_deficit -= bytes_written;
+                if (config.client_rate > 0) client->egress_tokens -= bytes_written;
+                budget -= bytes_written;
+            }
+
+            int is_idle = bytes_written == -1 || client_pending_bytes(client) == 0;
+            if (is_idle || bytes_written == 0 || bytes_written < limit) {
+                if (is_idle) client->egress_deficit = 0;
+                else client->egress_deficit = MIN(client->egress_deficit, (ssize_t)MAX(config.egress_quantum, 1));
+                if (prev != NULL) prev->egress_next = next;
+                else egress->head = next;
+                if (egress->tail == client) egress->tail = prev;
+                client->egress_next = NULL;
+            }
+            else prev = client;
+            client = next;
+        }
+    }
+    egress->head = egress->tail = NULL;     //clients cut off by budget are polled again
+}
+
+//poll wakes up in time for throttled clients to continue
+struct timeval *egress_timeout(egress_t *egress, struct timeval *wait_timeout, struct timeval *timeout) {
+    if (egress->wake_us == 0) return wait_timeout;
+    long long delay_us = MAX(egress->wake_us - stats_now_us(), 0);
+    egress->wake_us = 0;
+    if (wait_timeout != NULL && wait_timeout->tv_sec * 1000000LL + wait_timeout->tv_usec <= delay_us) return wait_timeout;
+    timeout->tv_sec = delay_us / 1000000;
+    timeout->tv_usec = delay_us % 1000000;
+    return timeout;
+}
@@ -0,0 +1,27 @@
+#include <sys/time.h>
+#include "types.h"
+
+#ifndef LAB33_EGRESS_H
+#define LAB33_EGRESS_H
+
+/*
+ * Writes of one worker loop are scheduled by deficit round robin. Every writable client gets
+ * egress_quantum bytes of credit per round, so a small response is sent in the first round
+ * while large ones take turns, and a loop stops writing after egress_budget bytes to read new
+ * requests again. Optional rate limit is a token bucket per client: client without tokens
+ * is not polled for write, loop wakes up when its bucket refills.
+ */
+
+typedef struct egress {
+    client_t *head, *tail;      //writable clients of current loop iteration
+    long long wake_us;          //earliest refill of a throttled client, 0 if none
+} egress_t;
+
+void egress_init(egress_t *egress);
+void egress_client_init(client_t *client);
+int egress_may_write(egress_t *egress, client_t *client);
+void egress_add(egress_t *egress, client_t *client);
+void egress_run(egress_t *egress);
+struct timeval *egress_timeout(egress_t *egress, struct timeval *wait_timeout, struct timeval *timeout);
+
+#endif
@@ -0,0 +1,139 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "handoff.h"
+#include "states.h"
+
+#define HANDOFF_MAGIC 'L'
+
+int handoff_fill_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        if (ERROR_LOG) fprintf(stderr, "handoff: path is too long '%s'\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int handoff_open_server(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_fill_address(path, &addr) == -1) return -1;
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        if (ERROR_LOG) perror("handoff_open_server: socket error");
+        return -1;
+    }
+
+    unlink(path);   //previous owner has already handed its listener to us or is dead
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+        if (ERROR_LOG) perror("handoff_open_server: bind error");
+        close(sock_fd);
+        return -1;
+    }
+
+    if (listen(sock_fd, 1) == -1) {
+        if (ERROR_LOG) perror("handoff_open_server: listen error");
+        close(sock_fd);
+        return -1;
+    }
+
+    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        if (ERROR_LOG) perror("handoff_open_server: fcntl error");
+    }
+
+    return sock_fd;
+}
+
+//returns listening fd of the previous proxy or -1 if there is nobody to take it from
+int handoff_receive_listen_fd(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_fill_address(path, &addr) == -1) return -1;
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        if (ERROR_LOG) perror("handoff_receive_listen_fd: socket error");
+        return -1;
+    }
+
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+        close(sock_fd);
+        return -1;
+    }
+
+    char magic = 0;
+    struct iovec iov = { .iov_base = &magic, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = recvmsg(sock_fd, &msg, 0);
+    } while (bytes_read == -1 && errno == EINTR);
+    close(sock_fd);
+
+    if (bytes_read != 1 || magic != HANDOFF_MAGIC) {
+        if (ERROR_LOG) fprintf(stderr, "handoff_receive_listen_fd: previous proxy sent no listener\n");
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        if (ERROR_LOG) fprintf(stderr, "handoff_receive_listen_fd: no descriptor in message\n");
+        return -1;
+    }
+
+    int listen_fd;
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    return listen_fd;
+}
+
+int handoff_send_listen_fd(int server_fd, int listen_fd) {
+    int sock_fd = accept(server_fd, NULL, NULL);
+    if (sock_fd == -1) {
+        if (errno == EWOULDBLOCK || errno == EINTR) return -1;
+        if (ERROR_LOG) perror("handoff_send_listen_fd: accept error");
+        return -1;
+    }
+
+    char magic = HANDOFF_MAGIC;
+    struct iovec iov = { .iov_base = &magic, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    int err_code = 0;
+    if (sendmsg(sock_fd, &msg, 0) != 1) {
+        if (ERROR_LOG) perror("handoff_send_listen_fd: sendmsg error");
+        err_code = -1;
+    }
+    close(sock_fd);
+    return err_code;
+}
@@ -0,0 +1,14 @@
+#ifndef LAB33_HANDOFF_H
+#define LAB33_HANDOFF_H
+
+/*
+ * Listening socket handoff between an old and a new proxy process.
+ * The running proxy listens on a unix socket; a starting proxy connects to it,
+ * receives the listening fd through SCM_RIGHTS and the old one goes draining.
+ */
+
+int handoff_open_server(const char *path);
+int handoff_receive_listen_fd(const char *path);
+int handoff_send_listen_fd(int server_fd, int listen_fd);
+
+#endif
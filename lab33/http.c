@@ -1,3 +1,8 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     //splice, pipe2
+#define HTTP_SPLICE
+#endif
+
 #include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,11 +14,23 @@
 #include "http.h"
 #include "states.h"
 #include "list_queue.h"
-
-http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_queue_t *http_queue) {
+#include "stats.h"
+#include "logger.h"
+#include "config.h"
+#include "body.h"
+#include "origin.h"
+#include "sockopt.h"
+#include "warm.h"
+#include "shmcache.h"
+
+//uploads are neither cached nor shared, their response belongs to the one client that sent the body;
+//http takes reference of stale_entry, revalidation starts with no clients;
+//without sock_fd http waits for connection slot of its host
+http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, int is_upload, int is_body_streaming,
+                    cache_entry_t *stale_entry, int background, http_queue_t *http_queue) {
     http_t *new_http = (http_t *)calloc(1, sizeof(http_t));
     if (new_http == NULL) {
-        if (ERROR_LOG) perror("create_http: Unable to allocate memory for http struct");
+        LOG_ERRNO("create_http: Unable to allocate memory for http struct");
         return NULL;
     }
 
@@ -26,15 +43,56 @@ http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host
         free(new_http);
         return NULL;
     }
+    new_http->is_uncacheable = new_http->dont_accept_clients = is_upload;
+    new_http->is_body_streaming = is_body_streaming;
+    new_http->stale_entry = stale_entry;
+    new_http->is_revalidation = background == HTTP_REVALIDATION;
+    new_http->is_warmup = background == HTTP_WARMUP;
+    new_http->is_peer_fetch = background == HTTP_PEER;
+    if (background != HTTP_FOREGROUND && background != HTTP_PEER) new_http->clients = 0;
+    if (sock_fd == -1) origin_wait(new_http);
+    else new_http->origin_state = origin_is_limited() && !new_http->is_peer_fetch ? ORIGIN_ACTIVE : ORIGIN_NONE;  //peer holds no slot of host
     http_enqueue(new_http, http_queue);
-    if (INFO_LOG) printf("[%s %s] Connected\n", host, path);
+    LOG_DEBUG("[%s %s] Connected", host, path);
     return new_http;
 }
 
+void http_goes_error(http_t *http);
+
+void http_arm_timer(http_t *http, int timeout) {
+    if (timeout > 0) timer_arm(&http->timer, timeout * 1000LL);
+    else timer_cancel(&http->timer);
+}
+
+void http_timeout(wheel_timer_t *timer) {
+    http_t *http = (http_t *)timer->owner;
+    write_lock_rwlock(&http->rwlock, "http_timeout");
+    if (http->status == DOWNLOADING && http->is_body_streaming && http->data_size == 0) {
+        http_arm_timer(http, config.first_byte_timeout);    //waiting for first byte starts after whole body is sent
+    }
+    else if (!IS_ERROR_OR_DONE_STATUS(http->status)) {
+        const char *reason = "idle";
+        if (http->status == AWAITING_REQUEST && http->sock_fd == -1) reason = "origin queue";
+        else if (http->status == AWAITING_REQUEST) reason = http->request_bytes_written == 0 ? "connect" : "sending request";
+        else if (http->data_size == 0) reason = "first byte";
+        LOG_WARN("[%d %s %s] Timed out: %s", http->sock_fd, http->host, http->path, reason);
+        STATS_INC(upstream_timeouts);
+        http_goes_error(http);
+    }
+    unlock_rwlock(&http->rwlock, "http_timeout");
+}
+
+//timer lives in the wheel of worker that took http from queue
+void http_start_timer(http_t *http, timer_wheel_t *timer_wheel) {
+    timer_init(&http->timer, timer_wheel, http_timeout, http);
+    http_arm_timer(http, http->sock_fd == -1 ? config.origin_queue_timeout : config.connect_timeout);
+}
+
 void remove_http(http_t *http, http_list_t *http_list, http_list_t *global_http_list, cache_t *cache) {
     http_remove_from_list(http, http_list);
     http_remove_from_global_list(http, global_http_list);
-    if (INFO_LOG) printf("[%d %s %s] Disconnected\n", http->sock_fd, http->host, http->path);
+    STATS_INC(upstream_closes);
+    LOG_DEBUG("[%d %s %s] Disconnected", http->sock_fd, http->host, http->path);
     http_destroy(http, cache);
     free(http);
 }
@@ -58,37 +116,65 @@ int http_init(http_t *http, int sock_fd, char *request, ssize_t request_size, ch
     http->sock_fd = sock_fd;
     http->request = request; http->request_size = request_size; http->request_bytes_written = 0;
     http->host = host; http->path = path;
+    http->hash = cache_hash(view_of(host), view_of(path));
     http->cache_entry = NULL;
+    http->is_uncacheable = http->is_body_streaming = FALSE;
+    http->passthrough_read_fd = http->passthrough_write_fd = -1;
+    http->passthrough_pipe_full = FALSE;
+    http->passthrough_size = 0;
+    http->max_age = http->stale_while_revalidate = http->stale_if_error = -1;
+    http->stale_entry = NULL;
+    http->is_revalidation = http->is_warmup = http->is_peer_fetch = FALSE;
+    http->origin_state = ORIGIN_NONE;
+    http->origin_next = NULL;
     return 0;
 }
 
+//connection slot goes to next request waiting for this host
+void http_close_upstream(http_t *http) {
+    close_socket(&http->sock_fd);
+    origin_leave(http);
+}
+
 void http_destroy(http_t *http, cache_t *cache) {
-    if (http->cache_entry != NULL && !http->cache_entry->is_full) {
-        cache_remove(http->cache_entry, cache);
+    timer_cancel(&http->timer);
+    http_close_upstream(http);      //host may belong to cache entry released below
+    if (http->stale_entry != NULL) {
+        if (http->is_revalidation) http->stale_entry->is_revalidating = FALSE;   //failed refresh may be tried again
+        cache_entry_release(http->stale_entry);
+        http->stale_entry = NULL;
+    }
+    if (http->is_warmup) warm_finished(http->cache_entry != NULL && http->cache_entry->is_full && http->cache_entry->is_linked);
+    if (http->cache_entry != NULL) {
+        if (!http->cache_entry->is_full) cache_remove(http->cache_entry, cache);
+        cache_entry_release(http->cache_entry);
         http->cache_entry = NULL;
     }
-    else if (http->cache_entry == NULL) {
-        free(http->data);
+    else {
+        body_free(http->data);
         free(http->host);
         free(http->path);
     }
-    close_socket(&http->sock_fd);
+    body_free(http->request);      //request was not sent completely
+    http->request = NULL;
     close_socket(&http->client_pipe_fd);
     close_socket(&http->http_pipe_fd);
+    close_socket(&http->passthrough_read_fd);
+    close_socket(&http->passthrough_write_fd);
     pthread_rwlock_destroy(&http->rwlock);
 }
 
 int http_check_disconnect(http_t *http) {
     write_lock_rwlock(&http->rwlock, "http_check_disconnect");
     if (http->clients == 0) {
-        if (IS_ERROR_OR_DONE_STATUS(http->status)) {
+        if (IS_ERROR_OR_DONE_STATUS(http->status) || http->dont_accept_clients) {   //nobody can use its response anymore
             http->dont_accept_clients = TRUE;
             unlock_rwlock(&http->rwlock, "http_check_disconnect: ERROR OR DONE");
             return TRUE;
         }
         unlock_rwlock(&http->rwlock, "http_check_disconnect: ELSE");
         #ifdef DROP_HTTP_NO_CLIENTS
-        close_socket(&http->sock_fd);
+        http_close_upstream(http);
         return TRUE;
         #endif
         return FALSE;
@@ -113,7 +199,7 @@ int http_open_socket(const char *hostname, int port) {
     int err_code;
     struct hostent *server_host = getipnodebyname(hostname, AF_INET, 0, &err_code);
     if (server_host == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "Unable to connect to host %s: %s\n", hostname, get_host_error(err_code));
+        LOG_WARN("Unable to connect to host %s: %s", hostname, get_host_error(err_code));
         return -1;
     }
 
@@ -128,26 +214,52 @@ int http_open_socket(const char *hostname, int port) {
 
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd == -1) {
-        if (ERROR_LOG) perror("open_http_socket: socket error");
+        LOG_ERRNO("open_http_socket: socket error");
         return -1;
     }
 
-    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1) {
-        if (ERROR_LOG) perror("open_http_socket: connect error");
+    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        LOG_ERRNO("open_http_socket: fcntl error");
+    }
+    sockopt_apply(sock_fd, SOCKOPT_ORIGIN);
+
+    //connect finishes in background, http_send_request checks its result once socket is writable
+    if (connect(sock_fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS) {
+        LOG_ERRNO("open_http_socket: connect error to %s", hostname);
         close(sock_fd);
         return -1;
     }
 
-    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
-        if (ERROR_LOG) perror("open_http_socket: fcntl error");
+    return sock_fd;
+}
+
+//host header value may carry explicit port: "example.com:8080"
+int http_open_host_socket(const char *host) {
+    int port = HTTP_DEFAULT_PORT;
+    const char *delim = strrchr(host, ':');
+    size_t hostname_len = delim == NULL ? strlen(host) : (size_t)(delim - host);
+    if (delim != NULL) {
+        port = get_number_from_string_by_length(delim + 1, strlen(delim + 1));
+        if (!IS_PORT_VALID(port)) {
+            LOG_WARN("Invalid port in host '%s'", host);
+            return -1;
+        }
     }
 
-    return sock_fd;
+    char hostname[HOSTNAME_MAX_SIZE];
+    if (hostname_len >= sizeof(hostname)) {
+        LOG_WARN("Host name '%s' is too long", host);
+        return -1;
+    }
+    memcpy(hostname, host, hostname_len);
+    hostname[hostname_len] = '\0';
+    return http_open_socket(hostname, port);
 }
 
 void http_goes_error(http_t *http) {
+    timer_cancel(&http->timer);
     http->status = SOCK_ERROR;
-    close_socket(&http->sock_fd);
+    http_close_upstream(http);
     http->data_size = 0;
     http->is_response_complete = FALSE;
     http->dont_accept_clients = TRUE;
@@ -155,16 +267,45 @@ void http_goes_error(http_t *http) {
     for (int i = 0; i < http->clients; i++) write(http->http_pipe_fd, buf1, 1);
 }
 
-void parse_http_response_headers(http_t *http) {
+int directive_value(const char *directive, size_t length, const char *name) {
+    size_t name_len = strlen(name);
+    if (length <= name_len || directive[name_len] != '=' || !strings_equal_by_length(directive, name_len, name, name_len)) return -1;
+    return get_number_from_string_by_length(directive + name_len + 1, length - name_len - 1);
+}
+
+//freshness comes from s-maxage or max-age, no-store, no-cache and private responses are not cached
+void parse_cache_control(http_t *http, const char *value, size_t value_len) {
+    int s_maxage = -1;
+    const char *end = value + value_len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == ',')) value++;
+        const char *directive = value;
+        while (value < end && *value != ',') value++;
+        size_t length = value - directive;
+        while (length > 0 && directive[length - 1] == ' ') length--;
+
+        int number;
+        if (strings_equal_by_length(directive, length, "no-store", strlen("no-store")) ||
+            strings_equal_by_length(directive, length, "no-cache", strlen("no-cache")) ||
+            strings_equal_by_length(directive, length, "private", strlen("private"))) http->is_uncacheable = TRUE;
+        else if ((number = directive_value(directive, length, "max-age")) != -1) http->max_age = number;
+        else if ((number = directive_value(directive, length, "s-maxage")) != -1) s_maxage = number;
+        else if ((number = directive_value(directive, length, "stale-while-revalidate")) != -1) http->stale_while_revalidate = number;
+        else if ((number = directive_value(directive, length, "stale-if-error")) != -1) http->stale_if_error = number;
+    }
+    if (s_maxage != -1) http->max_age = s_maxage;     //shared caches prefer it
+}
+
+void parse_http_response_headers(http_t *http, const char *data, ssize_t data_size) {
     int minor_version, status;
     const char *msg;
     size_t msg_len;
     struct phr_header headers[100];
     size_t num_headers = sizeof(headers) / sizeof(headers[0]);
 
-    int headers_size = phr_parse_response(http->data, http->data_size, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
+    int headers_size = phr_parse_response(data, data_size, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
     if (headers_size == -1) {
-        if (ERROR_LOG) fprintf(stderr, "parse_http_response: Unable to parse http response headers\n");
+        LOG_WARN("[%s %s] parse_http_response: Unable to parse http response headers", http->host, http->path);
         http_goes_error(http);
         return;
     }
@@ -173,7 +314,11 @@ void parse_http_response_headers(http_t *http) {
     if (headers_size >= 0) http->headers_size = headers_size;
 
     http->response_type = HTTP_RESPONSE_NONE;
+    http->max_age = http->stale_while_revalidate = http->stale_if_error = -1;
     for (int i = 0; i < num_headers; i++) {
+        if (strings_equal_by_length(headers[i].name, headers[i].name_len, "Cache-Control", strlen("Cache-Control"))) {
+            parse_cache_control(http, headers[i].value, headers[i].value_len);
+        }
         if (strings_equal_by_length(headers[i].name, headers[i].name_len, "Transfer-Encoding", strlen("Transfer-Encoding")) &&
         strings_equal_by_length(headers[i].value, headers[i].value_len, "chunked", strlen("chunked"))) {
             http->response_type = HTTP_RESPONSE_CHUNKED;
@@ -189,36 +334,63 @@ void parse_http_response_headers(http_t *http) {
     }
 }
 
+int is_negative_code(int code) {
+    return code == 301 || code == 404 || code == 410;
+}
+
+//errors are not cached over a stale copy, it is what clients get instead of them
+int http_is_cacheable(http_t *entry) {
+    if (entry->is_uncacheable) return FALSE;
+    if (entry->code == 200) return TRUE;
+    if (is_negative_code(entry->code)) return config.negative_ttl > 0;
+    return entry->code >= 500 && entry->code < 600 && config.error_ttl > 0 && entry->stale_entry == NULL;
+}
+
+//entry is added with its lifetimes once headers are known and follows data as it grows;
+//errors and redirects live for short ttl without stale windows unless origin says otherwise
+void http_update_cache_entry(http_t *entry, cache_t *cache) {
+    if (entry->cache_entry == NULL) {
+        entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
+        if (entry->cache_entry == NULL) {
+            entry->code = HTTP_CODE_NONE;
+            return;
+        }
+        int is_ok = entry->code == 200;
+        int ttl = is_ok ? config.cache_ttl : is_negative_code(entry->code) ? config.negative_ttl : config.error_ttl;
+        entry->cache_entry->code = entry->code;
+        entry->cache_entry->max_age = entry->max_age != -1 ? entry->max_age : ttl;
+        entry->cache_entry->stale_while_revalidate = entry->stale_while_revalidate != -1 ? entry->stale_while_revalidate : is_ok ? config.stale_while_revalidate : 0;
+        entry->cache_entry->stale_if_error = entry->stale_if_error != -1 ? entry->stale_if_error : is_ok ? config.stale_if_error : 0;
+        return;
+    }
+    write_lock_rwlock(&entry->cache_entry->rwlock, "http_update_cache_entry");
+    entry->cache_entry->data = entry->data;
+    entry->cache_entry->size = entry->data_size;
+    unlock_rwlock(&entry->cache_entry->rwlock, "http_update_cache_entry");
+}
+
+//complete response is offered to proxy processes sharing cache with this one too
+void http_complete_cache_entry(http_t *entry, cache_t *cache) {
+    if (entry->cache_entry == NULL) return;
+    cache_complete(entry->cache_entry, cache);
+    shmcache_store(entry->cache_entry);
+}
+
 void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize_t size, cache_t *cache) {
     size_t rsize = size;
     ssize_t pret;
 
     pret = phr_decode_chunked(&entry->decoder, buf + offset, &rsize);
     if (pret == -1) {
-        if (ERROR_LOG) fprintf(stderr, "parse_http_response_chunked: Unable to parse response\n");
+        LOG_WARN("[%s %s] parse_http_response_chunked: Unable to parse response", entry->host, entry->path);
         http_goes_error(entry);
         return;
     }
 
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: CODE 200");
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: CODE 200");
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
 
     if (pret == 0) {
-        if (entry->cache_entry != NULL) {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: FULL");
-            entry->cache_entry->is_full = TRUE;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_chunked: FULL");
-        }
+        http_complete_cache_entry(entry, cache);
         entry->is_response_complete = TRUE;
         char buf1[1] = { 1 };
         for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
@@ -226,31 +398,148 @@ void parse_http_response_chunked(http_t *entry, char *buf, ssize_t offset, ssize
 }
 
 void parse_http_response_by_length(http_t *entry, cache_t *cache) {
-    if (entry->code == 200) {
-        if (entry->cache_entry == NULL) {
-            entry->cache_entry = cache_add(entry->host, entry->path, entry->data, entry->data_size, cache);
-            if (entry->cache_entry == NULL) entry->code = HTTP_CODE_NONE;
-        }
-        else {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: CODE 200");
-            entry->cache_entry->data = entry->data;
-            entry->cache_entry->size = entry->data_size;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: CODE 200");
-        }
-    }
+    if (http_is_cacheable(entry)) http_update_cache_entry(entry, cache);
     if (entry->data_size == entry->headers_size + entry->response_size) {
-        if (entry->cache_entry != NULL) {
-            write_lock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: FULL");
-            entry->cache_entry->is_full = TRUE;
-            unlock_rwlock(&entry->cache_entry->rwlock, "parse_http_response_by_length: FULL");
-        }
+        http_complete_cache_entry(entry, cache);
         entry->is_response_complete = TRUE;
         char buf1[1] = { 1 };
         for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
     }
 }
 
+//upstream closed connection, called with write lock held
+void http_read_finished(http_t *entry, cache_t *cache) {
+    timer_cancel(&entry->timer);
+    entry->status = SOCK_DONE;
+    if (entry->response_type == HTTP_RESPONSE_NONE) {
+        entry->is_response_complete = TRUE;
+        http_complete_cache_entry(entry, cache);
+    }
+    http_close_upstream(entry);
+}
+
+ssize_t http_available_size(http_t *http) {
+    return http->data_size + http->passthrough_size;
+}
+
+#ifdef HTTP_SPLICE
+
+/*
+ * Uncacheable response of a single client needs no buffer: once headers and first part of body
+ * are in data, the rest goes upstream socket -> pipe -> client socket by splice, client drains
+ * the pipe after it has written data. Chunked bodies stay buffered, their end is found by decoder.
+ */
+void http_start_passthrough(http_t *entry) {
+    if (!config.passthrough || http_is_cacheable(entry) || entry->cache_entry != NULL || entry->stale_entry != NULL || entry->clients != 1 ||
+        entry->status != DOWNLOADING || entry->is_response_complete || entry->response_type == HTTP_RESPONSE_CHUNKED) return;
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        LOG_ERRNO("http_start_passthrough: Unable to create pipe");
+        return;     //response is just buffered as usual
+    }
+    entry->passthrough_read_fd = fds[0];
+    entry->passthrough_write_fd = fds[1];
+    entry->dont_accept_clients = TRUE;      //new clients would need the body from its start
+    STATS_INC(passthroughs);
+    LOG_DEBUG("[%d %s %s] Passing response %d through", entry->sock_fd, entry->host, entry->path, entry->code);
+}
+
+//EAGAIN after socket became readable means pipe is full, then http waits for pipe instead of socket
+void http_splice_data(http_t *entry, cache_t *cache) {
+    ssize_t limit = SPLICE_CHUNK_SIZE;
+    if (entry->response_type == HTTP_RESPONSE_CONTENT_LENGTH) {
+        ssize_t left = entry->headers_size + entry->response_size - http_available_size(entry);
+        if (left < limit) limit = left;
+    }
+
+    errno = 0;
+    ssize_t bytes_spliced = splice(entry->sock_fd, NULL, entry->passthrough_write_fd, NULL, limit, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes_spliced == -1 && errno == EAGAIN) {
+        entry->passthrough_pipe_full = TRUE;
+        return;
+    }
+
+    write_lock_rwlock(&entry->rwlock, "http_splice_data");
+    if (bytes_spliced == -1) {
+        LOG_ERRNO("http_splice_data: Unable to splice from http socket");
+        http_goes_error(entry);
+        unlock_rwlock(&entry->rwlock, "http_splice_data: -1");
+        return;
+    }
+
+    char buf1[1] = { 1 };
+    for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
+    if (bytes_spliced == 0) {
+        http_read_finished(entry, cache);
+        unlock_rwlock(&entry->rwlock, "http_splice_data: 0");
+        return;
+    }
+
+    entry->passthrough_size += bytes_spliced;
+    STATS_ADD(upstream_bytes_in, bytes_spliced);
+    STATS_ADD(spliced_bytes, bytes_spliced);
+    http_arm_timer(entry, config.upstream_idle_timeout);
+    if (entry->response_type == HTTP_RESPONSE_CONTENT_LENGTH && http_available_size(entry) == entry->headers_size + entry->response_size) {
+        entry->is_response_complete = TRUE;
+        timer_cancel(&entry->timer);
+        entry->status = SOCK_DONE;      //nothing else is read from this connection
+        http_close_upstream(entry);
+    }
+    unlock_rwlock(&entry->rwlock, "http_splice_data");
+}
+
+//called by client thread with read lock held, it is the only reader of pipe
+ssize_t http_splice_to_client(http_t *http, int client_sock_fd, ssize_t size) {
+    ssize_t bytes_spliced = splice(http->passthrough_read_fd, NULL, client_sock_fd, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes_spliced == -1 && errno == EAGAIN) return 0;
+    return bytes_spliced;
+}
+
+#else
+
+void http_start_passthrough(http_t *entry) { }
+
+void http_splice_data(http_t *entry, cache_t *cache) { }
+
+ssize_t http_splice_to_client(http_t *http, int client_sock_fd, ssize_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+//whole body of known length gets one buffer, others grow
+int http_reserve_data(http_t *entry, ssize_t size) {
+    if (entry->data != NULL && (ssize_t)body_capacity(entry->data) >= size) return 0;
+
+    char *data = NULL;
+    ssize_t response_size = entry->headers_size + entry->response_size;
+    if (entry->headers_size >= 0 && entry->response_type == HTTP_RESPONSE_CONTENT_LENGTH && response_size >= size) {
+        data = body_alloc(response_size);
+        if (data != NULL && entry->data != NULL) {
+            memcpy(data, entry->data, entry->data_size);
+            body_free(entry->data);
+        }
+    }
+    if (data == NULL) data = body_grow(entry->data, size);
+    if (data == NULL) return -1;
+    entry->data = data;
+    return 0;
+}
+
+//refused connect shows up either on write readiness or as error of first read
+void http_connect_failed(http_t *entry, cache_t *cache) {
+    STATS_INC(upstream_connect_errors);
+    if (config.error_ttl > 0 && !entry->is_peer_fetch) cache_host_failed(entry->host, config.error_ttl, cache);
+}
+
 void http_read_data(http_t *entry, cache_t *cache) {
+    if (entry->passthrough_write_fd != -1) {
+        http_splice_data(entry, cache);
+        return;
+    }
+
     char buf[BUF_SIZE];
     errno = 0;
     ssize_t bytes_read = recv(entry->sock_fd, buf, BUF_SIZE, MSG_DONTWAIT);
@@ -262,47 +551,51 @@ void http_read_data(http_t *entry, cache_t *cache) {
             return;
         }
 
-        if (ERROR_LOG) perror("http_read_data: Unable to read from http socket");
+        LOG_ERRNO("http_read_data: Unable to read from http socket");
+        if (entry->status == AWAITING_REQUEST && entry->request_bytes_written == 0) http_connect_failed(entry, cache);
         http_goes_error(entry);
         unlock_rwlock(&entry->rwlock, "http_read_data: -1");
         return;
     }
 
+    STATS_ADD(upstream_bytes_in, bytes_read);
     char buf1[1] = { 1 };
     for (int i = 0; i < entry->clients; i++) write(entry->http_pipe_fd, buf1, 1);
 
     if (bytes_read == 0) {
-        entry->status = SOCK_DONE;
-        if (entry->response_type == HTTP_RESPONSE_NONE) {
-            entry->is_response_complete = TRUE;
-            if (entry->cache_entry != NULL) entry->cache_entry->is_full = TRUE;
-        }
-        close_socket(&entry->sock_fd);
+        http_read_finished(entry, cache);
         unlock_rwlock(&entry->rwlock, "http_read_data: 0");
         return;
     }
 
     if (entry->status != DOWNLOADING) {
-        if (ERROR_LOG) fprintf(stderr, "read_http_data: reading from http when we shouldn't\n");
+        LOG_WARN("read_http_data: reading from http when we shouldn't");
         if (INFO_LOG) write(STDERR_FILENO, buf, bytes_read);
         unlock_rwlock(&entry->rwlock, "http_read_data: !DOWNLOADING");
         return;
     }
 
-    char *check = (char *)realloc(entry->data, entry->data_size + BUF_SIZE);
-    if (check == NULL) {
-        if (ERROR_LOG) perror("read_http_data: Unable to reallocate memory for http data");
+    //headers of first read are parsed in place, so buffer is sized by Content-Length before anything is stored
+    int b_no_headers = entry->headers_size == HTTP_NO_HEADERS;
+    int b_first_read = entry->data_size == 0;
+    if (b_no_headers && b_first_read) parse_http_response_headers(entry, buf, bytes_read);
+    if (entry->status == SOCK_ERROR) {
+        unlock_rwlock(&entry->rwlock, "http_read_data: SOCK ERROR");
+        return;
+    }
+
+    if (http_reserve_data(entry, entry->data_size + bytes_read) == -1) {
+        LOG_ERRNO("read_http_data: Unable to reallocate memory for http data");
         http_goes_error(entry);
         unlock_rwlock(&entry->rwlock, "http_read_data: CHECK NULL");
         return;
     }
 
-    entry->data = check;
     memcpy(entry->data + entry->data_size, buf, bytes_read);
     entry->data_size += bytes_read;
+    http_arm_timer(entry, config.upstream_idle_timeout);
 
-    int b_no_headers = entry->headers_size == HTTP_NO_HEADERS;
-    if (entry->headers_size == HTTP_NO_HEADERS) parse_http_response_headers(entry);
+    if (b_no_headers && !b_first_read) parse_http_response_headers(entry, entry->data, entry->data_size);
     if (entry->status == SOCK_ERROR) {
         unlock_rwlock(&entry->rwlock, "http_read_data: SOCK ERROR");
         return;
@@ -315,22 +608,61 @@ void http_read_data(http_t *entry, cache_t *cache) {
         else if (entry->response_type == HTTP_RESPONSE_CONTENT_LENGTH) {
             parse_http_response_by_length(entry, cache);
         }
+        if (entry->status == DOWNLOADING) http_start_passthrough(entry);
     }
 
     unlock_rwlock(&entry->rwlock, "http_read_data: END");
 }
 
-void http_send_request(http_t *entry) {
+//slot was granted while http waited, socket is opened by worker that owns http
+void http_connect_granted(http_t *entry, cache_t *cache) {
+    long long connect_start_us = stats_now_us();
+    int sock_fd = http_open_host_socket(entry->host);
+    STATS_ADD(upstream_connect_time, stats_now_us() - connect_start_us);
+
+    write_lock_rwlock(&entry->rwlock, "http_connect_granted");
+    if (sock_fd == -1) {
+        http_connect_failed(entry, cache);
+        http_goes_error(entry);
+    }
+    else {
+        STATS_INC(upstream_connects);
+        entry->sock_fd = sock_fd;
+        http_arm_timer(entry, config.connect_timeout);
+    }
+    unlock_rwlock(&entry->rwlock, "http_connect_granted");
+}
+
+void http_send_request(http_t *entry, cache_t *cache) {
+    int connect_error = entry->request_bytes_written == 0 ? get_connect_error(entry->sock_fd) : 0;
+    if (connect_error != 0) {
+        errno = connect_error;
+        LOG_ERRNO("[%s] http_send_request: unable to connect", entry->host);
+        http_connect_failed(entry, cache);
+        write_lock_rwlock(&entry->rwlock, "http_send_request: CONNECT");
+        http_goes_error(entry);
+        unlock_rwlock(&entry->rwlock, "http_send_request: CONNECT");
+        return;
+    }
+
     ssize_t bytes_written = write(entry->sock_fd, entry->request + entry->request_bytes_written, entry->request_size - entry->request_bytes_written);
-    if (bytes_written >= 0) entry->request_bytes_written += bytes_written;
+    if (bytes_written >= 0) {
+        entry->request_bytes_written += bytes_written;
+        STATS_ADD(upstream_bytes_out, bytes_written);
+    }
     write_lock_rwlock(&entry->rwlock, "http_send_request");
     if (entry->request_bytes_written == entry->request_size) {
         entry->status = DOWNLOADING;
         entry->request_size = 0;
-        free_with_null((void **)&entry->request);
+        body_free(entry->request);
+        entry->request = NULL;
+        http_arm_timer(entry, config.first_byte_timeout);
+        char buf1[1] = { 1 };
+        if (entry->is_body_streaming) write(entry->http_pipe_fd, buf1, 1);     //client may send body now
     }
+    else if (bytes_written > 0) http_arm_timer(entry, config.upstream_idle_timeout);
     if (bytes_written == -1) {
-        if (ERROR_LOG) perror("http_send_request: unable to write to http socket");
+        LOG_ERRNO("http_send_request: unable to write to http socket");
         http_goes_error(entry);
     }
     unlock_rwlock(&entry->rwlock, "http_send_request");
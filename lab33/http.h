@@ -5,16 +5,29 @@
 #ifndef LAB33_HTTP_H
 #define LAB33_HTTP_H
 
-http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, http_queue_t *http_queue);
+//who http is started for; background ones begin without clients
+#define HTTP_FOREGROUND 0
+#define HTTP_REVALIDATION 1     //refreshes its stale_entry
+#define HTTP_WARMUP 2           //fetched by cache warm-up, see warm.h
+#define HTTP_PEER 3             //miss of client fetched from another proxy node, see peer.h
+
+http_t *create_http(int sock_fd, char *request, ssize_t request_size, char *host, char *path, int is_upload, int is_body_streaming,
+                    cache_entry_t *stale_entry, int background, http_queue_t *http_queue);
 void remove_http(http_t *http, http_list_t *http_list, http_list_t *global_http_list, cache_t *cache);
 
 int http_init(http_t *http, int sock_fd, char *request, ssize_t request_size, char *host, char *path);
 void http_destroy(http_t *http, cache_t *cache);
 
 int http_check_disconnect(http_t *http);
+const char *get_host_error(int err_code);
 int http_open_socket(const char *hostname, int port);
+int http_open_host_socket(const char *host);
 
 void http_read_data(http_t *entry, cache_t *cache);
-void http_send_request(http_t *entry);
+ssize_t http_available_size(http_t *http);
+ssize_t http_splice_to_client(http_t *http, int client_sock_fd, ssize_t size);
+void http_connect_granted(http_t *entry, cache_t *cache);
+void http_send_request(http_t *entry, cache_t *cache);
+void http_start_timer(http_t *http, timer_wheel_t *timer_wheel);
 
 #endif
@@ -161,7 +161,8 @@ void client_enqueue(client_t *client, client_queue_t *client_queue) {
     //pthread_cond_broadcast(&client_queue->cond);
 
     char buf1[1] = { 1 };
-    write(client_queue->wakeup_pipe_fd, buf1, 4);
+    if (client->worker >= 0) write(client_queue->steer_pipe_fds[client->worker], buf1, 1);
+    else write(client_queue->wakeup_pipe_fd, buf1, 4);
 
     pthread_mutex_unlock(&client_queue->mutex);
 }
@@ -184,11 +185,14 @@ client_t *client_dequeue(client_queue_t *client_queue, int num, int idx, int *cu
 
     *cur_thr = (*cur_thr + 1) % (total_thr);*/
 
-    if (client_queue->head != NULL /*&& num <= client_queue->max_num*/) {
-        new_client = client_queue->tail;
-        client_queue->tail = client_queue->tail->prev;
-        if (client_queue->tail != NULL) client_queue->tail->next = NULL;
-        else client_queue->head = NULL;
+    //oldest client that is not steered to another worker
+    new_client = client_queue->tail;
+    while (new_client != NULL && new_client->worker >= 0 && new_client->worker != idx) new_client = new_client->prev;
+    if (new_client != NULL /*&& num <= client_queue->max_num*/) {
+        if (new_client->prev != NULL) new_client->prev->next = new_client->next;
+        else client_queue->head = new_client->next;
+        if (new_client->next != NULL) new_client->next->prev = new_client->prev;
+        else client_queue->tail = new_client->prev;
     }/*
     else if (client_queue->head != NULL) {
         char buf1[1] = { 1 };
@@ -199,3 +203,12 @@ client_t *client_dequeue(client_queue_t *client_queue, int num, int idx, int *cu
     pthread_mutex_unlock(&client_queue->mutex);
     return new_client;
 }
+
+//there is a client worker idx may take from queue
+int client_queue_has_client(client_queue_t *client_queue, int idx) {
+    pthread_mutex_lock(&client_queue->mutex);
+    client_t *client = client_queue->tail;
+    while (client != NULL && client->worker >= 0 && client->worker != idx) client = client->prev;
+    pthread_mutex_unlock(&client_queue->mutex);
+    return client != NULL;
+}
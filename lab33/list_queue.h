@@ -20,5 +20,6 @@ http_t *http_dequeue(http_queue_t *http_queue, int num, int idx, int *cur_thr, i
 
 void client_enqueue(client_t *client, client_queue_t *client_queue);
 client_t *client_dequeue(client_queue_t *client_queue, int num, int idx, int *cur_thr, int total_thr);
+int client_queue_has_client(client_queue_t *client_queue, int idx);
 
 #endif
@@ -0,0 +1,26 @@
+#include <pthread.h>
+
+#ifndef LAB33_LOCKPROF_H
+#define LAB33_LOCKPROF_H
+
+#define LOCKPROF_TABLE_SIZE 256     //call-site tags per thread, power of two
+#define LOCKPROF_HELD_DEPTH 16      //nested locks tracked for hold time
+#define LOCKPROF_REPORT_TOP 25
+
+/*
+ * Contention profiler behind read_lock_rwlock/write_lock_rwlock/unlock_rwlock.
+ * Every acquisition tries the lock first, only a failed try is timed as a wait.
+ * Hold time is charged to the tag of the acquiring call site.
+ * Stats live in per-thread tables, so profiling adds no shared writes.
+ */
+
+extern volatile int lockprof_enabled;
+
+int lockprof_rdlock(pthread_rwlock_t *rwlock, const char *tag);
+int lockprof_wrlock(pthread_rwlock_t *rwlock, const char *tag);
+void lockprof_unlocked(pthread_rwlock_t *rwlock);
+
+void lockprof_reset();
+void lockprof_print_report();
+
+#endif
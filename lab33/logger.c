@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "logger.h"
+#include "states.h"
+
+#define LOG_LEVEL_ACCESS 4  //access lines are written to stdout with info lines
+
+typedef struct log_record {
+    int level;
+    long long time_us;
+    char text[LOG_LINE_SIZE];
+} log_record_t;
+
+typedef struct log_ring {
+    log_record_t records[LOG_RING_SIZE];
+    volatile unsigned int head;     //written only by owner thread
+    volatile unsigned int tail;     //written only by writer thread
+    unsigned long long dropped;
+    struct log_ring *next;
+} log_ring_t;
+
+typedef struct log_batch {
+    char data[LOG_BATCH_SIZE];
+    size_t size;
+    int fd;
+} log_batch_t;
+
+volatile int log_level = LOG_LEVEL_INFO;
+
+static __thread log_ring_t *thread_ring = NULL;
+static log_ring_t *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer_thread;
+static volatile int writer_running = FALSE;
+static unsigned long long reported_dropped = 0;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG", "ACCESS" };
+
+int log_parse_level(const char *name) {
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char *log_level_name(int level) {
+    if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_ACCESS) return "UNKNOWN";
+    return level_names[level];
+}
+
+long long log_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void log_register_thread() {
+    if (thread_ring != NULL) return;
+    log_ring_t *ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+    if (ring == NULL) {
+        if (ERROR_LOG) perror("log_register_thread: Unable to allocate memory for log ring");
+        return;     //thread keeps logging synchronously
+    }
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    thread_ring = ring;
+}
+
+void log_push(int level, const char *text) {
+    log_ring_t *ring = thread_ring;
+    if (ring == NULL || !writer_running) {
+        fprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, "%s %s\n", log_level_name(level), text);
+        return;
+    }
+
+    unsigned int head = ring->head;
+    if (head - ring->tail >= LOG_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+
+    log_record_t *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->level = level;
+    record->time_us = log_now_us();
+    strcpy(record->text, text);
+
+    __sync_synchronize();   //record must be visible before writer sees new head
+    ring->head = head + 1;
+}
+
+void log_write(int level, int err_code, const char *format, ...) {
+    char text[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0) return;
+    if (length >= (int)sizeof(text)) length = sizeof(text) - 1;
+
+    if (err_code != 0 && length < (int)sizeof(text) - 3) {
+        char err_buf[128];
+        if (strerror_r(err_code, err_buf, sizeof(err_buf)) != 0) strcpy(err_buf, "(unable to generate error!)");
+        snprintf(text + length, sizeof(text) - length, ": %s", err_buf);
+    }
+    log_push(level, text);
+}
+
+void log_access(const char *client, const char *host, const char *path, int status, long long bytes, long long duration_us, const char *source) {
+    if (!INFO_LOG || !LOG_ENABLED(LOG_LEVEL_INFO)) return;
+    char url[LOG_LINE_SIZE / 2];
+    if (host == NULL) strcpy(url, "-");    //proxy generated response
+    else snprintf(url, sizeof(url), "http://%s%s", host, path == NULL ? "" : path);
+
+    char text[LOG_LINE_SIZE];
+    snprintf(text, sizeof(text), "client=%s url=%s status=%d bytes=%lld duration_ms=%.3f source=%s",
+             client, url, status, bytes, duration_us / 1000.0, source);
+    log_push(LOG_LEVEL_ACCESS, text);
+}
+
+void log_batch_flush(log_batch_t *batch) {
+    size_t offset = 0;
+    while (offset < batch->size) {
+        ssize_t bytes_written = write(batch->fd, batch->data + offset, batch->size - offset);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            break;      //nowhere to report it, drop the batch
+        }
+        offset += bytes_written;
+    }
+    batch->size = 0;
+}
+
+void log_batch_append(log_batch_t *batch, const log_record_t *record) {
+    if (batch->size + LOG_LINE_SIZE + 64 > LOG_BATCH_SIZE) log_batch_flush(batch);
+
+    time_t seconds = (time_t)(record->time_us / 1000000);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    size_t length = strftime(batch->data + batch->size, LOG_BATCH_SIZE - batch->size, "%Y-%m-%d %H:%M:%S", &tm);
+    batch->size += length;
+
+    int written = snprintf(batch->data + batch->size, LOG_BATCH_SIZE - batch->size, ".%03d %s %s\n",
+                           (int)(record->time_us % 1000000 / 1000), log_level_name(record->level), record->text);
+    if (written > 0) batch->size += written;
+}
+
+//returns number of records taken from rings
+int log_drain(log_batch_t *out_batch, log_batch_t *err_batch) {
+    int taken = 0;
+    unsigned long long dropped = 0;
+
+    pthread_mutex_lock(&rings_mutex);   //only guards ring list against registration, not records
+    for (log_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        unsigned int head = ring->head;
+        __sync_synchronize();
+        unsigned int tail = ring->tail;
+
+        while (tail != head) {
+            log_record_t *record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+            log_batch_append(record->level <= LOG_LEVEL_WARN ? err_batch : out_batch, record);
+            tail++;
+            taken++;
+        }
+
+        __sync_synchronize();   //record is copied before owner may reuse its slot
+        ring->tail = tail;
+        dropped += ring->dropped;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if (dropped != reported_dropped) {
+        char text[128];
+        int length = snprintf(text, sizeof(text), "WARN logger: %llu records dropped, rings were full\n", dropped - reported_dropped);
+        if (length > 0 && err_batch->size + length < LOG_BATCH_SIZE) {
+            memcpy(err_batch->data + err_batch->size, text, length);
+            err_batch->size += length;
+        }
+        reported_dropped = dropped;
+    }
+
+    log_batch_flush(out_batch);
+    log_batch_flush(err_batch);
+    return taken;
+}
+
+void *log_writer(void *param) {
+    log_batch_t *batches = (log_batch_t *)param;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000 * 1000 };
+
+    while (writer_running) {
+        if (log_drain(&batches[0], &batches[1]) == 0) nanosleep(&interval, NULL);
+    }
+    log_drain(&batches[0], &batches[1]);
+    return NULL;
+}
+
+int log_init(int level) {
+    log_level = level;
+
+    log_batch_t *batches = (log_batch_t *)calloc(2, sizeof(log_batch_t));
+    if (batches == NULL) {
+        perror("log_init: Unable to allocate memory for log batches");
+        return -1;
+    }
+    batches[0].fd = STDOUT_FILENO;
+    batches[1].fd = STDERR_FILENO;
+
+    writer_running = TRUE;
+    int err_code = pthread_create(&writer_thread, NULL, log_writer, batches);
+    if (err_code != 0) {
+        print_error("log_init: Unable to create writer thread", err_code);
+        writer_running = FALSE;
+        free(batches);
+        return -1;
+    }
+    log_register_thread();
+    return 0;
+}
+
+//must be called when no other thread logs anymore
+void log_destroy() {
+    if (!writer_running) return;
+    fflush(stdout);
+    writer_running = FALSE;
+
+    void *batches;
+    pthread_join(writer_thread, &batches);
+    free(batches);
+
+    log_ring_t *ring = rings;
+    while (ring != NULL) {
+        log_ring_t *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    rings = NULL;
+    thread_ring = NULL;
+}
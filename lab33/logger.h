@@ -0,0 +1,41 @@
+#include <errno.h>
+
+#ifndef LAB33_LOGGER_H
+#define LAB33_LOGGER_H
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_RING_SIZE 512           //records per thread, power of two
+#define LOG_LINE_SIZE 256
+#define LOG_FLUSH_INTERVAL_MS 50
+#define LOG_BATCH_SIZE (64 * 1024)
+
+extern volatile int log_level;
+
+/*
+ * Every registered thread formats records into its own single-producer ring,
+ * background writer thread drains all rings and writes them with one write() per batch.
+ * Records are dropped (and counted) when ring is full, event loops never block on output.
+ */
+
+#define LOG_ENABLED(LEVEL) ((LEVEL) <= log_level)
+#define LOG_ERROR(...) do { if (ERROR_LOG && LOG_ENABLED(LOG_LEVEL_ERROR)) log_write(LOG_LEVEL_ERROR, 0, __VA_ARGS__); } while (0)
+#define LOG_ERRNO(...) do { if (ERROR_LOG && LOG_ENABLED(LOG_LEVEL_ERROR)) log_write(LOG_LEVEL_ERROR, errno, __VA_ARGS__); } while (0)
+#define LOG_WARN(...) do { if (ERROR_LOG && LOG_ENABLED(LOG_LEVEL_WARN)) log_write(LOG_LEVEL_WARN, 0, __VA_ARGS__); } while (0)
+#define LOG_INFO(...) do { if (INFO_LOG && LOG_ENABLED(LOG_LEVEL_INFO)) log_write(LOG_LEVEL_INFO, 0, __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) do { if (INFO_LOG && LOG_ENABLED(LOG_LEVEL_DEBUG)) log_write(LOG_LEVEL_DEBUG, 0, __VA_ARGS__); } while (0)
+
+int log_init(int level);
+void log_register_thread();
+void log_destroy();
+
+int log_parse_level(const char *name);
+const char *log_level_name(int level);
+
+void log_write(int level, int err_code, const char *format, ...);
+void log_access(const char *client, const char *host, const char *path, int status, long long bytes, long long duration_us, const char *source);
+
+#endif
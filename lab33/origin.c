@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "origin.h"
+#include "states.h"
+#include "config.h"
+#include "stats.h"
+#include "logger.h"
+
+typedef struct origin {
+    char *host;
+    int active;
+    http_t *head, *tail;    //waiting https, first came is first served
+    struct origin *next;
+} origin_t;
+
+static origin_t *origins = NULL;
+static origin_t *cursor = NULL;     //host that got last slot, next one starts round after it
+static int total_active = 0;
+static pthread_mutex_t origins_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int origin_is_limited() {
+    return config.origin_connections > 0 || config.upstream_connections > 0;
+}
+
+origin_t *find_origin(const char *host, int create) {
+    for (origin_t *origin = origins; origin != NULL; origin = origin->next) {
+        if (STR_EQ(origin->host, host)) return origin;
+    }
+    if (!create) return NULL;
+
+    origin_t *origin = (origin_t *)calloc(1, sizeof(origin_t));
+    if (origin == NULL || (origin->host = strdup(host)) == NULL) {
+        LOG_ERRNO("find_origin: Unable to allocate memory for origin");
+        free(origin);
+        return NULL;
+    }
+    origin->next = origins;
+    origins = origin;
+    return origin;
+}
+
+void free_origin_if_unused(origin_t *origin) {
+    if (origin->active > 0 || origin->head != NULL) return;
+    origin_t **cur = &origins;
+    while (*cur != origin) cur = &(*cur)->next;
+    *cur = origin->next;
+    if (cursor == origin) cursor = NULL;
+    free(origin->host);
+    free(origin);
+}
+
+int has_room(origin_t *origin) {
+    return (config.origin_connections == 0 || origin->active < config.origin_connections) &&
+           (config.upstream_connections == 0 || total_active < config.upstream_connections);
+}
+
+void take_slot(origin_t *origin) {
+    origin->active++;
+    total_active++;
+}
+
+//first waiting http of host gets slot, its worker is woken to open socket
+void grant(origin_t *origin) {
+    http_t *http = origin->head;
+    origin->head = http->origin_next;
+    if (origin->head == NULL) origin->tail = NULL;
+    http->origin_next = NULL;
+    http->origin_state = ORIGIN_GRANTED;
+    take_slot(origin);
+    STATS_INC(origin_dequeued);
+    STATS_ADD(origin_wait_time, stats_now_us() - http->origin_wait_start_us);
+    char buf1[1] = { 1 };
+    write(http->client_pipe_fd, buf1, 1);
+}
+
+//hands out free slots one host at a time, starting after the host served last
+void dispatch() {
+    while (origins != NULL) {
+        origin_t *start = cursor != NULL && cursor->next != NULL ? cursor->next : origins;
+        origin_t *origin = start, *found = NULL;
+        do {
+            if (origin->head != NULL && has_room(origin)) {
+                found = origin;
+                break;
+            }
+            origin = origin->next != NULL ? origin->next : origins;
+        } while (origin != start);
+
+        if (found == NULL) return;
+        grant(found);
+        cursor = found;
+    }
+}
+
+void release_slot(origin_t *origin) {
+    origin->active--;
+    total_active--;
+    dispatch();
+    free_origin_if_unused(origin);
+}
+
+//TRUE if caller may connect now; host with waiters keeps their order
+int origin_admit(const char *host) {
+    if (!origin_is_limited()) return TRUE;
+    pthread_mutex_lock(&origins_mutex);
+    origin_t *origin = find_origin(host, TRUE);
+    int is_admitted = origin == NULL || (origin->head == NULL && has_room(origin));
+    if (is_admitted && origin != NULL) take_slot(origin);
+    pthread_mutex_unlock(&origins_mutex);
+    return is_admitted;
+}
+
+//admitted connection could not be opened
+void origin_cancel(const char *host) {
+    if (!origin_is_limited()) return;
+    pthread_mutex_lock(&origins_mutex);
+    origin_t *origin = find_origin(host, FALSE);
+    if (origin != NULL) release_slot(origin);
+    pthread_mutex_unlock(&origins_mutex);
+}
+
+//counted regardless of limits
+void origin_enter(const char *host) {
+    if (!origin_is_limited()) return;
+    pthread_mutex_lock(&origins_mutex);
+    origin_t *origin = find_origin(host, TRUE);
+    if (origin != NULL) take_slot(origin);
+    pthread_mutex_unlock(&origins_mutex);
+}
+
+//slot freed since origin_admit refused is taken right away, else http joins queue of its host
+void origin_wait(http_t *http) {
+    pthread_mutex_lock(&origins_mutex);
+    origin_t *origin = find_origin(http->host, TRUE);
+    http->origin_wait_start_us = stats_now_us();
+    STATS_INC(origin_queued);
+    http->origin_state = ORIGIN_WAITING;
+    http->origin_next = NULL;
+    if (origin == NULL) {
+        http->origin_state = ORIGIN_GRANTED;     //no memory to track host, it goes unlimited
+        STATS_INC(origin_dequeued);
+    }
+    else {
+        if (origin->tail != NULL) origin->tail->origin_next = http;
+        else origin->head = http;
+        origin->tail = http;
+        dispatch();
+    }
+    pthread_mutex_unlock(&origins_mutex);
+}
+
+//TRUE once for http that got slot while waiting
+int origin_take_grant(http_t *http) {
+    pthread_mutex_lock(&origins_mutex);
+    int is_granted = http->origin_state == ORIGIN_GRANTED;
+    if (is_granted) http->origin_state = ORIGIN_ACTIVE;
+    pthread_mutex_unlock(&origins_mutex);
+    return is_granted;
+}
+
+//http closes its upstream or gives up waiting, slot goes to next waiter
+void origin_leave(http_t *http) {
+    pthread_mutex_lock(&origins_mutex);
+    origin_t *origin = http->origin_state != ORIGIN_NONE ? find_origin(http->host, FALSE) : NULL;
+    if (origin != NULL && http->origin_state == ORIGIN_WAITING) {
+        http_t **cur = &origin->head, *prev = NULL;
+        while (*cur != NULL && *cur != http) {
+            prev = *cur;
+            cur = &(*cur)->origin_next;
+        }
+        if (*cur == http) {
+            *cur = http->origin_next;
+            if (origin->tail == http) origin->tail = prev;
+            STATS_INC(origin_dequeued);
+            STATS_ADD(origin_wait_time, stats_now_us() - http->origin_wait_start_us);
+        }
+        free_origin_if_unused(origin);
+    }
+    else if (origin != NULL) release_slot(origin);
+    http->origin_state = ORIGIN_NONE;
+    http->origin_next = NULL;
+    pthread_mutex_unlock(&origins_mutex);
+}
+
+void origin_destroy() {
+    pthread_mutex_lock(&origins_mutex);
+    while (origins != NULL) {
+        origin_t *next = origins->next;
+        free(origins->host);
+        free(origins);
+        origins = next;
+    }
+    cursor = NULL;
+    total_active = 0;
+    pthread_mutex_unlock(&origins_mutex);
+}
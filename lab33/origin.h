@@ -0,0 +1,27 @@
+#include "types.h"
+
+#ifndef LAB33_ORIGIN_H
+#define LAB33_ORIGIN_H
+
+#define ORIGIN_NONE 0       //not counted, limits are off
+#define ORIGIN_WAITING 1    //in queue of its host, has no socket yet
+#define ORIGIN_GRANTED 2    //holds slot, socket is opened by worker that owns http
+#define ORIGIN_ACTIVE 3     //holds slot and socket
+
+/*
+ * Upstream connections are capped per host and in total. Http that finds no free slot waits
+ * without socket in FIFO queue of its host. Freed slot goes to hosts with waiters in
+ * round-robin order, so a slow origin holds at most its own cap and cannot starve the rest.
+ * Uploads are counted but never wait, their client streams body right away.
+ */
+
+int origin_is_limited();
+int origin_admit(const char *host);
+void origin_cancel(const char *host);
+void origin_enter(const char *host);
+void origin_wait(http_t *http);
+int origin_take_grant(http_t *http);
+void origin_leave(http_t *http);
+void origin_destroy();
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Microbenchmark of picohttpparser header scanning for every SIMD level the CPU supports.
+ *
+ * Usage: parser_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "picohttpparser.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define MAX_HEADERS 100
+
+static const char request[] =
+    "GET /wp-content/uploads/2010/03/hello-kitty-darth-vader-pink.jpg HTTP/1.1\r\n"
+    "Host: www.kittyhell.com\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; U; Intel Mac OS X 10_6_3; ja-JP-mac; rv:1.9.2.3) Gecko/20100401 Firefox/3.6.3 "
+    "Pathtraq/0.9\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: ja,en-us;q=0.7,en;q=0.3\r\n"
+    "Accept-Encoding: gzip,deflate\r\n"
+    "Accept-Charset: Shift_JIS,utf-8;q=0.7,*;q=0.7\r\n"
+    "Keep-Alive: 115\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: wp_ozh_wsa_visits=2; wp_ozh_wsa_visit_lasttime=xxxxxxxxxx; "
+    "__utma=xxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.xxxxxxxxxx.x; "
+    "__utmz=xxxxxxxxx.xxxxxxxxxx.x.x.utmccn=(referral)|utmcsr=reader.livedoor.com|utmcct=/reader/|utmcmd=referral\r\n"
+    "\r\n";
+
+static const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 23 May 2005 22:38:34 GMT\r\n"
+    "Content-Type: text/html; charset=UTF-8\r\n"
+    "Content-Length: 138\r\n"
+    "Last-Modified: Wed, 08 Jan 2003 23:11:55 GMT\r\n"
+    "Server: Apache/1.3.3.7 (Unix) (Red-Hat/Linux)\r\n"
+    "ETag: \"3f80f-1b6-3e1cb03b\"\r\n"
+    "Cache-Control: public, max-age=31536000, stale-while-revalidate=86400\r\n"
+    "Set-Cookie: session=0123456789abcdef0123456789abcdef; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+    "Vary: Accept-Encoding, User-Agent\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char *level_names[] = { "scalar", "sse4.2", "avx2" };
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//returns sum of parsed lengths, it is compared between levels and keeps the loop from being optimized out
+size_t parse_request_once() {
+    const char *method, *path;
+    size_t method_len, path_len, num_headers = MAX_HEADERS;
+    int minor_version;
+    struct phr_header headers[MAX_HEADERS];
+
+    int size = phr_parse_request(request, sizeof(request) - 1, &method, &method_len, &path, &path_len, &minor_version, headers, &num_headers, 0);
+    if (size <= 0) return 0;
+    size_t sum = size + method_len + path_len + num_headers;
+    for (size_t i = 0; i < num_headers; i++) sum += headers[i].name_len + headers[i].value_len;
+    return sum;
+}
+
+size_t parse_response_once() {
+    const char *msg;
+    size_t msg_len, num_headers = MAX_HEADERS;
+    int minor_version, status;
+    struct phr_header headers[MAX_HEADERS];
+
+    int size = phr_parse_response(response, sizeof(response) - 1, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
+    if (size <= 0) return 0;
+    size_t sum = size + status + msg_len + num_headers;
+    for (size_t i = 0; i < num_headers; i++) sum += headers[i].name_len + headers[i].value_len;
+    return sum;
+}
+
+double run(size_t (*parse_once)(), long iterations, size_t *checksum) {
+    volatile size_t sink = 0;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) sink += parse_once();
+    double elapsed = now_seconds() - start;
+    *checksum = parse_once();
+    (void)sink;
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int default_level = phr_get_simd_level(), best_level = phr_get_max_simd_level();
+    printf("default: %s, supported up to: %s, iterations: %ld\n", level_names[default_level], level_names[best_level], iterations);
+    printf("%-8s %12s %10s %8s %12s %10s %8s\n", "level", "request ns", "MB/s", "speedup", "response ns", "MB/s", "speedup");
+
+    double scalar_request = 0, scalar_response = 0;
+    size_t expected_request = 0, expected_response = 0;
+    int result = EXIT_SUCCESS;
+
+    for (int level = PHR_SIMD_SCALAR; level <= best_level; level++) {
+        if (phr_set_simd_level(level) == -1) continue;  //sse4.2 builds have no scalar scanner
+
+        size_t request_checksum, response_checksum;
+        run(parse_request_once, iterations / 10, &request_checksum);   //warm up
+        double request_time = run(parse_request_once, iterations, &request_checksum);
+        double response_time = run(parse_response_once, iterations, &response_checksum);
+
+        if (expected_request == 0) {
+            expected_request = request_checksum;
+            expected_response = response_checksum;
+            scalar_request = request_time;
+            scalar_response = response_time;
+        }
+        if (request_checksum != expected_request || response_checksum != expected_response || request_checksum == 0) {
+            fprintf(stderr, "%s: parse results differ from first level\n", level_names[level]);
+            result = EXIT_FAILURE;
+        }
+
+        printf("%-8s %12.1f %10.1f %7.2fx %12.1f %10.1f %7.2fx\n", level_names[level],
+               request_time / iterations * 1e9, (sizeof(request) - 1) * iterations / request_time / 1e6, scalar_request / request_time,
+               response_time / iterations * 1e9, (sizeof(response) - 1) * iterations / response_time / 1e6, scalar_response / response_time);
+    }
+    return result;
+}
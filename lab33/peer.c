@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "peer.h"
+#include "http.h"
+#include "url.h"
+#include "stats.h"
+#include "config.h"
+#include "logger.h"
+
+#define SELF (-1)       //ring point of this node
+
+typedef struct peer {
+    char *name;                 //host:port of its listener, queries go to same port over UDP
+    struct sockaddr_in addr;
+} peer_t;
+
+typedef struct ring_point {
+    unsigned long long position;
+    int node;                   //index in peers or SELF
+} ring_point_t;
+
+//query socket of one worker, replies to its queries come back only there
+typedef struct query_socket {
+    int sock_fd;
+    unsigned int next_id;
+} query_socket_t;
+
+static struct {
+    peer_t peers[PEER_MAX];
+    int size;
+    ring_point_t *ring;
+    int ring_size;
+    pthread_key_t query_key;
+} nodes = { .size = 0, .ring = NULL, .ring_size = 0 };
+
+unsigned long long peer_mix(unsigned long long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+unsigned long long point_position(const char *name, int vnode) {
+    char key[HOSTNAME_MAX_SIZE + 16];
+    int length = snprintf(key, sizeof(key), "%s#%d", name, vnode);
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < length && i < (int)sizeof(key) - 1; i++) hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return peer_mix(hash);
+}
+
+int compare_points(const void *point1, const void *point2) {
+    unsigned long long position1 = ((const ring_point_t *)point1)->position, position2 = ((const ring_point_t *)point2)->position;
+    return position1 < position2 ? -1 : position1 > position2;
+}
+
+int peer_resolve(const char *name, struct sockaddr_in *addr) {
+    const char *delim = strrchr(name, ':');
+    int port = delim == NULL ? -1 : get_number_from_string_by_length(delim + 1, strlen(delim + 1));
+    if (!IS_PORT_VALID(port) || delim - name >= HOSTNAME_MAX_SIZE) {
+        LOG_ERROR("Peer '%s' is not host:port", name);
+        return -1;
+    }
+    char hostname[HOSTNAME_MAX_SIZE];
+    memcpy(hostname, name, delim - name);
+    hostname[delim - name] = '\0';
+
+    int err_code;
+    struct hostent *host = getipnodebyname(hostname, AF_INET, 0, &err_code);
+    if (host == NULL) {
+        LOG_ERROR("Unable to resolve peer %s: %s", name, get_host_error(err_code));
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    memcpy(&addr->sin_addr.s_addr, host->h_addr_list[0], sizeof(struct in_addr));
+    freehostent(host);
+    return 0;
+}
+
+void close_query_socket(void *value) {
+    query_socket_t *query = (query_socket_t *)value;
+    close(query->sock_fd);
+    free(query);
+}
+
+int build_ring(const char *self_name) {
+    nodes.ring_size = (nodes.size + 1) * PEER_VNODES;
+    nodes.ring = (ring_point_t *)malloc(sizeof(ring_point_t) * nodes.ring_size);
+    if (nodes.ring == NULL) {
+        LOG_ERRNO("build_ring: Unable to allocate memory for hash ring");
+        return -1;
+    }
+    for (int node = SELF; node < nodes.size; node++) {
+        const char *name = node == SELF ? self_name : nodes.peers[node].name;
+        for (int i = 0; i < PEER_VNODES; i++) {
+            ring_point_t *point = &nodes.ring[(node + 1) * PEER_VNODES + i];
+            point->position = point_position(name, i);
+            point->node = node;
+        }
+    }
+    qsort(nodes.ring, nodes.ring_size, sizeof(ring_point_t), compare_points);
+    return 0;
+}
+
+//parses config.peers; entry equal to this node's name is skipped, so all nodes may share one list
+int peer_init(int listen_port) {
+    if (config.peers == NULL) return 0;
+    char self_name[HOSTNAME_MAX_SIZE + 8];
+    if (config.peer_name != NULL) snprintf(self_name, sizeof(self_name), "%s", config.peer_name);
+    else snprintf(self_name, sizeof(self_name), "127.0.0.1:%d", listen_port);
+
+    const char *cur = config.peers;
+    while (*cur != '\0') {
+        const char *end = strchr(cur, ',');
+        size_t length = end == NULL ? strlen(cur) : (size_t)(end - cur);
+        if (length > 0 && !(length == strlen(self_name) && strncmp(cur, self_name, length) == 0)) {
+            if (nodes.size == PEER_MAX) {
+                LOG_ERROR("Too many peers, at most %d are supported", PEER_MAX);
+                return -1;
+            }
+            peer_t *peer = &nodes.peers[nodes.size];
+            peer->name = (char *)malloc(length + 1);
+            if (peer->name == NULL) {
+                LOG_ERRNO("peer_init: Unable to allocate memory for peer name");
+                return -1;
+            }
+            memcpy(peer->name, cur, length);
+            peer->name[length] = '\0';
+            nodes.size++;
+            if (peer_resolve(peer->name, &peer->addr) == -1) return -1;
+        }
+        cur += length;
+        if (*cur == ',') cur++;
+    }
+    if (nodes.size == 0) return 0;
+
+    int err_code = pthread_key_create(&nodes.query_key, close_query_socket);
+    if (err_code != 0) {
+        print_error("peer_init: Unable to create key", err_code);
+        return -1;
+    }
+    if (build_ring(self_name) == -1) return -1;
+    LOG_INFO("Peer cache: %d peers, this node is %s", nodes.size, self_name);
+    return 0;
+}
+
+//-1 when port is taken, e.g. by proxy this one takes over from; node then only asks others
+int peer_open_answer_socket(int listen_port) {
+    if (nodes.size == 0) return -1;
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd == -1) {
+        LOG_ERRNO("peer_open_answer_socket: socket error");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(listen_port);
+    if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1) {
+        LOG_ERRNO("peer_open_answer_socket: bind error, peers will not see this cache");
+        close(sock_fd);
+        return -1;
+    }
+    if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        LOG_ERRNO("peer_open_answer_socket: fcntl error");
+    }
+    return sock_fd;
+}
+
+//answers every query waiting on socket, called by main thread when it is readable
+void peer_answer(int sock_fd, cache_t *cache) {
+    char query[PEER_DATAGRAM_SIZE + 1], reply[64];
+    while (TRUE) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(struct sockaddr_in);
+        ssize_t size = recvfrom(sock_fd, query, PEER_DATAGRAM_SIZE, 0, (struct sockaddr *)&from, &from_len);
+        if (size == -1) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) LOG_ERRNO("peer_answer: recvfrom error");
+            return;
+        }
+        query[size] = '\0';
+
+        char *id = query + 5, *host = size < 5 || strncmp(query, "L33Q ", 5) != 0 ? NULL : strchr(id, ' ');
+        char *path = host == NULL ? NULL : strchr(host + 1, ' ');
+        if (path == NULL || host - id > 16) {
+            LOG_WARN("peer_answer: malformed query");
+            continue;
+        }
+        host++;
+        path++;
+        str_view_t host_view = { host, path - 1 - host }, path_view = { path, query + size - path };
+        int is_hit = cache_peek(host_view, path_view, cache_hash(host_view, path_view), cache) == CACHE_FRESH;
+
+        int reply_size = snprintf(reply, sizeof(reply), "L33%c %.*s", is_hit ? 'H' : 'M', (int)(host - 1 - id), id);
+        if (sendto(sock_fd, reply, reply_size, 0, (struct sockaddr *)&from, from_len) == -1) LOG_ERRNO("peer_answer: sendto error");
+        STATS_INC(peer_answers);
+        LOG_DEBUG("Peer query for '%.*s%.*s': %s", (int)host_view.length, host_view.data, (int)path_view.length, path_view.data, is_hit ? "hit" : "miss");
+    }
+}
+
+query_socket_t *get_query_socket(int create) {
+    query_socket_t *query = (query_socket_t *)pthread_getspecific(nodes.query_key);
+    if (query != NULL || !create) return query;
+
+    query = (query_socket_t *)malloc(sizeof(query_socket_t));
+    if (query == NULL) {
+        LOG_ERRNO("get_query_socket: Unable to allocate memory");
+        return NULL;
+    }
+    query->sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (query->sock_fd == -1) {
+        LOG_ERRNO("get_query_socket: socket error");
+        free(query);
+        return NULL;
+    }
+    if (fcntl(query->sock_fd, F_SETFL, O_NONBLOCK) == -1) {
+        LOG_ERRNO("get_query_socket: fcntl error");
+    }
+    query->next_id = 0;
+    pthread_setspecific(nodes.query_key, query);
+    return query;
+}
+
+int ring_owner(unsigned long long hash) {
+    unsigned long long position = peer_mix(hash);
+    int low = 0, high = nodes.ring_size;    //first point at or after position, ring wraps to point 0
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (nodes.ring[middle].position < position) low = middle + 1;
+        else high = middle;
+    }
+    return nodes.ring[low == nodes.ring_size ? 0 : low].node;
+}
+
+int find_sender(struct sockaddr_in *from) {
+    for (int i = 0; i < nodes.size; i++) {
+        if (nodes.peers[i].addr.sin_port == from->sin_port && nodes.peers[i].addr.sin_addr.s_addr == from->sin_addr.s_addr) return i;
+    }
+    return -1;
+}
+
+//sends query to all peers, -1 if url goes to origin without asking
+int peer_query_start(peer_lookup_t *lookup) {
+    if (nodes.size == 0) return -1;
+    query_socket_t *query = get_query_socket(TRUE);
+    if (query == NULL) return -1;
+
+    char datagram[PEER_DATAGRAM_SIZE];
+    lookup->id = query->next_id++;
+    int size = snprintf(datagram, sizeof(datagram), "L33Q %u %s %s", lookup->id, lookup->host, lookup->path);
+    if (size >= (int)sizeof(datagram)) return -1;
+    int sent = 0;
+    for (int i = 0; i < nodes.size; i++) {
+        if (sendto(query->sock_fd, datagram, size, 0, (struct sockaddr *)&nodes.peers[i].addr, sizeof(struct sockaddr_in)) == -1) {
+            LOG_ERRNO("peer_query_start: sendto %s error", nodes.peers[i].name);
+        }
+        else sent++;
+    }
+    if (sent == 0) return -1;
+    STATS_INC(peer_queries);
+
+    lookup->owner = ring_owner(lookup->hash);
+    lookup->hit = -1;
+    lookup->owner_answered = FALSE;
+    lookup->answers = 0;
+    lookup->answered = 0;
+    lookup->is_expired = FALSE;
+    return 0;
+}
+
+//query socket of calling worker, -1 until it sends first query
+int peer_query_fd() {
+    if (nodes.size == 0) return -1;
+    query_socket_t *query = get_query_socket(FALSE);
+    return query == NULL ? -1 : query->sock_fd;
+}
+
+//next reply waiting on query socket of calling worker, -1 when there is none
+int peer_read_reply(unsigned int *id, int *sender, int *is_hit) {
+    query_socket_t *query = get_query_socket(FALSE);
+    if (query == NULL) return -1;
+    char reply[64];
+    while (TRUE) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(struct sockaddr_in);
+        ssize_t size = recvfrom(query->sock_fd, reply, sizeof(reply) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (size == -1) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) LOG_ERRNO("peer_read_reply: recvfrom error");
+            return -1;
+        }
+        reply[size] = '\0';
+        char *end;
+        *sender = find_sender(&from);
+        if (*sender == -1 || size < 6 || strncmp(reply, "L33", 3) != 0 || (reply[3] != 'H' && reply[3] != 'M') || reply[4] != ' ') continue;
+        *id = (unsigned int)strtoul(reply + 5, &end, 10);
+        if (*end != '\0') continue;
+        *is_hit = reply[3] == 'H';
+        return 0;
+    }
+}
+
+void peer_query_answer(peer_lookup_t *lookup, int sender, int is_hit) {
+    if (lookup->answered & (1U << sender)) return;
+    lookup->answered |= 1U << sender;
+    lookup->answers++;
+    if (sender == lookup->owner) lookup->owner_answered = TRUE;
+    if (is_hit && (lookup->hit == -1 || sender == lookup->owner)) lookup->hit = sender;
+}
+
+//copy at owner is preferred, so other hits wait for its answer
+int peer_query_is_done(peer_lookup_t *lookup) {
+    if (lookup->is_expired || lookup->answers == nodes.size) return TRUE;
+    if (lookup->owner == SELF || lookup->owner_answered) return lookup->hit != -1;
+    return FALSE;
+}
+
+//name of peer to fetch url from, NULL when it goes to origin
+const char *peer_query_result(peer_lookup_t *lookup) {
+    if (lookup->hit != -1) {
+        STATS_INC(peer_hits);
+        return nodes.peers[lookup->hit].name;
+    }
+    if (config.peer_route && lookup->owner != SELF && lookup->owner_answered) {
+        STATS_INC(peer_routed);
+        return nodes.peers[lookup->owner].name;
+    }
+    return NULL;
+}
+
+void peer_destroy() {
+    for (int i = 0; i < nodes.size; i++) free(nodes.peers[i].name);
+    free(nodes.ring);
+    nodes.ring = NULL;
+    nodes.size = 0;
+}
@@ -0,0 +1,51 @@
+#include "cache.h"
+
+#ifndef LAB33_PEER_H
+#define LAB33_PEER_H
+
+#define PEER_MAX 32
+#define PEER_VNODES 64                          //points of every node on hash ring
+#define PEER_DATAGRAM_SIZE (URL_KEY_SIZE + 64)
+#define PEER_HEADER "X-Proxy-Peer"              //request sent to a peer, it is served without asking further
+
+/*
+ * Sibling protocol between proxy nodes. Every node answers UDP datagrams on the port of its
+ * listener: query "L33Q <id> <host> <path>" gets "L33H <id>" when fresh complete copy is
+ * cached there and "L33M <id>" otherwise; answering does not touch LRU or admission.
+ *
+ * Miss of a client request sends query to all peers from query socket of its worker and
+ * client waits in PEER_LOOKUP while worker goes on serving others; socket is polled with the
+ * rest and client timer ends waiting after config.peer_timeout milliseconds. Lookup is decided
+ * once owner of url on consistent hash ring answered and some node has response, or all answered.
+ * Response is fetched over HTTP from node that has it, owner first; when none does, url goes
+ * through owner, provided it answered and is not this node. Nodes agree on ring only if they
+ * know each other by same names. Request to a peer carries PEER_HEADER, so peer serves it
+ * from cache or origin but never asks or routes further.
+ */
+
+//miss of one client waiting for answers
+typedef struct peer_lookup {
+    unsigned int id;
+    int owner, hit, owner_answered, answers;
+    unsigned int answered;          //bit of every peer that answered
+    int is_expired;                 //peer_timeout passed
+    char *host, *path;              //given to http that fetches url
+    unsigned long long hash;
+    int headers_size;
+    cache_entry_t *stale_entry;
+} peer_lookup_t;
+
+int peer_init(int listen_port);
+int peer_open_answer_socket(int listen_port);
+void peer_answer(int sock_fd, cache_t *cache);
+
+int peer_query_start(peer_lookup_t *lookup);
+int peer_query_fd();
+int peer_read_reply(unsigned int *id, int *sender, int *is_hit);
+void peer_query_answer(peer_lookup_t *lookup, int sender, int is_hit);
+int peer_query_is_done(peer_lookup_t *lookup);
+const char *peer_query_result(peer_lookup_t *lookup);
+
+void peer_destroy();
+
+#endif
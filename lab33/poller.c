@@ -0,0 +1,411 @@
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "poller.h"
+#include "states.h"
+#include "stats.h"
+#include "logger.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define POLLER_HAVE_URING
+#endif
+#endif
+
+#ifdef POLLER_HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+int poller_parse_backend(const char *name) {
+    if (STR_EQ(name, "select")) return POLLER_BACKEND_SELECT;
+    if (STR_EQ(name, "io_uring")) return POLLER_BACKEND_URING;
+    return -1;
+}
+
+const char *poller_backend_name(int backend) {
+    return backend == POLLER_BACKEND_URING ? "io_uring" : "select";
+}
+
+#ifdef POLLER_HAVE_URING
+
+#define URING_REMOVE_DATA (~0ULL)   //completions of poll removals are only counted
+#define URING_USER_DATA(ROUND, FD) ((((unsigned long long)(ROUND) & 0xFFFFFFFFULL) << 32) | (unsigned int)(FD))
+
+struct poller_uring {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask, cq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_tail_local, to_submit;
+    unsigned long long round;
+    int *pending;   int pending_num, pending_size;  //polls of previous round that did not complete
+};
+
+long long uring_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void uring_unmap(struct poller_uring *uring) {
+    if (uring->sqes != NULL) munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) munmap(uring->cq_ring, uring->cq_ring_size);
+    if (uring->sq_ring != NULL) munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->ring_fd);
+}
+
+int uring_setup(struct poller_uring *uring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(uring, 0, sizeof(struct poller_uring));
+
+    uring->ring_fd = (int)syscall(__NR_io_uring_setup, POLLER_URING_ENTRIES, &params);
+    if (uring->ring_fd == -1) return -1;
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {     //needed for wait with timeout
+        close(uring->ring_fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_ring_size = MAX(uring->sq_ring_size, uring->cq_ring_size);
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) uring->sq_ring = NULL;
+    if (uring->sq_ring != NULL && (params.features & IORING_FEAT_SINGLE_MMAP)) uring->cq_ring = uring->sq_ring;
+    else if (uring->sq_ring != NULL) {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) uring->cq_ring = NULL;
+    }
+    if (uring->cq_ring != NULL) {
+        uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+        if (uring->sqes == MAP_FAILED) uring->sqes = NULL;
+    }
+    if (uring->sqes == NULL) {
+        int err_code = errno;
+        uring_unmap(uring);
+        errno = err_code;
+        return -1;
+    }
+
+    char *sq = (char *)uring->sq_ring, *cq = (char *)uring->cq_ring;
+    uring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring->sq_entries = params.sq_entries;
+    uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uring->cq_entries = params.cq_entries;
+    uring->sq_tail_local = *uring->sq_tail;
+    return 0;
+}
+
+//submits queued entries and, if min_complete > 0, waits for completions no longer than timeout_us
+int uring_enter(struct poller_uring *uring, unsigned min_complete, long long timeout_us) {
+    struct __kernel_timespec ts = { .tv_sec = timeout_us / 1000000, .tv_nsec = (timeout_us % 1000000) * 1000 };
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_us >= 0) arg.ts = (unsigned long long)(uintptr_t)&ts;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_tail_local, __ATOMIC_RELEASE);
+    unsigned flags = IORING_ENTER_EXT_ARG | (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    int submitted = (int)syscall(__NR_io_uring_enter, uring->ring_fd, uring->to_submit, min_complete, flags, &arg, sizeof(arg));
+    if (submitted > 0) uring->to_submit -= MIN((unsigned)submitted, uring->to_submit);
+    return submitted;
+}
+
+struct io_uring_sqe *uring_next_sqe(struct poller_uring *uring) {
+    if (uring->sq_tail_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+        uring_enter(uring, 0, -1);
+        if (uring->sq_tail_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) return NULL;
+    }
+    unsigned index = uring->sq_tail_local & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->sq_array[index] = index;
+    uring->sq_tail_local++;
+    uring->to_submit++;
+    return sqe;
+}
+
+int uring_poll_events(int events) {
+    int poll_events = 0;
+    if (events & POLLER_READ) poll_events |= POLLIN;
+    if (events & POLLER_WRITE) poll_events |= POLLOUT;
+    return poll_events;
+}
+
+//errors and hang-ups are reported as readiness, following read or write sees them like after select
+int uring_poller_events(int res) {
+    if (res < 0) return POLLER_READ | POLLER_WRITE;
+    int events = 0;
+    if (res & (POLLIN | POLLPRI)) events |= POLLER_READ;
+    if (res & POLLOUT) events |= POLLER_WRITE;
+    if (res & (POLLERR | POLLHUP | POLLNVAL)) events |= POLLER_READ | POLLER_WRITE;
+    return events;
+}
+
+//returns number of fds that became ready in current round, stale counts completions of older rounds
+int uring_reap(poller_t *poller, int *stale) {
+    struct poller_uring *uring = poller->uring;
+    unsigned head = *uring->cq_head;
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    int ready_num = 0;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        if (cqe->user_data == URING_REMOVE_DATA || (cqe->user_data >> 32) != (uring->round & 0xFFFFFFFFULL)) {
+            (*stale)++;
+            continue;
+        }
+        int fd = (int)(cqe->user_data & 0xFFFFFFFFULL);
+        int events = uring_poller_events(cqe->res) & poller->events[fd];
+        if (events == 0) events = poller->events[fd];
+        if (poller->ready[fd] == 0) ready_num++;
+        poller->ready[fd] |= events;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    return ready_num;
+}
+
+/*
+ * One-shot polls keep select semantics: a poll armed on an already ready fd completes at once.
+ * Polls of previous round that did not fire are removed in the same submission, each of them
+ * yields exactly two stale completions (its own and the removal's), so waiting for one more
+ * than that means waiting for a poll of this round.
+ */
+int uring_wait(poller_t *poller, struct timeval *timeout) {
+    struct poller_uring *uring = poller->uring;
+
+    for (int i = 0; i < uring->pending_num; i++) {
+        struct io_uring_sqe *sqe = uring_next_sqe(uring);
+        if (sqe == NULL) break;
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = URING_USER_DATA(uring->round, uring->pending[i]);
+        sqe->user_data = URING_REMOVE_DATA;
+    }
+    int stale_left = 2 * uring->pending_num;
+    uring->pending_num = 0;
+    uring->round++;
+
+    for (int i = 0; i < poller->fds_num; i++) {
+        int fd = poller->fds[i];
+        struct io_uring_sqe *sqe = uring_next_sqe(uring);
+        if (sqe == NULL) {
+            LOG_ERROR("poller: io_uring submission queue is full, fd %d is not watched", fd);
+            continue;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = uring_poll_events(poller->events[fd]);
+        sqe->user_data = URING_USER_DATA(uring->round, fd);
+    }
+
+    long long deadline_us = timeout == NULL ? -1 : uring_now_us() + (long long)timeout->tv_sec * 1000000 + timeout->tv_usec;
+    int ready_num = 0;
+    while (TRUE) {
+        long long remaining_us = deadline_us == -1 ? -1 : MAX(deadline_us - uring_now_us(), 0);
+        unsigned min_complete = remaining_us == 0 ? 0 : MIN((unsigned)MAX(stale_left, 0) + 1, uring->cq_entries);
+
+        errno = 0;
+        int result = uring_enter(uring, min_complete, remaining_us);
+        int err_code = errno;
+
+        int stale = 0;
+        ready_num += uring_reap(poller, &stale);
+        stale_left -= stale;
+        if (ready_num > 0 || remaining_us == 0) break;
+        if (result == -1 && err_code != ETIME && err_code != EBUSY) {
+            errno = err_code;
+            return -1;
+        }
+    }
+
+    if (uring->pending_size < poller->fds_num) {
+        int *check = (int *)realloc(uring->pending, poller->size * sizeof(int));
+        if (check == NULL) {
+            LOG_ERRNO("poller: Unable to allocate memory for pending polls");
+            return ready_num;   //polls left behind only report stale completions
+        }
+        uring->pending = check;
+        uring->pending_size = poller->size;
+    }
+    for (int i = 0; i < poller->fds_num; i++) {
+        if (poller->ready[poller->fds[i]] == 0) uring->pending[uring->pending_num++] = poller->fds[i];
+    }
+    return ready_num;
+}
+
+int uring_init(poller_t *poller) {
+    poller->uring = (struct poller_uring *)malloc(sizeof(struct poller_uring));
+    if (poller->uring == NULL) return -1;
+    if (uring_setup(poller->uring) == -1) {
+        free(poller->uring);
+        poller->uring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_destroy(poller_t *poller) {
+    if (poller->uring == NULL) return;
+    uring_unmap(poller->uring);     //closing ring cancels polls still armed
+    free(poller->uring->pending);
+    free(poller->uring);
+    poller->uring = NULL;
+}
+
+#else
+
+int uring_init(poller_t *poller) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_destroy(poller_t *poller) { }
+
+int uring_wait(poller_t *poller, struct timeval *timeout) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+static __thread int fd_limit_logged = FALSE;     //connections over the limit hang until timeout, one line per thread is enough
+
+int select_wait(poller_t *poller, struct timeval *timeout) {
+    fd_set readfds, writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    int max_fd = -1;
+
+    for (int i = 0; i < poller->fds_num; i++) {
+        int fd = poller->fds[i];
+        if (fd >= FD_SETSIZE) {
+            if (!fd_limit_logged) LOG_ERROR("poller: fd %d does not fit in select, io_backend=io_uring has no such limit", fd);
+            fd_limit_logged = TRUE;
+            continue;
+        }
+        if (poller->events[fd] & POLLER_READ) FD_SET(fd, &readfds);
+        if (poller->events[fd] & POLLER_WRITE) FD_SET(fd, &writefds);
+        max_fd = MAX(max_fd, fd);
+    }
+
+    int num_fds_ready = select(max_fd + 1, &readfds, &writefds, NULL, timeout);
+    if (num_fds_ready <= 0) return num_fds_ready;
+
+    for (int i = 0; i < poller->fds_num; i++) {
+        int fd = poller->fds[i];
+        if (fd >= FD_SETSIZE) continue;
+        if (FD_ISSET(fd, &readfds)) poller->ready[fd] |= POLLER_READ;
+        if (FD_ISSET(fd, &writefds)) poller->ready[fd] |= POLLER_WRITE;
+    }
+    return num_fds_ready;
+}
+
+int poller_backend_supported(int backend) {
+    if (backend != POLLER_BACKEND_URING) return TRUE;
+    poller_t poller = { .uring = NULL };
+    if (uring_init(&poller) == -1) return FALSE;
+    uring_destroy(&poller);
+    return TRUE;
+}
+
+int poller_init(poller_t *poller, int backend) {
+    poller->backend = backend;
+    poller->size = POLLER_INITIAL_SIZE;
+    poller->fds_num = 0;
+    poller->uring = NULL;
+    poller->events = (unsigned char *)calloc(poller->size, sizeof(unsigned char));
+    poller->ready = (unsigned char *)calloc(poller->size, sizeof(unsigned char));
+    poller->fds = (int *)malloc(poller->size * sizeof(int));
+    if (poller->events == NULL || poller->ready == NULL || poller->fds == NULL) {
+        LOG_ERRNO("poller_init: Unable to allocate memory for poller");
+        poller_destroy(poller);
+        return -1;
+    }
+
+    if (backend == POLLER_BACKEND_URING && uring_init(poller) == -1) {
+        LOG_ERRNO("poller_init: Unable to set up io_uring");
+        poller_destroy(poller);
+        return -1;
+    }
+    return 0;
+}
+
+void poller_destroy(poller_t *poller) {
+    uring_destroy(poller);
+    free_with_null((void **)&poller->events);
+    free_with_null((void **)&poller->ready);
+    free_with_null((void **)&poller->fds);
+}
+
+int poller_grow(poller_t *poller, int fd) {
+    int size = poller->size;
+    while (size <= fd) size *= 2;
+
+    unsigned char *events = (unsigned char *)realloc(poller->events, size);
+    if (events == NULL) return -1;
+    poller->events = events;
+    unsigned char *ready = (unsigned char *)realloc(poller->ready, size);
+    if (ready == NULL) return -1;
+    poller->ready = ready;
+    int *fds = (int *)realloc(poller->fds, size * sizeof(int));
+    if (fds == NULL) return -1;
+    poller->fds = fds;
+
+    memset(poller->events + poller->size, 0, size - poller->size);
+    memset(poller->ready + poller->size, 0, size - poller->size);
+    poller->size = size;
+    return 0;
+}
+
+void poller_reset(poller_t *poller) {
+    for (int i = 0; i < poller->fds_num; i++) {
+        poller->events[poller->fds[i]] = 0;
+        poller->ready[poller->fds[i]] = 0;
+    }
+    poller->fds_num = 0;
+}
+
+void poller_add(poller_t *poller, int fd, int events) {
+    if (fd < 0) return;
+    if (fd >= poller->size && poller_grow(poller, fd) == -1) {
+        LOG_ERRNO("poller_add: Unable to grow poller for fd %d", fd);
+        return;
+    }
+    if (poller->events[fd] == 0) poller->fds[poller->fds_num++] = fd;
+    poller->events[fd] |= events;
+}
+
+int poller_is_ready(poller_t *poller, int fd, int event) {
+    return fd >= 0 && fd < poller->size && (poller->ready[fd] & event);
+}
+
+int poller_wait(poller_t *poller, struct timeval *timeout) {
+    STATS_INC(poll_waits);
+    if (poller->backend == POLLER_BACKEND_URING) return uring_wait(poller, timeout);
+    return select_wait(poller, timeout);
+}
@@ -0,0 +1,44 @@
+#include <sys/time.h>
+
+#ifndef LAB33_POLLER_H
+#define LAB33_POLLER_H
+
+#define POLLER_READ 1
+#define POLLER_WRITE 2
+
+#define POLLER_BACKEND_SELECT 0
+#define POLLER_BACKEND_URING 1     //linux only, needs io_uring with IORING_FEAT_EXT_ARG (5.11)
+
+#define POLLER_INITIAL_SIZE 1024
+#define POLLER_URING_ENTRIES 1024
+
+/*
+ * Readiness backend of worker loop. Every iteration interest is added anew,
+ * then poller_wait reports which of the fds are ready, like select does.
+ * io_uring backend submits one poll per fd and waits in the same io_uring_enter,
+ * so it has no FD_SETSIZE limit and takes one syscall per iteration.
+ */
+
+struct poller_uring;
+
+typedef struct poller {
+    int backend;
+    unsigned char *events, *ready;      //indexed by fd
+    int size;
+    int *fds;   int fds_num;            //fds with interest in this iteration, fds_num <= size
+    struct poller_uring *uring;
+} poller_t;
+
+int poller_parse_backend(const char *name);
+const char *poller_backend_name(int backend);
+int poller_backend_supported(int backend);
+
+int poller_init(poller_t *poller, int backend);
+void poller_destroy(poller_t *poller);
+
+void poller_reset(poller_t *poller);
+void poller_add(poller_t *poller, int fd, int events);
+int poller_is_ready(poller_t *poller, int fd, int event);
+int poller_wait(poller_t *poller, struct timeval *timeout);
+
+#endif
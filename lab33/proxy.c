@@ -11,16 +11,45 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 #include "http.h"
 #include "client.h"
 #include "cache.h"
+#include "config.h"
+#include "handoff.h"
 #include "list_queue.h"
-
-int listen_fd;
+#include "stats.h"
+#include "logger.h"
+#include "lockprof.h"
+#include "timer_wheel.h"
+#include "poller.h"
+#include "body.h"
+#include "origin.h"
+#include "egress.h"
+#include "affinity.h"
+#include "sockopt.h"
+#include "warm.h"
+#include "snapshot.h"
+#include "shmcache.h"
+#include "peer.h"
+
+int listen_fd = -1;
+int handoff_fd = -1, handed_off = FALSE;
+int peer_fd = -1;     //answers queries of other proxy nodes, see peer.h
+int shutdown_pipe_fds[2];   //never read from, so it stays readable for every worker once written
 int current_thread = 0;
 int global_thread_count;
+int stdin_open = TRUE;
+int io_backend = POLLER_BACKEND_SELECT;
 cache_t cache;
 
+volatile int proxy_state = PROXY_RUNNING;
+volatile sig_atomic_t drain_requested = FALSE;
+
+int workers_alive = 0;
+pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+
 client_queue_t client_queue = { .head = NULL, .tail = NULL, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 http_queue_t http_queue = { .head = NULL, .tail = NULL, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
 client_list_t global_client_list = { .head = NULL, .rwlock = PTHREAD_RWLOCK_INITIALIZER, .size = 0 };
@@ -48,6 +77,7 @@ int open_listen_socket(int port) {
         close(sock_fd);
         return -1;
     }
+    sockopt_apply(sock_fd, SOCKOPT_LISTENER);
 
     if (listen(sock_fd, SOMAXCONN) == -1) {
         if (ERROR_LOG) perror("open_listen_socket: listen error");
@@ -66,7 +96,7 @@ void remove_all_queued_connections() {
     client_t *client = client_queue.head;
     while (client != NULL) {
         client_t *next = client->next;
-        if (INFO_LOG) printf("[%d] Disconnected\n", client->sock_fd);
+        LOG_DEBUG("[%d] Disconnected", client->sock_fd);
         close(client->sock_fd);
         free(client);
         client = next;
@@ -75,7 +105,30 @@ void remove_all_queued_connections() {
     http_t *http = http_queue.head;
     while (http != NULL) {
         http_t *next = http->next;
-        if (INFO_LOG) printf("[%d %s %s] Disconnected\n", http->sock_fd, http->host, http->path);
+        LOG_DEBUG("[%d %s %s] Disconnected", http->sock_fd, http->host, http->path);
+        http_destroy(http, &cache);
+        free(http);
+        http = next;
+    }
+}
+
+//called after all workers are joined, so only connections of workers stopped mid-transfer are left
+void remove_all_connections() {
+    client_t *client = global_client_list.head;
+    while (client != NULL) {
+        client_t *next = client->global_next;
+        client_remove_from_global_list(client, &global_client_list);
+        LOG_DEBUG("[%d] Disconnected", client->sock_fd);
+        client_destroy(client);
+        free(client);
+        client = next;
+    }
+
+    http_t *http = global_http_list.head;
+    while (http != NULL) {
+        http_t *next = http->global_next;
+        http_remove_from_global_list(http, &global_http_list);
+        LOG_DEBUG("[%d %s %s] Disconnected", http->sock_fd, http->host, http->path);
         http_destroy(http, &cache);
         free(http);
         http = next;
@@ -111,100 +164,88 @@ void print_active_connections() {
     unlock_rwlock(&global_http_list.rwlock, "print_active_connections: HTTP");
 }
 
+void print_stats() {
+    ssize_t size;
+    char *text = stats_render(&size);
+    if (text == NULL) return;
+    fwrite(text, 1, size, stdout);
+    fflush(stdout);
+    free(text);
+}
+
 void print_threads_load(thread_param_t *params, int size) {
     for (int i = 0; i < size; i++) {
         printf("- Thread %d: clients=%d, https=%d\n", params[i].index, params[i].client_size, params[i].http_size);
     }
 }
 
-int init_client_select_masks(client_list_t *client_list, fd_set *readfds, fd_set *writefds) {
-    int select_max_fd = -1;
-
+void add_client_interest(client_list_t *client_list, poller_t *poller, egress_t *egress) {
     client_t *client = client_list->head;
     while (client != NULL) {
         client_t *next = client->next;
 
+        if (client->status == PEER_LOOKUP) client_finish_peer_lookup(client, &global_http_list, &http_queue, &cache);
+        if (!IS_ERROR_OR_DONE_STATUS(client->status)) {
+            client_update_http_info(client);    //failed http fails its clients, they are removed right away
+            check_finished_writing_to_client(client);
+        }
+
         if (IS_ERROR_OR_DONE_STATUS(client->status)) {
             remove_client(client, client_list, &global_client_list);
             client = next;
             continue;
         }
 
-        client_update_http_info(client);
-        check_finished_writing_to_client(client);
-
-        if (client->http_entry != NULL) {
-            FD_SET(client->http_entry->client_pipe_fd, readfds);
-            select_max_fd = MAX(select_max_fd, client->http_entry->client_pipe_fd);
+        if (client->status == TUNNELING) {
+            tunnel_add_interest(client->tunnel, poller);
+            client = next;
+            continue;
         }
 
-        FD_SET(client->sock_fd, readfds);
-        select_max_fd = MAX(client->sock_fd, select_max_fd);
+        if (client->http_entry != NULL) poller_add(poller, client->http_entry->client_pipe_fd, POLLER_READ);
+        if (client->upload_buf != NULL) client_add_upload_interest(client, poller);
+        else if (client->status != PEER_LOOKUP) poller_add(poller, client->sock_fd, POLLER_READ);   //request is not sent anywhere yet
 
-        if (client->status == DOWNLOADING) {
-            read_lock_rwlock(&client->http_entry->rwlock, "client_worker: DOWNLOADING FD_SET");
-            if (client->bytes_written < client->http_entry->data_size) {
-                FD_SET(client->sock_fd, writefds);
-            }
-            unlock_rwlock(&client->http_entry->rwlock, "client_worker: DOWNLOADING FD_SET");
-        }
-        else if (client->status == GETTING_FROM_CACHE) {
-            read_lock_rwlock(&client->cache_entry->rwlock, "client_worker: CACHE FD_SET");
-            if (client->bytes_written < client->cache_entry->size) {
-                FD_SET(client->sock_fd, writefds);
-            }
-            unlock_rwlock(&client->cache_entry->rwlock, "client_worker: CACHE FD_SET");
-        }
+        if (client_pending_bytes(client) > 0 && egress_may_write(egress, client)) poller_add(poller, client->sock_fd, POLLER_WRITE);
 
         client = next;
     }
-
-    return select_max_fd;
+    int query_fd = peer_query_fd();
+    if (query_fd != -1) poller_add(poller, query_fd, POLLER_READ);
 }
 
-void update_client_connections(client_list_t *client_list, fd_set *readfds, fd_set *writefds) {
+//writes are not done right away: writable clients are collected and served in turns by egress
+void update_client_connections(client_list_t *client_list, poller_t *poller, egress_t *egress) {
+    int query_fd = peer_query_fd();
+    if (query_fd != -1 && poller_is_ready(poller, query_fd, POLLER_READ)) client_update_peer_replies(client_list);
+
     client_t *client = client_list->head;
     while (client != NULL) {
         client_t *next = client->next;
 
+        if (client->status == TUNNELING) {
+            client_update_tunnel(client, poller);
+            client = next;
+            continue;
+        }
+
         char buf[1] = { 1 };
-        if (client->http_entry != NULL && FD_ISSET(client->http_entry->client_pipe_fd, readfds)) {
+        if (client->http_entry != NULL && poller_is_ready(poller, client->http_entry->client_pipe_fd, POLLER_READ)) {
             read(client->http_entry->client_pipe_fd, buf, 1);
         }
 
-        if (!IS_ERROR_OR_DONE_STATUS(client->status) && FD_ISSET(client->sock_fd, readfds)) {
+        if (client->upload_buf != NULL) client_update_upload(client, poller);
+        else if (!IS_ERROR_OR_DONE_STATUS(client->status) && poller_is_ready(poller, client->sock_fd, POLLER_READ)) {
             client_read_data(client, &global_http_list, &http_queue, &cache);
         }
-        if (FD_ISSET(client->sock_fd, writefds)) {
-            ssize_t http_data_size = 0;
-            int http_status;
-            if (client->http_entry != NULL) {
-                read_lock_rwlock(&client->http_entry->rwlock, "client_worker: HTTP POST select");
-                http_data_size = client->http_entry->data_size;
-                http_status = client->http_entry->status;
-                unlock_rwlock(&client->http_entry->rwlock, "client_worker: HTTP POST select");
-            }
-
-            ssize_t cache_data_size = 0;
-            if (client->cache_entry != NULL) {
-                read_lock_rwlock(&client->cache_entry->rwlock, "client_worker: CACHE POST select");
-                cache_data_size = client->cache_entry->size;
-                unlock_rwlock(&client->cache_entry->rwlock, "client_worker: CACHE POST select");
-            }
-
-            if (((client->status == DOWNLOADING && http_status == DOWNLOADING && client->bytes_written < http_data_size) ||
-                (client->status == GETTING_FROM_CACHE && client->bytes_written < cache_data_size))) {
-                write_to_client(client);
-            }
-        }
+        if (poller_is_ready(poller, client->sock_fd, POLLER_WRITE) && client_pending_bytes(client) > 0) egress_add(egress, client);
 
         client = next;
     }
+    egress_run(egress);
 }
 
-int init_http_select_masks(http_list_t *http_list, fd_set *readfds, fd_set *writefds) {
-    int select_max_fd = -1;
-
+void add_http_interest(http_list_t *http_list, poller_t *poller) {
     http_t *http = http_list->head;
     while (http != NULL) {
         http_t *next = http->next;
@@ -215,74 +256,94 @@ int init_http_select_masks(http_list_t *http_list, fd_set *readfds, fd_set *writ
             continue;
         }
 
-        FD_SET(http->http_pipe_fd, readfds);
-        select_max_fd = MAX(select_max_fd, http->http_pipe_fd);
-
-        if (!IS_ERROR_OR_DONE_STATUS(http->status)) {
-            FD_SET(http->sock_fd, readfds);
-            select_max_fd = MAX(http->sock_fd, select_max_fd);
-        }
-        if (http->status == AWAITING_REQUEST) {
-            FD_SET(http->sock_fd, writefds);
-            select_max_fd = MAX(http->sock_fd, select_max_fd);
+        poller_add(poller, http->http_pipe_fd, POLLER_READ);
+        if (http->sock_fd == -1 && !IS_ERROR_OR_DONE_STATUS(http->status)) {   //waits for slot, pipe tells when it is granted
+            http = next;
+            continue;
         }
+        if (http->passthrough_pipe_full) poller_add(poller, http->passthrough_write_fd, POLLER_WRITE);
+        else if (!IS_ERROR_OR_DONE_STATUS(http->status)) poller_add(poller, http->sock_fd, POLLER_READ);
+        if (http->status == AWAITING_REQUEST) poller_add(poller, http->sock_fd, POLLER_WRITE);
 
         http = next;
     }
-
-    return select_max_fd;
 }
 
-void update_http_connections(http_list_t *http_list, fd_set *readfds, fd_set *writefds) {
+void update_http_connections(http_list_t *http_list, poller_t *poller) {
     http_t *http = http_list->head;
     while (http != NULL) {
         http_t *next = http->next;
         char buf[1] = { 1 };
-        if (FD_ISSET(http->http_pipe_fd, readfds)) {
+        if (poller_is_ready(poller, http->http_pipe_fd, POLLER_READ)) {
             read(http->http_pipe_fd, buf, 1);
         }
-        if (!IS_ERROR_OR_DONE_STATUS(http->status) && FD_ISSET(http->sock_fd, readfds)) {
+        if (http->sock_fd == -1 && !IS_ERROR_OR_DONE_STATUS(http->status)) {
+            if (origin_take_grant(http)) http_connect_granted(http, &cache);
+            http = next;
+            continue;
+        }
+        if (http->passthrough_pipe_full) {
+            //socket is read again on next iteration, its readiness does not tell if pipe has room
+            if (poller_is_ready(poller, http->passthrough_write_fd, POLLER_WRITE)) http->passthrough_pipe_full = FALSE;
+        }
+        else if (!IS_ERROR_OR_DONE_STATUS(http->status) && poller_is_ready(poller, http->sock_fd, POLLER_READ)) {
             http_read_data(http, &cache);
         }
-        if (http->status == AWAITING_REQUEST && FD_ISSET(http->sock_fd, writefds)) {
-            http_send_request(http);
+        if (http->status == AWAITING_REQUEST && poller_is_ready(poller, http->sock_fd, POLLER_WRITE)) {
+            http_send_request(http, &cache);
         }
         http = next;
     }
 }
 
-void *client_cancel_handler(void *param) {
-    client_list_t *client_list = (client_list_t *)param;
-    if (client_list == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "client_cancel_handler: param was NULL\n");
-        return NULL;
-    }
-
+//while draining, keep-alive clients between requests are closed right away, just accepted ones still send theirs
+void drain_idle_clients(client_list_t *client_list) {
     client_t *client = client_list->head;
     while (client != NULL) {
         client_t *next = client->next;
-        remove_client(client, client_list, &global_client_list);
+        if (client->status == AWAITING_REQUEST && client->request_size == 0 && !client->is_fresh) {
+            remove_client(client, client_list, &global_client_list);
+        }
         client = next;
     }
-
-    return NULL;
 }
 
-void *http_cancel_handler(void *param) {
-    http_list_t *http_list= (http_list_t *)param;
-    if (http_list == NULL) {
-        if (ERROR_LOG) fprintf(stderr, "http_cancel_handler: param was NULL\n");
-        return NULL;
-    }
-
+//https nobody waits for are only filling the cache, there is no point finishing them while draining
+void drain_orphan_https(http_list_t *http_list) {
     http_t *http = http_list->head;
     while (http != NULL) {
         http_t *next = http->next;
-        remove_http(http, http_list, &global_http_list, &cache);
+        write_lock_rwlock(&http->rwlock, "drain_orphan_https");
+        int is_orphan = http->clients == 0;
+        if (is_orphan) http->dont_accept_clients = TRUE;
+        unlock_rwlock(&http->rwlock, "drain_orphan_https");
+        if (is_orphan) remove_http(http, http_list, &global_http_list, &cache);
         http = next;
     }
+}
 
-    return NULL;
+//connections left after a forced stop outlive the worker, so their timers must leave its wheel
+void cancel_timers(client_list_t *client_list, http_list_t *http_list) {
+    for (client_t *client = client_list->head; client != NULL; client = client->next) timer_cancel(&client->timer);
+    for (http_t *http = http_list->head; http != NULL; http = http->next) timer_cancel(&http->timer);
+}
+
+//select wakes up at the nearest connection timeout, while draining also every DRAIN_POLL_INTERVAL
+struct timeval *get_select_timeout(timer_wheel_t *timer_wheel, struct timeval *timeout) {
+    struct timeval *wheel_timeout = timer_wheel_timeout(timer_wheel, timeout);
+    if (proxy_state == PROXY_RUNNING) return wheel_timeout;
+    if (wheel_timeout == NULL || wheel_timeout->tv_sec >= DRAIN_POLL_INTERVAL) {
+        timeout->tv_sec = DRAIN_POLL_INTERVAL;
+        timeout->tv_usec = 0;
+    }
+    return timeout;
+}
+
+void worker_finished() {
+    pthread_mutex_lock(&workers_mutex);
+    workers_alive--;
+    pthread_cond_signal(&workers_cond);
+    pthread_mutex_unlock(&workers_mutex);
 }
 
 void *connection_worker(void *_param) {
@@ -294,12 +355,22 @@ void *connection_worker(void *_param) {
 
     client_list_t client_list = { .head = NULL, .size = 0 };
     http_list_t http_list = { .head = NULL, .size = 0 };
-    fd_set readfds, writefds;
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    timer_wheel_t timer_wheel;
+    timer_wheel_init(&timer_wheel);
+    egress_t egress;
+    egress_init(&egress);
+    stats_register_thread(param->index);
+    log_register_thread();
+    if (config.cpu_affinity) affinity_bind_thread(param->index);
+
+    //ring may fail to set up in one thread only, e.g. on memlock limit, then this thread uses select
+    poller_t poller;
+    if (poller_init(&poller, io_backend) == -1 && (io_backend == POLLER_BACKEND_SELECT || poller_init(&poller, POLLER_BACKEND_SELECT) == -1)) {
+        worker_finished();
+        return NULL;
+    }
 
-    pthread_cleanup_push(http_cancel_handler, &http_list);
-    pthread_cleanup_push(client_cancel_handler, &client_list);
-    while (TRUE) {
+    while (proxy_state != PROXY_STOPPED) {
         param->http_size = http_list.size;
         param->client_size = client_list.size;
 
@@ -309,6 +380,8 @@ void *connection_worker(void *_param) {
 
         client_t *new_client = client_dequeue(&client_queue, http_list.size + client_list.size, param->index, &current_thread, global_thread_count);
         if (new_client != NULL) {
+            if (config.cpu_affinity) new_client = client_move_to_worker(new_client);
+            client_start_timer(new_client, &timer_wheel);
             client_add_to_list(new_client, &client_list);
             client_add_to_global_list(new_client, &global_client_list);
         }
@@ -319,43 +392,77 @@ void *connection_worker(void *_param) {
 
         http_t *new_http = http_dequeue(&http_queue, http_list.size + client_list.size, param->index, &current_thread, global_thread_count);
         if (new_http != NULL) {
+            http_start_timer(new_http, &timer_wheel);
             http_add_to_list(new_http, &http_list);
             http_add_to_global_list(new_http, &global_http_list);
         }
 
-        int select_max_fd = -1;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        int select_max_fd1 = init_client_select_masks(&client_list, &readfds, &writefds);
-        int select_max_fd2 = init_http_select_masks(&http_list, &readfds, &writefds);
-        select_max_fd = MAX(select_max_fd, select_max_fd1);
-        select_max_fd = MAX(select_max_fd, select_max_fd2);
+        if (proxy_state == PROXY_RUNNING) warm_continue(&http_queue, &cache);    //warm-up https that finished leave slots
+
+        if (proxy_state == PROXY_DRAINING) {
+            drain_idle_clients(&client_list);
+            drain_orphan_https(&http_list);
+            if (client_list.size == 0 && http_list.size == 0 && !client_queue_has_client(&client_queue, param->index)) break;
+        }
 
-        FD_SET(param->new_connection_pipe_fd, &readfds);
-        select_max_fd = MAX(select_max_fd, param->new_connection_pipe_fd);
+        poller_reset(&poller);
+        add_client_interest(&client_list, &poller, &egress);
+        add_http_interest(&http_list, &poller);
+        poller_add(&poller, param->new_connection_pipe_fd, POLLER_READ);
+        if (param->steer_pipe_fd != -1) poller_add(&poller, param->steer_pipe_fd, POLLER_READ);
+        if (proxy_state == PROXY_RUNNING) poller_add(&poller, shutdown_pipe_fds[0], POLLER_READ);
 
-        int num_fds_ready = select(select_max_fd + 1, &readfds, &writefds, NULL, NULL);
+        errno = 0;
+        struct timeval timeout;
+        int num_fds_ready = poller_wait(&poller, egress_timeout(&egress, get_select_timeout(&timer_wheel, &timeout), &timeout));
         if (num_fds_ready == -1) {
-            if (ERROR_LOG) fprintf(stderr, "connection_worker: select error\n");
+            if (errno == EINTR) continue;
+            LOG_ERRNO("connection_worker: %s error", poller_backend_name(poller.backend));
             break;
         }
-        if (num_fds_ready == 0) continue;
 
-        update_client_connections(&client_list, &readfds, &writefds);
-        update_http_connections(&http_list, &readfds, &writefds);
+        if (num_fds_ready > 0) {
+            update_client_connections(&client_list, &poller, &egress);
+            update_http_connections(&http_list, &poller);
 
-        if (FD_ISSET(param->new_connection_pipe_fd, &readfds)) {
-            char buf[1];
-            read(param->new_connection_pipe_fd, buf, 1);
+            if (poller_is_ready(&poller, param->new_connection_pipe_fd, POLLER_READ)) {
+                char buf[1];
+                read(param->new_connection_pipe_fd, buf, 1);
+            }
+            if (param->steer_pipe_fd != -1 && poller_is_ready(&poller, param->steer_pipe_fd, POLLER_READ)) {
+                char buf[1];
+                read(param->steer_pipe_fd, buf, 1);
+            }
         }
+        timer_wheel_expire(&timer_wheel);
     }
-    pthread_cleanup_pop(TRUE);
-    pthread_cleanup_pop(TRUE);
 
+    cancel_timers(&client_list, &http_list);
+    poller_destroy(&poller);
+
+    //connections left after a forced stop stay in global lists, main thread removes them after join
+    param->http_size = http_list.size;
+    param->client_size = client_list.size;
+    worker_finished();
     return NULL;
 }
 
-void update_accept(fd_set *readfds) {
+//load of worker is its clients and https as of its last loop iteration
+int threads_loaded(thread_param_t *params, int size, int limit) {
+    if (limit <= 0) return FALSE;
+    for (int i = 0; i < size; i++) {
+        if (params[i].client_size + params[i].http_size < limit) return FALSE;
+    }
+    return TRUE;
+}
+
+//above hard limits new connections are left in listen backlog until load goes down
+int accept_is_paused(thread_param_t *params, int size) {
+    if (config.max_connections > 0 && clients_open >= config.max_connections) return TRUE;
+    return threads_loaded(params, size, config.thread_connections);
+}
+
+void update_accept(fd_set *readfds, thread_param_t *params, int size) {
     if (FD_ISSET(listen_fd, readfds)) {
         errno = 0;
         int client_sock_fd = accept(listen_fd, NULL, NULL);
@@ -363,13 +470,82 @@ void update_accept(fd_set *readfds) {
             if (errno == EWOULDBLOCK) {
                 return;
             }
-            if (ERROR_LOG) perror("update_accept: accept error");
+            LOG_ERRNO("update_accept: accept error");
+            return;
+        }
+        if (threads_loaded(params, size, config.thread_soft_connections)) {
+            reject_client(client_sock_fd);
             return;
         }
-        create_client(client_sock_fd, &client_queue);
+        int worker = config.steer_incoming_cpu ? affinity_socket_worker(client_sock_fd, size) : -1;
+        if (worker >= 0) STATS_INC(steered);
+        create_client(client_sock_fd, worker, &client_queue);
     }
 }
 
+void accept_pending_connections() {
+    while (TRUE) {
+        int client_sock_fd = accept(listen_fd, NULL, NULL);
+        if (client_sock_fd == -1) break;
+        create_client(client_sock_fd, -1, &client_queue);
+    }
+}
+
+void start_drain() {
+    if (proxy_state != PROXY_RUNNING) return;
+    fprintf(stderr, "Draining: no new connections, waiting up to %d seconds for active ones\n", config.drain_timeout);
+
+    //after a handoff the new proxy owns the accept queue, otherwise we take everything already queued
+    if (!handed_off) accept_pending_connections();
+    close_socket(&listen_fd);
+    close_socket(&peer_fd);
+
+    proxy_state = PROXY_DRAINING;
+    if (snapshot_start(&cache, TRUE) == SNAPSHOT_STARTED) fprintf(stderr, "Writing cache snapshot to '%s'\n", config.snapshot_path);
+    char buf[1] = { 1 };
+    write(shutdown_pipe_fds[1], buf, 1);
+}
+
+void stop_workers() {
+    proxy_state = PROXY_STOPPED;
+    char buf[1] = { 1 };
+    write(shutdown_pipe_fds[1], buf, 1);
+}
+
+void update_handoff(fd_set *readfds) {
+    if (handoff_fd == -1 || !FD_ISSET(handoff_fd, readfds)) return;
+    if (handoff_send_listen_fd(handoff_fd, listen_fd) == -1) return;
+    fprintf(stderr, "Listening socket handed off to new proxy\n");
+    handed_off = TRUE;
+    start_drain();
+}
+
+void set_log_level(const char *name) {
+    int level = log_parse_level(name);
+    if (level == -1) {
+        fprintf(stderr, "Unknown log level '%s', expected error, warn, info or debug\n", name);
+        return;
+    }
+    log_level = level;
+    fprintf(stderr, "Log level set to %s\n", log_level_name(level));
+}
+
+//"locks" prints report, "locks on|off|reset" controls profiler
+void update_lock_profiler(const char *arg) {
+    if (STR_EQ(arg, "")) lockprof_print_report();
+    else if (STR_EQ(arg, " on")) lockprof_enabled = TRUE;
+    else if (STR_EQ(arg, " off")) lockprof_enabled = FALSE;
+    else if (STR_EQ(arg, " reset")) lockprof_reset();
+    else fprintf(stderr, "Usage: locks [on|off|reset]\n");
+}
+
+void update_snapshot() {
+    int result = snapshot_start(&cache, FALSE);
+    if (result == SNAPSHOT_STARTED) fprintf(stderr, "Writing cache snapshot to '%s'\n", config.snapshot_path);
+    else if (result == SNAPSHOT_BUSY) fprintf(stderr, "Cache snapshot is already being written\n");
+    else if (result == SNAPSHOT_DISABLED) fprintf(stderr, "Cache snapshot is disabled, set snapshot_path\n");
+}
+
 int update_stdin(fd_set *readfds, thread_param_t *params, int size) {
     if (FD_ISSET(STDIN_FILENO, readfds)) {
         char buf[BUF_SIZE + 1];
@@ -378,35 +554,120 @@ int update_stdin(fd_set *readfds, thread_param_t *params, int size) {
             if (ERROR_LOG)  perror("main: Unable to read from stdin");
             return -1;
         }
+        if (bytes_read == 0) {  //running detached from terminal, only signals and handoff are left
+            stdin_open = FALSE;
+            return 0;
+        }
         buf[bytes_read] = '\0';
         if (buf[bytes_read - 1] == '\n') buf[bytes_read - 1] = '\0';
 
         if (STR_EQ(buf, "exit")) return -1;
+        else if (STR_EQ(buf, "drain")) start_drain();
         else if (STR_EQ(buf, "cache")) cache_print_content(&cache);
+        else if (STR_EQ(buf, "snapshot")) update_snapshot();
         else if (STR_EQ(buf, "active")) print_active_connections();
         else if (STR_EQ(buf, "load")) print_threads_load(params, size);
+        else if (STR_EQ(buf, "stats")) print_stats();
+        else if (STR_EQ(buf, "config")) config_print();
+        else if (strncmp(buf, "locks", 5) == 0) update_lock_profiler(buf + 5);
+        else if (strncmp(buf, "loglevel ", 9) == 0) set_log_level(buf + 9);
     }
     return 0;
 }
 
 void proxy_spin(thread_param_t *params, int size) {
     fd_set readfds;
+    int accept_paused = FALSE;
 
-    while (TRUE) {
+    while (proxy_state == PROXY_RUNNING) {
+        int is_paused = accept_is_paused(params, size);
+        if (is_paused && !accept_paused) {
+            STATS_INC(accept_pauses);
+            LOG_WARN("Accept paused: %d clients open", clients_open);
+        }
+        else if (!is_paused && accept_paused) LOG_INFO("Accept resumed: %d clients open", clients_open);
+        accept_paused = is_paused;
+
+        int select_max_fd = listen_fd;
         FD_ZERO(&readfds);
-        FD_SET(listen_fd, &readfds);
-        FD_SET(STDIN_FILENO, &readfds);
+        if (!accept_paused) FD_SET(listen_fd, &readfds);
+        if (stdin_open) FD_SET(STDIN_FILENO, &readfds);
+        if (handoff_fd != -1) {
+            FD_SET(handoff_fd, &readfds);
+            select_max_fd = MAX(select_max_fd, handoff_fd);
+        }
+        if (peer_fd != -1) {
+            FD_SET(peer_fd, &readfds);
+            select_max_fd = MAX(select_max_fd, peer_fd);
+        }
 
-        int num_fds_ready = select(listen_fd + 1, &readfds, NULL, NULL, NULL);
+        errno = 0;
+        //workers do not wake main thread when load goes down, so paused accept is checked periodically
+        struct timeval pause_timeout = { .tv_sec = 0, .tv_usec = ACCEPT_PAUSE_INTERVAL * 1000 };
+        int num_fds_ready = select(select_max_fd + 1, &readfds, NULL, NULL, accept_paused ? &pause_timeout : NULL);
+        if (drain_requested) {
+            start_drain();
+            break;
+        }
         if (num_fds_ready == -1) {
+            if (errno == EINTR) continue;
             if (ERROR_LOG) perror("proxy_spin: select error");
+            stop_workers();
             break;
         }
         if (num_fds_ready == 0) continue;
 
-        update_accept(&readfds);
-        if (update_stdin(&readfds, params, size) == -1) break;
+        update_accept(&readfds, params, size);
+        update_handoff(&readfds);
+        if (peer_fd != -1 && FD_ISSET(peer_fd, &readfds)) peer_answer(peer_fd, &cache);
+        if (update_stdin(&readfds, params, size) == -1) {
+            stop_workers();
+            break;
+        }
+    }
+}
+
+void wait_for_workers(pthread_t *threads, int size) {
+    if (proxy_state == PROXY_DRAINING) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.drain_timeout;
+
+        pthread_mutex_lock(&workers_mutex);
+        while (workers_alive > 0) {
+            if (pthread_cond_timedwait(&workers_cond, &workers_mutex, &deadline) == ETIMEDOUT) {
+                fprintf(stderr, "Drain timeout, dropping %d busy pool threads\n", workers_alive);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&workers_mutex);
+        stop_workers();
     }
+
+    for (int i = 0; i < size; i++) pthread_join(threads[i], NULL);
+}
+
+void handle_drain_signal(int sig) {
+    (void)sig;
+    drain_requested = TRUE;
+}
+
+int setup_signals() {
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("main: signal error");
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = handle_drain_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;    //no SA_RESTART: select in main thread must see EINTR
+    if (sigaction(SIGTERM, &action, NULL) == -1) {
+        perror("main: sigaction error");
+        return -1;
+    }
+    return 0;
 }
 
 int parse_args(char *listen_port_str, int *listen_port, char *pool_size_str, int *pool_size) {
@@ -421,46 +682,125 @@ int parse_args(char *listen_port_str, int *listen_port, char *pool_size_str, int
 }
 
 void cleanup() {
+    snapshot_finish(&cache);
     cache_destroy(&cache);
+    shmcache_close();
+    close_socket(&peer_fd);
+    peer_destroy();
+    origin_destroy();
+    warm_destroy();
+    body_pools_destroy();
     pthread_mutex_destroy(&client_queue.mutex);
     pthread_cond_destroy(&client_queue.cond);
     pthread_mutex_destroy(&http_queue.mutex);
     pthread_cond_destroy(&http_queue.cond);
     pthread_rwlock_destroy(&global_client_list.rwlock);
     pthread_rwlock_destroy(&global_http_list.rwlock);
+    pthread_mutex_destroy(&workers_mutex);
+    pthread_cond_destroy(&workers_cond);
+    stats_destroy();
+    log_destroy();
     close(client_queue.wakeup_pipe_fd);
-    close(listen_fd);
+    if (client_queue.steer_pipe_fds != NULL) {
+        for (int i = 0; i < global_thread_count; i++) close(client_queue.steer_pipe_fds[i]);
+        free(client_queue.steer_pipe_fds);
+    }
+    affinity_destroy();
+    close(shutdown_pipe_fds[0]);
+    close(shutdown_pipe_fds[1]);
+    close_socket(&listen_fd);
+    if (handoff_fd != -1) {
+        close_socket(&handoff_fd);
+        if (!handed_off) unlink(config.handoff_path);   //after a handoff the path belongs to the new proxy
+    }
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s listen_port pool_size\n", argv[0]);
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s listen_port pool_size [option=value ...]\n", argv[0]);
         return EXIT_SUCCESS;
     }
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        perror("main: signal error");
-        return EXIT_FAILURE;
-    }
+    if (setup_signals() == -1) return EXIT_FAILURE;
 
     int fildes[2];
     if (open_wakeup_pipe(&fildes[0], &fildes[1]) == -1) {
         return EXIT_FAILURE;
     }
-    if (cache_init(&cache) != 0) {
-        fprintf(stderr, "Unable to init cache\n");
+    if (open_wakeup_pipe(&shutdown_pipe_fds[0], &shutdown_pipe_fds[1]) == -1) {
         return EXIT_FAILURE;
     }
-
     int port, pool_size;
     if (parse_args(argv[1], &port, argv[2], &pool_size) == -1) return EXIT_FAILURE;
-    if ((listen_fd = open_listen_socket(port)) == -1) return EXIT_FAILURE;
+    if (config_parse(argc - 3, argv + 3) == -1) return EXIT_FAILURE;
+    lockprof_enabled = config.lock_profile;
+    body_hugepages = config.hugepages;
+    if (config.cache_window > 100) {
+        fprintf(stderr, "Invalid cache_window %d, expected percent\n", config.cache_window);
+        return EXIT_FAILURE;
+    }
+    if (config.steer_incoming_cpu && !config.cpu_affinity) {
+        fprintf(stderr, "steer_incoming_cpu needs cpu_affinity=1\n");
+        return EXIT_FAILURE;
+    }
+    if (cache_init(&cache, (ssize_t)config.cache_size * 1024 * 1024, config.cache_window, config.cache_admission) != 0) {
+        fprintf(stderr, "Unable to init cache\n");
+        return EXIT_FAILURE;
+    }
+    int level = log_parse_level(config.log_level);
+    if (level == -1) {
+        fprintf(stderr, "Invalid log_level '%s', expected error, warn, info or debug\n", config.log_level);
+        return EXIT_FAILURE;
+    }
+    io_backend = poller_parse_backend(config.io_backend);
+    if (io_backend == -1) {
+        fprintf(stderr, "Invalid io_backend '%s', expected select or io_uring\n", config.io_backend);
+        return EXIT_FAILURE;
+    }
+    if (!poller_backend_supported(io_backend)) {
+        fprintf(stderr, "io_uring is not supported here (%s), falling back to select\n", strerror(errno));
+        io_backend = POLLER_BACKEND_SELECT;
+    }
+    if (stats_init(pool_size + 1) == -1) return EXIT_FAILURE;
+    stats_register_thread(pool_size);   //last slot belongs to main thread
+
+    //cache is warm before first connection is accepted
+    log_level = level;
+    if (config.shared_cache != NULL && shmcache_open(config.shared_cache, (size_t)config.shared_cache_size * 1024 * 1024) == -1) {
+        fprintf(stderr, "Shared cache '%s' is not available, cache stays local\n", config.shared_cache);
+    }
+    snapshot_load(&cache);
+    if (peer_init(port) == -1) {
+        fprintf(stderr, "Invalid peers '%s', expected comma separated host:port\n", config.peers);
+        return EXIT_FAILURE;
+    }
+    peer_fd = peer_open_answer_socket(port);
+
+    if (config.handoff_path != NULL) listen_fd = handoff_receive_listen_fd(config.handoff_path);
+    if (listen_fd != -1) fprintf(stderr, "Took listening socket over from previous proxy\n");
+    else if ((listen_fd = open_listen_socket(port)) == -1) return EXIT_FAILURE;
+    if (config.handoff_path != NULL) handoff_fd = handoff_open_server(config.handoff_path);
     atexit(cleanup);
 
     client_queue.wakeup_pipe_fd = fildes[0];
     client_queue.max_num = 0;
+    if (config.cpu_affinity && affinity_init() == -1) {
+        fprintf(stderr, "Unable to get cpus, pool threads are left unbound\n");
+        config.cpu_affinity = config.steer_incoming_cpu = FALSE;
+    }
+    if (config.steer_incoming_cpu) {
+        client_queue.steer_pipe_fds = (int *)malloc(sizeof(int) * pool_size);
+        if (client_queue.steer_pipe_fds == NULL) return EXIT_FAILURE;
+    }
     http_queue.wakeup_pipe_fd = fildes[0];
     http_queue.max_num = 0;
 
+    //drain signal must interrupt select in main thread, not in a pool thread
+    sigset_t drain_set, old_set;
+    sigemptyset(&drain_set);
+    sigaddset(&drain_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &drain_set, &old_set);
+    if (log_init(level) == -1) return EXIT_FAILURE;   //writer thread inherits blocked mask too
+
     int err_code, threads_created = 0;
     pthread_t threads[pool_size];
     thread_param_t param[pool_size];
@@ -468,6 +808,8 @@ int main(int argc, char **argv) {
     for (int i = 0; i < pool_size; i++) {
         param[i].index = i;
         param[i].new_connection_pipe_fd = fildes[1];
+        param[i].steer_pipe_fd = -1;
+        if (config.steer_incoming_cpu && open_wakeup_pipe(&client_queue.steer_pipe_fds[i], &param[i].steer_pipe_fd) == -1) break;
         param[i].http_size = 0;
         param[i].client_size = 0;
 
@@ -476,17 +818,21 @@ int main(int argc, char **argv) {
             print_error("Unable to create pool thread\n", err_code);
             break;
         }
-        pthread_detach(threads[i]);
         threads_created++;
     }
     fprintf(stderr, "Created %d out of %d pool threads!\n", threads_created, pool_size);
     if (threads_created == 0) return EXIT_FAILURE;
     global_thread_count = threads_created;
+    pthread_mutex_lock(&workers_mutex);
+    workers_alive = threads_created;
+    pthread_mutex_unlock(&workers_mutex);
     pthread_mutex_unlock(&client_queue.mutex);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
 
     proxy_spin(param, threads_created);
 
-    for (int i = 0; i < threads_created; i++) pthread_cancel(threads[i]);
+    wait_for_workers(threads, threads_created);
+    remove_all_connections();
     remove_all_queued_connections();
-    pthread_exit(NULL);
+    return EXIT_SUCCESS;
 }
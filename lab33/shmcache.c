@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmcache.h"
+#include "body.h"
+#include "stats.h"
+#include "logger.h"
+
+#define SHMCACHE_FREE 0         //pages are zero-filled, so unused chunks are free
+#define SHMCACHE_WRITING 1      //owned by one process that fills or frees it
+#define SHMCACHE_LINKED 2
+
+#define NO_CLASS 0xFF
+#define NO_ITEM 0ULL            //offsets are taken from segment start, header lives there
+
+#define ALIGNED(SIZE) (((SIZE) + 7) & ~(size_t)7)
+
+typedef struct shmcache_bucket {
+    pthread_mutex_t mutex;
+    unsigned long long head;
+} shmcache_bucket_t;
+
+typedef struct shmcache_class {
+    unsigned long long free_head;
+    unsigned long long hand;        //chunk clock looks at next, NO_ITEM before first eviction
+} shmcache_class_t;
+
+typedef struct shmcache_header {
+    char magic[8];
+    unsigned int version;
+    volatile unsigned int is_ready;     //set by creator once everything below is initialized
+    unsigned long long size;
+    unsigned long long buckets_offset, page_classes_offset, pages_offset;
+    unsigned int bucket_count, page_count;
+    volatile unsigned int pages_used;
+    pthread_mutex_t alloc_mutex;
+    shmcache_class_t classes[SHMCACHE_CLASSES];
+} shmcache_header_t;
+
+//followed by host, path and, aligned, response
+typedef struct shmcache_item {
+    unsigned long long next;            //bucket chain or free list
+    unsigned long long hash;
+    volatile unsigned int state;
+    volatile unsigned int referenced;   //clock bit, set by hits
+    int owner;                          //pid, while item is SHMCACHE_WRITING
+    unsigned int host_length, path_length;
+    int code, max_age, stale_while_revalidate, stale_if_error;
+    long long size;
+    long long completed_at;             //wall clock milliseconds, age starts here
+} shmcache_item_t;
+
+static shmcache_header_t *shm = NULL;
+static size_t shm_size = 0;
+
+size_t chunk_size(int class) {
+    return (size_t)1 << (SHMCACHE_MIN_CLASS_BITS + class);
+}
+
+int class_of(size_t size) {
+    for (int class = 0; class < SHMCACHE_CLASSES; class++) {
+        if (size <= chunk_size(class)) return class;
+    }
+    return -1;
+}
+
+shmcache_bucket_t *shm_buckets() {
+    return (shmcache_bucket_t *)((char *)shm + shm->buckets_offset);
+}
+
+unsigned char *shm_page_classes() {
+    return (unsigned char *)shm + shm->page_classes_offset;
+}
+
+unsigned long long page_offset(unsigned int page) {
+    return shm->pages_offset + (unsigned long long)page * SHMCACHE_PAGE_SIZE;
+}
+
+unsigned long long item_offset(shmcache_item_t *item) {
+    return (char *)item - (char *)shm;
+}
+
+//NULL unless offset is a chunk start in a used page, damaged links end where they point elsewhere
+shmcache_item_t *item_at(unsigned long long offset) {
+    if (offset < shm->pages_offset) return NULL;
+    unsigned long long relative = offset - shm->pages_offset;
+    unsigned long long page = relative / SHMCACHE_PAGE_SIZE;
+    if (page >= shm->pages_used) return NULL;
+    unsigned char class = shm_page_classes()[page];
+    if (class >= SHMCACHE_CLASSES || relative % SHMCACHE_PAGE_SIZE % chunk_size(class) != 0) return NULL;
+    return (shmcache_item_t *)((char *)shm + offset);
+}
+
+int process_is_alive(int pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+//1 if previous owner died and what mutex guards must be repaired, -1 if it is busy or cannot be used anymore
+int lock_robust(pthread_mutex_t *mutex, int is_try) {
+    int err_code = is_try ? pthread_mutex_trylock(mutex) : pthread_mutex_lock(mutex);
+    if (err_code == 0) return 0;
+    if (err_code == EOWNERDEAD) return 1;
+    if (err_code != EBUSY) LOG_ERROR("lock_robust: Unable to lock shared cache mutex: %s", strerror(err_code));
+    return -1;
+}
+
+//rest of chain after first item that does not belong to it is left to clock
+void repair_bucket(shmcache_bucket_t *bucket, unsigned int index) {
+    unsigned long long *link = &bucket->head;
+    unsigned long long items = 0, max_items = (unsigned long long)shm->pages_used * (SHMCACHE_PAGE_SIZE >> SHMCACHE_MIN_CLASS_BITS);
+    while (*link != NO_ITEM) {
+        shmcache_item_t *item = item_at(*link);
+        if (item == NULL || item->state != SHMCACHE_LINKED || (item->hash & (shm->bucket_count - 1)) != index || ++items > max_items) {
+            *link = NO_ITEM;
+            break;
+        }
+        link = &item->next;
+    }
+    pthread_mutex_consistent(&bucket->mutex);
+    STATS_INC(shared_recoveries);
+    LOG_WARN("Shared cache: bucket %u repaired after process holding it died", index);
+}
+
+shmcache_bucket_t *lock_bucket(unsigned long long hash, int is_try) {
+    unsigned int index = hash & (shm->bucket_count - 1);
+    shmcache_bucket_t *bucket = &shm_buckets()[index];
+    int result = lock_robust(&bucket->mutex, is_try);
+    if (result == -1) return NULL;
+    if (result == 1) repair_bucket(bucket, index);
+    return bucket;
+}
+
+void push_free(shmcache_item_t *item, int class) {
+    item->state = SHMCACHE_FREE;
+    item->next = shm->classes[class].free_head;
+    shm->classes[class].free_head = item_offset(item);
+}
+
+//free lists are rebuilt from item states, items of dead writers go back to them
+void repair_allocator() {
+    for (int class = 0; class < SHMCACHE_CLASSES; class++) {
+        shm->classes[class].free_head = NO_ITEM;
+        shm->classes[class].hand = NO_ITEM;
+    }
+    for (unsigned int page = 0; page < shm->pages_used; page++) {
+        unsigned char class = shm_page_classes()[page];
+        if (class >= SHMCACHE_CLASSES) continue;
+        for (size_t chunk = 0; chunk < SHMCACHE_PAGE_SIZE; chunk += chunk_size(class)) {
+            shmcache_item_t *item = (shmcache_item_t *)((char *)shm + page_offset(page) + chunk);
+            if (item->state == SHMCACHE_WRITING && !process_is_alive(item->owner)) item->state = SHMCACHE_FREE;
+            if (item->state == SHMCACHE_FREE) push_free(item, class);
+        }
+    }
+    pthread_mutex_consistent(&shm->alloc_mutex);
+    STATS_INC(shared_recoveries);
+    LOG_WARN("Shared cache: free lists rebuilt after process holding them died");
+}
+
+int lock_allocator() {
+    int result = lock_robust(&shm->alloc_mutex, FALSE);
+    if (result == 1) repair_allocator();
+    return result == -1 ? -1 : 0;
+}
+
+shmcache_item_t *pop_free(int class) {
+    shmcache_class_t *cls = &shm->classes[class];
+    if (cls->free_head == NO_ITEM) return NULL;
+    shmcache_item_t *item = item_at(cls->free_head);
+    if (item == NULL || item->state != SHMCACHE_FREE) {     //chunks behind damaged link wait for repair
+        cls->free_head = NO_ITEM;
+        return NULL;
+    }
+    cls->free_head = item->next;
+    return item;
+}
+
+//unused page goes to class, its chunks to free list
+shmcache_item_t *carve_page(int class) {
+    if (shm->pages_used == shm->page_count) return NULL;
+    unsigned int page = shm->pages_used;
+    shm_page_classes()[page] = class;
+    shm->pages_used = page + 1;
+    size_t size = chunk_size(class);
+    for (size_t chunk = SHMCACHE_PAGE_SIZE; chunk > 0; chunk -= size) {
+        push_free((shmcache_item_t *)((char *)shm + page_offset(page) + chunk - size), class);
+    }
+    return pop_free(class);
+}
+
+int find_class_page(int class, unsigned int from) {
+    for (unsigned int i = 0; i < shm->pages_used; i++) {
+        unsigned int page = (from + i) % shm->pages_used;
+        if (shm_page_classes()[page] == class) return page;
+    }
+    return -1;
+}
+
+//chunk under clock hand of class, hand moves on; NULL if class has no pages
+shmcache_item_t *advance_hand(int class) {
+    shmcache_class_t *cls = &shm->classes[class];
+    unsigned long long relative = cls->hand == NO_ITEM ? 0 : cls->hand - shm->pages_offset;
+    unsigned int page = relative / SHMCACHE_PAGE_SIZE;
+    size_t chunk = relative % SHMCACHE_PAGE_SIZE;
+    if (page >= shm->pages_used || shm_page_classes()[page] != class) {
+        int found = find_class_page(class, page);
+        if (found == -1) return NULL;
+        page = found;
+        chunk = 0;
+    }
+    shmcache_item_t *item = (shmcache_item_t *)((char *)shm + page_offset(page) + chunk);
+    chunk += chunk_size(class);
+    cls->hand = chunk < SHMCACHE_PAGE_SIZE ? page_offset(page) + chunk : page_offset((page + 1) % shm->pages_used);
+    return item;
+}
+
+int unlink_item(shmcache_bucket_t *bucket, shmcache_item_t *item) {
+    unsigned long long offset = item_offset(item);
+    for (unsigned long long *link = &bucket->head; *link != NO_ITEM; ) {
+        if (*link == offset) {
+            *link = item->next;
+            return TRUE;
+        }
+        shmcache_item_t *cur = item_at(*link);
+        if (cur == NULL) break;
+        link = &cur->next;
+    }
+    return FALSE;
+}
+
+//called with allocator lock held, buckets are only tried: their holders may wait for allocator
+shmcache_item_t *evict(int class) {
+    for (int i = 0; i < SHMCACHE_EVICT_SCAN; i++) {
+        shmcache_item_t *item = advance_hand(class);
+        if (item == NULL) return NULL;
+        if (item->state == SHMCACHE_FREE) continue;
+        if (item->state == SHMCACHE_WRITING) {
+            if (process_is_alive(item->owner)) continue;
+            return item;
+        }
+        if (item->referenced) {
+            item->referenced = FALSE;
+            continue;
+        }
+        shmcache_bucket_t *bucket = lock_bucket(item->hash, TRUE);
+        if (bucket == NULL) continue;
+        int is_linked = item->state == SHMCACHE_LINKED;     //replaced copy may have been taken meanwhile
+        if (is_linked) unlink_item(bucket, item);           //item of repaired chain is no longer in it
+        pthread_mutex_unlock(&bucket->mutex);
+        if (is_linked) return item;
+    }
+    return NULL;
+}
+
+shmcache_item_t *alloc_item(size_t size) {
+    int class = class_of(size);
+    if (class == -1 || lock_allocator() == -1) return NULL;
+    shmcache_item_t *item = pop_free(class);
+    if (item == NULL) item = carve_page(class);
+    if (item == NULL) item = evict(class);
+    if (item != NULL) {
+        item->owner = getpid();
+        item->state = SHMCACHE_WRITING;
+        item->referenced = FALSE;
+    }
+    pthread_mutex_unlock(&shm->alloc_mutex);
+    return item;
+}
+
+//item is SHMCACHE_WRITING and owned by this process
+void free_item(shmcache_item_t *item) {
+    if (lock_allocator() == -1) return;
+    push_free(item, shm_page_classes()[(item_offset(item) - shm->pages_offset) / SHMCACHE_PAGE_SIZE]);
+    pthread_mutex_unlock(&shm->alloc_mutex);
+}
+
+char *item_key(shmcache_item_t *item) {
+    return (char *)(item + 1);
+}
+
+char *item_data(shmcache_item_t *item) {
+    return item_key(item) + ALIGNED(item->host_length + item->path_length);
+}
+
+shmcache_item_t *find_item(shmcache_bucket_t *bucket, unsigned long long hash, str_view_t host, str_view_t path) {
+    for (unsigned long long offset = bucket->head; offset != NO_ITEM; ) {
+        shmcache_item_t *item = item_at(offset);
+        if (item == NULL) return NULL;
+        if (item->hash == hash && item->host_length == host.length && item->path_length == path.length &&
+            memcmp(item_key(item), host.data, host.length) == 0 && memcmp(item_key(item) + host.length, path.data, path.length) == 0) return item;
+        offset = item->next;
+    }
+    return NULL;
+}
+
+//complete response is copied in, older copy with same key is replaced
+void shmcache_store(cache_entry_t *entry) {
+    if (shm == NULL || entry->is_private) return;
+    size_t host_length = strlen(entry->host), path_length = strlen(entry->path);
+    shmcache_item_t *item = alloc_item(sizeof(shmcache_item_t) + ALIGNED(host_length + path_length) + entry->size);
+    if (item == NULL) return;
+
+    item->hash = entry->hash;
+    item->host_length = host_length;
+    item->path_length = path_length;
+    item->code = entry->code;
+    item->max_age = entry->max_age;
+    item->stale_while_revalidate = entry->stale_while_revalidate;
+    item->stale_if_error = entry->stale_if_error;
+    item->size = entry->size;
+    item->completed_at = wall_clock_ms() - cache_entry_age(entry);
+    memcpy(item_key(item), entry->host, host_length);
+    memcpy(item_key(item) + host_length, entry->path, path_length);
+    memcpy(item_data(item), entry->data, entry->size);
+
+    str_view_t host = { entry->host, host_length }, path = { entry->path, path_length };
+    shmcache_bucket_t *bucket = lock_bucket(item->hash, FALSE);
+    if (bucket == NULL) {
+        free_item(item);
+        return;
+    }
+    shmcache_item_t *old = find_item(bucket, item->hash, host, path);
+    if (old != NULL) {
+        unlink_item(bucket, old);
+        old->owner = getpid();
+        old->state = SHMCACHE_WRITING;
+    }
+    item->next = bucket->head;
+    item->state = SHMCACHE_LINKED;
+    __sync_synchronize();   //item is complete before chain points to it
+    bucket->head = item_offset(item);
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (old != NULL) free_item(old);
+    STATS_INC(shared_stores);
+}
+
+void free_meta(cache_entry_t *meta) {
+    free(meta->host);
+    free(meta->path);
+    if (meta->data != NULL) body_free(meta->data);
+}
+
+//copy of item becomes complete local entry, it comes with a reference for caller
+cache_entry_t *shmcache_fetch(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache) {
+    if (shm == NULL) return NULL;
+    shmcache_bucket_t *bucket = lock_bucket(hash, FALSE);
+    if (bucket == NULL) return NULL;
+
+    cache_entry_t meta;
+    memset(&meta, 0, sizeof(cache_entry_t));
+    long long age = 0;
+    int is_copied = FALSE;
+    shmcache_item_t *item = find_item(bucket, hash, host, path);
+    if (item != NULL) {
+        age = MAX(wall_clock_ms() - item->completed_at, 0);
+        if (age < (item->max_age + (long long)MAX(item->stale_while_revalidate, item->stale_if_error)) * 1000) {
+            item->referenced = TRUE;
+            meta.host = view_dup(host);
+            meta.path = view_dup(path);
+            meta.data = body_alloc(item->size);
+            if (meta.host != NULL && meta.path != NULL && meta.data != NULL) {
+                memcpy(meta.data, item_data(item), item->size);
+                meta.size = item->size;
+                meta.code = item->code;
+                meta.max_age = item->max_age;
+                meta.stale_while_revalidate = item->stale_while_revalidate;
+                meta.stale_if_error = item->stale_if_error;
+                is_copied = TRUE;
+            }
+        }
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    cache_entry_t *entry = is_copied ? cache_restore(&meta, age, 0, cache) : NULL;  //cache_find has counted request already
+    if (entry == NULL) {
+        free_meta(&meta);
+        return NULL;
+    }
+    STATS_INC(shared_hits);
+    return entry;
+}
+
+int init_segment(size_t size) {
+    unsigned int page_count = size / SHMCACHE_PAGE_SIZE, bucket_count = 0;
+    unsigned long long buckets_offset = ALIGNED(sizeof(shmcache_header_t)), page_classes_offset = 0, pages_offset = 0;
+    for (; page_count > 0; page_count--) {
+        for (bucket_count = 1024; bucket_count < page_count * SHMCACHE_BUCKETS_PER_PAGE; bucket_count *= 2);
+        page_classes_offset = buckets_offset + (unsigned long long)bucket_count * sizeof(shmcache_bucket_t);
+        pages_offset = (page_classes_offset + page_count + 4095) & ~4095ULL;
+        if (pages_offset + (unsigned long long)page_count * SHMCACHE_PAGE_SIZE <= size) break;
+    }
+    if (page_count == 0) {
+        LOG_ERROR("shmcache_open: %zu bytes do not fit a single page", size);
+        return -1;
+    }
+
+    memcpy(shm->magic, SHMCACHE_MAGIC, sizeof(shm->magic));
+    shm->version = SHMCACHE_VERSION;
+    shm->size = size;
+    shm->buckets_offset = buckets_offset;
+    shm->page_classes_offset = page_classes_offset;
+    shm->pages_offset = pages_offset;
+    shm->bucket_count = bucket_count;
+    shm->page_count = page_count;
+    shm->pages_used = 0;
+    for (int class = 0; class < SHMCACHE_CLASSES; class++) {
+        shm->classes[class].free_head = NO_ITEM;
+        shm->classes[class].hand = NO_ITEM;
+    }
+    memset(shm_page_classes(), NO_CLASS, page_count);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    int err_code = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (err_code == 0) err_code = pthread_mutex_init(&shm->alloc_mutex, &attr);
+    for (unsigned int i = 0; i < bucket_count && err_code == 0; i++) {
+        err_code = pthread_mutex_init(&shm_buckets()[i].mutex, &attr);
+        shm_buckets()[i].head = NO_ITEM;
+    }
+    pthread_mutexattr_destroy(&attr);
+    if (err_code != 0) {
+        LOG_ERROR("shmcache_open: Unable to init robust mutex: %s", strerror(err_code));
+        return -1;
+    }
+    __sync_synchronize();
+    shm->is_ready = TRUE;
+    return 0;
+}
+
+void sleep_ms(int ms) {
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = ms * 1000 * 1000 };
+    nanosleep(&interval, NULL);
+}
+
+//segment another process has created may not be sized yet
+size_t wait_for_size(int fd) {
+    for (int i = 0; i < SHMCACHE_OPEN_TIMEOUT * 100; i++) {
+        struct stat shm_stat;
+        if (fstat(fd, &shm_stat) == -1) {
+            LOG_ERRNO("shmcache_open: fstat error");
+            return 0;
+        }
+        if (shm_stat.st_size >= (off_t)sizeof(shmcache_header_t)) return shm_stat.st_size;
+        sleep_ms(10);
+    }
+    return 0;
+}
+
+int wait_until_ready(const char *name) {
+    for (int i = 0; i < SHMCACHE_OPEN_TIMEOUT * 100 && !shm->is_ready; i++) sleep_ms(10);
+    if (!shm->is_ready || memcmp(shm->magic, SHMCACHE_MAGIC, sizeof(shm->magic)) != 0 || shm->version != SHMCACHE_VERSION || shm->size > shm_size) {
+        LOG_ERROR("Shared cache: '%s' is not a usable segment, remove it when no proxy uses it", name);
+        return -1;
+    }
+    return 0;
+}
+
+//first process creates segment of given size, later ones attach to it as it is
+int shmcache_open(const char *name, size_t size) {
+    int is_creator = TRUE;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        is_creator = FALSE;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd == -1) {
+        LOG_ERRNO("shmcache_open: Unable to open shared memory '%s'", name);
+        return -1;
+    }
+    if (is_creator && ftruncate(fd, size) == -1) {
+        LOG_ERRNO("shmcache_open: Unable to size shared memory '%s'", name);
+        size = 0;
+    }
+    if (!is_creator) size = wait_for_size(fd);
+    void *map = size == 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (size != 0) LOG_ERRNO("shmcache_open: mmap error");
+        if (is_creator) shm_unlink(name);
+        return -1;
+    }
+
+    shm = (shmcache_header_t *)map;
+    shm_size = size;
+    if (is_creator ? init_segment(size) == -1 : wait_until_ready(name) == -1) {
+        shmcache_close();
+        if (is_creator) shm_unlink(name);
+        return -1;
+    }
+    LOG_INFO("Shared cache: %s '%s', %u pages of %d KiB, %u in use", is_creator ? "created" : "attached to", name,
+             shm->page_count, SHMCACHE_PAGE_SIZE / 1024, shm->pages_used);
+    return 0;
+}
+
+//segment stays for other processes and next start
+void shmcache_close() {
+    if (shm == NULL) return;
+    munmap(shm, shm_size);
+    shm = NULL;
+    shm_size = 0;
+}
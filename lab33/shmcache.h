@@ -0,0 +1,37 @@
+#include "cache.h"
+
+#ifndef LAB33_SHMCACHE_H
+#define LAB33_SHMCACHE_H
+
+#define SHMCACHE_MAGIC "L33SHMC"
+#define SHMCACHE_VERSION 1
+#define SHMCACHE_PAGE_SIZE (1024 * 1024)    //slab page, larger responses are not shared
+#define SHMCACHE_MIN_CLASS_BITS 10
+#define SHMCACHE_CLASSES 11                 //1 KiB .. 1 MiB chunks
+#define SHMCACHE_BUCKETS_PER_PAGE 64
+#define SHMCACHE_EVICT_SCAN 256             //chunks clock hand passes before store gives up
+#define SHMCACHE_OPEN_TIMEOUT 5             //seconds to wait for process that creates segment
+
+/*
+ * Cache tier shared by proxy processes of one host through named POSIX shared memory.
+ * Every process keeps its own cache_t; a local miss looks here before going upstream, and
+ * responses completed by any process are copied here. Hits are copied into local cache,
+ * so nothing outside the segment points into it and a process may go away at any time.
+ *
+ * Segment: header, hash buckets with chains of items, class of every slab page, pages.
+ * Page is given to a chunk size class when first needed; items are chunks holding key
+ * and response. Chains change under robust mutex of their bucket, free lists and pages
+ * under allocator mutex; bucket lock is taken first, allocator only tries bucket locks.
+ * Full class evicts by clock: hits set referenced bit, hand clears it or reclaims item.
+ *
+ * Process that dies holding a mutex leaves it to next owner, which repairs what it guards:
+ * chain is cut at first item that is not linked into that bucket, free lists are rebuilt
+ * from item states. Items a dead process was writing or freeing are reclaimed by clock.
+ */
+
+int shmcache_open(const char *name, size_t size);
+cache_entry_t *shmcache_fetch(str_view_t host, str_view_t path, unsigned long long hash, cache_t *cache);
+void shmcache_store(cache_entry_t *entry);
+void shmcache_close();
+
+#endif
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "body.h"
+#include "config.h"
+#include "logger.h"
+
+#define ALIGNED(SIZE) (((SIZE) + SNAPSHOT_ALIGN - 1) & ~((long long)SNAPSHOT_ALIGN - 1))
+
+typedef struct snapshot_index {
+    char *data;
+    size_t size, alloc_size;
+} snapshot_index_t;
+
+typedef struct snapshot_loader {
+    const char *map;
+    size_t *records;        //offsets of index records in map
+    unsigned int entries, next;
+    long long gap;          //milliseconds proxy was down
+    int restored, expired, failed;
+    cache_t *cache;
+} snapshot_loader_t;
+
+//background writer, next one joins previous
+static struct {
+    pthread_t thread;
+    int is_started, has_shutdown_snapshot;
+    volatile int is_writing;
+    cache_t *cache;
+    pthread_mutex_t mutex;
+} writer = { .is_started = FALSE, .has_shutdown_snapshot = FALSE, .is_writing = FALSE, .cache = NULL, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+void crc_init() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : crc >> 1;
+        crc_table[i] = crc;
+    }
+}
+
+//CRC-32 as in zlib
+unsigned int snapshot_checksum(const void *data, size_t size) {
+    pthread_once(&crc_once, crc_init);
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned int crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; i++) crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFU;
+}
+
+int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            LOG_ERRNO("snapshot: Unable to write to '%s'", config.snapshot_path);
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int write_padding(int fd, long long size) {
+    static const char zeros[SNAPSHOT_ALIGN] = { 0 };
+    return write_all(fd, zeros, ALIGNED(size) - size);
+}
+
+int index_append(snapshot_index_t *index, const snapshot_record_t *record, const char *host, const char *path) {
+    size_t size = ALIGNED(sizeof(snapshot_record_t) + record->host_length + record->path_length);
+    if (index->size + size > index->alloc_size) {
+        size_t alloc_size = MAX(index->alloc_size * 2, index->size + size + 64 * 1024);
+        char *check = (char *)realloc(index->data, alloc_size);
+        if (check == NULL) {
+            LOG_ERRNO("index_append: Unable to reallocate memory for snapshot index");
+            return -1;
+        }
+        index->data = check;
+        index->alloc_size = alloc_size;
+    }
+    char *cur = index->data + index->size;
+    memset(cur, 0, size);
+    memcpy(cur, record, sizeof(snapshot_record_t));
+    memcpy(cur + sizeof(snapshot_record_t), host, record->host_length);
+    memcpy(cur + sizeof(snapshot_record_t) + record->host_length, path, record->path_length);
+    index->size += size;
+    return 0;
+}
+
+//1 if written, 0 if entry is not complete yet
+int write_entry(int fd, cache_listing_t *listing, long long *offset, snapshot_index_t *index) {
+    cache_entry_t *entry = listing->entry;
+    read_lock_rwlock(&entry->rwlock, "write_entry: CACHE");
+    int is_full = entry->is_full;
+    unlock_rwlock(&entry->rwlock, "write_entry: CACHE");
+    if (!is_full || entry->size <= 0) return 0;     //complete entry does not change anymore
+
+    snapshot_record_t record;
+    memset(&record, 0, sizeof(snapshot_record_t));
+    record.data_offset = *offset;
+    record.size = entry->size;
+    record.age = cache_entry_age(entry);
+    record.code = entry->code;
+    record.max_age = entry->max_age;
+    record.stale_while_revalidate = entry->stale_while_revalidate;
+    record.stale_if_error = entry->stale_if_error;
+    record.frequency = listing->frequency;
+    record.host_length = strlen(entry->host);
+    record.path_length = strlen(entry->path);
+    record.checksum = snapshot_checksum(entry->data, entry->size);
+
+    if (write_all(fd, entry->data, entry->size) == -1 || write_padding(fd, entry->size) == -1) return -1;
+    *offset += ALIGNED(entry->size);
+    return index_append(index, &record, entry->host, entry->path) == -1 ? -1 : 1;
+}
+
+//returns number of written entries
+int snapshot_write(cache_t *cache) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", config.snapshot_path) >= (int)sizeof(tmp_path)) {
+        LOG_ERROR("snapshot_write: path '%s' is too long", config.snapshot_path);
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        LOG_ERRNO("snapshot_write: Unable to open '%s'", tmp_path);
+        return -1;
+    }
+    long long started_at = wall_clock_ms();
+
+    snapshot_index_t index = { .data = NULL, .size = 0, .alloc_size = 0 };
+    long long offset = SNAPSHOT_DATA_OFFSET;
+    unsigned int entries = 0;
+    int err_code = 0;
+    if (lseek(fd, offset, SEEK_SET) == -1) {
+        LOG_ERRNO("snapshot_write: lseek error");
+        err_code = -1;
+    }
+
+    //one page of references at a time, cache lock is not held while bodies are written
+    cache_listing_t page[CACHE_LIST_PAGE];
+    str_view_t any_host = { "", 0 };
+    int total, size;
+    for (int page_offset = 0; err_code == 0; page_offset += size) {
+        size = cache_list(any_host, page_offset, CACHE_LIST_PAGE, page, &total, cache);
+        for (int i = 0; i < size && err_code == 0; i++) {
+            int written = write_entry(fd, &page[i], &offset, &index);
+            if (written == -1) err_code = -1;
+            else entries += written;
+        }
+        cache_listing_release(page, size);
+        if (size < CACHE_LIST_PAGE) break;
+    }
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(snapshot_header_t));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.entries = entries;
+    header.index_offset = offset;
+    header.index_size = index.size;
+    header.written_at = wall_clock_ms();
+    header.index_checksum = snapshot_checksum(index.data, index.size);
+    header.header_checksum = snapshot_checksum(&header, offsetof(snapshot_header_t, header_checksum));
+
+    //header goes last, file without it is never renamed into place
+    if (err_code == 0) err_code = write_all(fd, index.data, index.size);
+    if (err_code == 0 && pwrite(fd, &header, sizeof(snapshot_header_t), 0) != sizeof(snapshot_header_t)) {
+        LOG_ERRNO("snapshot_write: Unable to write header");
+        err_code = -1;
+    }
+    if (err_code == 0 && fsync(fd) == -1) {
+        LOG_ERRNO("snapshot_write: fsync error");
+        err_code = -1;
+    }
+    free(index.data);
+    if (close(fd) == -1 && err_code == 0) {
+        LOG_ERRNO("snapshot_write: close error");
+        err_code = -1;
+    }
+    if (err_code == 0 && rename(tmp_path, config.snapshot_path) == -1) {
+        LOG_ERRNO("snapshot_write: Unable to rename '%s'", tmp_path);
+        err_code = -1;
+    }
+    if (err_code == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    LOG_INFO("Snapshot: %u entries, %lld bytes written to '%s' in %lld ms", entries, offset + (long long)index.size,
+             config.snapshot_path, header.written_at - started_at);
+    return entries;
+}
+
+void *snapshot_writer(void *param) {
+    (void)param;
+    snapshot_write(writer.cache);
+    writer.is_writing = FALSE;
+    return NULL;
+}
+
+//SNAPSHOT_BUSY while previous one is still written, -1 if writer could not be started
+int snapshot_start(cache_t *cache, int is_shutdown) {
+    if (config.snapshot_path == NULL) return SNAPSHOT_DISABLED;
+    pthread_mutex_lock(&writer.mutex);
+    if (writer.is_writing) {
+        pthread_mutex_unlock(&writer.mutex);
+        return SNAPSHOT_BUSY;
+    }
+    if (writer.is_started) pthread_join(writer.thread, NULL);
+    writer.is_started = FALSE;
+    writer.cache = cache;
+    writer.is_writing = TRUE;
+
+    //drain signal must keep going to main thread
+    sigset_t all_set, old_set;
+    sigfillset(&all_set);
+    pthread_sigmask(SIG_BLOCK, &all_set, &old_set);
+    int err_code = pthread_create(&writer.thread, NULL, snapshot_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    if (err_code != 0) {
+        writer.is_writing = FALSE;
+        pthread_mutex_unlock(&writer.mutex);
+        LOG_ERROR("snapshot_start: Unable to create writer thread: %s", strerror(err_code));
+        return -1;
+    }
+    writer.is_started = TRUE;
+    if (is_shutdown) writer.has_shutdown_snapshot = TRUE;
+    pthread_mutex_unlock(&writer.mutex);
+    return SNAPSHOT_STARTED;
+}
+
+//at exit: waits for running writer, writes snapshot itself if none was started on shutdown
+void snapshot_finish(cache_t *cache) {
+    if (config.snapshot_path == NULL) return;
+    pthread_mutex_lock(&writer.mutex);
+    if (writer.is_started) pthread_join(writer.thread, NULL);
+    writer.is_started = FALSE;
+    int has_shutdown_snapshot = writer.has_shutdown_snapshot;
+    pthread_mutex_unlock(&writer.mutex);
+    if (!has_shutdown_snapshot) snapshot_write(cache);
+}
+
+char *copy_string(const char *data, size_t length) {
+    char *copy = (char *)malloc(length + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+void load_entry(snapshot_loader_t *loader, unsigned int i) {
+    const snapshot_record_t *record = (const snapshot_record_t *)(loader->map + loader->records[i]);
+    long long age = record->age + loader->gap;
+    if (age >= (record->max_age + (long long)MAX(record->stale_while_revalidate, record->stale_if_error)) * 1000) {
+        __sync_fetch_and_add(&loader->expired, 1);
+        return;
+    }
+    const char *body = loader->map + record->data_offset;
+    if (snapshot_checksum(body, record->size) != record->checksum) {
+        LOG_WARN("Snapshot: body of entry %u is damaged", i);
+        __sync_fetch_and_add(&loader->failed, 1);
+        return;
+    }
+
+    cache_entry_t meta;
+    memset(&meta, 0, sizeof(cache_entry_t));
+    const char *name = (const char *)(record + 1);
+    meta.host = copy_string(name, record->host_length);
+    meta.path = copy_string(name + record->host_length, record->path_length);
+    meta.data = body_alloc(record->size);
+    if (meta.host != NULL && meta.path != NULL && meta.data != NULL) {
+        memcpy(meta.data, body, record->size);
+        meta.size = record->size;
+        meta.code = record->code;
+        meta.max_age = record->max_age;
+        meta.stale_while_revalidate = record->stale_while_revalidate;
+        meta.stale_if_error = record->stale_if_error;
+        cache_entry_t *entry = cache_restore(&meta, age, record->frequency, loader->cache);
+        if (entry != NULL) {
+            cache_entry_release(entry);
+            __sync_fetch_and_add(&loader->restored, 1);
+            return;
+        }
+    }
+    free(meta.host);
+    free(meta.path);
+    if (meta.data != NULL) body_free(meta.data);
+    __sync_fetch_and_add(&loader->failed, 1);
+}
+
+void *snapshot_loader_worker(void *param) {
+    snapshot_loader_t *loader = (snapshot_loader_t *)param;
+    while (TRUE) {
+        unsigned int i = __sync_fetch_and_add(&loader->next, 1);
+        if (i >= loader->entries) break;
+        load_entry(loader, i);
+    }
+    return NULL;
+}
+
+//header is trusted only after this, entries must fit into index before anything is allocated for them
+int check_snapshot_header(const char *map, size_t file_size) {
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    if (file_size < SNAPSHOT_DATA_OFFSET || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return -1;
+    if (header->header_checksum != snapshot_checksum(header, offsetof(snapshot_header_t, header_checksum))) return -1;
+    if (header->version != SNAPSHOT_VERSION || header->index_offset < SNAPSHOT_DATA_OFFSET || header->index_size < 0) return -1;
+    if ((unsigned long long)header->index_offset + header->index_size != file_size) return -1;
+    if (header->entries > (unsigned long long)header->index_size / sizeof(snapshot_record_t)) return -1;
+    return 0;
+}
+
+//index is checked whole, records must point inside file
+int check_snapshot_index(const char *map, size_t *records) {
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    const char *index = map + header->index_offset;
+    if (header->index_checksum != snapshot_checksum(index, header->index_size)) return -1;
+    long long cur = 0;
+    for (unsigned int i = 0; i < header->entries; i++) {
+        if (header->index_size - cur < (long long)sizeof(snapshot_record_t)) return -1;
+        const snapshot_record_t *record = (const snapshot_record_t *)(index + cur);
+        long long rest = header->index_size - cur - sizeof(snapshot_record_t);
+        if (record->host_length > rest || record->path_length > rest - record->host_length) return -1;
+        if (record->data_offset < SNAPSHOT_DATA_OFFSET || record->size <= 0 || record->size > header->index_offset - record->data_offset) return -1;
+        records[i] = header->index_offset + cur;
+        cur += ALIGNED(sizeof(snapshot_record_t) + record->host_length + record->path_length);
+    }
+    return 0;
+}
+
+//returns number of restored entries, -1 if there is no usable snapshot
+int snapshot_load(cache_t *cache) {
+    if (config.snapshot_path == NULL) return -1;
+    int fd = open(config.snapshot_path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) LOG_INFO("Snapshot: '%s' does not exist yet, cache starts empty", config.snapshot_path);
+        else LOG_ERRNO("snapshot_load: Unable to open '%s'", config.snapshot_path);
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        LOG_ERRNO("snapshot_load: fstat error");
+        close(fd);
+        return -1;
+    }
+    size_t file_size = file_stat.st_size;
+    if (file_size < SNAPSHOT_DATA_OFFSET) {
+        LOG_WARN("Snapshot: '%s' is not a cache snapshot, cache starts empty", config.snapshot_path);
+        close(fd);
+        return -1;
+    }
+    char *map = (char *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO("snapshot_load: mmap error");
+        return -1;
+    }
+    posix_madvise(map, file_size, POSIX_MADV_WILLNEED);
+    long long started_at = wall_clock_ms();
+
+    const snapshot_header_t *header = (const snapshot_header_t *)map;
+    if (check_snapshot_header(map, file_size) == -1) {
+        LOG_WARN("Snapshot: '%s' is damaged, cache starts empty", config.snapshot_path);
+        munmap(map, file_size);
+        return -1;
+    }
+    snapshot_loader_t loader = { .map = map, .records = NULL, .entries = header->entries, .next = 0,
+                                 .gap = MAX(started_at - header->written_at, 0), .restored = 0, .expired = 0, .failed = 0, .cache = cache };
+    loader.records = (size_t *)malloc(sizeof(size_t) * MAX(loader.entries, 1));
+    if (loader.records == NULL || check_snapshot_index(map, loader.records) == -1) {
+        if (loader.records == NULL) LOG_ERRNO("snapshot_load: Unable to allocate memory for index");
+        else LOG_WARN("Snapshot: '%s' is damaged, cache starts empty", config.snapshot_path);
+        free(loader.records);
+        munmap(map, file_size);
+        return -1;
+    }
+
+    //calling thread takes entries too
+    int threads_num = MAX(config.snapshot_threads, 1), threads_created = 0;
+    pthread_t threads[threads_num];
+    for (int i = 1; i < threads_num; i++) {
+        if (pthread_create(&threads[threads_created], NULL, snapshot_loader_worker, &loader) != 0) break;
+        threads_created++;
+    }
+    snapshot_loader_worker(&loader);
+    for (int i = 0; i < threads_created; i++) pthread_join(threads[i], NULL);
+
+    LOG_INFO("Snapshot: restored %d entries from '%s' in %lld ms by %d threads, %d expired, %d failed", loader.restored,
+             config.snapshot_path, wall_clock_ms() - started_at, threads_created + 1, loader.expired, loader.failed);
+    free(loader.records);
+    munmap(map, file_size);
+    return loader.restored;
+}
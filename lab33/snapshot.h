@@ -0,0 +1,48 @@
+#include "cache.h"
+
+#ifndef LAB33_SNAPSHOT_H
+#define LAB33_SNAPSHOT_H
+
+#define SNAPSHOT_MAGIC "L33CACHE"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DATA_OFFSET 4096   //bodies start after header page
+#define SNAPSHOT_ALIGN 8
+
+#define SNAPSHOT_STARTED 0
+#define SNAPSHOT_BUSY 1
+#define SNAPSHOT_DISABLED 2
+
+/*
+ * Cache snapshot, file at config.snapshot_path:
+ *   header     magic, version, entries, where index is, wall clock time of writing, checksums
+ *   bodies     complete responses one after another, each aligned
+ *   index      record per entry with its body offset, size, checksum, age and policy fields,
+ *              followed by host and path
+ * Writer collects cache page by page, so workers go on serving while it writes; file is written
+ * under temporary name and renamed when complete. Loader maps file and restores entries in
+ * config.snapshot_threads threads before listening socket is opened, entries whose body checksum
+ * does not match or that expired meanwhile are left out. Snapshot is best effort: entries added
+ * or removed while it is written may be missed.
+ */
+
+typedef struct snapshot_header {
+    char magic[8];
+    unsigned int version, entries;
+    long long index_offset, index_size;
+    long long written_at;           //milliseconds since epoch, ages go on while proxy is down
+    unsigned int index_checksum;
+    unsigned int header_checksum;   //of fields above
+} snapshot_header_t;
+
+typedef struct snapshot_record {
+    long long data_offset, size, age;   //age in milliseconds when snapshot was written
+    int code, max_age, stale_while_revalidate, stale_if_error, frequency;
+    unsigned int host_length, path_length;
+    unsigned int checksum;              //of body
+} snapshot_record_t;
+
+int snapshot_load(cache_t *cache);
+int snapshot_start(cache_t *cache, int is_shutdown);
+void snapshot_finish(cache_t *cache);
+
+#endif
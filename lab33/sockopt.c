@@ -0,0 +1,96 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <errno.h>
+#include "sockopt.h"
+#include "states.h"
+#include "config.h"
+#include "stats.h"
+#include "logger.h"
+
+typedef struct sockopt {
+    const char *name;
+    int level, option;
+    int scale;                      //config gives buffer sizes in kilobytes
+    int *values[SOCKOPT_ROLES];     //config value by role, NULL where option is not used
+} sockopt_t;
+
+static int kernel_default = 0;      //option is only reported for this role
+
+static sockopt_t options[] = {
+    { "tcp_nodelay", IPPROTO_TCP, TCP_NODELAY, 1, { NULL, &config.tcp_nodelay, &config.tcp_nodelay } },
+    { "so_sndbuf", SOL_SOCKET, SO_SNDBUF, 1024, { NULL, &config.client_sndbuf, &kernel_default } },
+    { "so_rcvbuf", SOL_SOCKET, SO_RCVBUF, 1024, { &kernel_default, &kernel_default, &config.origin_rcvbuf } },
+    #ifdef TCP_DEFER_ACCEPT
+    { "tcp_defer_accept", IPPROTO_TCP, TCP_DEFER_ACCEPT, 1, { &config.defer_accept, NULL, NULL } },
+    #endif
+    #ifdef TCP_FASTOPEN
+    { "tcp_fastopen", IPPROTO_TCP, TCP_FASTOPEN, 1, { &config.fastopen, NULL, NULL } },
+    #endif
+    #ifdef TCP_FASTOPEN_CONNECT
+    { "tcp_fastopen_connect", IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, { NULL, NULL, &config.origin_fastopen } },
+    #endif
+};
+
+#define OPTIONS_NUM (sizeof(options) / sizeof(options[0]))
+
+static const char *role_names[SOCKOPT_ROLES] = { "listener", "client", "origin" };
+static int effective[SOCKOPT_ROLES][OPTIONS_NUM];
+static int is_claimed[SOCKOPT_ROLES];              //first socket of role reads options back
+static volatile int is_read_back[SOCKOPT_ROLES];   //set after effective values are complete
+
+void read_back(int sock_fd, int role) {
+    for (size_t i = 0; i < OPTIONS_NUM; i++) {
+        int value = -1;
+        socklen_t length = sizeof(int);
+        if (options[i].values[role] == NULL || getsockopt(sock_fd, options[i].level, options[i].option, &value, &length) == -1) value = -1;
+        effective[role][i] = value;
+    }
+}
+
+//failures are not fatal, socket works with kernel default then
+void sockopt_apply(int sock_fd, int role) {
+    int is_first = __sync_bool_compare_and_swap(&is_claimed[role], FALSE, TRUE);
+    for (size_t i = 0; i < OPTIONS_NUM; i++) {
+        if (options[i].values[role] == NULL || *options[i].values[role] <= 0) continue;
+        int value = *options[i].values[role] * options[i].scale;
+        if (setsockopt(sock_fd, options[i].level, options[i].option, &value, sizeof(int)) == -1) {
+            STATS_INC(sockopt_errors);
+            if (is_first) LOG_ERRNO("sockopt_apply: Unable to set %s=%d on %s socket", options[i].name, value, role_names[role]);
+        }
+    }
+    if (is_first) {
+        read_back(sock_fd, role);
+        __sync_synchronize();   //values are written before stats may see flag
+        is_read_back[role] = TRUE;
+    }
+}
+
+//response is not over and rest of it follows soon: kernel holds partial segment until next send
+ssize_t sockopt_send(int sock_fd, const char *data, size_t size, int is_more) {
+    int flags = 0;
+    #ifdef MSG_MORE
+    if (is_more && config.cork) flags |= MSG_MORE;
+    #endif
+    return send(sock_fd, data, size, flags);
+}
+
+int sockopt_count(void) {
+    return (int)OPTIONS_NUM;
+}
+
+const char *sockopt_name(int index) {
+    return options[index].name;
+}
+
+const char *sockopt_role_name(int role) {
+    return role_names[role];
+}
+
+//-1 if option is not used for role or no socket of role was opened yet
+int sockopt_effective(int role, int index) {
+    if (!is_read_back[role]) return -1;
+    __sync_synchronize();
+    return effective[role][index];
+}
@@ -0,0 +1,25 @@
+#include <sys/types.h>
+
+#ifndef LAB33_SOCKOPT_H
+#define LAB33_SOCKOPT_H
+
+#define SOCKOPT_LISTENER 0
+#define SOCKOPT_CLIENT 1
+#define SOCKOPT_ORIGIN 2
+#define SOCKOPT_ROLES 3
+
+/*
+ * Socket options by role of socket, taken from config at startup. Option set to 0 keeps
+ * kernel default, options platform does not have are skipped. Values kernel actually uses
+ * are read back from first socket of each role and shown in stats.
+ */
+
+void sockopt_apply(int sock_fd, int role);
+ssize_t sockopt_send(int sock_fd, const char *data, size_t size, int is_more);
+
+int sockopt_count(void);
+const char *sockopt_name(int index);
+const char *sockopt_role_name(int role);
+int sockopt_effective(int role, int index);
+
+#endif
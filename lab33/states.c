@@ -6,7 +6,9 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include "states.h"
+#include "lockprof.h"
 
 void print_error(const char *prefix, int code) {
     if (prefix == NULL) prefix = "error";
@@ -35,6 +37,31 @@ int convert_number(char *str, int *number) {
     return 0;
 }
 
+str_view_t view_of(const char *str) {
+    str_view_t view = { .data = str, .length = strlen(str) };
+    return view;
+}
+
+int view_equals(str_view_t view, const char *str) {
+    for (size_t i = 0; i < view.length; i++) {
+        if (str[i] == '\0' || str[i] != view.data[i]) return FALSE;
+    }
+    return str[view.length] == '\0';
+}
+
+int views_equal(str_view_t view1, str_view_t view2) {
+    return view1.length == view2.length && memcmp(view1.data, view2.data, view1.length) == 0;
+}
+
+//owned copy for http or cache entry that keeps the key
+char *view_dup(str_view_t view) {
+    char *str = (char *)malloc(view.length + 1);
+    if (str == NULL) return NULL;
+    memcpy(str, view.data, view.length);
+    str[view.length] = '\0';
+    return str;
+}
+
 int strings_equal_by_length(const char *str1, size_t len1, const char *str2, size_t len2) {
     if (len1 != len2) return FALSE;
     if (str1 == NULL || str2 == NULL) return FALSE;
@@ -59,6 +86,14 @@ void close_socket(int *sock_fd) {
     *sock_fd = -1;
 }
 
+//result of non-blocking connect, checked once socket becomes writable
+int get_connect_error(int sock_fd) {
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1) error = errno;
+    return error;
+}
+
 void free_with_null(void **mem) {
     if (mem == NULL) return;
     free(*mem);
@@ -66,7 +101,7 @@ void free_with_null(void **mem) {
 }
 
 int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
-    int err_code = pthread_rwlock_rdlock(rwlock);
+    int err_code = lockprof_enabled ? lockprof_rdlock(rwlock, error) : pthread_rwlock_rdlock(rwlock);
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
@@ -74,7 +109,7 @@ int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
 }
 
 int write_lock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
-    int err_code = pthread_rwlock_wrlock(rwlock);
+    int err_code = lockprof_enabled ? lockprof_wrlock(rwlock, error) : pthread_rwlock_wrlock(rwlock);
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
@@ -86,9 +121,17 @@ int unlock_rwlock(pthread_rwlock_t *rwlock, const char *error) {
     if (err_code != 0) {
         if (ERROR_LOG) print_error(error, err_code);
     }
+    else lockprof_unlocked(rwlock);
     return err_code;
 }
 
+//milliseconds since epoch, for ages that outlive this process
+long long wall_clock_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
 int open_wakeup_pipe(int *fd1, int *fd2) {
     int fildes[2];
     if (pipe(fildes) == -1) {
@@ -4,13 +4,27 @@
 //#define DROP_HTTP_NO_CLIENTS
 
 #define BUF_SIZE 4096
+#define REQUEST_BUF_SIZE (16 * 1024 - 16)   //request headers of one client, fills 16 KiB block of body pool
+#define SPLICE_CHUNK_SIZE (64 * 1024)    //default pipe capacity on linux
 
+#define HTTP_DEFAULT_PORT 80
+#define HOSTNAME_MAX_SIZE 256
+
+#define PEER_LOOKUP 4           //only for client, miss waits for answers of peer nodes
+#define TUNNELING 3             //only for client
 #define GETTING_FROM_CACHE 2    //only for client
 #define DOWNLOADING 1
 #define AWAITING_REQUEST 0
 #define SOCK_DONE (-1)
 #define SOCK_ERROR (-2)
 
+#define PROXY_RUNNING 0
+#define PROXY_DRAINING 1     //no new connections, in-flight responses are finished
+#define PROXY_STOPPED 2      //workers leave their loops immediately
+
+#define DRAIN_POLL_INTERVAL 1   //seconds between drain checks in select
+#define ACCEPT_PAUSE_INTERVAL 50    //milliseconds between load checks while accept is paused
+
 #define HTTP_NO_HEADERS (-1)
 
 #define HTTP_CODE_UNDEFINED (-1)
@@ -20,6 +34,12 @@
 #define HTTP_RESPONSE_CHUNKED (1)
 #define HTTP_RESPONSE_NONE (0)
 
+#define REQUEST_GET 0
+#define REQUEST_CONNECT 1
+#define REQUEST_UPLOAD 2    //POST and PUT, their bodies are streamed upstream
+
+#define UPLOAD_CHUNKED (-1) //upload_left while chunked body goes on
+
 #define TRUE 1
 #define FALSE 0
 
@@ -32,18 +52,31 @@
 #define IS_ERROR_STATUS(STATUS) ((STATUS) == SOCK_ERROR)
 #define IS_ERROR_OR_DONE_STATUS(STATUS) ((STATUS) < 0)
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+
+//string inside buffer someone else owns, not NUL terminated
+typedef struct str_view {
+    const char *data;
+    size_t length;
+} str_view_t;
 
 void print_error(const char *prefix, int code);
 int convert_number(char *str, int *number);
 int strings_equal_by_length(const char *str1, size_t len1, const char *str2, size_t len2);
 int get_number_from_string_by_length(const char *str, size_t length);
+str_view_t view_of(const char *str);
+int view_equals(str_view_t view, const char *str);
+int views_equal(str_view_t view1, str_view_t view2);
+char *view_dup(str_view_t view);
 void close_socket(int *sock_fd);
+int get_connect_error(int sock_fd);
 void free_with_null(void **mem);
 
 int read_lock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
 int write_lock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
 int unlock_rwlock(pthread_rwlock_t *rwlock, const char *func_name);
 
+long long wall_clock_ms();
 int open_wakeup_pipe(int *fd1, int *fd2);
 
 #endif
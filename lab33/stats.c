@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "states.h"
+#include "sockopt.h"
+
+#define RENDER_CHUNK 4096
+
+__thread stats_t *thread_stats = NULL;
+
+static stats_t *stats_slots = NULL;
+static int stats_slots_num = 0;
+
+//upper bounds in microseconds for exported prometheus buckets
+static const long long export_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+static const double export_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+#define EXPORT_BOUNDS_NUM (sizeof(export_bounds) / sizeof(export_bounds[0]))
+#define EXPORT_QUANTILES_NUM (sizeof(export_quantiles) / sizeof(export_quantiles[0]))
+
+int stats_init(int slots) {
+    stats_slots = (stats_t *)calloc(slots, sizeof(stats_t));
+    if (stats_slots == NULL) {
+        if (ERROR_LOG) perror("stats_init: Unable to allocate memory for stats");
+        return -1;
+    }
+    stats_slots_num = slots;
+    return 0;
+}
+
+void stats_register_thread(int slot) {
+    if (slot < 0 || slot >= stats_slots_num) return;
+    thread_stats = &stats_slots[slot];
+}
+
+void stats_destroy() {
+    free(stats_slots);
+    stats_slots = NULL;
+    stats_slots_num = 0;
+}
+
+long long stats_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int histogram_index(long long value) {
+    if (value < 0) value = 0;
+    if (value < HISTOGRAM_SUB_COUNT) return (int)value;
+
+    int msb = 0;
+    while ((value >> (msb + 1)) != 0) msb++;
+    if (msb >= HISTOGRAM_MAX_BITS) return HISTOGRAM_SIZE - 1;
+
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT + (int)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+long long histogram_bucket_upper_bound(int index) {
+    if (index < HISTOGRAM_SUB_COUNT) return index;
+    int shift = index / HISTOGRAM_SUB_COUNT - 1;
+    long long sub = index % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, long long value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->total_count++;
+    histogram->sum += value < 0 ? 0 : value;
+}
+
+void histogram_merge(histogram_t *dest, const histogram_t *src) {
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) dest->counts[i] += src->counts[i];
+    dest->total_count += src->total_count;
+    dest->sum += src->sum;
+}
+
+long long histogram_quantile(const histogram_t *histogram, double quantile) {
+    if (histogram->total_count == 0) return 0;
+    counter_t rank = (counter_t)(quantile * histogram->total_count);
+    if (rank == 0) rank = 1;
+
+    counter_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) return histogram_bucket_upper_bound(i);
+    }
+    return histogram_bucket_upper_bound(HISTOGRAM_SIZE - 1);
+}
+
+//slots are read while owners keep writing them, totals may be off by in-flight increments
+void stats_collect(stats_t *total) {
+    memset(total, 0, sizeof(stats_t));
+    for (int i = 0; i < stats_slots_num; i++) {
+        stats_t *slot = &stats_slots[i];
+        total->connections += slot->connections;
+        total->disconnections += slot->disconnections;
+        total->requests += slot->requests;
+        total->hits += slot->hits;
+        total->misses += slot->misses;
+        total->coalesced += slot->coalesced;
+        total->client_bytes_in += slot->client_bytes_in;
+        total->client_bytes_out += slot->client_bytes_out;
+        total->upstream_bytes_in += slot->upstream_bytes_in;
+        total->upstream_bytes_out += slot->upstream_bytes_out;
+        total->upstream_connects += slot->upstream_connects;
+        total->upstream_connect_errors += slot->upstream_connect_errors;
+        total->upstream_connect_time += slot->upstream_connect_time;
+        total->upstream_closes += slot->upstream_closes;
+        total->client_timeouts += slot->client_timeouts;
+        total->upstream_timeouts += slot->upstream_timeouts;
+        total->poll_waits += slot->poll_waits;
+        total->passthroughs += slot->passthroughs;
+        total->spliced_bytes += slot->spliced_bytes;
+        total->tunnels += slot->tunnels;
+        total->body_allocs += slot->body_allocs;
+        total->body_reallocs += slot->body_reallocs;
+        total->cache_evictions += slot->cache_evictions;
+        total->cache_rejects += slot->cache_rejects;
+        total->stale_hits += slot->stale_hits;
+        total->stale_if_error += slot->stale_if_error;
+        total->negative_hits += slot->negative_hits;
+        total->failed_host_hits += slot->failed_host_hits;
+        total->origin_queued += slot->origin_queued;
+        total->origin_dequeued += slot->origin_dequeued;
+        total->origin_wait_time += slot->origin_wait_time;
+        total->egress_rounds += slot->egress_rounds;
+        total->egress_throttled += slot->egress_throttled;
+        total->rejected += slot->rejected;
+        total->accept_pauses += slot->accept_pauses;
+        total->steered += slot->steered;
+        total->sockopt_errors += slot->sockopt_errors;
+        total->canonicalized += slot->canonicalized;
+        total->purged += slot->purged;
+        total->warmed += slot->warmed;
+        total->shared_hits += slot->shared_hits;
+        total->shared_stores += slot->shared_stores;
+        total->shared_recoveries += slot->shared_recoveries;
+        total->peer_queries += slot->peer_queries;
+        total->peer_hits += slot->peer_hits;
+        total->peer_routed += slot->peer_routed;
+        total->peer_answers += slot->peer_answers;
+        total->revalidations += slot->revalidations;
+        histogram_merge(&total->ttfb, &slot->ttfb);
+        histogram_merge(&total->response_time, &slot->response_time);
+    }
+}
+
+void render_append(render_buffer_t *buffer, const char *format, ...) {
+    if (buffer->error) return;
+
+    while (TRUE) {
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(buffer->data + buffer->size, buffer->alloc_size - buffer->size, format, args);
+        va_end(args);
+
+        if (length < 0) {
+            buffer->error = TRUE;
+            return;
+        }
+        if (buffer->size + length < buffer->alloc_size) {
+            buffer->size += length;
+            return;
+        }
+
+        char *check = (char *)realloc(buffer->data, buffer->alloc_size + MAX(RENDER_CHUNK, length + 1));
+        if (check == NULL) {
+            if (ERROR_LOG) perror("render_append: Unable to reallocate memory for stats");
+            buffer->error = TRUE;
+            return;
+        }
+        buffer->data = check;
+        buffer->alloc_size += MAX(RENDER_CHUNK, length + 1);
+    }
+}
+
+void render_counter(render_buffer_t *buffer, const char *name, const char *help, counter_t value) {
+    render_append(buffer, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+void render_histogram(render_buffer_t *buffer, const char *name, const char *help, const histogram_t *histogram) {
+    render_append(buffer, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    int index = 0;
+    counter_t cumulative = 0;
+    for (size_t i = 0; i < EXPORT_BOUNDS_NUM; i++) {
+        while (index < HISTOGRAM_SIZE && histogram_bucket_upper_bound(index) <= export_bounds[i]) {
+            cumulative += histogram->counts[index++];
+        }
+        render_append(buffer, "%s_bucket{le=\"%g\"} %llu\n", name, export_bounds[i] / 1e6, cumulative);
+    }
+    render_append(buffer, "%s_bucket{le=\"+Inf\"} %llu\n", name, histogram->total_count);
+    render_append(buffer, "%s_sum %.6f\n%s_count %llu\n", name, histogram->sum / 1e6, name, histogram->total_count);
+
+    render_append(buffer, "# TYPE %s_quantile gauge\n", name);
+    for (size_t i = 0; i < EXPORT_QUANTILES_NUM; i++) {
+        render_append(buffer, "%s_quantile{quantile=\"%g\"} %.6f\n", name, export_quantiles[i], histogram_quantile(histogram, export_quantiles[i]) / 1e6);
+    }
+}
+
+//prometheus text exposition format, caller frees the result
+char *stats_render(ssize_t *size) {
+    stats_t *total = (stats_t *)malloc(sizeof(stats_t));
+    if (total == NULL) {
+        if (ERROR_LOG) perror("stats_render: Unable to allocate memory for stats");
+        return NULL;
+    }
+    stats_collect(total);
+
+    render_buffer_t buffer = { .data = NULL, .size = 0, .alloc_size = 0, .error = FALSE };
+    render_counter(&buffer, "proxy_connections_total", "Accepted client connections.", total->connections);
+    render_counter(&buffer, "proxy_requests_total", "Parsed client requests.", total->requests);
+    render_counter(&buffer, "proxy_cache_hits_total", "Requests served from complete cache entries.", total->hits);
+    render_counter(&buffer, "proxy_cache_misses_total", "Requests that opened a new upstream connection.", total->misses);
+    render_counter(&buffer, "proxy_coalesced_requests_total", "Requests attached to an already running upstream download.", total->coalesced);
+    render_counter(&buffer, "proxy_client_bytes_received_total", "Bytes read from clients.", total->client_bytes_in);
+    render_counter(&buffer, "proxy_client_bytes_sent_total", "Bytes written to clients.", total->client_bytes_out);
+    render_counter(&buffer, "proxy_upstream_bytes_received_total", "Bytes read from origins.", total->upstream_bytes_in);
+    render_counter(&buffer, "proxy_upstream_bytes_sent_total", "Bytes written to origins.", total->upstream_bytes_out);
+    render_counter(&buffer, "proxy_upstream_connects_total", "Started upstream connects.", total->upstream_connects);
+    render_counter(&buffer, "proxy_upstream_connect_errors_total", "Failed upstream resolves and immediately failed connects.", total->upstream_connect_errors);
+    render_counter(&buffer, "proxy_client_timeouts_total", "Clients closed by idle or request header timeout.", total->client_timeouts);
+    render_counter(&buffer, "proxy_upstream_timeouts_total", "Upstreams closed by connect, first byte or idle timeout.", total->upstream_timeouts);
+    render_counter(&buffer, "proxy_poll_waits_total", "Readiness waits of worker loops, one syscall each.", total->poll_waits);
+    render_counter(&buffer, "proxy_passthroughs_total", "Uncacheable responses spliced from upstream to client.", total->passthroughs);
+    render_counter(&buffer, "proxy_spliced_bytes_total", "Response bytes moved by splice, without copies to user space.", total->spliced_bytes);
+    render_counter(&buffer, "proxy_tunnels_total", "CONNECT tunnels opened.", total->tunnels);
+    render_counter(&buffer, "proxy_body_allocs_total", "Response buffers allocated once at their final size.", total->body_allocs);
+    render_counter(&buffer, "proxy_body_reallocs_total", "Growths of response buffers of unknown size.", total->body_reallocs);
+    render_counter(&buffer, "proxy_cache_evictions_total", "Complete entries evicted to make room.", total->cache_evictions);
+    render_counter(&buffer, "proxy_cache_rejects_total", "Entries that left window without being admitted to main cache.", total->cache_rejects);
+    render_counter(&buffer, "proxy_stale_hits_total", "Expired entries served while they were revalidated.", total->stale_hits);
+    render_counter(&buffer, "proxy_stale_if_error_total", "Expired entries served because origin failed.", total->stale_if_error);
+    render_counter(&buffer, "proxy_negative_hits_total", "Hits on cached error and redirect responses.", total->negative_hits);
+    render_counter(&buffer, "proxy_failed_host_hits_total", "Requests answered locally because their host recently failed.", total->failed_host_hits);
+    render_counter(&buffer, "proxy_revalidations_total", "Background refreshes of expired entries.", total->revalidations);
+    render_append(&buffer, "# HELP proxy_upstream_connect_seconds_total Time spent resolving origins and starting connects.\n");
+    render_append(&buffer, "# TYPE proxy_upstream_connect_seconds_total counter\nproxy_upstream_connect_seconds_total %.6f\n", total->upstream_connect_time / 1e6);
+    render_append(&buffer, "# TYPE proxy_active_clients gauge\nproxy_active_clients %lld\n", (long long)(total->connections - total->disconnections));
+    render_append(&buffer, "# TYPE proxy_active_upstreams gauge\nproxy_active_upstreams %lld\n", (long long)(total->misses - total->upstream_closes));
+    render_counter(&buffer, "proxy_origin_queued_total", "Requests that waited for a free connection to their origin.", total->origin_queued);
+    render_append(&buffer, "# HELP proxy_origin_wait_seconds_total Time requests spent waiting for origin connections.\n");
+    render_append(&buffer, "# TYPE proxy_origin_wait_seconds_total counter\nproxy_origin_wait_seconds_total %.6f\n", total->origin_wait_time / 1e6);
+    render_append(&buffer, "# TYPE proxy_origin_queue_depth gauge\nproxy_origin_queue_depth %lld\n", (long long)(total->origin_queued - total->origin_dequeued));
+    render_counter(&buffer, "proxy_egress_rounds_total", "Round robin passes over writable clients.", total->egress_rounds);
+    render_counter(&buffer, "proxy_rejected_connections_total", "Connections answered with 503 because workers were overloaded.", total->rejected);
+    render_counter(&buffer, "proxy_accept_pauses_total", "Times accepting stopped because of connection limits.", total->accept_pauses);
+    render_counter(&buffer, "proxy_steered_connections_total", "Connections given to worker bound to cpu that received them.", total->steered);
+    render_counter(&buffer, "proxy_socket_option_errors_total", "Socket options kernel refused to set.", total->sockopt_errors);
+    render_counter(&buffer, "proxy_canonicalized_requests_total", "Requests whose cache key differs from host and target they were sent with.", total->canonicalized);
+    render_counter(&buffer, "proxy_cache_purged_entries_total", "Cache entries removed through admin purge.", total->purged);
+    render_counter(&buffer, "proxy_warmup_fetches_total", "Upstream fetches started by cache warm-up.", total->warmed);
+    render_counter(&buffer, "proxy_shared_cache_hits_total", "Local misses served from cache shared with other proxy processes.", total->shared_hits);
+    render_counter(&buffer, "proxy_shared_cache_stores_total", "Complete responses copied into shared cache.", total->shared_stores);
+    render_counter(&buffer, "proxy_shared_cache_recoveries_total", "Shared cache structures repaired after a process died holding their lock.", total->shared_recoveries);
+    render_counter(&buffer, "proxy_peer_queries_total", "Misses asked about at other proxy nodes.", total->peer_queries);
+    render_counter(&buffer, "proxy_peer_hits_total", "Misses fetched from a node that had fresh copy.", total->peer_hits);
+    render_counter(&buffer, "proxy_peer_routed_total", "Misses no node had, fetched through node owning url on hash ring.", total->peer_routed);
+    render_counter(&buffer, "proxy_peer_answers_total", "Queries of other nodes answered from this cache.", total->peer_answers);
+    render_append(&buffer, "# HELP proxy_socket_option Value kernel uses, read back from first socket of role.\n# TYPE proxy_socket_option gauge\n");
+    for (int role = 0; role < SOCKOPT_ROLES; role++) {
+        for (int i = 0; i < sockopt_count(); i++) {
+            int value = sockopt_effective(role, i);
+            if (value != -1) render_append(&buffer, "proxy_socket_option{role=\"%s\",option=\"%s\"} %d\n", sockopt_role_name(role), sockopt_name(i), value);
+        }
+    }
+    render_counter(&buffer, "proxy_egress_throttled_total", "Times client was not polled for write because of its rate limit.", total->egress_throttled);
+    render_histogram(&buffer, "proxy_ttfb_seconds", "Time from parsed request to first response byte sent.", &total->ttfb);
+    render_histogram(&buffer, "proxy_response_seconds", "Time from parsed request to last response byte sent.", &total->response_time);
+    free(total);
+
+    if (buffer.error) {
+        free(buffer.data);
+        return NULL;
+    }
+    *size = buffer.size;
+    return buffer.data;
+}
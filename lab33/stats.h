@@ -0,0 +1,68 @@
+#include <stdlib.h>
+
+#ifndef LAB33_STATS_H
+#define LAB33_STATS_H
+
+#define STATS_PATH "/__proxy/stats"
+
+//log-linear buckets: 2^HISTOGRAM_SUB_BITS buckets per power of two, values are microseconds
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_SIZE ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef unsigned long long counter_t;
+
+typedef struct histogram {
+    counter_t counts[HISTOGRAM_SIZE];
+    counter_t total_count, sum;
+} histogram_t;
+
+//every thread writes only its own slot, readers sum all slots without locking
+typedef struct stats {
+    counter_t connections, disconnections, requests, hits, misses, coalesced;
+    counter_t client_bytes_in, client_bytes_out, upstream_bytes_in, upstream_bytes_out;
+    counter_t upstream_connects, upstream_connect_errors, upstream_connect_time, upstream_closes;
+    counter_t client_timeouts, upstream_timeouts;
+    counter_t poll_waits;
+    counter_t passthroughs, spliced_bytes, tunnels;
+    counter_t body_allocs, body_reallocs;
+    counter_t cache_evictions, cache_rejects;
+    counter_t stale_hits, stale_if_error, revalidations;
+    counter_t negative_hits, failed_host_hits;
+    counter_t origin_queued, origin_dequeued, origin_wait_time;
+    counter_t egress_rounds, egress_throttled;
+    counter_t rejected, accept_pauses, steered;
+    counter_t sockopt_errors;
+    counter_t canonicalized;
+    counter_t purged, warmed;
+    counter_t shared_hits, shared_stores, shared_recoveries;
+    counter_t peer_queries, peer_hits, peer_routed, peer_answers;
+    histogram_t ttfb, response_time;
+    char padding[64];   //keeps hot counters of neighbour threads on different cache lines
+} stats_t;
+
+//text that grows as it is written, first failed append makes the rest no-ops
+typedef struct render_buffer {
+    char *data;
+    ssize_t size, alloc_size;
+    int error;
+} render_buffer_t;
+
+extern __thread stats_t *thread_stats;
+
+#define STATS_ADD(FIELD, VALUE) do { if (thread_stats != NULL) thread_stats->FIELD += (VALUE); } while (0)
+#define STATS_INC(FIELD) STATS_ADD(FIELD, 1)
+#define STATS_RECORD(FIELD, START_US) do { if (thread_stats != NULL) histogram_record(&thread_stats->FIELD, stats_now_us() - (START_US)); } while (0)
+
+int stats_init(int slots);
+void stats_register_thread(int slot);
+void stats_destroy();
+
+long long stats_now_us();
+void histogram_record(histogram_t *histogram, long long value);
+
+void render_append(render_buffer_t *buffer, const char *format, ...);
+char *stats_render(ssize_t *size);
+
+#endif
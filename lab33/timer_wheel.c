@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <time.h>
+#include "timer_wheel.h"
+#include "states.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+long long timer_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+unsigned long long get_now_tick(timer_wheel_t *wheel) {
+    return (unsigned long long)(timer_now_ms() - wheel->start_ms) / TIMER_WHEEL_TICK_MS;
+}
+
+void timer_wheel_init(timer_wheel_t *wheel) {
+    wheel->start_ms = timer_now_ms();
+    wheel->current = 0;
+    wheel->size = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) wheel->slots[level][i] = NULL;
+    }
+}
+
+void timer_init(wheel_timer_t *timer, timer_wheel_t *wheel, void (*callback)(wheel_timer_t *), void *owner) {
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->owner = owner;
+    timer->wheel = wheel;
+    timer->slot = NULL;
+    timer->prev = timer->next = NULL;
+}
+
+//level is picked by delay from current tick, slot inside level by bits of absolute expiry
+void wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->expires < wheel->current) timer->expires = wheel->current;
+    unsigned long long delta = timer->expires - wheel->current;
+    if (delta >= TIMER_WHEEL_RANGE) {
+        timer->expires = wheel->current + TIMER_WHEEL_RANGE - 1;
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) level++;
+
+    wheel_timer_t **slot = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) (*slot)->prev = timer;
+    *slot = timer;
+    wheel->size++;
+}
+
+void wheel_remove(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->prev != NULL) timer->prev->next = timer->next;
+    else *timer->slot = timer->next;
+    if (timer->next != NULL) timer->next->prev = timer->prev;
+    timer->slot = NULL;
+    timer->prev = timer->next = NULL;
+    wheel->size--;
+}
+
+void timer_arm(wheel_timer_t *timer, long long timeout_ms) {
+    timer_wheel_t *wheel = timer->wheel;
+    if (timer->slot != NULL) wheel_remove(wheel, timer);
+    timer->expires = get_now_tick(wheel) + (MAX(timeout_ms, 0) + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    wheel_add(wheel, timer);
+}
+
+void timer_cancel(wheel_timer_t *timer) {
+    if (timer->slot != NULL) wheel_remove(timer->wheel, timer);
+}
+
+//moves timers of upper levels whose slots start at current tick one level down
+void wheel_cascade(timer_wheel_t *wheel) {
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        int index = (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        wheel_timer_t *timer = wheel->slots[level][index];
+        wheel->slots[level][index] = NULL;
+        while (timer != NULL) {
+            wheel_timer_t *next = timer->next;
+            wheel->size--;
+            wheel_add(wheel, timer);
+            timer = next;
+        }
+        if (index != 0) break;
+    }
+}
+
+//runs callbacks of expired timers, callback may arm its timer again
+int timer_wheel_expire(timer_wheel_t *wheel) {
+    unsigned long long now_tick = get_now_tick(wheel);
+    int expired = 0;
+
+    while (wheel->current <= now_tick) {
+        if (wheel->size == 0) {
+            wheel->current = now_tick + 1;
+            break;
+        }
+        if ((wheel->current & TIMER_WHEEL_MASK) == 0) wheel_cascade(wheel);
+
+        wheel_timer_t **slot = &wheel->slots[0][wheel->current & TIMER_WHEEL_MASK];
+        while (*slot != NULL) {
+            wheel_timer_t *timer = *slot;
+            wheel_remove(wheel, timer);
+            timer->callback(timer);
+            expired++;
+        }
+        wheel->current++;
+    }
+    return expired;
+}
+
+//tick of the nearest expiry or cascade
+unsigned long long wheel_next_tick(timer_wheel_t *wheel) {
+    unsigned long long next = wheel->current + TIMER_WHEEL_RANGE;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        if (wheel->slots[0][(wheel->current + i) & TIMER_WHEEL_MASK] != NULL) {
+            next = wheel->current + i;
+            break;
+        }
+    }
+
+    int upper_levels_used = FALSE;
+    for (int level = 2; level < TIMER_WHEEL_LEVELS && !upper_levels_used; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            if (wheel->slots[level][i] != NULL) {
+                upper_levels_used = TRUE;
+                break;
+            }
+        }
+    }
+
+    unsigned long long first_block = (wheel->current + TIMER_WHEEL_MASK) >> TIMER_WHEEL_BITS;
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        unsigned long long block = first_block + i;
+        if (wheel->slots[1][block & TIMER_WHEEL_MASK] != NULL || (upper_levels_used && (block & TIMER_WHEEL_MASK) == 0)) {
+            unsigned long long cascade_tick = block << TIMER_WHEEL_BITS;
+            if (cascade_tick < next) next = cascade_tick;
+            break;
+        }
+    }
+    return next;
+}
+
+//select timeout until the nearest expiry, NULL if wheel is empty
+struct timeval *timer_wheel_timeout(timer_wheel_t *wheel, struct timeval *timeout) {
+    if (wheel->size == 0) return NULL;
+
+    long long wait_ms = wheel->start_ms + (long long)wheel_next_tick(wheel) * TIMER_WHEEL_TICK_MS - timer_now_ms();
+    wait_ms = MAX(wait_ms, 0);
+    timeout->tv_sec = wait_ms / 1000;
+    timeout->tv_usec = (wait_ms % 1000) * 1000;
+    return timeout;
+}
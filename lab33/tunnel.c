@@ -0,0 +1,193 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     //splice, pipe2
+#define TUNNEL_SPLICE
+#endif
+
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "tunnel.h"
+#include "states.h"
+#include "logger.h"
+
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection established\r\n\r\n"
+
+#ifdef TUNNEL_SPLICE
+
+int half_init(tunnel_half_t *half) {
+    if (pipe2(half->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        LOG_ERRNO("tunnel_create: Unable to create pipe");
+        return -1;
+    }
+    return 0;
+}
+
+//EAGAIN with bytes already in pipe means pipe is full, reading stops until some of them are delivered
+ssize_t half_fill(tunnel_half_t *half) {
+    ssize_t bytes_read = splice(half->from_fd, NULL, half->pipe_fds[1], NULL, SPLICE_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes_read == -1 && errno == EAGAIN && half->pending > 0) half->pipe_full = TRUE;
+    return bytes_read;
+}
+
+ssize_t half_drain(tunnel_half_t *half) {
+    return splice(half->pipe_fds[0], NULL, half->to_fd, NULL, half->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+int half_queue(tunnel_half_t *half, const char *data, ssize_t size) {
+    if (write(half->pipe_fds[1], data, size) != size) return -1;
+    half->pending += size;
+    return 0;
+}
+
+#else
+
+int half_init(tunnel_half_t *half) {
+    half->buf = (char *)malloc(BUF_SIZE);
+    if (half->buf == NULL) {
+        LOG_ERRNO("tunnel_create: Unable to allocate memory for tunnel buffer");
+        return -1;
+    }
+    return 0;
+}
+
+//buffer is refilled only when it is empty, so pipe_full is never set
+ssize_t half_fill(tunnel_half_t *half) {
+    half->buf_offset = 0;
+    return recv(half->from_fd, half->buf, BUF_SIZE, MSG_DONTWAIT);
+}
+
+ssize_t half_drain(tunnel_half_t *half) {
+    ssize_t bytes_written = send(half->to_fd, half->buf + half->buf_offset, half->pending, MSG_DONTWAIT);
+    if (bytes_written > 0) half->buf_offset += bytes_written;
+    return bytes_written;
+}
+
+int half_queue(tunnel_half_t *half, const char *data, ssize_t size) {
+    if (half->buf_offset + half->pending + size > BUF_SIZE) return -1;
+    memcpy(half->buf + half->buf_offset + half->pending, data, size);
+    half->pending += size;
+    return 0;
+}
+
+#endif
+
+void half_destroy(tunnel_half_t *half) {
+    close_socket(&half->pipe_fds[0]);
+    close_socket(&half->pipe_fds[1]);
+    free_with_null((void **)&half->buf);
+}
+
+int half_is_readable(tunnel_half_t *half) {
+    #ifdef TUNNEL_SPLICE
+    return !half->eof && !half->pipe_full;
+    #else
+    return !half->eof && half->pending == 0;
+    #endif
+}
+
+void half_add_interest(tunnel_half_t *half, poller_t *poller) {
+    if (half_is_readable(half)) poller_add(poller, half->from_fd, POLLER_READ);
+    if (half->pending > 0) poller_add(poller, half->to_fd, POLLER_WRITE);
+}
+
+//returns number of bytes moved or -1, both ends are non-blocking
+ssize_t half_update(tunnel_half_t *half, poller_t *poller) {
+    ssize_t moved = 0;
+    if (half_is_readable(half) && poller_is_ready(poller, half->from_fd, POLLER_READ)) {
+        errno = 0;
+        ssize_t bytes_read = half_fill(half);
+        if (bytes_read == 0) half->eof = TRUE;
+        else if (bytes_read > 0) {
+            half->pending += bytes_read;
+            moved += bytes_read;
+        }
+        else if (errno != EAGAIN) return -1;
+    }
+
+    if (half->pending > 0 && poller_is_ready(poller, half->to_fd, POLLER_WRITE)) {
+        errno = 0;
+        ssize_t bytes_written = half_drain(half);
+        if (bytes_written > 0) {
+            half->pending -= bytes_written;
+            half->pipe_full = FALSE;
+            half->bytes += bytes_written;
+            moved += bytes_written;
+        }
+        else if (bytes_written == -1 && errno != EAGAIN) return -1;
+    }
+
+    //sender finished, receiver gets EOF too, the other direction stays open
+    if (half->eof && half->pending == 0 && !half->shut) {
+        shutdown(half->to_fd, SHUT_WR);
+        half->shut = TRUE;
+    }
+    return moved;
+}
+
+int half_create(tunnel_half_t *half, int from_fd, int to_fd) {
+    memset(half, 0, sizeof(tunnel_half_t));
+    half->from_fd = from_fd;
+    half->to_fd = to_fd;
+    half->pipe_fds[0] = half->pipe_fds[1] = -1;
+    return half_init(half);
+}
+
+//initial bytes are those client sent right after CONNECT request, usually start of TLS handshake
+tunnel_t *tunnel_create(int client_sock_fd, int sock_fd, const char *initial, ssize_t initial_size) {
+    tunnel_t *tunnel = (tunnel_t *)calloc(1, sizeof(tunnel_t));
+    if (tunnel == NULL) {
+        LOG_ERRNO("tunnel_create: Unable to allocate memory for tunnel");
+        return NULL;
+    }
+    tunnel->sock_fd = -1;
+    tunnel->connected = FALSE;
+
+    if (half_create(&tunnel->up, client_sock_fd, sock_fd) == -1 || half_create(&tunnel->down, sock_fd, client_sock_fd) == -1 ||
+        (initial_size > 0 && half_queue(&tunnel->up, initial, initial_size) == -1)) {
+        tunnel_destroy(tunnel);
+        return NULL;
+    }
+    tunnel->sock_fd = sock_fd;
+    return tunnel;
+}
+
+void tunnel_destroy(tunnel_t *tunnel) {
+    if (tunnel == NULL) return;
+    half_destroy(&tunnel->up);
+    half_destroy(&tunnel->down);
+    close_socket(&tunnel->sock_fd);
+    free(tunnel->host);
+    free(tunnel);
+}
+
+void tunnel_add_interest(tunnel_t *tunnel, poller_t *poller) {
+    if (!tunnel->connected) {
+        poller_add(poller, tunnel->sock_fd, POLLER_WRITE);
+        return;
+    }
+    half_add_interest(&tunnel->up, poller);
+    half_add_interest(&tunnel->down, poller);
+}
+
+int tunnel_update(tunnel_t *tunnel, poller_t *poller) {
+    if (!tunnel->connected) {
+        if (!poller_is_ready(poller, tunnel->sock_fd, POLLER_WRITE)) return TUNNEL_IDLE;
+        int connect_error = get_connect_error(tunnel->sock_fd);
+        if (connect_error != 0) {
+            errno = connect_error;
+            return TUNNEL_ERROR;
+        }
+        tunnel->connected = TRUE;
+        if (half_queue(&tunnel->down, TUNNEL_ESTABLISHED, (ssize_t)strlen(TUNNEL_ESTABLISHED)) == -1) return TUNNEL_ERROR;
+        return TUNNEL_ACTIVE;
+    }
+
+    ssize_t up_moved = half_update(&tunnel->up, poller);
+    ssize_t down_moved = half_update(&tunnel->down, poller);
+    if (up_moved == -1 || down_moved == -1) return TUNNEL_ERROR;
+    if (tunnel->up.shut && tunnel->down.shut) return TUNNEL_CLOSED;
+    return up_moved + down_moved > 0 ? TUNNEL_ACTIVE : TUNNEL_IDLE;
+}
@@ -0,0 +1,39 @@
+#include <sys/types.h>
+#include "poller.h"
+
+#ifndef LAB33_TUNNEL_H
+#define LAB33_TUNNEL_H
+
+#define TUNNEL_ERROR (-1)
+#define TUNNEL_IDLE 0
+#define TUNNEL_ACTIVE 1     //connected or moved some bytes
+#define TUNNEL_CLOSED 2     //both sides finished sending and everything was delivered
+
+/*
+ * CONNECT tunnel, both of its sockets belong to worker of the client.
+ * On linux bytes go socket -> pipe -> socket by splice and never enter user space,
+ * elsewhere they go through a buffer per direction.
+ */
+
+typedef struct tunnel_half {
+    int from_fd, to_fd;
+    int pipe_fds[2];
+    char *buf;  ssize_t buf_offset;
+    ssize_t pending;        //taken from from_fd, not yet given to to_fd
+    int pipe_full, eof, shut;
+    long long bytes;        //delivered to to_fd
+} tunnel_half_t;
+
+typedef struct tunnel {
+    int sock_fd, connected;
+    char *host;                 //freed with tunnel
+    tunnel_half_t up, down;     //client -> upstream, upstream -> client
+} tunnel_t;
+
+tunnel_t *tunnel_create(int client_sock_fd, int sock_fd, const char *initial, ssize_t initial_size);
+void tunnel_destroy(tunnel_t *tunnel);
+
+void tunnel_add_interest(tunnel_t *tunnel, poller_t *poller);
+int tunnel_update(tunnel_t *tunnel, poller_t *poller);
+
+#endif
@@ -1,5 +1,9 @@
+#include <netinet/in.h>
 #include "cache.h"
 #include "picohttpparser.h"
+#include "timer_wheel.h"
+#include "tunnel.h"
+#include "peer.h"
 
 #ifndef LAB33_TYPES_H
 #define LAB33_TYPES_H
@@ -7,13 +11,25 @@
 typedef struct http {
     int sock_fd, code, clients, status, error, is_response_complete, dont_accept_clients;
     int response_type, headers_size; ssize_t response_size;
+    int is_uncacheable, is_body_streaming;     //request body is still being sent by its client
+    int max_age, stale_while_revalidate, stale_if_error;   //from Cache-Control, -1 if absent
+    cache_entry_t *stale_entry;     //expired copy this response refreshes, clients fall back to it on error
+    int is_revalidation;            //started without clients to refresh stale_entry
+    int is_warmup;                  //started without clients by cache warm-up
+    int is_peer_fetch;              //connected to another proxy node, not to origin of host
+    int origin_state; long long origin_wait_start_us;   //connection slot of its host, see origin.h
+    struct http *origin_next;       //queue of https waiting for that slot
     struct phr_chunked_decoder decoder;
     char *data;     ssize_t data_size;
     char *request;  ssize_t request_size;   ssize_t request_bytes_written;
     char *host, *path;
+    unsigned long long hash;        //of host and path, checked before strings when clients look for http to join
     cache_entry_t *cache_entry;
     pthread_rwlock_t rwlock;
     int client_pipe_fd, http_pipe_fd;
+    int passthrough_read_fd, passthrough_write_fd;  //-1 unless body is spliced to the only client
+    int passthrough_pipe_full;  ssize_t passthrough_size;   //bytes put into pipe, they follow data
+    wheel_timer_t timer;        //armed by owning worker only
     struct http *prev, *next;
     struct http *global_prev, *global_next;
 } http_t;
@@ -21,8 +37,24 @@ typedef struct http {
 typedef struct client {
     int sock_fd, status;
     cache_entry_t *cache_entry;  http_t *http_entry;
-    char *request;  ssize_t request_size;
+    char *request;  ssize_t request_size;  //REQUEST_BUF_SIZE block taken on first read, kept until miss gives it to http
     ssize_t bytes_written;
+    tunnel_t *tunnel;           //only while TUNNELING
+    peer_lookup_t *peer_lookup; //only while PEER_LOOKUP
+    ssize_t upload_left;        //body bytes client has not sent yet, or UPLOAD_CHUNKED
+    struct phr_chunked_decoder upload_decoder;
+    char *upload_buf;  ssize_t upload_buf_size, upload_buf_sent;   //not NULL while body is streamed
+    long long request_start_us; int response_started;
+    int response_code; const char *response_source;    //for access log
+    int is_from_peer;           //request came from another proxy node, see peer.h
+    int close_after_response;   //rest of request was not read, connection cannot be reused
+    int is_fresh;               //nothing read since accept, so not an idle keep-alive connection
+    char peer[INET_ADDRSTRLEN];
+    ssize_t egress_deficit;     //bytes client may still send in current round, see egress.h
+    long long egress_tokens, egress_refill_us;      //token bucket of rate limit
+    struct client *egress_next;
+    wheel_timer_t timer;        //armed by owning worker only
+    int worker;                 //index of worker that must take client from queue, -1 is any
     pthread_t thread_id;
     struct client *prev, *next;
     struct client *global_prev, *global_next;
@@ -46,6 +78,7 @@ typedef struct client_queue {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     int wakeup_pipe_fd, max_num;
+    int *steer_pipe_fds;        //wake up one worker for client steered to it, NULL if steering is off
 } client_queue_t;
 
 typedef struct http_queue_t {
@@ -59,6 +92,7 @@ typedef struct http_queue_t {
 typedef struct thread_param {
     int index;
     int new_connection_pipe_fd;
+    int steer_pipe_fd;          //clients steered to this worker only, -1 if steering is off
     int http_size, client_size;
 } thread_param_t;
 
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "url.h"
+#include "config.h"
+
+#define HTTPS_DEFAULT_PORT 443
+
+#define IS_UNRESERVED(C) (isalnum((unsigned char)(C)) || (C) == '-' || (C) == '.' || (C) == '_' || (C) == '~')
+
+typedef struct key_writer {
+    char *data;
+    size_t size, length;
+} key_writer_t;
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+int put_char(key_writer_t *writer, char c) {
+    if (writer->length == writer->size) return -1;
+    writer->data[writer->length++] = c;
+    return 0;
+}
+
+int put_view(key_writer_t *writer, str_view_t view) {
+    if (writer->size - writer->length < view.length) return -1;
+    memcpy(writer->data + writer->length, view.data, view.length);
+    writer->length += view.length;
+    return 0;
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//%41 becomes A, %2f becomes %2F; malformed escapes are copied as they are
+int put_escaped(key_writer_t *writer, str_view_t view) {
+    for (size_t i = 0; i < view.length; i++) {
+        int high = i + 2 < view.length && view.data[i] == '%' ? hex_value(view.data[i + 1]) : -1;
+        int low = high != -1 ? hex_value(view.data[i + 2]) : -1;
+        if (low == -1) {
+            if (put_char(writer, view.data[i]) == -1) return -1;
+            continue;
+        }
+        char decoded = (char)(high * 16 + low);
+        if (IS_UNRESERVED(decoded)) {
+            if (put_char(writer, decoded) == -1) return -1;
+        }
+        else if (put_char(writer, '%') == -1 || put_char(writer, hex_digits[high]) == -1 || put_char(writer, hex_digits[low]) == -1) return -1;
+        i += 2;
+    }
+    return 0;
+}
+
+int put_host(key_writer_t *writer, str_view_t host, int default_port) {
+    size_t name_len = host.length;
+    if (host.length > 0 && host.data[0] == '[') {   //IPv6 literal, its colons are not port
+        const char *close = memchr(host.data, ']', host.length);
+        if (close != NULL) name_len = close - host.data + 1;
+    }
+    else {
+        for (size_t i = host.length; i > 0; i--) {
+            if (host.data[i - 1] != ':') continue;
+            name_len = i - 1;
+            break;
+        }
+    }
+
+    size_t letters = name_len;
+    if (letters > 1 && host.data[letters - 1] == '.') letters--;     //fully qualified name with root dot
+    for (size_t i = 0; i < letters; i++) {
+        if (put_char(writer, (char)tolower((unsigned char)host.data[i])) == -1) return -1;
+    }
+
+    if (name_len + 1 >= host.length) return 0;     //no port or empty one
+    const char *port = host.data + name_len + 1;
+    size_t port_len = host.length - name_len - 1;
+    int number = get_number_from_string_by_length(port, port_len);
+    if (number == default_port) return 0;
+    if (!IS_PORT_VALID(number)) {       //connect reports it, key keeps it as it is
+        str_view_t raw = { host.data + name_len, port_len + 1 };
+        return put_view(writer, raw);
+    }
+    char buf[8];
+    str_view_t decimal = { buf, (size_t)snprintf(buf, sizeof(buf), ":%d", number) };
+    return put_view(writer, decimal);
+}
+
+int compare_params(const void *param1, const void *param2) {
+    const str_view_t *view1 = (const str_view_t *)param1, *view2 = (const str_view_t *)param2;
+    int diff = memcmp(view1->data, view2->data, MIN(view1->length, view2->length));
+    if (diff != 0) return diff;
+    return view1->length < view2->length ? -1 : view1->length > view2->length;
+}
+
+//config.url_strip_params is a comma separated list of names
+int is_stripped_param(str_view_t param) {
+    if (config.url_strip_params == NULL) return FALSE;
+    const char *eq = memchr(param.data, '=', param.length);
+    size_t name_len = eq == NULL ? param.length : (size_t)(eq - param.data);
+    const char *name = config.url_strip_params;
+    while (*name != '\0') {
+        const char *comma = strchr(name, ',');
+        size_t len = comma == NULL ? strlen(name) : (size_t)(comma - name);
+        if (strings_equal_by_length(name, len, param.data, name_len)) return TRUE;
+        if (comma == NULL) break;
+        name = comma + 1;
+    }
+    return FALSE;
+}
+
+//query is already normalized and lies outside of part writer fills
+int put_query(key_writer_t *writer, str_view_t query) {
+    str_view_t params[URL_MAX_PARAMS];
+    size_t params_num = 0;
+    const char *start = query.data, *end = query.data + query.length;
+    while (start < end) {
+        const char *amp = memchr(start, '&', end - start);
+        if (amp == NULL) amp = end;
+        str_view_t param = { start, amp - start };
+        start = amp + 1;
+        if (param.length == 0 || is_stripped_param(param)) continue;
+        if (params_num == URL_MAX_PARAMS) {
+            if (put_char(writer, '?') == -1) return -1;
+            return put_view(writer, query);
+        }
+        params[params_num++] = param;
+    }
+
+    if (config.url_sort_query) qsort(params, params_num, sizeof(str_view_t), compare_params);
+    for (size_t i = 0; i < params_num; i++) {
+        if (put_char(writer, i == 0 ? '?' : '&') == -1 || put_view(writer, params[i]) == -1) return -1;
+    }
+    return 0;
+}
+
+//value of index-th parameter with this name, decoded and NUL terminated, cut to size; -1 if there is no such parameter
+ssize_t url_query_param(str_view_t query, const char *name, int index, char *value, size_t size) {
+    const char *start = query.data, *end = query.data + query.length;
+    while (start < end) {
+        const char *amp = memchr(start, '&', end - start);
+        if (amp == NULL) amp = end;
+        const char *eq = memchr(start, '=', amp - start);
+        const char *name_end = eq == NULL ? amp : eq;
+        if (strings_equal_by_length(start, name_end - start, name, strlen(name)) && index-- == 0) {
+            size_t length = 0;
+            for (const char *c = eq == NULL ? amp : eq + 1; c < amp && length + 1 < size; c++) {
+                int high = *c == '%' && amp - c > 2 ? hex_value(c[1]) : -1;
+                int low = high != -1 ? hex_value(c[2]) : -1;
+                if (low != -1) {
+                    value[length++] = (char)(high * 16 + low);
+                    c += 2;
+                }
+                else value[length++] = *c == '+' ? ' ' : *c;
+            }
+            value[length] = '\0';
+            return (ssize_t)length;
+        }
+        start = amp + 1;
+    }
+    return -1;
+}
+
+int starts_with_scheme(str_view_t target, const char *scheme) {
+    size_t length = strlen(scheme);
+    return target.length >= length && strncasecmp(target.data, scheme, length) == 0;
+}
+
+//returns -1 if key does not fit, caller then uses host and target as they are
+int url_canonicalize(str_view_t host, str_view_t target, char *key, size_t key_size, str_view_t *key_host, str_view_t *key_path) {
+    int default_port = HTTP_DEFAULT_PORT;
+    size_t scheme_len = 0;
+    if (starts_with_scheme(target, "http://")) scheme_len = strlen("http://");
+    else if (starts_with_scheme(target, "https://")) {
+        scheme_len = strlen("https://");
+        default_port = HTTPS_DEFAULT_PORT;
+    }
+    if (scheme_len > 0) {       //absolute-form, its authority replaces Host header
+        size_t authority_len = 0;
+        while (scheme_len + authority_len < target.length && strchr("/?#", target.data[scheme_len + authority_len]) == NULL) authority_len++;
+        host.data = target.data + scheme_len;
+        host.length = authority_len;
+        for (size_t i = authority_len; i > 0; i--) {
+            if (host.data[i - 1] != '@') continue;
+            host.data += i;
+            host.length -= i;
+            break;
+        }
+        target.data += scheme_len + authority_len;
+        target.length -= scheme_len + authority_len;
+    }
+
+    key_writer_t writer = { key, key_size / 2, 0 };
+    if (put_host(&writer, host, default_port) == -1) return -1;
+    key_host->data = key;
+    key_host->length = writer.length;
+
+    size_t path_start = writer.length;
+    str_view_t path = target, query = { NULL, 0 };
+    const char *fragment = memchr(target.data, '#', target.length);
+    if (fragment != NULL) path.length = fragment - target.data;
+    const char *question = memchr(path.data, '?', path.length);
+    if (question != NULL) {
+        query.data = question + 1;
+        query.length = path.length - (query.data - path.data);
+        path.length = question - path.data;
+    }
+    if (path.length == 0 && put_char(&writer, '/') == -1) return -1;
+    if (put_escaped(&writer, path) == -1) return -1;
+
+    if (query.data != NULL) {
+        //normalized query goes to second half of key first, parameters are sorted there
+        key_writer_t scratch = { key + key_size / 2, key_size - key_size / 2, 0 };
+        if (put_escaped(&scratch, query) == -1) return -1;
+        str_view_t normalized = { scratch.data, scratch.length };
+        if (put_query(&writer, normalized) == -1) return -1;
+    }
+    key_path->data = key + path_start;
+    key_path->length = writer.length - path_start;
+    return 0;
+}
@@ -0,0 +1,19 @@
+#include "states.h"
+
+#ifndef LAB33_URL_H
+#define LAB33_URL_H
+
+#define URL_KEY_SIZE (2 * REQUEST_BUF_SIZE)    //canonical key and room to reorder its query
+#define URL_MAX_PARAMS 64                      //longer queries are kept as they are
+
+/*
+ * Cache key of GET request. Host is taken from absolute-form target or Host header, its case is
+ * folded and default port dropped; path loses scheme and authority, percent-escapes of unreserved
+ * characters are decoded and the rest are upper-cased. Query parameters may be sorted and some of
+ * them left out (config). Request sent to origin stays as client wrote it.
+ */
+
+int url_canonicalize(str_view_t host, str_view_t target, char *key, size_t key_size, str_view_t *key_host, str_view_t *key_path);
+ssize_t url_query_param(str_view_t query, const char *name, int index, char *value, size_t size);
+
+#endif
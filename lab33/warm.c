@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "warm.h"
+#include "client.h"
+#include "http.h"
+#include "url.h"
+#include "config.h"
+#include "logger.h"
+
+#define WARM_STARTED 0
+#define WARM_SKIPPED 1
+#define WARM_FAILED 2
+
+typedef struct warm_job {
+    char **urls;
+    int size, capacity, next;       //urls before next are taken, array is dropped when all are
+    int in_flight, cached, skipped, failed;
+    pthread_mutex_t mutex;
+} warm_job_t;
+
+static warm_job_t job = { .urls = NULL, .size = 0, .capacity = 0, .next = 0, .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+int warm_add(const char *url, size_t length) {
+    char *copy = (char *)malloc(length + 1);
+    if (copy == NULL) {
+        LOG_ERRNO("warm_add: Unable to allocate memory for url");
+        return -1;
+    }
+    memcpy(copy, url, length);
+    copy[length] = '\0';
+
+    pthread_mutex_lock(&job.mutex);
+    if (job.size == job.capacity) {
+        int capacity = MAX(job.capacity * 2, 64);
+        char **check = (char **)realloc(job.urls, sizeof(char *) * capacity);
+        if (check == NULL) {
+            pthread_mutex_unlock(&job.mutex);
+            LOG_ERRNO("warm_add: Unable to reallocate memory for url list");
+            free(copy);
+            return -1;
+        }
+        job.urls = check;
+        job.capacity = capacity;
+    }
+    job.urls[job.size++] = copy;
+    pthread_mutex_unlock(&job.mutex);
+    return 0;
+}
+
+//one url per line, empty lines and lines starting with # are skipped; returns number of queued urls
+int warm_add_file(const char *file_path) {
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        LOG_ERRNO("warm_add_file: Unable to open '%s'", file_path);
+        return -1;
+    }
+    char line[WARM_URL_MAX_SIZE];
+    int added = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        size_t length = strcspn(line, "\r\n");
+        if (line[length] == '\0' && !feof(file)) {     //rest of too long line
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n');
+            continue;
+        }
+        if (length == 0 || line[0] == '#') continue;
+        if (warm_add(line, length) == -1) break;
+        added++;
+    }
+    fclose(file);
+    return added;
+}
+
+int warm_start(const char *url, http_queue_t *http_queue, cache_t *cache) {
+    char key[URL_KEY_SIZE];
+    str_view_t no_host = { "", 0 }, host, path;
+    if (url_canonicalize(no_host, view_of(url), key, sizeof(key), &host, &path) == -1 || host.length == 0) {
+        LOG_WARN("Warm-up: '%s' is not an absolute url", url);
+        return WARM_FAILED;
+    }
+
+    cache_entry_t *entry = cache_find(host, path, cache_hash(host, path), cache);
+    if (entry != NULL) {
+        read_lock_rwlock(&entry->rwlock, "warm_start: CACHE");
+        int is_useful = !entry->is_full || cache_entry_freshness(entry) == CACHE_FRESH;
+        unlock_rwlock(&entry->rwlock, "warm_start: CACHE");
+        cache_entry_release(entry);
+        if (is_useful) return WARM_SKIPPED;
+    }
+
+    if (client_start_background(host, path, NULL, HTTP_WARMUP, http_queue) == -1) return WARM_FAILED;
+    STATS_INC(warmed);
+    return WARM_STARTED;
+}
+
+//worker that finds mutex taken leaves starting to the one holding it, connects may block for a while
+void warm_continue(http_queue_t *http_queue, cache_t *cache) {
+    if (job.next == job.size) return;
+    if (pthread_mutex_trylock(&job.mutex) != 0) return;
+    while (job.next < job.size && job.in_flight < MAX(config.warm_concurrency, 1)) {
+        char *url = job.urls[job.next];
+        job.urls[job.next++] = NULL;
+        int result = warm_start(url, http_queue, cache);
+        free(url);
+        if (result == WARM_STARTED) job.in_flight++;
+        else if (result == WARM_SKIPPED) job.skipped++;
+        else job.failed++;
+    }
+    if (job.next == job.size) {
+        free(job.urls);
+        job.urls = NULL;
+        job.size = job.capacity = job.next = 0;
+    }
+    pthread_mutex_unlock(&job.mutex);
+}
+
+//called when warm-up http is destroyed, its slot goes to next url
+void warm_finished(int is_cached) {
+    pthread_mutex_lock(&job.mutex);
+    job.in_flight--;
+    if (is_cached) job.cached++;
+    else job.failed++;
+    pthread_mutex_unlock(&job.mutex);
+}
+
+void warm_render(render_buffer_t *buffer) {
+    pthread_mutex_lock(&job.mutex);
+    render_append(buffer, "queued %d\nin_flight %d\ncached %d\nskipped %d\nfailed %d\n",
+                  job.size - job.next, job.in_flight, job.cached, job.skipped, job.failed);
+    pthread_mutex_unlock(&job.mutex);
+}
+
+void warm_destroy() {
+    for (int i = job.next; i < job.size; i++) free(job.urls[i]);
+    free(job.urls);
+    job.urls = NULL;
+    job.size = job.capacity = job.next = 0;
+}
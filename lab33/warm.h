@@ -0,0 +1,23 @@
+#include "cache.h"
+#include "types.h"
+#include "stats.h"
+
+#ifndef LAB33_WARM_H
+#define LAB33_WARM_H
+
+#define WARM_URL_MAX_SIZE 4096      //longer lines of url list are skipped
+
+/*
+ * Cache warm-up. Absolute URLs are queued by admin API and fetched by https without clients,
+ * at most config.warm_concurrency at a time: workers start next ones from their loop as earlier
+ * ones finish. URLs whose fresh or still downloading entry is already in cache are skipped.
+ */
+
+int warm_add(const char *url, size_t length);
+int warm_add_file(const char *file_path);
+void warm_continue(http_queue_t *http_queue, cache_t *cache);
+void warm_finished(int is_cached);
+void warm_render(render_buffer_t *buffer);
+void warm_destroy();
+
+#endif